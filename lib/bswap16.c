@@ -0,0 +1,148 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bswap16.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BSWAP16_X86 1
+#include <immintrin.h>
+#else
+#define BSWAP16_X86 0
+#endif
+
+static void bswap16_scalar(uint16_t *buf, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = (uint16_t)((buf[i] >> 8) | (buf[i] << 8));
+    }
+}
+
+#if BSWAP16_X86
+
+/* pshufb control mask that swaps adjacent bytes within each 16 byte
+ * lane. */
+#define BSWAP16_SHUF_LANE                       \
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+
+__attribute__((target("ssse3")))
+static void bswap16_ssse3(uint16_t *buf, size_t n)
+{
+    const __m128i shuf = _mm_setr_epi8(BSWAP16_SHUF_LANE);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i *p = (__m128i*)&buf[i];
+        _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), shuf));
+    }
+    bswap16_scalar(buf + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void bswap16_avx2(uint16_t *buf, size_t n)
+{
+    const __m256i shuf = _mm256_setr_epi8(BSWAP16_SHUF_LANE,
+                                          BSWAP16_SHUF_LANE);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i *p = (__m256i*)&buf[i];
+        _mm256_storeu_si256(p,
+                            _mm256_shuffle_epi8(_mm256_loadu_si256(p),
+                                                shuf));
+    }
+    /* Finish the tail here rather than calling bswap16_ssse3(), whose
+     * non-VEX instructions would pay an AVX-SSE transition penalty. */
+    if (i + 8 <= n) {
+        __m128i *p = (__m128i*)&buf[i];
+        _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p),
+                                             _mm256_castsi256_si128(shuf)));
+        i += 8;
+    }
+    _mm256_zeroupper();
+    bswap16_scalar(buf + i, n - i);
+}
+
+#endif  /* BSWAP16_X86 */
+
+typedef void (*bswap16_fn)(uint16_t*, size_t);
+
+static const bswap16_fn bswap16_fns[BSWAP16_NIMPLS] = {
+    [BSWAP16_SCALAR] = bswap16_scalar,
+#if BSWAP16_X86
+    [BSWAP16_SSSE3] = bswap16_ssse3,
+    [BSWAP16_AVX2] = bswap16_avx2,
+#endif
+};
+
+int bswap16_impl_supported(enum bswap16_impl impl)
+{
+    switch (impl) {
+    case BSWAP16_SCALAR:
+        return 1;
+#if BSWAP16_X86
+    case BSWAP16_SSSE3:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3");
+    case BSWAP16_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+const char* bswap16_impl_str(enum bswap16_impl impl)
+{
+    switch (impl) {
+    case BSWAP16_SCALAR:
+        return "scalar";
+    case BSWAP16_SSSE3:
+        return "ssse3";
+    case BSWAP16_AVX2:
+        return "avx2";
+    default:
+        return "<unknown>";
+    }
+}
+
+/* -1 until the first bswap16_buf() or bswap16_get_impl() call picks
+ * one. Racing to pick is harmless, since everybody picks the same. */
+static int bswap16_cur_impl = -1;
+
+enum bswap16_impl bswap16_get_impl(void)
+{
+    int impl = __atomic_load_n(&bswap16_cur_impl, __ATOMIC_RELAXED);
+    if (impl < 0) {
+        impl = BSWAP16_NIMPLS - 1;
+        while (!bswap16_impl_supported(impl)) {
+            impl--;
+        }
+        __atomic_store_n(&bswap16_cur_impl, impl, __ATOMIC_RELAXED);
+    }
+    return impl;
+}
+
+int bswap16_set_impl(enum bswap16_impl impl)
+{
+    if (impl >= BSWAP16_NIMPLS || !bswap16_impl_supported(impl)) {
+        return -1;
+    }
+    __atomic_store_n(&bswap16_cur_impl, (int)impl, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void bswap16_buf(uint16_t *buf, size_t n)
+{
+    bswap16_fns[bswap16_get_impl()](buf, n);
+}
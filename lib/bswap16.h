@@ -0,0 +1,68 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file bswap16.h
+ * @brief Byte-swapping arrays of 16-bit values
+ *
+ * Board sample packets carry over a thousand big-endian samples each,
+ * so swapping them one ntohs() at a time shows up in profiles. These
+ * routines swap whole arrays in place, using SIMD instructions when
+ * the CPU has them.
+ *
+ * The implementation is picked at runtime the first time
+ * bswap16_buf() is called: the best one the CPU supports. Every
+ * implementation produces identical results.
+ */
+
+#ifndef _LIB_BSWAP16_H_
+#define _LIB_BSWAP16_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Byte swap implementations, from slowest to fastest. */
+enum bswap16_impl {
+    BSWAP16_SCALAR = 0,         /**< Portable C */
+    BSWAP16_SSSE3,              /**< x86 SSSE3 (pshufb) */
+    BSWAP16_AVX2,               /**< x86 AVX2 (vpshufb) */
+
+    BSWAP16_NIMPLS
+};
+
+/** Byte swap each of the n 16-bit values in buf, in place. */
+void bswap16_buf(uint16_t *buf, size_t n);
+
+/** Get a short name for an implementation, e.g. "ssse3". */
+const char* bswap16_impl_str(enum bswap16_impl impl);
+
+/** Nonzero if impl can run on this CPU. */
+int bswap16_impl_supported(enum bswap16_impl impl);
+
+/** Get the implementation bswap16_buf() is using (or will use). */
+enum bswap16_impl bswap16_get_impl(void);
+
+/**
+ * Make bswap16_buf() use a particular implementation.
+ *
+ * This is for testing and benchmarking; the default choice is the
+ * fastest available. Don't call it while other threads might be
+ * calling bswap16_buf().
+ *
+ * @return 0 on success, -1 if impl isn't supported on this CPU.
+ */
+int bswap16_set_impl(enum bswap16_impl impl);
+
+#endif
@@ -27,16 +27,44 @@
 #ifndef _LIB_CHANNEL_STORAGE_H_
 #define _LIB_CHANNEL_STORAGE_H_
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 struct ch_storage_ops;
 struct raw_pkt_bsmp;
 
+/* Board samples passed to ch_storage_write() have their samples in
+ * network byte order (see raw_pkt_ntoh_hdr()). */
+#define CH_STORAGE_WIRE_ORDER 0x1
+
+/* A run of board samples that never arrived, and were stored as
+ * placeholders (see RAW_PFLAG_B_MISSING). */
+struct ch_gap {
+    uint64_t start;             /* index of the first one */
+    uint64_t len;               /* how many */
+};
+
+/* Most compression threads ch_storage_stats() reports on. */
+#define CH_STORAGE_MAX_THREADS 16
+
+/* How much space board samples took up in a store, and what it took
+ * to compress them. */
+struct ch_storage_stats {
+    uint64_t nbytes_in;         /* board samples written, in bytes */
+    uint64_t nbytes_out;        /* what they take up in the file */
+    size_t nthreads;            /* compression threads, if any */
+    struct {
+        uint64_t nbytes_in;     /* bytes it compressed, */
+        uint64_t busy_ns;       /* in this many nanoseconds */
+    } threads[CH_STORAGE_MAX_THREADS];
+};
+
 struct ch_storage {
     const char *ch_path;
     const struct ch_storage_ops *ops;
     void *priv;
+    unsigned ch_flags;          /* CH_STORAGE_*; set before opening */
 };
 
 struct ch_storage_ops {
@@ -45,7 +73,13 @@ struct ch_storage_ops {
     int (*ch_datasync)(struct ch_storage*);
     int (*ch_write)(struct ch_storage*, const struct raw_pkt_bsmp *bsamps,
                     size_t nsamps);
+    int (*ch_write_at)(struct ch_storage*, const struct raw_pkt_bsmp *bsamps,
+                       size_t nsamps, size_t offset);
+    int (*ch_write_gaps)(struct ch_storage*, const struct ch_gap *gaps,
+                         size_t ngaps);
     void (*ch_free)(struct ch_storage*);
+    /* Optional: */
+    int (*ch_stats)(struct ch_storage*, struct ch_storage_stats *stats);
 };
 
 static inline int ch_storage_open(struct ch_storage *chns, unsigned flags)
@@ -70,6 +104,37 @@ static inline int ch_storage_write(struct ch_storage *chns,
     return chns->ops->ch_write(chns, bsamps, nsamps);
 }
 
+/* Overwrite board samples that were already written, starting
+ * "offset" board samples from the beginning. Doesn't affect where
+ * ch_storage_write() appends. Writing past the end is an error. */
+static inline int ch_storage_write_at(struct ch_storage *chns,
+                                      const struct raw_pkt_bsmp *bsamps,
+                                      size_t nsamps, size_t offset)
+{
+    return chns->ops->ch_write_at(chns, bsamps, nsamps, offset);
+}
+
+/* Record a table of the gaps in what was written. Call this at most
+ * once, after the last ch_storage_write(). */
+static inline int ch_storage_write_gaps(struct ch_storage *chns,
+                                        const struct ch_gap *gaps,
+                                        size_t ngaps)
+{
+    return chns->ops->ch_write_gaps(chns, gaps, ngaps);
+}
+
+/* Get storage statistics. The totals are final once chns is closed.
+ * Returns -1, with errno ENOSYS, if the backend doesn't keep any. */
+static inline int ch_storage_stats(struct ch_storage *chns,
+                                   struct ch_storage_stats *stats)
+{
+    if (!chns->ops->ch_stats) {
+        errno = ENOSYS;
+        return -1;
+    }
+    return chns->ops->ch_stats(chns, stats);
+}
+
 static inline void ch_storage_free(struct ch_storage *chns)
 {
     void (*f)(struct ch_storage*) = chns->ops->ch_free;
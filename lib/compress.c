@@ -0,0 +1,454 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "compress.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lz4.h>
+#include <zstd.h>
+
+/*
+ * HDF5 filter 32004 splits its input into blocks, each compressed on
+ * its own. This is its default block size, which is bigger than any
+ * chunk we write, so there's one block.
+ */
+#define LZ4_BLOCK_SIZE (1U << 30)
+#define LZ4_HDR_SIZE 12         /* big-endian u64 length, u32 block size */
+#define LZ4_BLOCK_HDR_SIZE 4    /* big-endian u32 compressed length */
+
+/* Records per block of a shuffle. Shuffling reads a byte from every
+ * record for each byte it writes; doing it this many records at a
+ * time keeps the records it's reading in cache. */
+#define SHUFFLE_BLOCK_RECS 64
+
+struct compress_ctx {
+    int codec;
+    int level;
+    size_t rec_size;
+    ZSTD_CCtx *zctx;
+    uint8_t *scratch;           /* filtered input, before compressing */
+    size_t scratch_size;
+};
+
+static const char *const codec_names[COMPRESS_NCODECS] = {
+    [COMPRESS_NONE] = "none",
+    [COMPRESS_LZ4] = "lz4",
+    [COMPRESS_ZSTD] = "zstd",
+    [COMPRESS_SHUFFLE_LZ4] = "shuffle+lz4",
+    [COMPRESS_SHUFFLE_ZSTD] = "shuffle+zstd",
+    [COMPRESS_DELTA_ZSTD] = "delta+zstd",
+};
+
+const char* compress_codec_str(int codec)
+{
+    if (codec < 0 || codec >= COMPRESS_NCODECS) {
+        return "unknown";
+    }
+    return codec_names[codec];
+}
+
+int compress_codec_from_str(const char *name)
+{
+    for (int i = 0; i < COMPRESS_NCODECS; i++) {
+        if (!strcmp(name, codec_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static inline int codec_uses_lz4(int codec)
+{
+    return codec == COMPRESS_LZ4 || codec == COMPRESS_SHUFFLE_LZ4;
+}
+
+static inline int codec_has_filter(int codec)
+{
+    return (codec == COMPRESS_SHUFFLE_LZ4 ||
+            codec == COMPRESS_SHUFFLE_ZSTD ||
+            codec == COMPRESS_DELTA_ZSTD);
+}
+
+/*
+ * Filters
+ */
+
+/* Byte i of record r goes to dst[i * nrecs + r]; any bytes past the
+ * last whole record stay where they are. Like HDF5's shuffle filter,
+ * this leaves the data alone unless there's more than one record of
+ * more than one byte. */
+static void shuffle(uint8_t *dst, const uint8_t *src, size_t len,
+                    size_t rec_size)
+{
+    size_t nrecs = rec_size ? len / rec_size : 0;
+    if (rec_size <= 1 || nrecs <= 1) {
+        memcpy(dst, src, len);
+        return;
+    }
+    for (size_t r0 = 0; r0 < nrecs; r0 += SHUFFLE_BLOCK_RECS) {
+        size_t nr = nrecs - r0;
+        if (nr > SHUFFLE_BLOCK_RECS) {
+            nr = SHUFFLE_BLOCK_RECS;
+        }
+        const uint8_t *s = src + r0 * rec_size;
+        for (size_t i = 0; i < rec_size; i++) {
+            uint8_t *d = dst + i * nrecs + r0;
+            for (size_t r = 0; r < nr; r++) {
+                d[r] = s[r * rec_size + i];
+            }
+        }
+    }
+    memcpy(dst + nrecs * rec_size, src + nrecs * rec_size,
+           len - nrecs * rec_size);
+}
+
+static void unshuffle(uint8_t *dst, const uint8_t *src, size_t len,
+                      size_t rec_size)
+{
+    size_t nrecs = rec_size ? len / rec_size : 0;
+    if (rec_size <= 1 || nrecs <= 1) {
+        memcpy(dst, src, len);
+        return;
+    }
+    for (size_t r0 = 0; r0 < nrecs; r0 += SHUFFLE_BLOCK_RECS) {
+        size_t nr = nrecs - r0;
+        if (nr > SHUFFLE_BLOCK_RECS) {
+            nr = SHUFFLE_BLOCK_RECS;
+        }
+        uint8_t *d = dst + r0 * rec_size;
+        for (size_t i = 0; i < rec_size; i++) {
+            const uint8_t *s = src + i * nrecs + r0;
+            for (size_t r = 0; r < nr; r++) {
+                d[r * rec_size + i] = s[r];
+            }
+        }
+    }
+    memcpy(dst + nrecs * rec_size, src + nrecs * rec_size,
+           len - nrecs * rec_size);
+}
+
+/* Each 16-bit word, minus the one rec_size bytes earlier. The first
+ * record, and a trailing odd byte, are copied as-is. */
+static void delta16(uint8_t *dst, const uint8_t *src, size_t len,
+                    size_t rec_size)
+{
+    const uint16_t *s = (const uint16_t*)src;
+    uint16_t *d = (uint16_t*)dst;
+    size_t n = len / 2;
+    size_t stride = rec_size / 2;
+    size_t head = stride < n ? stride : n;
+    memcpy(d, s, head * 2);
+    for (size_t i = head; i < n; i++) {
+        d[i] = (uint16_t)(s[i] - s[i - stride]);
+    }
+    if (len & 1) {
+        dst[len - 1] = src[len - 1];
+    }
+}
+
+static void undelta16(uint8_t *dst, const uint8_t *src, size_t len,
+                      size_t rec_size)
+{
+    const uint16_t *s = (const uint16_t*)src;
+    uint16_t *d = (uint16_t*)dst;
+    size_t n = len / 2;
+    size_t stride = rec_size / 2;
+    size_t head = stride < n ? stride : n;
+    memcpy(d, s, head * 2);
+    for (size_t i = head; i < n; i++) {
+        d[i] = (uint16_t)(s[i] + d[i - stride]);
+    }
+    if (len & 1) {
+        dst[len - 1] = src[len - 1];
+    }
+}
+
+/*
+ * Compressors
+ */
+
+static inline void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+            (uint32_t)p[2] << 8 | (uint32_t)p[3]);
+}
+
+static inline void put_be64(uint8_t *p, uint64_t v)
+{
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+static inline uint64_t get_be64(const uint8_t *p)
+{
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static size_t lz4_bound(size_t len)
+{
+    size_t nblocks = (len + LZ4_BLOCK_SIZE - 1) / LZ4_BLOCK_SIZE;
+    size_t block = len < LZ4_BLOCK_SIZE ? len : LZ4_BLOCK_SIZE;
+    return (LZ4_HDR_SIZE +
+            nblocks * (LZ4_BLOCK_HDR_SIZE + LZ4_COMPRESSBOUND(block)));
+}
+
+/* Blocks that don't shrink are stored as-is, and marked by having
+ * their compressed length equal the block size. */
+static size_t lz4_encode(int accel, uint8_t *dst, size_t dst_size,
+                         const uint8_t *src, size_t len)
+{
+    if (dst_size < lz4_bound(len)) {
+        return 0;
+    }
+    size_t block_size = len < LZ4_BLOCK_SIZE ? len : LZ4_BLOCK_SIZE;
+    uint8_t *out = dst;
+    put_be64(out, len);
+    put_be32(out + 8, (uint32_t)block_size);
+    out += LZ4_HDR_SIZE;
+    for (size_t off = 0; off < len; off += block_size) {
+        size_t n = len - off < block_size ? len - off : block_size;
+        int zlen = LZ4_compress_fast((const char*)src + off,
+                                     (char*)out + LZ4_BLOCK_HDR_SIZE,
+                                     (int)n, LZ4_COMPRESSBOUND((int)n),
+                                     accel);
+        if (zlen <= 0) {
+            return 0;
+        }
+        if ((size_t)zlen >= n) {
+            memcpy(out + LZ4_BLOCK_HDR_SIZE, src + off, n);
+            zlen = (int)n;
+        }
+        put_be32(out, (uint32_t)zlen);
+        out += LZ4_BLOCK_HDR_SIZE + zlen;
+    }
+    return (size_t)(out - dst);
+}
+
+static size_t lz4_decode(uint8_t *dst, size_t dst_size,
+                         const uint8_t *src, size_t len)
+{
+    if (len < LZ4_HDR_SIZE) {
+        return 0;
+    }
+    uint64_t orig = get_be64(src);
+    size_t block_size = get_be32(src + 8);
+    const uint8_t *in = src + LZ4_HDR_SIZE;
+    const uint8_t *end = src + len;
+    if (orig > dst_size || (orig && !block_size)) {
+        return 0;
+    }
+    for (size_t off = 0; off < orig; off += block_size) {
+        size_t n = orig - off < block_size ? orig - off : block_size;
+        if ((size_t)(end - in) < LZ4_BLOCK_HDR_SIZE) {
+            return 0;
+        }
+        size_t zlen = get_be32(in);
+        in += LZ4_BLOCK_HDR_SIZE;
+        if ((size_t)(end - in) < zlen) {
+            return 0;
+        }
+        if (zlen == n) {
+            memcpy(dst + off, in, n);
+        } else if (LZ4_decompress_safe((const char*)in, (char*)dst + off,
+                                       (int)zlen, (int)n) != (int)n) {
+            return 0;
+        }
+        in += zlen;
+    }
+    return (size_t)orig;
+}
+
+static size_t zstd_encode(ZSTD_CCtx *zctx, int level, uint8_t *dst,
+                          size_t dst_size, const uint8_t *src, size_t len)
+{
+    size_t ret = ZSTD_compressCCtx(zctx, dst, dst_size, src, len, level);
+    return ZSTD_isError(ret) ? 0 : ret;
+}
+
+static size_t zstd_decoded_size(const uint8_t *src, size_t len)
+{
+    unsigned long long n = ZSTD_getFrameContentSize(src, len);
+    if (n == ZSTD_CONTENTSIZE_UNKNOWN || n == ZSTD_CONTENTSIZE_ERROR ||
+        n > SIZE_MAX) {
+        return 0;
+    }
+    return (size_t)n;
+}
+
+static size_t zstd_decode(uint8_t *dst, size_t dst_size,
+                          const uint8_t *src, size_t len)
+{
+    size_t ret = ZSTD_decompress(dst, dst_size, src, len);
+    return ZSTD_isError(ret) ? 0 : ret;
+}
+
+/*
+ * Codecs
+ */
+
+size_t compress_bound(int codec, size_t len)
+{
+    switch (codec) {
+    case COMPRESS_NONE:
+        return len;
+    case COMPRESS_LZ4:
+    case COMPRESS_SHUFFLE_LZ4:
+        return lz4_bound(len);
+    case COMPRESS_ZSTD:
+    case COMPRESS_SHUFFLE_ZSTD:
+    case COMPRESS_DELTA_ZSTD:
+        return ZSTD_compressBound(len);
+    default:
+        return 0;
+    }
+}
+
+struct compress_ctx* compress_ctx_alloc(int codec, int level,
+                                        size_t rec_size)
+{
+    if (codec <= COMPRESS_NONE || codec >= COMPRESS_NCODECS ||
+        level < 0 || (codec == COMPRESS_DELTA_ZSTD && rec_size % 2)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct compress_ctx *ctx = malloc(sizeof(*ctx));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->codec = codec;
+    ctx->level = level;
+    ctx->rec_size = rec_size;
+    ctx->zctx = NULL;
+    ctx->scratch = NULL;
+    ctx->scratch_size = 0;
+    if (!codec_uses_lz4(codec)) {
+        ctx->zctx = ZSTD_createCCtx();
+        if (!ctx->zctx) {
+            free(ctx);
+            return NULL;
+        }
+    }
+    return ctx;
+}
+
+void compress_ctx_free(struct compress_ctx *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+    ZSTD_freeCCtx(ctx->zctx);
+    free(ctx->scratch);
+    free(ctx);
+}
+
+size_t compress_encode(struct compress_ctx *ctx, void *dst, size_t dst_size,
+                       const void *src, size_t len)
+{
+    const uint8_t *in = src;
+    if (codec_has_filter(ctx->codec)) {
+        if (ctx->scratch_size < len) {
+            uint8_t *s = realloc(ctx->scratch, len);
+            if (!s) {
+                return 0;
+            }
+            ctx->scratch = s;
+            ctx->scratch_size = len;
+        }
+        if (ctx->codec == COMPRESS_DELTA_ZSTD) {
+            delta16(ctx->scratch, src, len, ctx->rec_size);
+        } else {
+            shuffle(ctx->scratch, src, len, ctx->rec_size);
+        }
+        in = ctx->scratch;
+    }
+    size_t ret;
+    if (codec_uses_lz4(ctx->codec)) {
+        ret = lz4_encode(ctx->level ? ctx->level : 1, dst, dst_size,
+                         in, len);
+    } else {
+        ret = zstd_encode(ctx->zctx, ctx->level, dst, dst_size, in, len);
+    }
+    return ret < len ? ret : 0;
+}
+
+size_t compress_decoded_size(int codec, const void *src, size_t len)
+{
+    switch (codec) {
+    case COMPRESS_NONE:
+        return len;
+    case COMPRESS_LZ4:
+    case COMPRESS_SHUFFLE_LZ4:
+        return len < LZ4_HDR_SIZE ? 0 : (size_t)get_be64(src);
+    case COMPRESS_ZSTD:
+    case COMPRESS_SHUFFLE_ZSTD:
+    case COMPRESS_DELTA_ZSTD:
+        return zstd_decoded_size(src, len);
+    default:
+        return 0;
+    }
+}
+
+size_t compress_decode(int codec, size_t rec_size, void *dst,
+                       size_t dst_size, const void *src, size_t len)
+{
+    if (codec == COMPRESS_NONE) {
+        if (len > dst_size) {
+            return 0;
+        }
+        memcpy(dst, src, len);
+        return len;
+    }
+    if (codec < 0 || codec >= COMPRESS_NCODECS ||
+        (codec == COMPRESS_DELTA_ZSTD && rec_size % 2)) {
+        return 0;
+    }
+
+    /* Filtered data gets decompressed to a temporary buffer first. */
+    uint8_t *out = dst;
+    size_t n = 0;
+    if (codec_has_filter(codec)) {
+        n = compress_decoded_size(codec, src, len);
+        if (!n || n > dst_size || !(out = malloc(n))) {
+            return 0;
+        }
+        dst_size = n;
+    }
+    if (codec_uses_lz4(codec)) {
+        n = lz4_decode(out, dst_size, src, len);
+    } else {
+        n = zstd_decode(out, dst_size, src, len);
+    }
+    if (out != dst) {
+        if (n && codec == COMPRESS_DELTA_ZSTD) {
+            undelta16(dst, out, n, rec_size);
+        } else if (n) {
+            unshuffle(dst, out, n, rec_size);
+        }
+        free(out);
+    }
+    return n;
+}
@@ -0,0 +1,117 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file compress.h
+ * @brief Lossless compression of stored board samples
+ *
+ * Each scheme is a reversible filter that lines up bytes that tend
+ * to be equal, followed by a general-purpose compressor:
+ *
+ * - Byte shuffle: byte i of every record, then byte i + 1, and so
+ *   on, exactly as HDF5's shuffle filter does it. With board sample
+ *   records, that puts each channel's high bytes (which hardly
+ *   change) next to each other.
+ *
+ * - Delta: each 16-bit word minus the one a record earlier, modulo
+ *   2^16. Neural data changes slowly from sample to sample, so most
+ *   differences are small.
+ *
+ * The compressors' output is in the format of the registered HDF5
+ * filters for them (COMPRESS_H5Z_*), so HDF5 chunks compressed here
+ * are readable by any HDF5 library with those filters available
+ * (e.g. h5py, after "import hdf5plugin").
+ */
+
+#ifndef _LIB_COMPRESS_H_
+#define _LIB_COMPRESS_H_
+
+#include <stddef.h>
+
+/* Registered HDF5 filter IDs, from the HDF Group's list. */
+#define COMPRESS_H5Z_LZ4 32004
+#define COMPRESS_H5Z_ZSTD 32015
+
+/** Compression schemes. The numbers are stored in files; don't
+ * change them. */
+enum compress_codec {
+    COMPRESS_NONE = 0,          /**< Stored as-is */
+    COMPRESS_LZ4 = 1,           /**< LZ4, in HDF5 filter 32004's format */
+    COMPRESS_ZSTD = 2,          /**< A zstd frame (HDF5 filter 32015) */
+    COMPRESS_SHUFFLE_LZ4 = 3,   /**< Byte shuffle, then LZ4 */
+    COMPRESS_SHUFFLE_ZSTD = 4,  /**< Byte shuffle, then zstd */
+    COMPRESS_DELTA_ZSTD = 5,    /**< 16-bit delta, then zstd */
+
+    COMPRESS_NCODECS
+};
+
+/** Per-thread compression state. */
+struct compress_ctx;
+
+/** Get a short name for a codec, e.g. "shuffle+lz4". */
+const char* compress_codec_str(int codec);
+
+/** Look up a codec by its compress_codec_str() name; -1 if none. */
+int compress_codec_from_str(const char *name);
+
+/** The most bytes compress_encode() can produce from len bytes. */
+size_t compress_bound(int codec, size_t len);
+
+/**
+ * Allocate state for compressing with a codec.
+ *
+ * @param codec Codec to compress with; not COMPRESS_NONE.
+ * @param level For zstd, the compression level (0 means zstd's
+ *              default); for LZ4, the acceleration factor (higher is
+ *              faster, and compresses less; 0 means 1).
+ * @param rec_size Record size, in bytes: shuffles gather each byte
+ *                 of a record, and deltas subtract the word a record
+ *                 earlier (so it must be even). Ignored otherwise.
+ * @return New state, or NULL on error (errno EINVAL if the
+ *         arguments don't make sense).
+ */
+struct compress_ctx* compress_ctx_alloc(int codec, int level,
+                                        size_t rec_size);
+
+/** Free state allocated with compress_ctx_alloc(). */
+void compress_ctx_free(struct compress_ctx *ctx);
+
+/**
+ * Compress len bytes from src into dst.
+ *
+ * A context may only be used by one thread at a time.
+ *
+ * @return Length of the result, or 0 if it wouldn't be any shorter
+ *         than len (or something went wrong); callers should store
+ *         those bytes as-is.
+ */
+size_t compress_encode(struct compress_ctx *ctx, void *dst, size_t dst_size,
+                       const void *src, size_t len);
+
+/** Length of what len bytes compressed with codec will decompress
+ * to, from their header; 0 if that isn't known. */
+size_t compress_decoded_size(int codec, const void *src, size_t len);
+
+/**
+ * Decompress the output of compress_encode().
+ *
+ * @param rec_size As passed to compress_ctx_alloc().
+ * @return Length of the result, or 0 if src is corrupt or the result
+ *         won't fit in dst_size bytes.
+ */
+size_t compress_decode(int codec, size_t rec_size, void *dst,
+                       size_t dst_size, const void *src, size_t len);
+
+#endif
@@ -0,0 +1,269 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "compress_pool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "compress.h"
+#include "safe_pthread.h"
+
+#define JOBS_PER_THREAD 2
+
+enum {
+    JOB_IDLE = 0,
+    JOB_QUEUED,                 /* submitted; maybe being compressed */
+    JOB_DONE,
+};
+
+struct compress_worker {
+    struct compress_pool *pool;
+    pthread_t thread;
+    int started;
+    struct compress_ctx *ctx;
+    struct compress_thread_stats stats; /* protected by pool->mtx */
+};
+
+struct compress_pool {
+    pthread_mutex_t mtx;
+    pthread_cond_t work_cv;     /* workers wait here for jobs */
+    pthread_cond_t done_cv;     /* compress_pool_reap() waits here */
+    int stop;
+
+    struct compress_job *jobs;
+    size_t njobs;
+    /* Free-running counts of jobs released, started by a worker, and
+     * submitted; job i is jobs[i % njobs]. */
+    uint64_t tail;
+    uint64_t next_run;
+    uint64_t submitted;
+
+    struct compress_worker workers[COMPRESS_POOL_MAX_THREADS];
+    size_t nthreads;
+};
+
+static uint64_t compress_pool_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Compress a job, and return how long it took. */
+static uint64_t compress_job_run(struct compress_worker *w,
+                                 struct compress_job *job)
+{
+    uint64_t start = compress_pool_now_ns();
+    size_t n = compress_encode(w->ctx, job->zbuf, job->zbuf_size,
+                               job->in, job->in_len);
+    job->compressed = n != 0;
+    job->out = n ? job->zbuf : job->in;
+    job->out_len = n ? n : job->in_len;
+    return compress_pool_now_ns() - start;
+}
+
+/* Call with pool->mtx held. */
+static void compress_job_account(struct compress_worker *w,
+                                 const struct compress_job *job,
+                                 uint64_t ns)
+{
+    w->stats.njobs++;
+    w->stats.nbytes_in += job->in_len;
+    w->stats.nbytes_out += job->out_len;
+    w->stats.busy_ns += ns;
+}
+
+static void* compress_pool_main(void *arg)
+{
+    struct compress_worker *w = arg;
+    struct compress_pool *pool = w->pool;
+    safe_p_mutex_lock(&pool->mtx);
+    while (1) {
+        while (!pool->stop && pool->next_run == pool->submitted) {
+            safe_p_cond_wait(&pool->work_cv, &pool->mtx);
+        }
+        if (pool->stop) {
+            break;
+        }
+        struct compress_job *job = &pool->jobs[pool->next_run++ %
+                                               pool->njobs];
+        safe_p_mutex_unlock(&pool->mtx);
+        uint64_t ns = compress_job_run(w, job);
+        safe_p_mutex_lock(&pool->mtx);
+        compress_job_account(w, job, ns);
+        job->state = JOB_DONE;
+        safe_p_cond_signal(&pool->done_cv);
+    }
+    safe_p_mutex_unlock(&pool->mtx);
+    return NULL;
+}
+
+struct compress_pool* compress_pool_alloc(int codec, int level,
+                                          size_t rec_size, size_t max_in,
+                                          size_t nthreads)
+{
+    if (nthreads > COMPRESS_POOL_MAX_THREADS || !max_in) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct compress_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mtx, NULL);
+    pthread_cond_init(&pool->work_cv, NULL);
+    pthread_cond_init(&pool->done_cv, NULL);
+    pool->nthreads = nthreads;
+    pool->njobs = nthreads ? nthreads * JOBS_PER_THREAD : 1;
+    pool->jobs = calloc(pool->njobs, sizeof(*pool->jobs));
+    if (!pool->jobs) {
+        goto fail;
+    }
+    size_t zbuf_size = compress_bound(codec, max_in);
+    for (size_t i = 0; i < pool->njobs; i++) {
+        struct compress_job *job = &pool->jobs[i];
+        job->in = malloc(max_in);
+        job->zbuf = malloc(zbuf_size);
+        job->zbuf_size = zbuf_size;
+        if (!job->in || !job->zbuf) {
+            goto fail;
+        }
+    }
+    for (size_t i = 0; i < (nthreads ? nthreads : 1); i++) {
+        struct compress_worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->ctx = compress_ctx_alloc(codec, level, rec_size);
+        if (!w->ctx) {
+            goto fail;
+        }
+    }
+    for (size_t i = 0; i < nthreads; i++) {
+        struct compress_worker *w = &pool->workers[i];
+        int en = pthread_create(&w->thread, NULL, compress_pool_main, w);
+        if (en) {
+            errno = en;
+            goto fail;
+        }
+        w->started = 1;
+    }
+    return pool;
+
+ fail:
+    compress_pool_free(pool);
+    return NULL;
+}
+
+void compress_pool_free(struct compress_pool *pool)
+{
+    if (!pool) {
+        return;
+    }
+    safe_p_mutex_lock(&pool->mtx);
+    pool->stop = 1;
+    safe_p_cond_broadcast(&pool->work_cv);
+    safe_p_mutex_unlock(&pool->mtx);
+    for (size_t i = 0; i < COMPRESS_POOL_MAX_THREADS; i++) {
+        struct compress_worker *w = &pool->workers[i];
+        if (w->started) {
+            safe_p_join(w->thread, NULL);
+        }
+        compress_ctx_free(w->ctx);
+    }
+    for (size_t i = 0; pool->jobs && i < pool->njobs; i++) {
+        free(pool->jobs[i].in);
+        free(pool->jobs[i].zbuf);
+    }
+    free(pool->jobs);
+    pthread_cond_destroy(&pool->done_cv);
+    pthread_cond_destroy(&pool->work_cv);
+    pthread_mutex_destroy(&pool->mtx);
+    free(pool);
+}
+
+struct compress_job* compress_pool_job(struct compress_pool *pool)
+{
+    /* Only we change submitted and tail, so no need to lock. */
+    if (pool->submitted - pool->tail == pool->njobs) {
+        return NULL;
+    }
+    struct compress_job *job = &pool->jobs[pool->submitted % pool->njobs];
+    assert(job->state == JOB_IDLE);
+    return job;
+}
+
+void compress_pool_submit(struct compress_pool *pool,
+                          struct compress_job *job)
+{
+    assert(job == &pool->jobs[pool->submitted % pool->njobs]);
+    assert(job->in_len);
+    if (!pool->nthreads) {
+        struct compress_worker *w = &pool->workers[0];
+        uint64_t ns = compress_job_run(w, job);
+        safe_p_mutex_lock(&pool->mtx);
+        compress_job_account(w, job, ns);
+        job->state = JOB_DONE;
+        pool->next_run = ++pool->submitted;
+        safe_p_mutex_unlock(&pool->mtx);
+        return;
+    }
+    safe_p_mutex_lock(&pool->mtx);
+    job->state = JOB_QUEUED;
+    pool->submitted++;
+    safe_p_cond_signal(&pool->work_cv);
+    safe_p_mutex_unlock(&pool->mtx);
+}
+
+struct compress_job* compress_pool_reap(struct compress_pool *pool,
+                                        int wait)
+{
+    if (pool->tail == pool->submitted) {
+        return NULL;
+    }
+    struct compress_job *job = &pool->jobs[pool->tail % pool->njobs];
+    safe_p_mutex_lock(&pool->mtx);
+    while (wait && job->state != JOB_DONE) {
+        safe_p_cond_wait(&pool->done_cv, &pool->mtx);
+    }
+    int done = job->state == JOB_DONE;
+    safe_p_mutex_unlock(&pool->mtx);
+    return done ? job : NULL;
+}
+
+void compress_pool_release(struct compress_pool *pool,
+                           struct compress_job *job)
+{
+    assert(job == &pool->jobs[pool->tail % pool->njobs]);
+    assert(job->state == JOB_DONE);
+    job->state = JOB_IDLE;
+    pool->tail++;
+}
+
+size_t compress_pool_nthreads(struct compress_pool *pool)
+{
+    return pool->nthreads ? pool->nthreads : 1;
+}
+
+void compress_pool_thread_stats(struct compress_pool *pool, size_t i,
+                                struct compress_thread_stats *stats)
+{
+    assert(i < compress_pool_nthreads(pool));
+    safe_p_mutex_lock(&pool->mtx);
+    *stats = pool->workers[i].stats;
+    safe_p_mutex_unlock(&pool->mtx);
+}
@@ -0,0 +1,127 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file compress_pool.h
+ * @brief Compressing buffers on worker threads, in order
+ *
+ * A storage backend fills a job's input buffer and submits it; a pool
+ * thread compresses it; the backend reaps finished jobs, writes them
+ * out, and releases them for reuse. Jobs are reaped in the order they
+ * were submitted, however the threads finish them, so the file comes
+ * out the same as if they were compressed one at a time.
+ *
+ * The pool has two jobs per thread, so the threads can work on one
+ * while the backend fills the next. Only the thread that allocated
+ * the pool may call anything but compress_pool_thread_stats().
+ *
+ * A typical write looks like this:
+ *
+ *     while (!(job = compress_pool_job(pool))) {
+ *         done = compress_pool_reap(pool, 1);
+ *         ...write done->out, done->out_len bytes...
+ *         compress_pool_release(pool, done);
+ *     }
+ *     ...fill job->in, set job->in_len and job->tag...
+ *     compress_pool_submit(pool, job);
+ */
+
+#ifndef _LIB_COMPRESS_POOL_H_
+#define _LIB_COMPRESS_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Most threads a pool can have. */
+#define COMPRESS_POOL_MAX_THREADS 16
+
+struct compress_pool;
+
+struct compress_job {
+    void *in;                   /* input buffer, max_in bytes */
+    size_t in_len;              /* bytes of it to compress */
+    uint64_t tag;               /* caller's, e.g. where this goes */
+
+    /* Results, once reaped. If compressed is zero, compressing didn't
+     * help, and out points at the input. */
+    const void *out;
+    size_t out_len;
+    int compressed;
+
+    /* Private */
+    int state;
+    void *zbuf;
+    size_t zbuf_size;
+};
+
+/* What a pool thread has done so far. */
+struct compress_thread_stats {
+    uint64_t njobs;
+    uint64_t nbytes_in;
+    uint64_t nbytes_out;
+    uint64_t busy_ns;           /* time spent compressing */
+};
+
+/**
+ * Allocate a pool, and start its threads.
+ *
+ * @param codec, level, rec_size See compress_ctx_alloc().
+ * @param max_in Largest job input, in bytes.
+ * @param nthreads Number of threads, up to COMPRESS_POOL_MAX_THREADS.
+ *                 If zero, compress_pool_submit() compresses the job
+ *                 itself, so it's done by the time it returns.
+ * @return New pool, or NULL on error.
+ */
+struct compress_pool* compress_pool_alloc(int codec, int level,
+                                          size_t rec_size, size_t max_in,
+                                          size_t nthreads);
+
+/** Stop a pool's threads and free it. Unreaped jobs are lost. */
+void compress_pool_free(struct compress_pool *pool);
+
+/**
+ * Get the next job to fill in.
+ *
+ * @return The job, or NULL if they're all in use; reap and release
+ *         one, then try again.
+ */
+struct compress_job* compress_pool_job(struct compress_pool *pool);
+
+/** Start compressing the job compress_pool_job() last returned. */
+void compress_pool_submit(struct compress_pool *pool,
+                          struct compress_job *job);
+
+/**
+ * Get the oldest submitted job that hasn't been released yet.
+ *
+ * @param wait If nonzero, wait for it to finish.
+ * @return The job, or NULL if there isn't one, or (if wait is zero)
+ *         it isn't finished yet.
+ */
+struct compress_job* compress_pool_reap(struct compress_pool *pool,
+                                        int wait);
+
+/** Done with a job compress_pool_reap() returned. */
+void compress_pool_release(struct compress_pool *pool,
+                           struct compress_job *job);
+
+/** Number of threads; always at least 1 for stats purposes. */
+size_t compress_pool_nthreads(struct compress_pool *pool);
+
+/** Copy out what thread i has done. */
+void compress_pool_thread_stats(struct compress_pool *pool, size_t i,
+                                struct compress_thread_stats *stats);
+
+#endif
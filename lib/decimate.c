@@ -0,0 +1,401 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "decimate.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DECIM_X86 1
+#include <immintrin.h>
+#else
+#define DECIM_X86 0
+#endif
+
+/* Channels are padded to a multiple of this many floats (one AVX
+ * register), and frames aligned to match. */
+#define DECIM_VEC 8
+#define DECIM_ALIGN (DECIM_VEC * sizeof(float))
+
+/* Each stage's filter has this many taps per unit of its factor (plus
+ * one, to make it symmetric about a sample), with its cutoff at
+ * DECIM_CUTOFF times the new Nyquist rate. That keeps about the bottom
+ * half of the new band flat, and stops everything from a little above
+ * the new Nyquist rate up; what aliases from in between lands in the
+ * top of the band, which is in the transition band anyway. */
+#define DECIM_TAPS_PER_FACTOR 12
+#define DECIM_CUTOFF 0.8
+
+/* Filter ntaps frames, each stride floats (a multiple of DECIM_VEC)
+ * apart, into y: y[i] = sum(taps[k] * frames[k * stride + i]). Each
+ * block of channels stays in registers for all the taps. */
+typedef void (*decim_fir_fn)(float *y, const float *frames,
+                             const float *taps, unsigned ntaps,
+                             size_t stride);
+
+static void decim_fir_scalar(float *y, const float *frames,
+                             const float *taps, unsigned ntaps,
+                             size_t stride)
+{
+    for (size_t i = 0; i < stride; i += DECIM_VEC) {
+        float acc[DECIM_VEC] = { 0 };
+        const float *x = frames + i;
+        for (unsigned k = 0; k < ntaps; k++, x += stride) {
+            for (size_t j = 0; j < DECIM_VEC; j++) {
+                acc[j] += taps[k] * x[j];
+            }
+        }
+        memcpy(y + i, acc, sizeof(acc));
+    }
+}
+
+#if DECIM_X86
+__attribute__((target("avx2,fma")))
+static void decim_fir_avx2(float *y, const float *frames,
+                           const float *taps, unsigned ntaps,
+                           size_t stride)
+{
+    size_t i = 0;
+    /* Two blocks at a time, to keep both FMA units busy. */
+    for (; i + 2 * DECIM_VEC <= stride; i += 2 * DECIM_VEC) {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        const float *x = frames + i;
+        for (unsigned k = 0; k < ntaps; k++, x += stride) {
+            __m256 c = _mm256_broadcast_ss(taps + k);
+            acc0 = _mm256_fmadd_ps(c, _mm256_load_ps(x), acc0);
+            acc1 = _mm256_fmadd_ps(c, _mm256_load_ps(x + DECIM_VEC), acc1);
+        }
+        _mm256_store_ps(y + i, acc0);
+        _mm256_store_ps(y + i + DECIM_VEC, acc1);
+    }
+    for (; i < stride; i += DECIM_VEC) {
+        __m256 acc = _mm256_setzero_ps();
+        const float *x = frames + i;
+        for (unsigned k = 0; k < ntaps; k++, x += stride) {
+            acc = _mm256_fmadd_ps(_mm256_broadcast_ss(taps + k),
+                                  _mm256_load_ps(x), acc);
+        }
+        _mm256_store_ps(y + i, acc);
+    }
+    _mm256_zeroupper();
+}
+#endif
+
+/* x[i] = in[i], for i < n. This happens for every input frame, so
+ * it's worth vectorizing too. */
+typedef void (*decim_cvt_fn)(float *x, const uint16_t *in, size_t n);
+
+static void decim_cvt_scalar(float *x, const uint16_t *in, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        x[i] = in[i];
+    }
+}
+
+#if DECIM_X86
+__attribute__((target("avx2,fma")))
+static void decim_cvt_avx2(float *x, const uint16_t *in, size_t n)
+{
+    size_t i = 0;
+    for (; i + DECIM_VEC <= n; i += DECIM_VEC) {
+        __m128i u16 = _mm_loadu_si128((const __m128i*)(in + i));
+        __m256i i32 = _mm256_cvtepu16_epi32(u16);
+        _mm256_store_ps(x + i, _mm256_cvtepi32_ps(i32));
+    }
+    _mm256_zeroupper();
+    decim_cvt_scalar(x + i, in + i, n - i);
+}
+#endif
+
+static void decim_pick_kernels(decim_fir_fn *fir, decim_cvt_fn *cvt)
+{
+#if DECIM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        *fir = decim_fir_avx2;
+        *cvt = decim_cvt_avx2;
+        return;
+    }
+#endif
+    *fir = decim_fir_scalar;
+    *cvt = decim_cvt_scalar;
+}
+
+struct decim_stage {
+    unsigned factor;
+    unsigned ntaps;
+    unsigned pos;               /* history slot for the next frame */
+    unsigned phase;             /* frames since the last output */
+    float *taps;
+    /* 2 * ntaps frames. Each frame goes in two slots, ntaps apart, so
+     * the last ntaps frames are always contiguous. */
+    float *hist;
+};
+
+struct decim {
+    size_t nchans;
+    size_t stride;              /* nchans, padded to DECIM_VEC */
+    unsigned factor;
+    int envelope;
+    int primed;                 /* histories hold something */
+    unsigned delay;
+    decim_fir_fn fir;
+    decim_cvt_fn cvt;
+
+    size_t nstages;
+    struct decim_stage *stages;
+    float *x;                   /* stage input */
+    float *y;                   /* stage output */
+
+    unsigned env_phase;
+    uint16_t *env_min;
+    uint16_t *env_max;
+};
+
+static void* decim_alloc(size_t size)
+{
+    void *ret;
+    if (posix_memalign(&ret, DECIM_ALIGN, size)) {
+        return NULL;
+    }
+    memset(ret, 0, size);
+    return ret;
+}
+
+/* Blackman-windowed sinc low-pass filter for decimating by factor,
+ * normalized to unity gain at DC. */
+static void decim_design(float *taps, unsigned ntaps, unsigned factor)
+{
+    const double fc = DECIM_CUTOFF / (2.0 * factor); /* cycles/sample */
+    const double mid = (ntaps - 1) / 2.0;
+    double sum = 0.0;
+    double *h = malloc(ntaps * sizeof(double));
+    for (unsigned n = 0; n < ntaps; n++) {
+        double t = n - mid;
+        double sinc = t == 0.0 ? 2.0 * fc : sin(2.0 * M_PI * fc * t) /
+                                            (M_PI * t);
+        double w = (0.42 - 0.5 * cos(2.0 * M_PI * n / (ntaps - 1)) +
+                    0.08 * cos(4.0 * M_PI * n / (ntaps - 1)));
+        h[n] = sinc * w;
+        sum += h[n];
+    }
+    for (unsigned n = 0; n < ntaps; n++) {
+        taps[n] = (float)(h[n] / sum);
+    }
+    free(h);
+}
+
+/* Split factor into stages of at most DECIM_MAX_STAGE_FACTOR, biggest
+ * first, except for a prime factor too big for that, which gets a
+ * stage of its own. Returns the number of stages, filling in
+ * factors[] if it's not NULL. */
+static size_t decim_split(unsigned factor, unsigned *factors)
+{
+    size_t n = 0;
+    for (unsigned f = DECIM_MAX_STAGE_FACTOR; f > 1 && factor > 1; f--) {
+        while (factor % f == 0) {
+            if (factors) {
+                factors[n] = f;
+            }
+            n++;
+            factor /= f;
+        }
+    }
+    if (factor > 1) {
+        if (factors) {
+            factors[n] = factor;
+        }
+        n++;
+    }
+    return n;
+}
+
+struct decim* decim_new(size_t nchans, unsigned factor, int envelope)
+{
+    if (!nchans || !factor) {
+        return NULL;
+    }
+    struct decim *dec = calloc(1, sizeof(*dec));
+    if (!dec) {
+        return NULL;
+    }
+    dec->nchans = nchans;
+    dec->stride = (nchans + DECIM_VEC - 1) / DECIM_VEC * DECIM_VEC;
+    dec->factor = factor;
+    dec->envelope = envelope;
+    decim_pick_kernels(&dec->fir, &dec->cvt);
+    if (envelope) {
+        dec->env_min = malloc(nchans * sizeof(uint16_t));
+        dec->env_max = malloc(nchans * sizeof(uint16_t));
+        if (!dec->env_min || !dec->env_max) {
+            goto fail;
+        }
+        return dec;
+    }
+
+    size_t frame_size = dec->stride * sizeof(float);
+    dec->x = decim_alloc(frame_size);
+    dec->y = decim_alloc(frame_size);
+    dec->nstages = decim_split(factor, NULL);
+    dec->stages = calloc(dec->nstages ? dec->nstages : 1,
+                         sizeof(*dec->stages));
+    if (!dec->x || !dec->y || !dec->stages) {
+        goto fail;
+    }
+    unsigned factors[sizeof(unsigned) * 8];
+    decim_split(factor, factors);
+    unsigned rate_div = 1;
+    for (size_t s = 0; s < dec->nstages; s++) {
+        struct decim_stage *st = &dec->stages[s];
+        st->factor = factors[s];
+        st->ntaps = DECIM_TAPS_PER_FACTOR * st->factor + 1;
+        st->taps = malloc(st->ntaps * sizeof(float));
+        st->hist = decim_alloc(2 * st->ntaps * frame_size);
+        if (!st->taps || !st->hist) {
+            goto fail;
+        }
+        decim_design(st->taps, st->ntaps, st->factor);
+        dec->delay += (st->ntaps - 1) / 2 * rate_div;
+        rate_div *= st->factor;
+    }
+    return dec;
+
+ fail:
+    decim_free(dec);
+    return NULL;
+}
+
+void decim_free(struct decim *dec)
+{
+    if (!dec) {
+        return;
+    }
+    for (size_t s = 0; dec->stages && s < dec->nstages; s++) {
+        free(dec->stages[s].taps);
+        free(dec->stages[s].hist);
+    }
+    free(dec->stages);
+    free(dec->x);
+    free(dec->y);
+    free(dec->env_min);
+    free(dec->env_max);
+    free(dec);
+}
+
+void decim_reset(struct decim *dec)
+{
+    dec->primed = 0;
+    dec->env_phase = 0;
+    for (size_t s = 0; s < dec->nstages; s++) {
+        dec->stages[s].pos = 0;
+        dec->stages[s].phase = 0;
+    }
+}
+
+unsigned decim_delay(const struct decim *dec)
+{
+    return dec->delay;
+}
+
+/* Fill a stage's history with copies of frame x, so it starts out in
+ * the steady state for a constant input instead of ringing. */
+static void decim_stage_prime(struct decim_stage *st, size_t stride,
+                              const float *x)
+{
+    for (unsigned k = 0; k < 2 * st->ntaps; k++) {
+        memcpy(st->hist + k * stride, x, stride * sizeof(float));
+    }
+}
+
+/* Push frame x into a stage. If that's an output, filter into y and
+ * return 1; otherwise, return 0. */
+static int decim_stage_push(struct decim *dec, struct decim_stage *st,
+                            const float *x, float *y)
+{
+    const size_t stride = dec->stride;
+    const size_t fsize = stride * sizeof(float);
+    memcpy(st->hist + st->pos * stride, x, fsize);
+    memcpy(st->hist + (st->pos + st->ntaps) * stride, x, fsize);
+    if (++st->pos == st->ntaps) {
+        st->pos = 0;
+    }
+    if (++st->phase < st->factor) {
+        return 0;
+    }
+    st->phase = 0;
+    /* The oldest of the last ntaps frames is in slot pos. The filter
+     * is symmetric, so it doesn't matter which way we walk them. */
+    dec->fir(y, st->hist + st->pos * stride, st->taps, st->ntaps, stride);
+    return 1;
+}
+
+static int decim_push_envelope(struct decim *dec, const uint16_t *in,
+                               uint16_t *out, uint16_t *out_max)
+{
+    uint16_t *mn = dec->env_min;
+    uint16_t *mx = dec->env_max;
+    if (!dec->env_phase) {
+        memcpy(mn, in, dec->nchans * sizeof(uint16_t));
+        memcpy(mx, in, dec->nchans * sizeof(uint16_t));
+    } else {
+        for (size_t c = 0; c < dec->nchans; c++) {
+            mn[c] = in[c] < mn[c] ? in[c] : mn[c];
+            mx[c] = in[c] > mx[c] ? in[c] : mx[c];
+        }
+    }
+    if (++dec->env_phase < dec->factor) {
+        return 0;
+    }
+    dec->env_phase = 0;
+    memcpy(out, mn, dec->nchans * sizeof(uint16_t));
+    memcpy(out_max, mx, dec->nchans * sizeof(uint16_t));
+    return 1;
+}
+
+int decim_push(struct decim *dec, const uint16_t *in,
+               uint16_t *out, uint16_t *out_max)
+{
+    if (dec->envelope) {
+        return decim_push_envelope(dec, in, out, out_max);
+    }
+
+    float *x = dec->x;
+    float *y = dec->y;
+    dec->cvt(x, in, dec->nchans);
+    if (!dec->primed) {
+        /* Stages see the same DC level, so prime them all with the
+         * first frame. */
+        for (size_t s = 0; s < dec->nstages; s++) {
+            decim_stage_prime(&dec->stages[s], dec->stride, x);
+        }
+        dec->primed = 1;
+    }
+    for (size_t s = 0; s < dec->nstages; s++) {
+        if (!decim_stage_push(dec, &dec->stages[s], x, y)) {
+            return 0;
+        }
+        float *tmp = x;
+        x = y;
+        y = tmp;
+    }
+    for (size_t c = 0; c < dec->nchans; c++) {
+        float v = nearbyintf(x[c]);
+        out[c] = (uint16_t)(v < 0.0f ? 0 : v > UINT16_MAX ? UINT16_MAX : v);
+    }
+    return 1;
+}
@@ -0,0 +1,91 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file decimate.h
+ * @brief Multichannel decimation, with anti-alias filtering
+ *
+ * A decimator takes frames of nchans 16-bit samples, and produces one
+ * frame for every "factor" frames it's given. Normally that's the
+ * input low-pass filtered to below the new Nyquist rate, so nothing
+ * aliases. In envelope mode, it's the smallest and largest value of
+ * each channel over those frames instead, which is what a display
+ * needs to draw a trace without hiding spikes.
+ *
+ * Filtering happens in a cascade of stages, each decimating by at
+ * most DECIM_MAX_STAGE_FACTOR, since that needs far fewer filter taps
+ * than doing a big factor in one go. Each stage is a windowed-sinc
+ * FIR filter, only evaluated when it produces an output. The
+ * arithmetic runs across channels, so it uses the widest SIMD
+ * instructions the CPU has (picked at runtime, as in bswap16.h).
+ *
+ * Filtered outputs lag their inputs by the filters' group delay;
+ * see decim_delay().
+ */
+
+#ifndef _LIB_DECIMATE_H_
+#define _LIB_DECIMATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct decim;
+
+/** Largest factor a single filter stage decimates by. */
+#define DECIM_MAX_STAGE_FACTOR 10
+
+/**
+ * Create a decimator.
+ *
+ * @param nchans Number of channels (samples per frame); nonzero.
+ * @param factor Produce one frame per this many; nonzero. 1 passes
+ *               frames straight through.
+ * @param envelope If nonzero, produce per-channel minimums and
+ *                 maximums instead of filtering.
+ * @return New decimator, or NULL on failure.
+ */
+struct decim* decim_new(size_t nchans, unsigned factor, int envelope);
+
+/** Free a decimator from decim_new(); NULL is OK. */
+void decim_free(struct decim *dec);
+
+/**
+ * Forget everything pushed so far, e.g. because some frames went
+ * missing. The next frame starts over as if the decimator were new.
+ */
+void decim_reset(struct decim *dec);
+
+/**
+ * Push a frame into a decimator.
+ *
+ * @param dec Decimator
+ * @param in nchans input samples
+ * @param out Where to put nchans output samples (the minimums, in
+ *            envelope mode), if there's an output frame.
+ * @param out_max In envelope mode, where to put nchans maximums;
+ *                ignored otherwise.
+ * @return 1 if this produced an output frame, 0 if not.
+ */
+int decim_push(struct decim *dec, const uint16_t *in,
+               uint16_t *out, uint16_t *out_max);
+
+/**
+ * Group delay of a filtering decimator, in input frames: an output
+ * reflects the input from about this many frames before the one that
+ * produced it. Zero in envelope mode.
+ */
+unsigned decim_delay(const struct decim *dec);
+
+#endif
@@ -0,0 +1,735 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "direct_ch_storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/version.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "type_attrs.h"
+#include "ch_storage.h"
+#include "logging.h"
+#include "raw_file.h"
+#include "raw_packets.h"
+
+/* io_uring appeared in Linux 5.1. We talk to it with raw system
+ * calls, to avoid depending on liburing. */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0) && \
+     defined(__NR_io_uring_setup))
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#else
+#define HAVE_IO_URING 0
+#endif
+
+#define DATA_OFF RAW_FILE_HDR_SIZE /* a DIRECT_CH_ALIGN multiple */
+#define ALIGN_UP(x) (((x) + DIRECT_CH_ALIGN - 1) & \
+                     ~(uint64_t)(DIRECT_CH_ALIGN - 1))
+#define ALIGN_DOWN(x) ((x) & ~(uint64_t)(DIRECT_CH_ALIGN - 1))
+
+struct direct_buf {
+    uint8_t *mem;               /* opts.buf_size bytes, aligned */
+    struct iovec iov;           /* what's being written, */
+    uint64_t off;               /* and where */
+    int busy;                   /* an io_uring write is in flight */
+};
+
+struct direct_uring {
+    int fd;                     /* -1 if we're using pwrite() */
+#if HAVE_IO_URING
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;              /* may be sq_ring */
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+struct direct_ch_data {
+    int fd;
+    mode_t mode;
+    struct direct_ch_opts opts;
+    struct direct_uring ring;
+
+    /* bufs[cur] is being filled with what goes at file offset pos;
+     * fill bytes of it so far. The rest may be in flight. */
+    struct direct_buf *bufs;
+    size_t cur;
+    size_t fill;
+    uint64_t pos;
+    size_t ninflight;
+
+    uint8_t *hdr;               /* aligned, for the header */
+    uint64_t prealloc_end;      /* file space is allocated up to here */
+    int err;                    /* errno of a failed io_uring write */
+    struct raw_file_meta meta;
+};
+
+static inline struct direct_ch_data* direct_ch_data(struct ch_storage *chns)
+{
+    struct direct_ch_data *data = chns->priv;
+    return data;
+}
+
+static int direct_ch_open(struct ch_storage *chns, unsigned flags);
+static int direct_ch_close(struct ch_storage *chns);
+static int direct_ch_datasync(struct ch_storage *chns);
+static int direct_ch_write(struct ch_storage *chns,
+                           const struct raw_pkt_bsmp*,
+                           size_t);
+static int direct_ch_write_at(struct ch_storage *chns,
+                              const struct raw_pkt_bsmp*,
+                              size_t, size_t);
+static int direct_ch_write_gaps(struct ch_storage *chns,
+                                const struct ch_gap*,
+                                size_t);
+static void direct_ch_free(struct ch_storage *chns);
+
+static const struct ch_storage_ops direct_ch_storage_ops = {
+    .ch_open = direct_ch_open,
+    .ch_close = direct_ch_close,
+    .ch_datasync = direct_ch_datasync,
+    .ch_write = direct_ch_write,
+    .ch_write_at = direct_ch_write_at,
+    .ch_write_gaps = direct_ch_write_gaps,
+    .ch_free = direct_ch_free,
+};
+
+void direct_ch_opts_init(struct direct_ch_opts *opts)
+{
+    opts->buf_size = DIRECT_CH_BUF_SIZE;
+    opts->nbufs = DIRECT_CH_NBUFS;
+    opts->prealloc_size = DIRECT_CH_PREALLOC_SIZE;
+    opts->expected_nsamps = 0;
+    opts->direct_io = 1;
+    opts->io_uring = 1;
+}
+
+struct ch_storage *direct_ch_storage_alloc(const char *out_file_path,
+                                           mode_t mode)
+{
+    struct ch_storage *storage = malloc(sizeof(struct ch_storage));
+    struct direct_ch_data *data = calloc(1, sizeof(struct direct_ch_data));
+    if (!storage || !data) {
+        free(storage);
+        free(data);
+        return NULL;
+    }
+    data->fd = -1;
+    data->mode = mode;
+    direct_ch_opts_init(&data->opts);
+    data->ring.fd = -1;
+    storage->ch_path = out_file_path;
+    storage->ops = &direct_ch_storage_ops;
+    storage->priv = data;
+    storage->ch_flags = 0;
+    return storage;
+}
+
+int direct_ch_storage_set_opts(struct ch_storage *chns,
+                               const struct direct_ch_opts *opts)
+{
+    if (!opts->buf_size || opts->buf_size % DIRECT_CH_ALIGN ||
+        opts->nbufs < 2 || opts->nbufs > DIRECT_CH_MAX_NBUFS) {
+        errno = EINVAL;
+        return -1;
+    }
+    direct_ch_data(chns)->opts = *opts;
+    return 0;
+}
+
+static void direct_ch_free(struct ch_storage *chns)
+{
+    free(direct_ch_data(chns));
+    free(chns);
+}
+
+/*
+ * io_uring
+ */
+
+#if HAVE_IO_URING
+
+static int direct_uring_setup(struct direct_uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = (p.cq_off.cqes +
+                          p.cq_entries * sizeof(struct io_uring_cqe));
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    int single = 0;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        single = 1;
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+#endif
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = single ? ring->sq_ring : MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    if (ring->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+    if (!single) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+    uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+
+ fail:
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+}
+
+static void direct_uring_teardown(struct direct_uring *ring)
+{
+    if (ring->fd == -1) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+static int direct_uring_enter(struct direct_uring *ring, unsigned to_submit,
+                              unsigned min_complete, unsigned flags)
+{
+    int ret;
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit,
+                           min_complete, flags, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
+/* Start writing buf; there's always room, as there are more
+ * submission queue entries than buffers. If this fails, buf is
+ * still marked busy if the kernel took it anyway. */
+static int direct_uring_write(struct direct_ch_data *data,
+                              struct direct_buf *buf)
+{
+    struct direct_uring *ring = &data->ring;
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = data->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&buf->iov;
+    sqe->len = 1;
+    sqe->off = buf->off;
+    sqe->user_data = (uint64_t)(buf - data->bufs);
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    int ret = direct_uring_enter(ring, 1, 0, 0) == 1 ? 0 : -1;
+    if (ret == -1 &&
+        __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == tail) {
+        /* It's still on the queue; take it back. */
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        return -1;
+    }
+    /* Otherwise it's the kernel's now, and it will complete. */
+    buf->busy = 1;
+    data->ninflight++;
+    return ret;
+}
+
+/* Handle finished writes. If wait is nonzero and none have finished,
+ * wait for one. */
+static int direct_uring_reap(struct direct_ch_data *data, int wait)
+{
+    struct direct_uring *ring = &data->ring;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail && wait) {
+        if (direct_uring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS) == -1) {
+            return -1;
+        }
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct direct_buf *buf = &data->bufs[cqe->user_data];
+        if (cqe->res < 0) {
+            data->err = -cqe->res;
+        } else if ((size_t)cqe->res != buf->iov.iov_len && !data->err) {
+            data->err = ENOSPC; /* it's a regular file */
+        }
+        buf->busy = 0;
+        data->ninflight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#else  /* !HAVE_IO_URING */
+
+static int direct_uring_setup(struct direct_uring *ring,
+                              __unused unsigned entries)
+{
+    ring->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+
+static void direct_uring_teardown(__unused struct direct_uring *ring)
+{
+}
+
+static int direct_uring_write(__unused struct direct_ch_data *data,
+                              __unused struct direct_buf *buf)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+static int direct_uring_reap(__unused struct direct_ch_data *data,
+                             __unused int wait)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif  /* HAVE_IO_URING */
+
+/*
+ * Writing
+ */
+
+static int direct_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+    while (len) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            if (n == 0) {
+                errno = ENOSPC;
+            }
+            return -1;
+        }
+        buf = (const uint8_t*)buf + n;
+        len -= (size_t)n;
+        off += n;
+    }
+    return 0;
+}
+
+static int direct_pread(int fd, void *buf, size_t len, off_t off)
+{
+    while (len) {
+        ssize_t n = pread(fd, buf, len, off);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        buf = (uint8_t*)buf + n;
+        len -= (size_t)n;
+        off += n;
+    }
+    return 0;
+}
+
+/* Return -1, with errno set, if an earlier write failed. */
+static int direct_check_err(struct direct_ch_data *data)
+{
+    if (data->err) {
+        errno = data->err;
+        return -1;
+    }
+    return 0;
+}
+
+/* Wait for every write in flight. */
+static int direct_drain(struct direct_ch_data *data)
+{
+    while (data->ninflight) {
+        if (direct_uring_reap(data, 1) == -1) {
+            return -1;
+        }
+    }
+    return direct_check_err(data);
+}
+
+/* Make sure there's file space up to end. */
+static int direct_prealloc(struct direct_ch_data *data, uint64_t end)
+{
+    if (!data->opts.prealloc_size || end <= data->prealloc_end) {
+        return 0;
+    }
+    uint64_t new_end = data->prealloc_end + data->opts.prealloc_size;
+    if (new_end < end) {
+        new_end = ALIGN_UP(end);
+    }
+    if (fallocate(data->fd, FALLOC_FL_KEEP_SIZE, (off_t)data->prealloc_end,
+                  (off_t)(new_end - data->prealloc_end)) == -1) {
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            return -1;
+        }
+        /* We'll just have to do without. */
+        data->opts.prealloc_size = 0;
+        return 0;
+    }
+    data->prealloc_end = new_end;
+    return 0;
+}
+
+/* Write the first len bytes of buf at data->pos. len is padded out
+ * to a DIRECT_CH_ALIGN multiple with zeroes. If sync is zero, this
+ * may return before the write is done. */
+static int direct_write_buf(struct direct_ch_data *data,
+                            struct direct_buf *buf, size_t len, int sync)
+{
+    size_t alen = ALIGN_UP(len);
+    memset(buf->mem + len, 0, alen - len);
+    buf->iov.iov_base = buf->mem;
+    buf->iov.iov_len = alen;
+    buf->off = data->pos;
+    if (direct_prealloc(data, buf->off + alen) == -1) {
+        return -1;
+    }
+    if (!sync && data->ring.fd != -1) {
+        if (direct_uring_write(data, buf) == 0) {
+            return 0;
+        }
+        /* Don't trust the ring again: let whatever it took finish,
+         * then use pwrite() from here on. */
+        log_WARNING("io_uring write failed (%m); switching to pwrite()");
+        int taken = buf->busy;
+        if (direct_drain(data) == -1) {
+            return -1;
+        }
+        direct_uring_teardown(&data->ring);
+        if (taken) {
+            return 0;
+        }
+    }
+    return direct_pwrite(data->fd, buf->mem, alen, (off_t)buf->off);
+}
+
+/* Submit the full buffer being filled, and wait until the next one
+ * is free to fill. */
+static int direct_next_buf(struct direct_ch_data *data)
+{
+    const size_t buf_size = data->opts.buf_size;
+    if (direct_write_buf(data, &data->bufs[data->cur], buf_size, 0) == -1) {
+        return -1;
+    }
+    data->pos += buf_size;
+    data->fill = 0;
+    data->cur = (data->cur + 1) % data->opts.nbufs;
+    while (data->bufs[data->cur].busy) {
+        if (direct_uring_reap(data, 1) == -1) {
+            return -1;
+        }
+    }
+    return direct_check_err(data);
+}
+
+static int direct_append(struct direct_ch_data *data, const void *src,
+                         size_t len)
+{
+    const size_t buf_size = data->opts.buf_size;
+    while (len) {
+        size_t n = buf_size - data->fill;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(data->bufs[data->cur].mem + data->fill, src, n);
+        data->fill += n;
+        src = (const uint8_t*)src + n;
+        len -= n;
+        if (data->fill == buf_size && direct_next_buf(data) == -1) {
+            return -1;
+        }
+    }
+    /* Notice failures as soon as we can. */
+    if (data->ninflight && direct_uring_reap(data, 0) == -1) {
+        return -1;
+    }
+    return direct_check_err(data);
+}
+
+/* Write everything so far to the file, including the partly filled
+ * buffer, and wait for it to get there. */
+static int direct_flush(struct direct_ch_data *data)
+{
+    if (direct_drain(data) == -1) {
+        return -1;
+    }
+    return (data->fill ?
+            direct_write_buf(data, &data->bufs[data->cur], data->fill, 1) :
+            0);
+}
+
+static int direct_write_header(struct direct_ch_data *data)
+{
+    raw_file_meta_header(&data->meta, data->hdr);
+    return direct_pwrite(data->fd, data->hdr, DATA_OFF, 0);
+}
+
+/* Append the gap table, index and footer. */
+static int direct_append_tail(struct direct_ch_data *data)
+{
+    struct iovec iov[3];
+    raw_file_meta_tail(&data->meta, data->pos + data->fill, iov);
+    for (size_t i = 0; i < 3; i++) {
+        if (direct_append(data, iov[i].iov_base, iov[i].iov_len) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * ch_storage ops
+ */
+
+static void direct_free_bufs(struct direct_ch_data *data)
+{
+    for (size_t i = 0; data->bufs && i < data->opts.nbufs; i++) {
+        free(data->bufs[i].mem);
+    }
+    free(data->bufs);
+    free(data->hdr);
+    data->bufs = NULL;
+    data->hdr = NULL;
+}
+
+static int direct_ch_open(struct ch_storage *chns, unsigned flags)
+{
+    struct direct_ch_data *data = direct_ch_data(chns);
+    const struct direct_ch_opts *opts = &data->opts;
+    data->bufs = calloc(opts->nbufs, sizeof(*data->bufs));
+    if (!data->bufs ||
+        posix_memalign((void**)&data->hdr, DIRECT_CH_ALIGN, DATA_OFF)) {
+        goto fail;
+    }
+    for (size_t i = 0; i < opts->nbufs; i++) {
+        if (posix_memalign((void**)&data->bufs[i].mem, DIRECT_CH_ALIGN,
+                           opts->buf_size)) {
+            goto fail;
+        }
+    }
+    data->cur = 0;
+    data->fill = 0;
+    data->pos = DATA_OFF;
+    data->ninflight = 0;
+    data->prealloc_end = 0;
+    data->err = 0;
+    raw_file_meta_init(&data->meta,
+                       (chns->ch_flags & CH_STORAGE_WIRE_ORDER ?
+                        RAW_FILE_F_SAMPS_BE : 0),
+                       0);
+
+    data->fd = -1;
+    if (opts->direct_io) {
+        data->fd = open(chns->ch_path, (int)flags | O_DIRECT, data->mode);
+        if (data->fd == -1 && errno == EINVAL) {
+            log_WARNING("%s doesn't support O_DIRECT; writing it through "
+                        "the page cache", chns->ch_path);
+        }
+    }
+    if (data->fd == -1) {
+        data->fd = open(chns->ch_path, (int)flags, data->mode);
+    }
+    if (data->fd == -1) {
+        goto fail;
+    }
+    if (direct_prealloc(data, (DATA_OFF + (uint64_t)opts->expected_nsamps *
+                               sizeof(struct raw_pkt_bsmp))) == -1 ||
+        direct_write_header(data) == -1) {
+        goto fail;
+    }
+    /* Room for every buffer to be in flight, and then some. */
+    if (opts->io_uring &&
+        direct_uring_setup(&data->ring, (unsigned)opts->nbufs * 2) == -1) {
+        log_INFO("can't use io_uring (%m); writing %s with pwrite()",
+                 chns->ch_path);
+    }
+    return data->fd;
+
+ fail:
+    if (data->fd != -1) {
+        close(data->fd);
+        data->fd = -1;
+    }
+    direct_free_bufs(data);
+    return -1;
+}
+
+static int direct_ch_close(struct ch_storage *chns)
+{
+    struct direct_ch_data *data = direct_ch_data(chns);
+    int ret = 0;
+    /* Everything goes out padded, so trim that back off, then fill
+     * in the header. */
+    if (direct_append_tail(data) == -1 ||
+        direct_flush(data) == -1 ||
+        ftruncate(data->fd, (off_t)(data->pos + data->fill)) == -1 ||
+        direct_write_header(data) == -1) {
+        ret = -1;
+    }
+    direct_uring_teardown(&data->ring);
+    if (close(data->fd) == -1) {
+        ret = -1;
+    }
+    data->fd = -1;
+    direct_free_bufs(data);
+    raw_file_meta_free(&data->meta);
+    return ret;
+}
+
+static int direct_ch_datasync(struct ch_storage *chns)
+{
+    struct direct_ch_data *data = direct_ch_data(chns);
+    if (direct_flush(data) == -1) {
+        return -1;
+    }
+    return fdatasync(data->fd);
+}
+
+static int direct_ch_write(struct ch_storage *chns,
+                           const struct raw_pkt_bsmp *bsamps,
+                           size_t n)
+{
+    struct direct_ch_data *data = direct_ch_data(chns);
+    if (raw_file_meta_add(&data->meta, bsamps, n) == -1) {
+        return -1;
+    }
+    return direct_append(data, bsamps, n * sizeof(*bsamps));
+}
+
+static int direct_ch_write_at(struct ch_storage *chns,
+                              const struct raw_pkt_bsmp *bsamps,
+                              size_t n, size_t offset)
+{
+    struct direct_ch_data *data = direct_ch_data(chns);
+    const uint8_t *src = (const uint8_t*)bsamps;
+    uint64_t start = DATA_OFF + (uint64_t)offset * sizeof(*bsamps);
+    uint64_t end = start + (uint64_t)n * sizeof(*bsamps);
+    if (offset + n > data->meta.nsamps) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (raw_file_meta_rewrite(&data->meta, bsamps, n, offset) == -1) {
+        return -1;
+    }
+
+    /* Anything in the buffer being filled gets patched there. */
+    if (end > data->pos) {
+        uint64_t first = start > data->pos ? start : data->pos;
+        memcpy(data->bufs[data->cur].mem + (first - data->pos),
+               src + (first - start), end - first);
+        end = first;
+    }
+    if (start == end) {
+        return 0;
+    }
+
+    /* The rest has been written, or is being written. Wait for that,
+     * then read in the blocks it's in, patch them, and write them
+     * back. The buffer being filled starts on a block boundary, so
+     * they're all behind it. */
+    if (direct_drain(data) == -1) {
+        return -1;
+    }
+    uint64_t astart = ALIGN_DOWN(start), aend = ALIGN_UP(end);
+    uint8_t *tmp;
+    if (posix_memalign((void**)&tmp, DIRECT_CH_ALIGN, aend - astart)) {
+        return -1;
+    }
+    int ret = -1;
+    if (direct_pread(data->fd, tmp, aend - astart, (off_t)astart) == -1) {
+        goto out;
+    }
+    memcpy(tmp + (start - astart), src, end - start);
+    ret = direct_pwrite(data->fd, tmp, aend - astart, (off_t)astart);
+ out:
+    free(tmp);
+    return ret;
+}
+
+static int direct_ch_write_gaps(struct ch_storage *chns,
+                                const struct ch_gap *gaps,
+                                size_t ngaps)
+{
+    /* It goes out when the file is closed. */
+    return raw_file_meta_gaps(&direct_ch_data(chns)->meta, gaps, ngaps);
+}
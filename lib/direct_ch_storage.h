@@ -0,0 +1,91 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file direct_ch_storage.h
+ * @brief Raw channel storage that bypasses the page cache
+ *
+ * This stores board samples like the raw backend does, but opens the
+ * file with O_DIRECT, and writes it through io_uring. Board samples
+ * are copied into a ring of block-aligned buffers; each one that
+ * fills up is submitted, and ch_storage_write() returns without
+ * waiting for it, unless every buffer is still being written. File
+ * space is preallocated with fallocate() ahead of the writes.
+ *
+ * If the kernel doesn't have io_uring (or it's forbidden), buffers
+ * are written with pwrite() instead, one at a time. If the file
+ * system doesn't do O_DIRECT, the file is opened without it.
+ *
+ * The file is a raw file (see raw_file.h), whose header is a whole
+ * number of DIRECT_CH_ALIGN blocks, so every write starts and ends
+ * on a DIRECT_CH_ALIGN boundary. The file is padded out to a
+ * DIRECT_CH_ALIGN multiple while it's written, and truncated to its
+ * real length when it's closed. Until then, it has no footer, and
+ * the header's fields from the first board sample are zero.
+ *
+ * @see ch_storage.h
+ */
+
+#ifndef _LIB_DIRECT_CHANNEL_STORAGE_H_
+#define _LIB_DIRECT_CHANNEL_STORAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct ch_storage;
+
+/* Alignment of every write: the largest logical block size of any
+ * disk we're likely to see, and the page size. */
+#define DIRECT_CH_ALIGN 4096
+
+/* Defaults for struct direct_ch_opts. A 50 ms worker buffer at 30
+ * kHz is about 3.4 MB, so it fills a few buffers; there are enough
+ * for a couple of worker buffers in flight. */
+#define DIRECT_CH_BUF_SIZE (1 << 20)
+#define DIRECT_CH_NBUFS 8
+#define DIRECT_CH_PREALLOC_SIZE (64 << 20)
+
+/* Most buffers there can be. */
+#define DIRECT_CH_MAX_NBUFS 256
+
+/* Tunables; see direct_ch_opts_init() for defaults. */
+struct direct_ch_opts {
+    size_t buf_size;            /* bytes per write; a multiple of
+                                 * DIRECT_CH_ALIGN */
+    size_t nbufs;               /* buffers, at least 2; all but the one
+                                 * being filled can be in flight */
+    uint64_t prealloc_size;     /* fallocate() this much at a time;
+                                 * 0 means don't */
+    size_t expected_nsamps;     /* if nonzero, preallocate this many
+                                 * board samples' worth on open */
+    int direct_io;              /* open with O_DIRECT */
+    int io_uring;               /* write through io_uring, not
+                                 * pwrite() */
+};
+
+/* Fill in the defaults. */
+void direct_ch_opts_init(struct direct_ch_opts *opts);
+
+/* Create new channel storage object; returns NULL on error. */
+struct ch_storage *direct_ch_storage_alloc(const char *out_file_path,
+                                           mode_t mode);
+
+/* Change the tunables from their defaults. Call this before opening
+ * chns. Returns -1 (with errno EINVAL) if they don't make sense. */
+int direct_ch_storage_set_opts(struct ch_storage *chns,
+                               const struct direct_ch_opts *opts);
+
+#endif
@@ -0,0 +1,294 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dnode_pack.h"
+
+#include <string.h>
+
+/*
+ * Field numbers, from data.proto. protobuf-c packs fields in field
+ * number order, so the encoders below do too; keep them in sync.
+ */
+
+enum {
+    DNODE_SAMPLE_TYPE = 1,
+    DNODE_SAMPLE_SUBSAMPLE = 2,
+    DNODE_SAMPLE_SAMPLE = 3,
+};
+
+enum {
+    BSMP_IS_LIVE = 1,
+    BSMP_IS_LAST = 2,
+    BSMP_EXP_COOKIE = 3,
+    BSMP_BOARD_ID = 4,
+    BSMP_SAMP_IDX = 5,
+    BSMP_CHIP_LIVE = 6,
+    BSMP_SAMPLES = 7,
+    BSMP_IS_ERR = 8,
+    BSMP_DECIMATION = 9,
+    BSMP_ENVELOPE_MAX = 10,
+};
+
+enum {
+    BSUB_IS_LIVE = 1,
+    BSUB_IS_LAST = 2,
+    BSUB_EXP_COOKIE = 3,
+    BSUB_BOARD_ID = 4,
+    BSUB_SAMP_IDX = 5,
+    BSUB_CHIP_LIVE = 6,
+    BSUB_CHIPS = 7,
+    BSUB_CHANNELS = 8,
+    BSUB_SAMPLES = 9,
+    BSUB_GPIO = 10,
+    BSUB_DAC_CHANNEL = 11,
+    BSUB_DAC_VALUE = 12,
+    BSUB_IS_ERR = 13,
+    BSUB_DECIMATION = 14,
+    BSUB_PACKED_SAMPLES = 15,
+    BSUB_CFG_GEN = 16,
+};
+
+/* Wire types */
+#define WT_VARINT 0
+#define WT_LEN 2
+
+/*
+ * Writer. With a NULL pk, it just counts bytes, which is how we size
+ * embedded messages before writing their length prefixes.
+ */
+
+struct dnode_w {
+    struct dnode_pack *pk;
+    size_t len;                 /* bytes so far */
+    uint8_t *seg;               /* start of the current scratch iovec */
+    uint8_t *p;                 /* next scratch byte */
+    int err;
+};
+
+static size_t dnode_varint_size(uint64_t v)
+{
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static void dnode_w_varint(struct dnode_w *w, uint64_t v)
+{
+    size_t n = dnode_varint_size(v);
+    w->len += n;
+    if (!w->pk) {
+        return;
+    }
+    if ((size_t)(w->pk->buf + sizeof(w->pk->buf) - w->p) < n) {
+        w->err = 1;
+        return;
+    }
+    while (v >= 0x80) {
+        *w->p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *w->p++ = (uint8_t)v;
+}
+
+static void dnode_w_tag(struct dnode_w *w, unsigned field, unsigned wt)
+{
+    dnode_w_varint(w, (uint64_t)field << 3 | wt);
+}
+
+/* End the current scratch iovec, if it has anything in it. */
+static void dnode_w_end_seg(struct dnode_w *w)
+{
+    struct dnode_pack *pk = w->pk;
+    if (w->p == w->seg) {
+        return;
+    }
+    if (pk->niov == DNODE_PACK_NIOVS) {
+        w->err = 1;
+        return;
+    }
+    pk->iov[pk->niov].iov_base = w->seg;
+    pk->iov[pk->niov].iov_len = (size_t)(w->p - w->seg);
+    pk->niov++;
+    w->seg = w->p;
+}
+
+/* Reference n bytes at data, instead of copying them. */
+static void dnode_w_ref(struct dnode_w *w, const void *data, size_t n)
+{
+    struct dnode_pack *pk = w->pk;
+    w->len += n;
+    if (!pk || !n) {
+        return;
+    }
+    dnode_w_end_seg(w);
+    if (pk->niov == DNODE_PACK_NIOVS) {
+        w->err = 1;
+        return;
+    }
+    pk->iov[pk->niov].iov_base = (void*)data;
+    pk->iov[pk->niov].iov_len = n;
+    pk->niov++;
+}
+
+/*
+ * Fields
+ */
+
+static void dnode_w_u64(struct dnode_w *w, unsigned field, int has,
+                        uint64_t v)
+{
+    if (has) {
+        dnode_w_tag(w, field, WT_VARINT);
+        dnode_w_varint(w, v);
+    }
+}
+
+static void dnode_w_bool(struct dnode_w *w, unsigned field, int has, int v)
+{
+    dnode_w_u64(w, field, has, v ? 1 : 0);
+}
+
+static void dnode_w_bytes(struct dnode_w *w, unsigned field, int has,
+                          const ProtobufCBinaryData *v)
+{
+    if (has) {
+        dnode_w_tag(w, field, WT_LEN);
+        dnode_w_varint(w, v->len);
+        dnode_w_ref(w, v->data, v->len);
+    }
+}
+
+static void dnode_w_packed(struct dnode_w *w, unsigned field,
+                           const uint32_t *v, size_t n)
+{
+    if (!n) {
+        return;
+    }
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++) {
+        len += dnode_varint_size(v[i]);
+    }
+    dnode_w_tag(w, field, WT_LEN);
+    dnode_w_varint(w, len);
+    if (!w->pk) {
+        w->len += len;
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        dnode_w_varint(w, v[i]);
+    }
+}
+
+/*
+ * Messages
+ */
+
+static void dnode_w_bsmp(struct dnode_w *w, const BoardSample *m)
+{
+    if (m->base.n_unknown_fields) {
+        w->err = 1;
+        return;
+    }
+    dnode_w_bool(w, BSMP_IS_LIVE, m->has_is_live, m->is_live);
+    dnode_w_bool(w, BSMP_IS_LAST, m->has_is_last, m->is_last);
+    dnode_w_u64(w, BSMP_EXP_COOKIE, m->has_exp_cookie, m->exp_cookie);
+    dnode_w_u64(w, BSMP_BOARD_ID, m->has_board_id, m->board_id);
+    dnode_w_u64(w, BSMP_SAMP_IDX, m->has_samp_idx, m->samp_idx);
+    dnode_w_u64(w, BSMP_CHIP_LIVE, m->has_chip_live, m->chip_live);
+    dnode_w_bytes(w, BSMP_SAMPLES, m->has_samples, &m->samples);
+    dnode_w_bool(w, BSMP_IS_ERR, m->has_is_err, m->is_err);
+    dnode_w_u64(w, BSMP_DECIMATION, m->has_decimation, m->decimation);
+    dnode_w_bytes(w, BSMP_ENVELOPE_MAX, m->has_envelope_max,
+                  &m->envelope_max);
+}
+
+static void dnode_w_bsub(struct dnode_w *w, const BoardSubsample *m)
+{
+    if (m->base.n_unknown_fields) {
+        w->err = 1;
+        return;
+    }
+    dnode_w_bool(w, BSUB_IS_LIVE, m->has_is_live, m->is_live);
+    dnode_w_bool(w, BSUB_IS_LAST, m->has_is_last, m->is_last);
+    dnode_w_u64(w, BSUB_EXP_COOKIE, m->has_exp_cookie, m->exp_cookie);
+    dnode_w_u64(w, BSUB_BOARD_ID, m->has_board_id, m->board_id);
+    dnode_w_u64(w, BSUB_SAMP_IDX, m->has_samp_idx, m->samp_idx);
+    dnode_w_u64(w, BSUB_CHIP_LIVE, m->has_chip_live, m->chip_live);
+    dnode_w_packed(w, BSUB_CHIPS, m->chips, m->n_chips);
+    dnode_w_packed(w, BSUB_CHANNELS, m->channels, m->n_channels);
+    dnode_w_packed(w, BSUB_SAMPLES, m->samples, m->n_samples);
+    dnode_w_u64(w, BSUB_GPIO, m->has_gpio, m->gpio);
+    dnode_w_u64(w, BSUB_DAC_CHANNEL, m->has_dac_channel, m->dac_channel);
+    dnode_w_u64(w, BSUB_DAC_VALUE, m->has_dac_value, m->dac_value);
+    dnode_w_bool(w, BSUB_IS_ERR, m->has_is_err, m->is_err);
+    dnode_w_u64(w, BSUB_DECIMATION, m->has_decimation, m->decimation);
+    dnode_w_bytes(w, BSUB_PACKED_SAMPLES, m->has_packed_samples,
+                  &m->packed_samples);
+    dnode_w_u64(w, BSUB_CFG_GEN, m->has_cfg_gen, m->cfg_gen);
+}
+
+size_t dnode_pack(struct dnode_pack *pk, const DnodeSample *msg)
+{
+    struct dnode_w w = {
+        .pk = pk, .len = 0, .seg = pk->buf, .p = pk->buf, .err = 0,
+    };
+    pk->niov = 0;
+    pk->len = 0;
+    if (msg->base.n_unknown_fields) {
+        return 0;
+    }
+    if (msg->has_type) {
+        /* An enum is an int32, which gets sign extended. */
+        dnode_w_tag(&w, DNODE_SAMPLE_TYPE, WT_VARINT);
+        dnode_w_varint(&w, (uint64_t)(int64_t)msg->type);
+    }
+    if (msg->subsample) {
+        struct dnode_w sz = { .pk = NULL };
+        dnode_w_bsub(&sz, msg->subsample);
+        dnode_w_tag(&w, DNODE_SAMPLE_SUBSAMPLE, WT_LEN);
+        dnode_w_varint(&w, sz.len);
+        dnode_w_bsub(&w, msg->subsample);
+    }
+    if (msg->sample) {
+        struct dnode_w sz = { .pk = NULL };
+        dnode_w_bsmp(&sz, msg->sample);
+        dnode_w_tag(&w, DNODE_SAMPLE_SAMPLE, WT_LEN);
+        dnode_w_varint(&w, sz.len);
+        dnode_w_bsmp(&w, msg->sample);
+    }
+    dnode_w_end_seg(&w);
+    if (w.err) {
+        pk->niov = 0;
+        return 0;
+    }
+    pk->len = w.len;
+    return pk->len;
+}
+
+size_t dnode_pack_flatten(const struct dnode_pack *pk, uint8_t *out,
+                          size_t size)
+{
+    if (pk->len > size) {
+        return 0;
+    }
+    for (size_t i = 0; i < pk->niov; i++) {
+        memcpy(out, pk->iov[i].iov_base, pk->iov[i].iov_len);
+        out += pk->iov[i].iov_len;
+    }
+    return pk->len;
+}
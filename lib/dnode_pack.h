@@ -0,0 +1,82 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file dnode_pack.h
+ * @brief Fast DnodeSample encoder, for forwarding
+ *
+ * Every forwarded protobuf sample has to be packed, and protobuf-c's
+ * dnode_sample__pack() is slow at it: it walks the message's
+ * descriptors twice (once to size it, once to pack it), and copies
+ * the board sample's kilobytes of "samples" into the output along
+ * with everything else.
+ *
+ * dnode_pack() knows the DnodeSample, BoardSample and BoardSubsample
+ * layouts already. It encodes the small fields into a scratch
+ * buffer, but only points at "bytes" fields, producing an iovec array
+ * you can hand straight to sendmsg(). The bytes that make up the
+ * message are exactly what dnode_sample__pack() would produce.
+ */
+
+#ifndef _LIB_DNODE_PACK_H_
+#define _LIB_DNODE_PACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "proto/data.pb-c.h"
+
+/**
+ * Scratch space for everything but "bytes" fields. This fits a
+ * BoardSubsample with over a thousand channels. */
+#define DNODE_PACK_BUF_SIZE (32 * 1024)
+
+/**
+ * Most iovecs a packed message needs: scratch space before, between
+ * and after the two "bytes" fields a BoardSample can have. (A
+ * BoardSubsample only has one.) */
+#define DNODE_PACK_NIOVS 5
+
+/** A packed DnodeSample. */
+struct dnode_pack {
+    struct iovec iov[DNODE_PACK_NIOVS]; /**< The message, in order */
+    size_t niov;                        /**< Valid entries in iov */
+    size_t len;                         /**< Total length of iov */
+    uint8_t buf[DNODE_PACK_BUF_SIZE];   /**< Scratch; iov points here */
+};
+
+/**
+ * Pack a DnodeSample.
+ *
+ * "bytes" fields aren't copied, so the data they point to must stay
+ * put until you're done with pk->iov.
+ *
+ * @param pk Where to pack it
+ * @param msg Message to pack
+ * @return The packed size (pk->len), or 0 on failure: the message
+ *         has unknown fields, or doesn't fit in pk->buf.
+ */
+size_t dnode_pack(struct dnode_pack *pk, const DnodeSample *msg);
+
+/**
+ * Copy a packed message into a flat buffer.
+ *
+ * @return pk->len, or 0 if it doesn't fit in size bytes.
+ */
+size_t dnode_pack_flatten(const struct dnode_pack *pk, uint8_t *out,
+                          size_t size);
+
+#endif
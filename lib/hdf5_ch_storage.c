@@ -22,24 +22,40 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <hdf5.h>
+#include <zlib.h>
 
 #include "logging.h"
 #include "type_attrs.h"
 #include "ch_storage.h"
+#include "compress.h"
+#include "compress_pool.h"
 #include "raw_packets.h"
+#include "transpose16.h"
 
-#define DSET_EXTEND_FACTOR 1.75 /* TODO tune this knob */
+#define DSET_EXTEND_FACTOR 1.75 /* past the expected size, if any */
 #define RANK 1                  /* we store as an array of board samples */
-#define CHUNK_DIM0 50
-#define CHUNK_DIM1 1
+#define CACHE_SLOTS_PER_CHUNK 100 /* per the H5Pset_chunk_cache() docs */
 #define IS_LITTLE_ENDIAN (1 == *(unsigned char *)&(const int){1})
 #define HOST_H5_ORDER (IS_LITTLE_ENDIAN ? H5T_ORDER_LE : H5T_ORDER_BE)
 #define COOKIE_H5_TYPE H5T_NATIVE_UINT64
+#define GAPS_DSET_SUFFIX "_gaps"
+#define COL_SAMPS_NAME "samples" /* HDF5_CH_LAYOUT_CHANNELS sample array */
+
+/* H5Dwrite_chunk() was H5DOwrite_chunk(), in the high-level library,
+ * until 1.10.3; we don't bother with that. */
+#if H5_VERSION_GE(1, 10, 3)
+#define HAVE_H5DWRITE_CHUNK 1
+#else
+#define HAVE_H5DWRITE_CHUNK 0
+#endif
 
 static int hdf5_ch_open(struct ch_storage *chns, unsigned flags);
 static int hdf5_ch_close(struct ch_storage *chns);
@@ -47,14 +63,25 @@ static int hdf5_ch_datasync(struct ch_storage *chns);
 static int hdf5_ch_write(struct ch_storage *chns,
                          const struct raw_pkt_bsmp*,
                          size_t);
+static int hdf5_ch_write_at(struct ch_storage *chns,
+                            const struct raw_pkt_bsmp*,
+                            size_t, size_t);
+static int hdf5_ch_write_gaps(struct ch_storage *chns,
+                              const struct ch_gap*,
+                              size_t);
 static void hdf5_ch_free(struct ch_storage *chns);
+static int hdf5_ch_stats(struct ch_storage *chns,
+                         struct ch_storage_stats *stats);
 
 static const struct ch_storage_ops hdf5_ch_storage_ops = {
     .ch_open = hdf5_ch_open,
     .ch_close = hdf5_ch_close,
     .ch_datasync = hdf5_ch_datasync,
     .ch_write = hdf5_ch_write,
+    .ch_write_at = hdf5_ch_write_at,
+    .ch_write_gaps = hdf5_ch_write_gaps,
     .ch_free = hdf5_ch_free,
+    .ch_stats = hdf5_ch_stats,
 };
 
 /* Convert an unsigned integer (or unsigned type) to the corresponding
@@ -90,6 +117,29 @@ static const struct ch_storage_ops hdf5_ch_storage_ops = {
 #define H5_ATTR_COOKIE_NAME "experiment_cookie"
 #define H5_NATTRS (H5_ATTR_COOKIE + 1)
 
+/* The channel-major layout's per-board-sample datasets, besides the
+ * samples themselves -- the numbers index into h5_ch_data->h5_cols
+ * and struct h5_cols. The names match the row layout's fields. */
+#define H5_COL_SIDX 0           /* b_sidx */
+#define H5_COL_FLAGS 1          /* ph.p_flags */
+#define H5_COL_CHIP_LIVE 2      /* b_chip_live */
+#define H5_NCOLS (H5_COL_CHIP_LIVE + 1)
+
+static const char *const h5_col_names[H5_NCOLS] = {
+    [H5_COL_SIDX] = "samp_index",
+    [H5_COL_FLAGS] = "ph_flags",
+    [H5_COL_CHIP_LIVE] = "chip_live",
+};
+
+/* Board samples in channel-major form, nsamps of them. */
+struct h5_cols {
+    size_t nsamps;
+    raw_samp_t *samps;          /* [RAW_BSMP_NSAMP][nsamps] */
+    uint32_t *sidx;
+    uint8_t *flags;
+    uint32_t *chip_live;
+};
+
 struct h5_ch_data {
     const char *dset_name;      /* dataset name */
     hid_t h5_file;              /* HDF5 file type */
@@ -97,7 +147,7 @@ struct h5_ch_data {
     hid_t h5_arrtype;           /* sample array (within bsamp) data type */
     hid_t h5_dtype;             /* board sample data type */
     hid_t h5_dset;              /* data set */
-    hsize_t h5_chunk_dims[2];   /* data set chunk dimensions */
+    hsize_t h5_chunk_dims[RANK]; /* data set chunk dimensions */
     hsize_t h5_dset_off;        /* current dataset write offset */
     hsize_t h5_dset_size;       /* current dataset size */
     hid_t h5_attr_dspace;       /* attribute data space */
@@ -109,6 +159,42 @@ struct h5_ch_data {
     int h5_need_attrs;
 
     uint32_t h5_debug_board_id;
+
+    struct hdf5_ch_opts h5_opts;
+
+    /* Cached for hdf5_write_slab(). h5_filespace's extent tracks
+     * h5_dset_size; h5_memspace's is h5_memspace_n. */
+    hid_t h5_filespace;
+    hid_t h5_memspace;
+    hsize_t h5_memspace_n;
+
+    /* Direct chunk writes (h5_opts.direct_chunk). Board samples
+     * between the start of the chunk h5_dset_off is in and
+     * h5_dset_off wait in h5_chunk until it's full. */
+    uint8_t *h5_chunk;
+    size_t h5_chunk_bytes;      /* a whole chunk */
+    uint8_t *h5_zbuf;           /* compressed chunk, if h5_opts.deflate */
+    size_t h5_zbuf_size;
+
+    /* With h5_opts.compress, full chunks get compressed here, then
+     * written in order. h5_skip_mask is the filter mask of a chunk
+     * that compressing didn't help. */
+    struct compress_pool *h5_pool;
+    uint32_t h5_skip_mask;
+
+    /* Final ch_storage_stats(), once closed. */
+    struct ch_storage_stats h5_stats;
+
+    /* Channel-major layout (HDF5_CH_LAYOUT_CHANNELS). h5_dset and
+     * h5_filespace are for the samples; h5_cols and h5_col_filespace
+     * for the rest. Board samples between the start of the chunk
+     * h5_dset_off is in and h5_dset_off wait, already transposed, in
+     * h5_colbuf until it's full. */
+    hid_t h5_group;
+    hid_t h5_samp_type;         /* sample type, in memory and the file */
+    hid_t h5_cols[H5_NCOLS];
+    hid_t h5_col_filespace;
+    struct h5_cols h5_colbuf;
 };
 
 static inline struct h5_ch_data* h5_data(struct ch_storage *chns)
@@ -130,9 +216,7 @@ static void h5_ch_data_init(struct h5_ch_data *data, const char *dset_name)
     data->h5_arrtype = -1;
     data->h5_dtype = -1;
     data->h5_dset = -1;
-    /* TODO tune the chunk dimensions and the chunk cache */
-    data->h5_chunk_dims[0] = CHUNK_DIM0;
-    data->h5_chunk_dims[1] = CHUNK_DIM1;
+    data->h5_chunk_dims[0] = HDF5_CH_CHUNK_NSAMPS;
     data->h5_dset_off = 0;
     data->h5_dset_size = 0;
     data->h5_attr_dspace = -1;
@@ -141,6 +225,63 @@ static void h5_ch_data_init(struct h5_ch_data *data, const char *dset_name)
     }
     data->h5_need_attrs = 1;
     data->h5_debug_board_id = 0;
+    hdf5_ch_opts_init(&data->h5_opts);
+    data->h5_filespace = -1;
+    data->h5_memspace = -1;
+    data->h5_memspace_n = 0;
+    data->h5_chunk = NULL;
+    data->h5_chunk_bytes = 0;
+    data->h5_zbuf = NULL;
+    data->h5_zbuf_size = 0;
+    data->h5_pool = NULL;
+    data->h5_skip_mask = 0;
+    memset(&data->h5_stats, 0, sizeof(data->h5_stats));
+    data->h5_group = -1;
+    data->h5_samp_type = -1;
+    for (size_t i = 0; i < H5_NCOLS; i++) {
+        data->h5_cols[i] = -1;
+    }
+    data->h5_col_filespace = -1;
+    memset(&data->h5_colbuf, 0, sizeof(data->h5_colbuf));
+}
+
+static void h5_cols_free(struct h5_cols *cols)
+{
+    free(cols->samps);
+    free(cols->sidx);
+    free(cols->flags);
+    free(cols->chip_live);
+    memset(cols, 0, sizeof(*cols));
+}
+
+static int h5_cols_alloc(struct h5_cols *cols, size_t nsamps)
+{
+    cols->nsamps = nsamps;
+    cols->samps = malloc(RAW_BSMP_NSAMP * nsamps * sizeof(*cols->samps));
+    cols->sidx = malloc(nsamps * sizeof(*cols->sidx));
+    cols->flags = malloc(nsamps * sizeof(*cols->flags));
+    cols->chip_live = malloc(nsamps * sizeof(*cols->chip_live));
+    if (!cols->samps || !cols->sidx || !cols->flags || !cols->chip_live) {
+        h5_cols_free(cols);
+        return -1;
+    }
+    return 0;
+}
+
+/* Transpose nsamps board samples into cols, starting at column at. */
+static void h5_cols_gather(struct h5_cols *cols, size_t at,
+                           const struct raw_pkt_bsmp *bsamps, size_t nsamps)
+{
+    assert(at + nsamps <= cols->nsamps);
+    assert(sizeof(*bsamps) % sizeof(raw_samp_t) == 0);
+    for (size_t i = 0; i < nsamps; i++) {
+        cols->sidx[at + i] = bsamps[i].b_sidx;
+        cols->flags[at + i] = bsamps[i].ph.p_flags;
+        cols->chip_live[at + i] = bsamps[i].b_chip_live;
+    }
+    transpose16(cols->samps + at, cols->nsamps,
+                bsamps[0].b_samps, sizeof(*bsamps) / sizeof(raw_samp_t),
+                nsamps, RAW_BSMP_NSAMP);
 }
 
 static int h5_ch_data_teardown(struct h5_ch_data *data)
@@ -154,9 +295,31 @@ static int h5_ch_data_teardown(struct h5_ch_data *data)
     if (data->h5_attr_dspace >= 0 && H5Sclose(data->h5_attr_dspace) < 0) {
         ret = -1;
     }
+    if (data->h5_filespace >= 0 && H5Sclose(data->h5_filespace) < 0) {
+        ret = -1;
+    }
+    if (data->h5_memspace >= 0 && H5Sclose(data->h5_memspace) < 0) {
+        ret = -1;
+    }
+    free(data->h5_chunk);
+    free(data->h5_zbuf);
+    compress_pool_free(data->h5_pool);
+    h5_cols_free(&data->h5_colbuf);
+    for (size_t i = 0; i < H5_NCOLS; i++) {
+        if (data->h5_cols[i] >= 0 && H5Dclose(data->h5_cols[i]) < 0) {
+            ret = -1;
+        }
+    }
+    if (data->h5_col_filespace >= 0 &&
+        H5Sclose(data->h5_col_filespace) < 0) {
+        ret = -1;
+    }
     if (data->h5_dset >= 0 && H5Dclose(data->h5_dset) < 0) {
         ret = -1;
     }
+    if (data->h5_group >= 0 && H5Gclose(data->h5_group) < 0) {
+        ret = -1;
+    }
     if (data->h5_arrtype >= 0 && H5Tclose(data->h5_arrtype) < 0) {
         ret = -1;
     }
@@ -172,6 +335,24 @@ static int h5_ch_data_teardown(struct h5_ch_data *data)
     return ret;
 }
 
+void hdf5_ch_opts_init(struct hdf5_ch_opts *opts)
+{
+    opts->chunk_nsamps = HDF5_CH_CHUNK_NSAMPS;
+    opts->cache_bytes = HDF5_CH_CACHE_BYTES;
+    opts->alloc_early = 0;
+    opts->meta_block_size = HDF5_CH_META_BLOCK_SIZE;
+    opts->latest_format = 0;
+    opts->expected_nsamps = 0;
+    opts->direct_chunk = 0;
+    opts->deflate = 0;
+    opts->compress = COMPRESS_NONE;
+    opts->compress_level = 0;
+    opts->compress_threads = HDF5_CH_COMPRESS_THREADS;
+    opts->layout = HDF5_CH_LAYOUT_ROWS;
+    opts->col_chunk_nchans = HDF5_CH_COL_CHUNK_NCHANS;
+    opts->col_chunk_nsamps = HDF5_CH_COL_CHUNK_NSAMPS;
+}
+
 static int hdf5_write_close(hid_t *attr, hid_t mem_type_id, const void *buf)
 {
     if (H5Awrite(*attr, mem_type_id, buf) < 0 || H5Aclose(*attr) < 0) {
@@ -198,30 +379,101 @@ struct ch_storage *hdf5_ch_storage_alloc(const char *out_file_path,
     storage->ch_path = out_file_path;
     storage->ops = &hdf5_ch_storage_ops;
     storage->priv = data;
+    storage->ch_flags = 0;
     return storage;
 }
 
+int hdf5_ch_storage_set_opts(struct ch_storage *chns,
+                             const struct hdf5_ch_opts *opts)
+{
+    /* HDF5 chunks must be smaller than 4 GB. */
+    if (!opts->chunk_nsamps ||
+        opts->chunk_nsamps > UINT32_MAX / sizeof(struct raw_pkt_bsmp) ||
+        opts->deflate < 0 || opts->deflate > 9 ||
+        (opts->direct_chunk && !HAVE_H5DWRITE_CHUNK) ||
+        opts->compress < COMPRESS_NONE ||
+        opts->compress >= COMPRESS_NCODECS ||
+        opts->compress == COMPRESS_DELTA_ZSTD ||
+        (opts->compress && opts->deflate) ||
+        opts->compress_level < 0 ||
+        opts->compress_threads > COMPRESS_POOL_MAX_THREADS) {
+        errno = EINVAL;
+        return -1;
+    }
+    switch (opts->layout) {
+    case HDF5_CH_LAYOUT_ROWS:
+        break;
+    case HDF5_CH_LAYOUT_CHANNELS:
+        if (!opts->col_chunk_nchans || !opts->col_chunk_nsamps ||
+            opts->col_chunk_nchans > RAW_BSMP_NSAMP ||
+            (opts->col_chunk_nsamps >
+             UINT32_MAX / (opts->col_chunk_nchans * sizeof(raw_samp_t))) ||
+            opts->direct_chunk) {
+            errno = EINVAL;
+            return -1;
+        }
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    h5_data(chns)->h5_opts = *opts;
+    return 0;
+}
+
 static void hdf5_ch_free(struct ch_storage *chns)
 {
     free(h5_data(chns));
     free(chns);
 }
 
-/* Make the data space for storing board samples */
+/* Create the file */
+static hid_t hdf5_create_file(struct h5_ch_data *data, const char *path,
+                              unsigned flags)
+{
+    const struct hdf5_ch_opts *opts = &data->h5_opts;
+    hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+    if (fapl < 0) {
+        return -1;
+    }
+    if (H5Pset_meta_block_size(fapl, opts->meta_block_size) >= 0 &&
+        (!opts->latest_format ||
+         H5Pset_libver_bounds(fapl, H5F_LIBVER_LATEST,
+                              H5F_LIBVER_LATEST) >= 0)) {
+        data->h5_file = H5Fcreate(path, flags, H5P_DEFAULT, fapl);
+    }
+    H5Pclose(fapl);
+    return data->h5_file;
+}
+
+/* Make the data space for storing board samples. If we know how many
+ * are coming, make room for them all now; extending the dataset
+ * later means updating its chunk index while we're trying to keep
+ * up with the data node. */
 static hid_t hdf5_create_dspace(struct h5_ch_data *data)
 {
-    const hsize_t cur_dim = 0, max_dim = H5S_UNLIMITED;
+    const hsize_t cur_dim = data->h5_opts.expected_nsamps;
+    const hsize_t max_dim = H5S_UNLIMITED;
     data->h5_dspace = H5Screate_simple(RANK, &cur_dim, &max_dim);
+    if (data->h5_dspace >= 0) {
+        data->h5_dset_size = cur_dim;
+    }
     return data->h5_dspace;
 }
 
-/* Make the data types for storing board samples */
-static hid_t hdf5_create_dtypes(struct h5_ch_data *data)
+/* Make the data types for storing board samples. If wire_order is
+ * set, the samples are declared big-endian, so HDF5 writes them
+ * as-is, and readers convert them as needed. */
+static hid_t hdf5_create_dtypes(struct h5_ch_data *data, int wire_order)
 {
     struct raw_pkt_bsmp bs;     /* just for type conversion/sizeof */
     hsize_t nsamps = RAW_BSMP_NSAMP;
-    data->h5_arrtype = H5Tarray_create2(TO_H5_UTYPE(bs.b_samps[0]), 1,
-                                        &nsamps);
+    hid_t samp_type = TO_H5_UTYPE(bs.b_samps[0]);
+    if (wire_order) {
+        assert(sizeof(bs.b_samps[0]) == 2);
+        samp_type = H5T_STD_U16BE;
+    }
+    data->h5_arrtype = H5Tarray_create2(samp_type, 1, &nsamps);
     if (data->h5_arrtype < 0) {
         return -1;
     }
@@ -242,34 +494,403 @@ static hid_t hdf5_create_dtypes(struct h5_ch_data *data)
     return data->h5_dtype;
 }
 
-/* Make the data set itself */
-static hid_t hdf5_create_dset(struct h5_ch_data *data)
+/* Smallest prime >= n; chunk cache hash tables want one. */
+static size_t hdf5_next_prime(size_t n)
+{
+    for (;; n++) {
+        size_t d = 2;
+        while (d * d <= n && n % d) {
+            d++;
+        }
+        if (n > 1 && d * d > n) {
+            return n;
+        }
+    }
+}
+
+/*
+ * Compression filters
+ */
+
+/* HDF5 doesn't tell a filter which dataset it's working on, so each
+ * thread keeps the context its filter used last, instead of making
+ * one per chunk. */
+struct hdf5_filter_ctx {
+    int codec;
+    int level;
+    struct compress_ctx *ctx;
+};
+
+static pthread_once_t hdf5_filter_once = PTHREAD_ONCE_INIT;
+static pthread_key_t hdf5_filter_key;
+static int hdf5_filter_key_ok;
+
+static void hdf5_filter_ctx_free(void *arg)
+{
+    struct hdf5_filter_ctx *fctx = arg;
+    compress_ctx_free(fctx->ctx);
+    free(fctx);
+}
+
+static void hdf5_filter_key_init(void)
+{
+    hdf5_filter_key_ok = !pthread_key_create(&hdf5_filter_key,
+                                             hdf5_filter_ctx_free);
+}
+
+/* Get this thread's context for codec and level; NULL on error. */
+static struct compress_ctx* hdf5_filter_ctx(int codec, int level)
+{
+    pthread_once(&hdf5_filter_once, hdf5_filter_key_init);
+    if (!hdf5_filter_key_ok) {
+        return NULL;
+    }
+    struct hdf5_filter_ctx *fctx = pthread_getspecific(hdf5_filter_key);
+    if (fctx && fctx->ctx && fctx->codec == codec && fctx->level == level) {
+        return fctx->ctx;
+    }
+    if (!fctx) {
+        fctx = calloc(1, sizeof(*fctx));
+        if (!fctx) {
+            return NULL;
+        }
+        if (pthread_setspecific(hdf5_filter_key, fctx)) {
+            free(fctx);
+            return NULL;
+        }
+    }
+    compress_ctx_free(fctx->ctx);
+    fctx->codec = codec;
+    fctx->level = level;
+    fctx->ctx = compress_ctx_alloc(codec, level, 0);
+    return fctx->ctx;
+}
+
+/* Run a COMPRESS_LZ4 or COMPRESS_ZSTD filter in HDF5's filter
+ * calling convention: replace *buf (*buf_size bytes, nbytes of them
+ * used) with the result, and return its length, or 0 on error. */
+static size_t hdf5_filter(int codec, int level, unsigned flags,
+                          size_t nbytes, size_t *buf_size, void **buf)
+{
+    const int reverse = !!(flags & H5Z_FLAG_REVERSE);
+    size_t out_size = (reverse ?
+                       compress_decoded_size(codec, *buf, nbytes) :
+                       compress_bound(codec, nbytes));
+    void *out = out_size ? H5allocate_memory(out_size, 0) : NULL;
+    size_t n = 0;
+    if (!out) {
+        return 0;
+    }
+    if (reverse) {
+        n = compress_decode(codec, 0, out, out_size, *buf, nbytes);
+    } else {
+        /* If it doesn't help, the filter's optional, so HDF5 stores
+         * the chunk as it was. */
+        struct compress_ctx *ctx = hdf5_filter_ctx(codec, level);
+        if (ctx) {
+            n = compress_encode(ctx, out, out_size, *buf, nbytes);
+        }
+    }
+    if (!n) {
+        H5free_memory(out);
+        return 0;
+    }
+    H5free_memory(*buf);
+    *buf = out;
+    *buf_size = out_size;
+    return n;
+}
+
+/* The LZ4 filter's cd_values[0] is its block size; 0 means the
+ * default, which is what we write. We keep the acceleration factor
+ * in cd_values[1], which other implementations ignore. */
+static size_t hdf5_filter_lz4(unsigned flags, size_t cd_nelmts,
+                              const unsigned cd_values[], size_t nbytes,
+                              size_t *buf_size, void **buf)
+{
+    int level = cd_nelmts > 1 ? (int)cd_values[1] : 0;
+    return hdf5_filter(COMPRESS_LZ4, level, flags, nbytes, buf_size, buf);
+}
+
+/* The zstd filter's cd_values[0] is the compression level. */
+static size_t hdf5_filter_zstd(unsigned flags, size_t cd_nelmts,
+                               const unsigned cd_values[], size_t nbytes,
+                               size_t *buf_size, void **buf)
+{
+    int level = cd_nelmts > 0 ? (int)cd_values[0] : 0;
+    return hdf5_filter(COMPRESS_ZSTD, level, flags, nbytes, buf_size, buf);
+}
+
+static const H5Z_class2_t hdf5_filter_classes[] = {
+    {
+        .version = H5Z_CLASS_T_VERS,
+        .id = COMPRESS_H5Z_LZ4,
+        .encoder_present = 1,
+        .decoder_present = 1,
+        .name = "lz4",
+        .filter = hdf5_filter_lz4,
+    },
+    {
+        .version = H5Z_CLASS_T_VERS,
+        .id = COMPRESS_H5Z_ZSTD,
+        .encoder_present = 1,
+        .decoder_present = 1,
+        .name = "zstd",
+        .filter = hdf5_filter_zstd,
+    },
+};
+
+/* Make our filters available to the HDF5 library, unless it has
+ * them already (say, from a plugin). */
+static int hdf5_register_filters(void)
+{
+    const size_t n = sizeof(hdf5_filter_classes) /
+        sizeof(hdf5_filter_classes[0]);
+    for (size_t i = 0; i < n; i++) {
+        const H5Z_class2_t *cls = &hdf5_filter_classes[i];
+        htri_t avail = H5Zfilter_avail(cls->id);
+        if (avail < 0 || (!avail && H5Zregister(cls) < 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Add opts->compress's filters to a dataset creation property list,
+ * and return how many there are. */
+static int hdf5_set_compress(hid_t cprops, const struct hdf5_ch_opts *opts)
+{
+    int nfilters = 0;
+    unsigned cd_values[2] = { 0, (unsigned)opts->compress_level };
+    switch (opts->compress) {
+    case COMPRESS_SHUFFLE_LZ4:
+    case COMPRESS_SHUFFLE_ZSTD:
+        if (H5Pset_shuffle(cprops) < 0) {
+            return -1;
+        }
+        nfilters++;
+        break;
+    default:
+        break;
+    }
+    switch (opts->compress) {
+    case COMPRESS_LZ4:
+    case COMPRESS_SHUFFLE_LZ4:
+        if (H5Pset_filter(cprops, COMPRESS_H5Z_LZ4, H5Z_FLAG_OPTIONAL,
+                          2, cd_values) < 0) {
+            return -1;
+        }
+        break;
+    case COMPRESS_ZSTD:
+    case COMPRESS_SHUFFLE_ZSTD:
+        if (H5Pset_filter(cprops, COMPRESS_H5Z_ZSTD, H5Z_FLAG_OPTIONAL,
+                          1, &cd_values[1]) < 0) {
+            return -1;
+        }
+        break;
+    default:
+        assert(0);
+        return -1;
+    }
+    return nfilters + 1;
+}
+
+/* Creation properties for a dataset with the given chunk shape */
+static hid_t hdf5_dset_cprops(const struct hdf5_ch_opts *opts, int rank,
+                              const hsize_t *chunk_dims)
 {
-    hid_t ret = -1;
     hid_t cprops = H5Pcreate(H5P_DATASET_CREATE);
     if (cprops < 0) {
         return -1;
     }
-    if (H5Pset_chunk(cprops, RANK, data->h5_chunk_dims) >= 0) {
-        ret = H5Dcreate2(data->h5_file, data->dset_name,
-                         data->h5_dtype, data->h5_dspace,
-                         H5P_DEFAULT, cprops, H5P_DEFAULT);
+
+    /* Board samples are written once, in order, and chunks get
+     * filled completely; there's no point initializing them. */
+    if (H5Pset_chunk(cprops, rank, chunk_dims) < 0 ||
+        H5Pset_alloc_time(cprops, (opts->alloc_early ?
+                                   H5D_ALLOC_TIME_EARLY :
+                                   H5D_ALLOC_TIME_INCR)) < 0 ||
+        H5Pset_fill_time(cprops, H5D_FILL_TIME_NEVER) < 0 ||
+        (opts->deflate && H5Pset_deflate(cprops, opts->deflate) < 0) ||
+        (opts->compress && hdf5_set_compress(cprops, opts) < 0)) {
+        H5Pclose(cprops);
+        return -1;
+    }
+    return cprops;
+}
+
+/* Access properties for a dataset with chunks of chunk_bytes */
+static hid_t hdf5_dset_aprops(const struct hdf5_ch_opts *opts,
+                              size_t chunk_bytes)
+{
+    hid_t aprops = H5Pcreate(H5P_DATASET_ACCESS);
+    if (aprops < 0) {
+        return -1;
+    }
+
+    /* HDF5 doesn't cache chunks bigger than the cache at all, which
+     * (see HDF5_CH_CACHE_BYTES) is what we want. Otherwise, w0 = 1
+     * evicts full chunks first. */
+    size_t nslots = hdf5_next_prime(CACHE_SLOTS_PER_CHUNK *
+                                    (opts->cache_bytes / chunk_bytes + 1));
+    if (H5Pset_chunk_cache(aprops, nslots, opts->cache_bytes, 1.0) < 0) {
+        H5Pclose(aprops);
+        return -1;
+    }
+    return aprops;
+}
+
+/* Make the data set itself */
+static hid_t hdf5_create_dset(struct h5_ch_data *data)
+{
+    const struct hdf5_ch_opts *opts = &data->h5_opts;
+    hid_t ret = -1;
+    data->h5_chunk_dims[0] = opts->chunk_nsamps;
+    hid_t cprops = hdf5_dset_cprops(opts, RANK, data->h5_chunk_dims);
+    hid_t aprops = hdf5_dset_aprops(opts, (opts->chunk_nsamps *
+                                           sizeof(struct raw_pkt_bsmp)));
+    if (cprops < 0 || aprops < 0) {
+        goto out;
+    }
+
+    ret = H5Dcreate2(data->h5_file, data->dset_name,
+                     data->h5_dtype, data->h5_dspace,
+                     H5P_DEFAULT, cprops, aprops);
+    if (ret >= 0) {
+        data->h5_filespace = H5Dget_space(ret);
+        if (data->h5_filespace < 0) {
+            H5Dclose(ret);
+            ret = -1;
+        }
+    }
+ out:
+    if (aprops >= 0) {
+        H5Pclose(aprops);
+    }
+    if (cprops >= 0) {
+        H5Pclose(cprops);
     }
-    H5Pclose(cprops);
     if (ret >= 0) {
         data->h5_dset = ret;
     }
     return ret;
 }
 
+/* HDF5 type of one of the h5_cols datasets */
+static hid_t hdf5_col_type(size_t col)
+{
+    struct raw_pkt_bsmp bs;     /* just for type conversion */
+    switch (col) {
+    case H5_COL_SIDX:
+        return TO_H5_UTYPE(bs.b_sidx);
+    case H5_COL_FLAGS:
+        return TO_H5_UTYPE(bs.ph.p_flags);
+    case H5_COL_CHIP_LIVE:
+        return TO_H5_UTYPE(bs.b_chip_live);
+    default:
+        assert(0);
+        return -1;
+    }
+}
+
+/* Make the channel-major layout's group and data sets. As with
+ * hdf5_create_dtypes(), if wire_order is set, samples are declared
+ * big-endian. */
+static int hdf5_create_cols(struct h5_ch_data *data, int wire_order)
+{
+    const struct hdf5_ch_opts *opts = &data->h5_opts;
+    struct raw_pkt_bsmp bs;     /* just for type conversion */
+    int ret = -1;
+    hid_t samp_cprops = -1, samp_aprops = -1;
+    hid_t col_cprops = -1, col_aprops = -1;
+    hid_t samp_dspace = -1;
+
+    data->h5_group = H5Gcreate2(data->h5_file, data->dset_name,
+                                H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if (data->h5_group < 0) {
+        goto out;
+    }
+
+    data->h5_samp_type = TO_H5_UTYPE(bs.b_samps[0]);
+    if (wire_order) {
+        assert(sizeof(bs.b_samps[0]) == 2);
+        data->h5_samp_type = H5T_STD_U16BE;
+    }
+    const hsize_t samp_chunk[2] = { opts->col_chunk_nchans,
+                                    opts->col_chunk_nsamps };
+    const hsize_t cur_dims[2] = { RAW_BSMP_NSAMP, opts->expected_nsamps };
+    const hsize_t max_dims[2] = { RAW_BSMP_NSAMP, H5S_UNLIMITED };
+    samp_cprops = hdf5_dset_cprops(opts, 2, samp_chunk);
+    samp_aprops = hdf5_dset_aprops(opts, (opts->col_chunk_nchans *
+                                          opts->col_chunk_nsamps *
+                                          sizeof(raw_samp_t)));
+    samp_dspace = H5Screate_simple(2, cur_dims, max_dims);
+    if (samp_cprops < 0 || samp_aprops < 0 || samp_dspace < 0) {
+        goto out;
+    }
+    data->h5_dset = H5Dcreate2(data->h5_group, COL_SAMPS_NAME,
+                               data->h5_samp_type, samp_dspace,
+                               H5P_DEFAULT, samp_cprops, samp_aprops);
+    if (data->h5_dset < 0) {
+        goto out;
+    }
+    data->h5_filespace = H5Dget_space(data->h5_dset);
+    if (data->h5_filespace < 0) {
+        goto out;
+    }
+
+    const hsize_t col_chunk = opts->col_chunk_nsamps;
+    const hsize_t col_max = H5S_UNLIMITED;
+    col_cprops = hdf5_dset_cprops(opts, 1, &col_chunk);
+    col_aprops = hdf5_dset_aprops(opts, opts->col_chunk_nsamps *
+                                  sizeof(uint32_t));
+    data->h5_col_filespace = H5Screate_simple(1, &cur_dims[1], &col_max);
+    if (col_cprops < 0 || col_aprops < 0 || data->h5_col_filespace < 0) {
+        goto out;
+    }
+    for (size_t i = 0; i < H5_NCOLS; i++) {
+        data->h5_cols[i] = H5Dcreate2(data->h5_group, h5_col_names[i],
+                                      hdf5_col_type(i),
+                                      data->h5_col_filespace,
+                                      H5P_DEFAULT, col_cprops, col_aprops);
+        if (data->h5_cols[i] < 0) {
+            goto out;
+        }
+    }
+
+    if (h5_cols_alloc(&data->h5_colbuf, opts->col_chunk_nsamps) < 0) {
+        goto out;
+    }
+    data->h5_dset_size = opts->expected_nsamps;
+    ret = 0;
+ out:
+    if (samp_dspace >= 0) {
+        H5Sclose(samp_dspace);
+    }
+    if (col_aprops >= 0) {
+        H5Pclose(col_aprops);
+    }
+    if (col_cprops >= 0) {
+        H5Pclose(col_cprops);
+    }
+    if (samp_aprops >= 0) {
+        H5Pclose(samp_aprops);
+    }
+    if (samp_cprops >= 0) {
+        H5Pclose(samp_cprops);
+    }
+    return ret;
+}
+
 /* Add attributes for experiment-wide packet fields */
 static hid_t hdf5_create_attrs(struct h5_ch_data *data)
 {
     struct raw_pkt_bsmp bs;
     raw_packet_init(&bs, RAW_MTYPE_BSMP, 0);
 
-    /* The dataset is the primary data object for these attributes. */
-    hid_t dobj = data->h5_dset;
+    /* The dataset (or with the channel-major layout, its group) is
+     * the primary data object for these attributes. */
+    hid_t dobj = data->h5_group >= 0 ? data->h5_group : data->h5_dset;
     assert(dobj >= 0);
 
     /* The attributes all live in the same 1x1 dataspace. */
@@ -316,25 +937,78 @@ static hid_t hdf5_create_attrs(struct h5_ch_data *data)
     return 0;
 }
 
+/* Are we writing whole chunks ourselves? */
+static int hdf5_direct_chunks(const struct hdf5_ch_opts *opts)
+{
+    return (opts->direct_chunk ||
+            (opts->compress && HAVE_H5DWRITE_CHUNK &&
+             opts->layout == HDF5_CH_LAYOUT_ROWS));
+}
+
+/* Allocate buffers (and the compression pool) for direct chunk
+ * writes, if we're doing them */
+static int hdf5_alloc_chunk_bufs(struct h5_ch_data *data)
+{
+    const struct hdf5_ch_opts *opts = &data->h5_opts;
+    if (!hdf5_direct_chunks(opts)) {
+        return 0;
+    }
+    data->h5_chunk_bytes = opts->chunk_nsamps * sizeof(struct raw_pkt_bsmp);
+    data->h5_chunk = malloc(data->h5_chunk_bytes);
+    if (!data->h5_chunk) {
+        return -1;
+    }
+    if (opts->compress) {
+        /* Shuffling treats each board sample as a record, just like
+         * HDF5's shuffle filter does with our compound type. */
+        data->h5_pool = compress_pool_alloc(opts->compress,
+                                            opts->compress_level,
+                                            sizeof(struct raw_pkt_bsmp),
+                                            data->h5_chunk_bytes,
+                                            opts->compress_threads);
+        if (!data->h5_pool) {
+            return -1;
+        }
+        const int shuffled = (opts->compress == COMPRESS_SHUFFLE_LZ4 ||
+                              opts->compress == COMPRESS_SHUFFLE_ZSTD);
+        data->h5_skip_mask = shuffled ? 0x3 : 0x1;
+    } else if (opts->deflate) {
+        data->h5_skip_mask = 0x1;
+        data->h5_zbuf_size = compressBound(data->h5_chunk_bytes);
+        data->h5_zbuf = malloc(data->h5_zbuf_size);
+        if (!data->h5_zbuf) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static int hdf5_ch_open(struct ch_storage *chns, unsigned flags)
 {
     struct h5_ch_data tmp;
     h5_ch_data_init(&tmp, h5_data(chns)->dset_name); /* initialize defaults */
+    tmp.h5_opts = h5_data(chns)->h5_opts;
 
-    tmp.h5_file = H5Fcreate(chns->ch_path, flags, H5P_DEFAULT, H5P_DEFAULT);
-    if (tmp.h5_file < 0) {
+    if (hdf5_create_file(&tmp, chns->ch_path, flags) < 0) {
         goto fail;
     }
-    if (hdf5_create_dspace(&tmp) < 0) {
+    const int wire_order = !!(chns->ch_flags & CH_STORAGE_WIRE_ORDER);
+    if (tmp.h5_opts.compress && hdf5_register_filters() < 0) {
         goto fail;
     }
-    if (hdf5_create_dtypes(&tmp) < 0) {
+    if (tmp.h5_opts.layout == HDF5_CH_LAYOUT_CHANNELS) {
+        if (hdf5_create_cols(&tmp, wire_order) < 0) {
+            goto fail;
+        }
+    } else if (hdf5_create_dspace(&tmp) < 0 ||
+               hdf5_create_dtypes(&tmp, wire_order) < 0 ||
+               hdf5_create_dset(&tmp) < 0) {
         goto fail;
     }
-    if (hdf5_create_dset(&tmp) < 0) {
+    if (hdf5_create_attrs(&tmp) < 0) {
         goto fail;
     }
-    if (hdf5_create_attrs(&tmp) < 0) {
+    if (hdf5_alloc_chunk_bufs(&tmp) < 0) {
         goto fail;
     }
     memcpy(h5_data(chns), &tmp, sizeof(tmp)); /* Success! */
@@ -350,21 +1024,348 @@ static int hdf5_ch_open(struct ch_storage *chns, unsigned flags)
     return -1;
 }
 
+/*
+ * Direct chunk writes
+ */
+
+/* Write len bytes of a chunk, already run through the filters
+ * filter_mask doesn't mask off, with H5Dwrite_chunk(). */
+static int hdf5_put_chunk(struct h5_ch_data *data, const void *buf,
+                          size_t len, uint32_t filter_mask, hsize_t start)
+{
+#if HAVE_H5DWRITE_CHUNK
+    return H5Dwrite_chunk(data->h5_dset, H5P_DEFAULT, filter_mask, &start,
+                          len, buf) < 0 ? -1 : 0;
+#else
+    (void)data;
+    (void)buf;
+    (void)len;
+    (void)filter_mask;
+    (void)start;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Write out the chunks the compression pool is done with, in the
+ * order they were submitted, waiting for the next nwait of them
+ * (SIZE_MAX for all) if they aren't done yet. */
+static int hdf5_reap_chunks(struct h5_ch_data *data, size_t nwait)
+{
+    struct compress_job *job;
+    while ((job = compress_pool_reap(data->h5_pool, nwait > 0))) {
+        int ret = hdf5_put_chunk(data, job->out, job->out_len,
+                                 job->compressed ? 0 : data->h5_skip_mask,
+                                 job->tag);
+        compress_pool_release(data->h5_pool, job);
+        if (ret < 0) {
+            return -1;
+        }
+        if (nwait && nwait != SIZE_MAX) {
+            nwait--;
+        }
+    }
+    return 0;
+}
+
+/* Write a whole chunk, which starts at dataset offset start. The
+ * dataset's extent must already include start. With a compression
+ * pool, the chunk is copied, and written once it's compressed. */
+static int hdf5_write_chunk(struct h5_ch_data *data, const void *buf,
+                            hsize_t start)
+{
+    const void *out = buf;
+    size_t len = data->h5_chunk_bytes;
+    uint32_t filter_mask = 0;
+    if (data->h5_pool) {
+        struct compress_job *job;
+        while (!(job = compress_pool_job(data->h5_pool))) {
+            if (hdf5_reap_chunks(data, 1) < 0) {
+                return -1;
+            }
+        }
+        memcpy(job->in, buf, len);
+        job->in_len = len;
+        job->tag = start;
+        compress_pool_submit(data->h5_pool, job);
+        return hdf5_reap_chunks(data, 0);
+    }
+    if (data->h5_opts.deflate) {
+        /* This is what HDF5's deflate filter does, too. It's an
+         * optional filter, so if it doesn't help, we can say we
+         * skipped it. */
+        uLongf zlen = data->h5_zbuf_size;
+        if (compress2(data->h5_zbuf, &zlen, buf, len,
+                      data->h5_opts.deflate) == Z_OK && zlen < len) {
+            out = data->h5_zbuf;
+            len = zlen;
+        } else {
+            filter_mask = data->h5_skip_mask;
+        }
+    }
+    return hdf5_put_chunk(data, out, len, filter_mask, start);
+}
+
+/* Append board samples at h5_dset_off, a chunk at a time. Whole,
+ * aligned chunks go straight from bsamps; everything else goes
+ * through h5_chunk. */
+static int hdf5_append_chunks(struct h5_ch_data *data,
+                              const struct raw_pkt_bsmp *bsamps,
+                              size_t nsamps)
+{
+    const hsize_t chunk_nsamps = data->h5_chunk_dims[0];
+    hsize_t off = data->h5_dset_off;
+    while (nsamps) {
+        size_t fill = off % chunk_nsamps;
+        size_t n;
+        if (!fill && nsamps >= chunk_nsamps) {
+            n = chunk_nsamps;
+            if (hdf5_write_chunk(data, bsamps, off) < 0) {
+                return -1;
+            }
+        } else {
+            n = chunk_nsamps - fill;
+            if (n > nsamps) {
+                n = nsamps;
+            }
+            memcpy(data->h5_chunk + fill * sizeof(*bsamps), bsamps,
+                   n * sizeof(*bsamps));
+            if (fill + n == chunk_nsamps &&
+                hdf5_write_chunk(data, data->h5_chunk, off - fill) < 0) {
+                return -1;
+            }
+        }
+        bsamps += n;
+        nsamps -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/* Dataset offset of the first board sample still waiting in h5_chunk
+ * or h5_colbuf; h5_dset_off if there's no such buffer. */
+static hsize_t hdf5_buffered_off(const struct h5_ch_data *data)
+{
+    hsize_t off = data->h5_dset_off;
+    if (data->h5_chunk) {
+        return off - off % data->h5_chunk_dims[0];
+    }
+    if (data->h5_colbuf.nsamps) {
+        return off - off % data->h5_colbuf.nsamps;
+    }
+    return off;
+}
+
+/* Write out the partly-filled chunk in h5_chunk, if there is one,
+ * and wait for the compression pool to finish the rest. The rest of
+ * the chunk is zeroed, and trimmed off on close. */
+static int hdf5_flush_chunk(struct h5_ch_data *data)
+{
+    const size_t bsamp_size = sizeof(struct raw_pkt_bsmp);
+    size_t fill = data->h5_dset_off % data->h5_chunk_dims[0];
+    if (data->h5_chunk && fill) {
+        memset(data->h5_chunk + fill * bsamp_size, 0,
+               data->h5_chunk_bytes - fill * bsamp_size);
+        if (hdf5_write_chunk(data, data->h5_chunk,
+                             data->h5_dset_off - fill) < 0) {
+            return -1;
+        }
+    }
+    return data->h5_pool ? hdf5_reap_chunks(data, SIZE_MAX) : 0;
+}
+
+/*
+ * Channel-major layout
+ */
+
+/* Write the first nsamps board samples in cols at dataset offset
+ * start, which must be within the dataset's extent. */
+static int hdf5_write_cols(struct h5_ch_data *data,
+                           const struct h5_cols *cols, size_t nsamps,
+                           hsize_t start)
+{
+    int ret = -1;
+    const hsize_t mem_dims[2] = { RAW_BSMP_NSAMP, cols->nsamps };
+    const hsize_t mem_start[2] = { 0, 0 };
+    const hsize_t file_start[2] = { 0, start };
+    const hsize_t count[2] = { RAW_BSMP_NSAMP, nsamps };
+    const void *bufs[H5_NCOLS] = {
+        [H5_COL_SIDX] = cols->sidx,
+        [H5_COL_FLAGS] = cols->flags,
+        [H5_COL_CHIP_LIVE] = cols->chip_live,
+    };
+    hid_t samp_memspace = H5Screate_simple(2, mem_dims, NULL);
+    hid_t col_memspace = H5Screate_simple(1, &mem_dims[1], NULL);
+    if (samp_memspace < 0 || col_memspace < 0) {
+        goto out;
+    }
+    if (H5Sselect_hyperslab(samp_memspace, H5S_SELECT_SET, mem_start, NULL,
+                            count, NULL) < 0 ||
+        H5Sselect_hyperslab(data->h5_filespace, H5S_SELECT_SET, file_start,
+                            NULL, count, NULL) < 0 ||
+        H5Dwrite(data->h5_dset, data->h5_samp_type, samp_memspace,
+                 data->h5_filespace, H5P_DEFAULT, cols->samps) < 0) {
+        goto out;
+    }
+    if (H5Sselect_hyperslab(col_memspace, H5S_SELECT_SET, mem_start, NULL,
+                            &count[1], NULL) < 0 ||
+        H5Sselect_hyperslab(data->h5_col_filespace, H5S_SELECT_SET, &start,
+                            NULL, &count[1], NULL) < 0) {
+        goto out;
+    }
+    for (size_t i = 0; i < H5_NCOLS; i++) {
+        if (H5Dwrite(data->h5_cols[i], hdf5_col_type(i), col_memspace,
+                     data->h5_col_filespace, H5P_DEFAULT, bufs[i]) < 0) {
+            goto out;
+        }
+    }
+    ret = 0;
+ out:
+    if (col_memspace >= 0) {
+        H5Sclose(col_memspace);
+    }
+    if (samp_memspace >= 0) {
+        H5Sclose(samp_memspace);
+    }
+    return ret;
+}
+
+/* Append board samples at h5_dset_off, transposing them into
+ * h5_colbuf and writing it out each time it fills up. */
+static int hdf5_append_cols(struct h5_ch_data *data,
+                            const struct raw_pkt_bsmp *bsamps,
+                            size_t nsamps)
+{
+    struct h5_cols *cols = &data->h5_colbuf;
+    hsize_t off = data->h5_dset_off;
+    while (nsamps) {
+        size_t fill = off % cols->nsamps;
+        size_t n = cols->nsamps - fill;
+        if (n > nsamps) {
+            n = nsamps;
+        }
+        h5_cols_gather(cols, fill, bsamps, n);
+        if (fill + n == cols->nsamps &&
+            hdf5_write_cols(data, cols, cols->nsamps, off - fill) < 0) {
+            return -1;
+        }
+        bsamps += n;
+        nsamps -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/* Write out what's in h5_colbuf, if anything. It stays there, so
+ * the whole chunk gets written when it fills up. */
+static int hdf5_flush_cols(struct h5_ch_data *data)
+{
+    hsize_t start = hdf5_buffered_off(data);
+    if (!data->h5_colbuf.nsamps || start == data->h5_dset_off) {
+        return 0;
+    }
+    return hdf5_write_cols(data, &data->h5_colbuf,
+                           data->h5_dset_off - start, start);
+}
+
+/* Set the dataset's extent (all of them, with the channel-major
+ * layout) to size board samples. */
+static herr_t hdf5_set_extent(struct h5_ch_data *data, hsize_t size)
+{
+#if RANK != 1
+#error "If RANK !=1, hdf5_set_extent is broken"
+#endif
+    const hsize_t max_dim = H5S_UNLIMITED;
+    herr_t ret;
+    if (data->h5_group < 0) {
+        ret = H5Dset_extent(data->h5_dset, &size);
+        if (ret >= 0) {
+            ret = H5Sset_extent_simple(data->h5_filespace, RANK, &size,
+                                       &max_dim);
+        }
+    } else {
+        const hsize_t dims[2] = { RAW_BSMP_NSAMP, size };
+        const hsize_t max_dims[2] = { RAW_BSMP_NSAMP, H5S_UNLIMITED };
+        ret = H5Dset_extent(data->h5_dset, dims);
+        if (ret >= 0) {
+            ret = H5Sset_extent_simple(data->h5_filespace, 2, dims,
+                                       max_dims);
+        }
+        for (size_t i = 0; ret >= 0 && i < H5_NCOLS; i++) {
+            ret = H5Dset_extent(data->h5_cols[i], &size);
+        }
+        if (ret >= 0) {
+            ret = H5Sset_extent_simple(data->h5_col_filespace, 1, &size,
+                                       &max_dim);
+        }
+    }
+    if (ret >= 0) {
+        data->h5_dset_size = size;
+    }
+    return ret;
+}
+
+/* Fill in stats for what's been written so far. */
+static void hdf5_get_stats(struct h5_ch_data *data,
+                           struct ch_storage_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->nbytes_in = data->h5_dset_off * sizeof(struct raw_pkt_bsmp);
+    stats->nbytes_out = H5Dget_storage_size(data->h5_dset);
+    for (size_t i = 0; i < H5_NCOLS && data->h5_cols[i] >= 0; i++) {
+        stats->nbytes_out += H5Dget_storage_size(data->h5_cols[i]);
+    }
+    if (data->h5_pool) {
+        stats->nthreads = compress_pool_nthreads(data->h5_pool);
+        for (size_t i = 0; i < stats->nthreads; i++) {
+            struct compress_thread_stats ts;
+            compress_pool_thread_stats(data->h5_pool, i, &ts);
+            stats->threads[i].nbytes_in = ts.nbytes_in;
+            stats->threads[i].busy_ns = ts.busy_ns;
+        }
+    }
+}
+
+static int hdf5_ch_stats(struct ch_storage *chns,
+                         struct ch_storage_stats *stats)
+{
+    struct h5_ch_data *data = h5_data(chns);
+    if (data->h5_file >= 0) {
+        hdf5_get_stats(data, stats);
+    } else {
+        *stats = data->h5_stats;
+    }
+    return 0;
+}
+
 static int hdf5_ch_close(struct ch_storage *chns)
 {
     struct h5_ch_data *data = h5_data(chns);
-    if (H5Dset_extent(data->h5_dset, &data->h5_dset_off) < 0) {
+    if (hdf5_flush_chunk(data) < 0 || hdf5_flush_cols(data) < 0) {
+        log_ERR("Can't write the last chunk of %s, dataset %s; "
+                "samples after offset %llu will be garbage",
+                chns->ch_path, data->dset_name,
+                (long long unsigned)hdf5_buffered_off(data));
+    }
+    if (hdf5_set_extent(data, data->h5_dset_off) < 0) {
         log_ERR("Can't clean up dataset on close; sample data in "
                 "%s, dataset %s after offset %llu will be garbage",
                 chns->ch_path, data->dset_name,
                 (long long unsigned)data->h5_dset_off);
     }
-    return h5_ch_data_teardown(h5_data(chns));
+    hdf5_get_stats(data, &data->h5_stats);
+    int ret = h5_ch_data_teardown(data);
+    data->h5_file = -1;
+    return ret;
 }
 
 static int hdf5_ch_datasync(struct ch_storage *chns)
 {
-    return H5Fflush(h5_data(chns)->h5_file, H5F_SCOPE_LOCAL);
+    struct h5_ch_data *data = h5_data(chns);
+    if (hdf5_flush_chunk(data) < 0 || hdf5_flush_cols(data) < 0) {
+        return -1;
+    }
+    return H5Fflush(data->h5_file, H5F_SCOPE_LOCAL);
 }
 
 /* Initialize dataset attributes that require a board sample to fill in. */
@@ -397,14 +1398,39 @@ static herr_t hdf5_extend(struct h5_ch_data *data, hsize_t minsize)
     if (newsize < minsize) {
         newsize = minsize;
     }
-#if RANK != 1
-#error "If RANK !=1, hdf5_extend is broken"
-#endif
-    herr_t ret = H5Dset_extent(data->h5_dset, &newsize);
-    if (ret >= 0) {
-        data->h5_dset_size = newsize;
+    return hdf5_set_extent(data, newsize);
+}
+
+/* Write nsamps board samples at the given dataset offset, which
+ * must already be within the dataset's extent. */
+static herr_t hdf5_write_slab(struct h5_ch_data *data,
+                              const struct raw_pkt_bsmp *bsamps,
+                              size_t nsamps, hsize_t start)
+{
+    hsize_t slabdims[RANK] = {(hsize_t)nsamps};
+
+    if (data->h5_memspace_n != nsamps) {
+        if (data->h5_memspace < 0) {
+            data->h5_memspace = H5Screate_simple(RANK, slabdims, NULL);
+            if (data->h5_memspace < 0) {
+                return -1;
+            }
+        } else if (H5Sset_extent_simple(data->h5_memspace, RANK, slabdims,
+                                        NULL) < 0) {
+            data->h5_memspace_n = 0;
+            return -1;
+        }
+        data->h5_memspace_n = nsamps;
     }
-    return ret;
+    if (H5Sselect_hyperslab(data->h5_filespace, H5S_SELECT_SET, &start,
+                            NULL, slabdims, NULL) < 0) {
+        return -1;
+    }
+    if (H5Dwrite(data->h5_dset, data->h5_dtype, data->h5_memspace,
+                 data->h5_filespace, H5P_DEFAULT, bsamps) < 0) {
+        return -1;
+    }
+    return 0;
 }
 
 static int hdf5_ch_write(struct ch_storage *chns,
@@ -423,13 +1449,16 @@ static int hdf5_ch_write(struct ch_storage *chns,
         data->h5_need_attrs = 0;
     }
 
-    /* Sanity-check that we're not getting packets from a different board. */
+    /* Sanity-check that we're not getting packets from a different board,
+     * or with samples in a different byte order than we declared. */
     assert(bsamps[0].b_id == data->h5_debug_board_id);
+    assert(!(bsamps[0].ph.p_flags & RAW_PFLAG_B_SAMPS_BE) ==
+           !(chns->ch_flags & CH_STORAGE_WIRE_ORDER));
 
     /* If we're getting more board samples than will fit, we need to
      * extend the dataset. */
     hsize_t next_offset = data->h5_dset_off + nsamps;
-    if (next_offset >= data->h5_dset_size) {
+    if (next_offset > data->h5_dset_size) {
         if (hdf5_extend(data, next_offset) < 0) {
             log_ERR("Can't increase space allocated for HDF5 dataset");
             return -1;
@@ -437,35 +1466,116 @@ static int hdf5_ch_write(struct ch_storage *chns,
     }
 
     /* Everything's set up; do the write. */
+    int ret;
+    if (data->h5_chunk) {
+        ret = hdf5_append_chunks(data, bsamps, nsamps);
+    } else if (data->h5_colbuf.nsamps) {
+        ret = hdf5_append_cols(data, bsamps, nsamps);
+    } else {
+        ret = hdf5_write_slab(data, bsamps, nsamps, data->h5_dset_off);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+    data->h5_dset_off = next_offset;
+    return 0;
+}
+
+static int hdf5_ch_write_at(struct ch_storage *chns,
+                            const struct raw_pkt_bsmp *bsamps,
+                            size_t nsamps, size_t offset)
+{
+    struct h5_ch_data *data = h5_data(chns);
+    if (!nsamps) {
+        return 0;
+    }
+    if (offset + nsamps > data->h5_dset_off) {
+        errno = EINVAL;
+        return -1;
+    }
+    assert(bsamps[0].b_id == data->h5_debug_board_id);
+    assert(!(bsamps[0].ph.p_flags & RAW_PFLAG_B_SAMPS_BE) ==
+           !(chns->ch_flags & CH_STORAGE_WIRE_ORDER));
+
+    /* Anything in the chunk that's still being filled gets patched
+     * there; the rest is in the file already. */
+    hsize_t buffered = hdf5_buffered_off(data);
+    if (offset + nsamps > buffered) {
+        size_t first = offset < buffered ? buffered - offset : 0;
+        size_t at = offset + first - buffered;
+        if (data->h5_chunk) {
+            memcpy(data->h5_chunk + at * sizeof(*bsamps), bsamps + first,
+                   (nsamps - first) * sizeof(*bsamps));
+        } else {
+            h5_cols_gather(&data->h5_colbuf, at, bsamps + first,
+                           nsamps - first);
+        }
+        nsamps = first;
+    }
+    if (!nsamps) {
+        return 0;
+    }
+    if (!data->h5_colbuf.nsamps) {
+        /* Chunks still being compressed would overwrite this. */
+        if (data->h5_pool && hdf5_reap_chunks(data, SIZE_MAX) < 0) {
+            return -1;
+        }
+        return hdf5_write_slab(data, bsamps, nsamps, offset);
+    }
+    struct h5_cols cols;
+    if (h5_cols_alloc(&cols, nsamps) < 0) {
+        return -1;
+    }
+    h5_cols_gather(&cols, 0, bsamps, nsamps);
+    int ret = hdf5_write_cols(data, &cols, nsamps, offset);
+    h5_cols_free(&cols);
+    return ret;
+}
+
+static int hdf5_ch_write_gaps(struct ch_storage *chns,
+                              const struct ch_gap *gaps,
+                              size_t ngaps)
+{
+    struct h5_ch_data *data = h5_data(chns);
     int ret = -1;
-    hsize_t slabdims[RANK] = {(hsize_t)nsamps};
-    hid_t filespace = -1;
-    hid_t memspace = -1;
+    hid_t dtype = -1;
+    hid_t dspace = -1;
+    hid_t dset = -1;
+    hsize_t dim = ngaps;
+    size_t name_size = strlen(data->dset_name) + sizeof(GAPS_DSET_SUFFIX);
+    char name[name_size];
 
-    filespace = H5Dget_space(data->h5_dset);
-    if (filespace < 0) {
-        goto fail;
+    snprintf(name, name_size, "%s" GAPS_DSET_SUFFIX, data->dset_name);
+    dtype = H5Tcreate(H5T_COMPOUND, sizeof(struct ch_gap));
+    if (dtype < 0 ||
+        H5Tinsert(dtype, "start", offsetof(struct ch_gap, start),
+                  H5T_NATIVE_UINT64) < 0 ||
+        H5Tinsert(dtype, "len", offsetof(struct ch_gap, len),
+                  H5T_NATIVE_UINT64) < 0) {
+        goto out;
     }
-    memspace = H5Screate_simple(RANK, slabdims, NULL);
-    if (memspace < 0) {
-        goto fail;
+    dspace = H5Screate_simple(1, &dim, NULL);
+    if (dspace < 0) {
+        goto out;
     }
-    if (H5Sselect_hyperslab(filespace, H5S_SELECT_SET, &data->h5_dset_off,
-                            NULL, slabdims, NULL) < 0) {
-        goto fail;
+    dset = H5Dcreate2(data->h5_file, name, dtype, dspace,
+                      H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    if (dset < 0) {
+        goto out;
     }
-    if (H5Dwrite(data->h5_dset, data->h5_dtype, memspace, filespace,
-                 H5P_DEFAULT, bsamps) < 0) {
-        goto fail;
+    if (H5Dwrite(dset, dtype, H5S_ALL, H5S_ALL, H5P_DEFAULT, gaps) < 0) {
+        goto out;
     }
-    data->h5_dset_off = next_offset;
     ret = 0;
- fail:
-    if (filespace != -1 && H5Sclose(filespace) < 0) {
-        log_ERR("can't free resources acquired while writing samples");
+ out:
+    if (dset >= 0 && H5Dclose(dset) < 0) {
+        ret = -1;
     }
-    if (memspace != -1 && H5Sclose(memspace) < 0) {
-        log_ERR("can't free resources acquired while writing samples");
+    if (dspace >= 0 && H5Sclose(dspace) < 0) {
+        ret = -1;
+    }
+    if (dtype >= 0 && H5Tclose(dtype) < 0) {
+        ret = -1;
     }
     return ret;
 }
@@ -16,18 +16,141 @@
 /**
  * @file hdf5_ch_storage.h
  * @brief HDF5 channel storage backend
+ *
+ * Board samples go in a one-dimensional dataset of compound
+ * records. A gap table (see ch_storage_write_gaps()), if there is
+ * one, goes in another dataset with the same name plus "_gaps",
+ * with "start" and "len" fields.
+ *
+ * With the channel-major layout (HDF5_CH_LAYOUT_CHANNELS), the
+ * dataset name is a group instead, holding:
+ *
+ *   - "samples": a [RAW_BSMP_NSAMP][time] array of samples, chunked
+ *     along time, so one channel's samples are contiguous;
+ *   - "samp_index", "ph_flags", "chip_live": one-dimensional
+ *     [time] arrays of the other board sample fields.
+ *
+ * The attributes are on the group. Reading one channel then touches
+ * only the chunks holding it, rather than every byte of the file.
+ *
+ * Chunks can be compressed with LZ4 or zstd (see compress.h). The
+ * files name them by their registered HDF5 filter IDs, which we
+ * register with the HDF5 library ourselves if it doesn't have them
+ * already; other readers need the filter plugins (in Python,
+ * "import hdf5plugin" before opening the file with h5py).
+ *
+ * How the dataset is laid out and cached can be tuned with
+ * hdf5_ch_storage_set_opts(); the defaults suit sustained writes at
+ * 30 kHz, a sample buffer (50 ms, by default) at a time. Run
+ * util/bench-hdf5 to compare settings on a given disk.
+ *
  * @see ch_storage.h
  */
 
 #ifndef _LIB_HDF5_CHANNEL_STORAGE_H_
 #define _LIB_HDF5_CHANNEL_STORAGE_H_
 
+#include <stddef.h>
+
 #include <hdf5.h>
 
 struct ch_storage;
 
+/*
+ * Defaults for struct hdf5_ch_opts, from util/bench-hdf5 --sweep.
+ *
+ * Chunks of about 2 MB keep the chunk index small without making
+ * any one write slow. A chunk cache smaller than a chunk is the
+ * fastest: full chunks go straight to the file instead of being
+ * copied into the cache first (2-3 GB/s vs. 4 GB/s, with 50 ms
+ * writes into the page cache). The metadata block size, file format
+ * and allocation time made no measurable difference, so the format
+ * stays readable by HDF5 1.8.
+ *
+ * Direct chunk writes are off by default. With a chunk cache smaller
+ * than a chunk, H5Dwrite() already writes around the cache, and
+ * assembling chunks that 50 ms writes don't line up with costs a
+ * copy (about 30% more CPU time). They pay off with compression,
+ * where H5Dwrite() recompresses every partly-written chunk (1.8x
+ * throughput at zlib level 1), and with small chunks.
+ */
+#define HDF5_CH_CHUNK_NSAMPS 1024
+#define HDF5_CH_CACHE_BYTES (1024 * 1024)
+#define HDF5_CH_META_BLOCK_SIZE (1024 * 1024)
+
+/*
+ * Channel-major chunks: a chip's worth of channels by about a second
+ * (2 MB, as above). Uncompressed, HDF5 reads just the part of each
+ * chunk a reader asked for, so reading one channel of 20 seconds
+ * takes about a millisecond, vs. over half a second with the row
+ * layout. Writing costs about three times the CPU time of the row
+ * layout: a chunk length's worth of board samples (73 MB here) gets
+ * transposed into memory before any of it can be written. That's
+ * still over 10x faster than a data node sends them; shorter chunks
+ * use less memory, but make single-channel reads slower.
+ */
+#define HDF5_CH_COL_CHUNK_NCHANS 32
+#define HDF5_CH_COL_CHUNK_NSAMPS 32768
+
+/*
+ * Compression (struct hdf5_ch_opts.compress). Any COMPRESS_* codec
+ * but COMPRESS_DELTA_ZSTD works: HDF5 has no registered delta
+ * filter, so readers couldn't undo it. The shuffle codecs use HDF5's
+ * own shuffle filter, ahead of the compressor in the pipeline.
+ *
+ * With the row layout, compressed chunks are assembled and written
+ * directly, as with direct_chunk, so compress_threads threads can
+ * compress several at once; chunks are still written in order. With
+ * the channel-major layout, HDF5 compresses them as it writes them,
+ * on the storage thread, and compress_threads is ignored.
+ */
+#define HDF5_CH_COMPRESS_THREADS 2
+
+/* Dataset layouts (struct hdf5_ch_opts.layout). */
+#define HDF5_CH_LAYOUT_ROWS 0     /* one compound record per sample */
+#define HDF5_CH_LAYOUT_CHANNELS 1 /* channel-major; see above */
+
+/* Tunables; see hdf5_ch_opts_init() for defaults. */
+struct hdf5_ch_opts {
+    size_t chunk_nsamps;        /* board samples per dataset chunk */
+    size_t cache_bytes;         /* chunk cache size; 0 disables it */
+    int alloc_early;            /* allocate the whole extent on open,
+                                 * instead of a chunk at a time */
+    size_t meta_block_size;     /* file metadata block size */
+    int latest_format;          /* use the newest file format (newer
+                                 * chunk indexes, but needs HDF5 1.10
+                                 * or later to read) */
+    size_t expected_nsamps;     /* if nonzero, size the dataset for
+                                 * this many board samples on open */
+    int direct_chunk;           /* assemble whole chunks ourselves and
+                                 * write them with H5Dwrite_chunk(),
+                                 * skipping HDF5's conversion and
+                                 * chunk cache (needs HDF5 1.10.3) */
+    int deflate;                /* if nonzero, the zlib level to
+                                 * compress chunks with */
+    int compress;               /* COMPRESS_* codec (see above) */
+    int compress_level;         /* see compress_ctx_alloc() */
+    size_t compress_threads;    /* compression threads; 0 compresses
+                                 * on the storage thread */
+    int layout;                 /* HDF5_CH_LAYOUT_* */
+    size_t col_chunk_nchans;    /* HDF5_CH_LAYOUT_CHANNELS chunk size, */
+    size_t col_chunk_nsamps;    /* in channels by board samples */
+};
+
+/* Fill in the defaults. */
+void hdf5_ch_opts_init(struct hdf5_ch_opts *opts);
+
 /* Create new channel storage object; returns NULL on error. */
 struct ch_storage *hdf5_ch_storage_alloc(const char *out_file_path,
                                          const char *dataset_name);
 
+/* Change the tunables from their defaults. Call this before opening
+ * chns. Returns -1 (with errno EINVAL) if they don't make sense.
+ *
+ * The channel-major layout ignores chunk_nsamps, in favor of the
+ * col_chunk_* fields, and doesn't support direct_chunk. The deflate
+ * and compress options can't both be set. */
+int hdf5_ch_storage_set_opts(struct ch_storage *chns,
+                             const struct hdf5_ch_opts *opts);
+
 #endif
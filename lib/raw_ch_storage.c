@@ -15,18 +15,39 @@
 
 #include "raw_ch_storage.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "type_attrs.h"
 #include "ch_storage.h"
+#include "compress.h"
+#include "compress_pool.h"
+#include "raw_file.h"
 #include "raw_packets.h"
 
 struct raw_ch_data {
     int fd;
     mode_t mode;
+    struct raw_ch_opts opts;
+    struct raw_file_meta meta;
+
+    /* Compressed (framed) files only. Board samples from frm_off on
+     * are gathered into the input buffer of the pool's next job;
+     * frm_fill of them so far. */
+    struct compress_pool *pool;
+    uint64_t frm_off;
+    size_t frm_fill;
+    struct compress_ctx *patch_ctx; /* for ch_storage_write_at() */
+
+    uint64_t nbytes_in;
+    uint64_t nbytes_out;
+    struct ch_storage_stats stats; /* final ch_storage_stats() */
 };
 
 static inline struct raw_ch_data* raw_ch_data(struct ch_storage *chns)
@@ -41,16 +62,35 @@ static int raw_ch_datasync(struct ch_storage *chns);
 static int raw_ch_write(struct ch_storage *chns,
                         const struct raw_pkt_bsmp*,
                         size_t);
+static int raw_ch_write_at(struct ch_storage *chns,
+                           const struct raw_pkt_bsmp*,
+                           size_t, size_t);
+static int raw_ch_write_gaps(struct ch_storage *chns,
+                             const struct ch_gap*,
+                             size_t);
 static void raw_ch_free(struct ch_storage *chns);
+static int raw_ch_stats(struct ch_storage *chns,
+                        struct ch_storage_stats *stats);
 
 static const struct ch_storage_ops raw_ch_storage_ops = {
     .ch_open = raw_ch_open,
     .ch_close = raw_ch_close,
     .ch_datasync = raw_ch_datasync,
     .ch_write = raw_ch_write,
+    .ch_write_at = raw_ch_write_at,
+    .ch_write_gaps = raw_ch_write_gaps,
     .ch_free = raw_ch_free,
+    .ch_stats = raw_ch_stats,
 };
 
+void raw_ch_opts_init(struct raw_ch_opts *opts)
+{
+    opts->compress = COMPRESS_NONE;
+    opts->compress_level = 0;
+    opts->compress_threads = RAW_CH_COMPRESS_THREADS;
+    opts->frame_nsamps = RAW_CH_FRAME_NSAMPS;
+}
+
 struct ch_storage *raw_ch_storage_alloc(const char *out_file_path, mode_t mode)
 {
     struct ch_storage *storage = malloc(sizeof(struct ch_storage));
@@ -62,12 +102,40 @@ struct ch_storage *raw_ch_storage_alloc(const char *out_file_path, mode_t mode)
     }
     data->fd = -1;
     data->mode = mode;
+    raw_ch_opts_init(&data->opts);
+    data->pool = NULL;
+    data->frm_off = 0;
+    data->frm_fill = 0;
+    data->patch_ctx = NULL;
+    data->nbytes_in = 0;
+    data->nbytes_out = 0;
+    memset(&data->stats, 0, sizeof(data->stats));
+    memset(&data->meta, 0, sizeof(data->meta));
     storage->ch_path = out_file_path;
     storage->ops = &raw_ch_storage_ops;
     storage->priv = data;
+    storage->ch_flags = 0;
     return storage;
 }
 
+int raw_ch_storage_set_opts(struct ch_storage *chns,
+                            const struct raw_ch_opts *opts)
+{
+    /* Frames' lengths must fit in a uint32_t, compressed or not. */
+    if (opts->compress < COMPRESS_NONE ||
+        opts->compress >= COMPRESS_NCODECS ||
+        opts->compress_level < 0 ||
+        opts->compress_threads > COMPRESS_POOL_MAX_THREADS ||
+        !opts->frame_nsamps ||
+        (opts->frame_nsamps >
+         UINT32_MAX / 2 / sizeof(struct raw_pkt_bsmp))) {
+        errno = EINVAL;
+        return -1;
+    }
+    raw_ch_data(chns)->opts = *opts;
+    return 0;
+}
+
 static void raw_ch_free(struct ch_storage *chns)
 {
     free(raw_ch_data(chns));
@@ -77,26 +145,361 @@ static void raw_ch_free(struct ch_storage *chns)
 static int raw_ch_open(struct ch_storage *chns, unsigned flags)
 {
     struct raw_ch_data *data = chns->priv;
+    const struct raw_ch_opts *opts = &data->opts;
+    uint8_t hdr[RAW_FILE_HDR_SIZE];
+
+    /* Get the compression pool first, so the file isn't created if
+     * we can't have one. */
+    if (opts->compress) {
+        data->pool = compress_pool_alloc(opts->compress,
+                                         opts->compress_level,
+                                         sizeof(struct raw_pkt_bsmp),
+                                         (opts->frame_nsamps *
+                                          sizeof(struct raw_pkt_bsmp)),
+                                         opts->compress_threads);
+        if (!data->pool) {
+            return -1;
+        }
+    }
+    raw_file_meta_init(&data->meta,
+                       ((opts->compress ? RAW_FILE_F_FRAMED : 0) |
+                        (chns->ch_flags & CH_STORAGE_WIRE_ORDER ?
+                         RAW_FILE_F_SAMPS_BE : 0)),
+                       opts->compress);
+    raw_file_meta_header(&data->meta, hdr);
     data->fd = open(chns->ch_path, flags, data->mode);
+    if (data->fd == -1) {
+        goto fail;
+    }
+    if (write(data->fd, hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+        goto fail;
+    }
     return data->fd;
+
+ fail:
+    if (data->fd != -1) {
+        close(data->fd);
+        data->fd = -1;
+    }
+    compress_pool_free(data->pool);
+    data->pool = NULL;
+    return -1;
+}
+
+/*
+ * Frames
+ */
+
+/* Write a frame header, then len bytes of buf. */
+static int raw_write_frame(struct raw_ch_data *data, int codec,
+                           uint64_t offset, size_t nsamps,
+                           const void *buf, size_t len)
+{
+    struct raw_ch_frame frm = {
+        .frm_codec = (uint32_t)codec,
+        .frm_offset = offset,
+        .frm_nsamps = (uint32_t)nsamps,
+        .frm_len = (uint32_t)len,
+    };
+    memcpy(frm.frm_magic, RAW_CH_FRAME_MAGIC, sizeof(frm.frm_magic));
+    struct iovec iov[2] = {
+        { .iov_base = &frm, .iov_len = sizeof(frm) },
+        { .iov_base = (void*)buf, .iov_len = len },
+    };
+    ssize_t status = writev(data->fd, iov, 2);
+    if (status != (ssize_t)(sizeof(frm) + len)) {
+        return -1;
+    }
+    data->nbytes_out += (uint64_t)status;
+    return 0;
+}
+
+/* Write out the frames the compression pool is done with, in order,
+ * waiting for the next nwait of them (SIZE_MAX for all) if they
+ * aren't done yet. */
+static int raw_reap_frames(struct raw_ch_data *data, size_t nwait)
+{
+    struct compress_job *job;
+    while ((job = compress_pool_reap(data->pool, nwait > 0))) {
+        int ret = raw_write_frame(data,
+                                  (job->compressed ? data->opts.compress :
+                                   COMPRESS_NONE),
+                                  job->tag,
+                                  job->in_len / sizeof(struct raw_pkt_bsmp),
+                                  job->out, job->out_len);
+        compress_pool_release(data->pool, job);
+        if (ret < 0) {
+            return -1;
+        }
+        if (nwait && nwait != SIZE_MAX) {
+            nwait--;
+        }
+    }
+    return 0;
+}
+
+/* The job board samples are being gathered into. */
+static struct compress_job* raw_frame_job(struct raw_ch_data *data)
+{
+    struct compress_job *job;
+    while (!(job = compress_pool_job(data->pool))) {
+        if (raw_reap_frames(data, 1) < 0) {
+            return NULL;
+        }
+    }
+    return job;
+}
+
+/* Hand the board samples gathered so far to the pool, if there are
+ * any; the next ones start a new frame. */
+static int raw_submit_frame(struct raw_ch_data *data)
+{
+    if (!data->frm_fill) {
+        return 0;
+    }
+    struct compress_job *job = compress_pool_job(data->pool);
+    job->in_len = data->frm_fill * sizeof(struct raw_pkt_bsmp);
+    job->tag = data->frm_off;
+    compress_pool_submit(data->pool, job);
+    data->frm_off += data->frm_fill;
+    data->frm_fill = 0;
+    return raw_reap_frames(data, 0);
+}
+
+/* Write out everything, including a partly-filled frame. */
+static int raw_flush_frames(struct raw_ch_data *data)
+{
+    if (!data->pool) {
+        return 0;
+    }
+    if (raw_submit_frame(data) < 0) {
+        return -1;
+    }
+    return raw_reap_frames(data, SIZE_MAX);
+}
+
+static int raw_append_frames(struct raw_ch_data *data,
+                             const struct raw_pkt_bsmp *bsamps, size_t n)
+{
+    const size_t frame_nsamps = data->opts.frame_nsamps;
+    while (n) {
+        struct compress_job *job = raw_frame_job(data);
+        if (!job) {
+            return -1;
+        }
+        size_t k = frame_nsamps - data->frm_fill;
+        if (k > n) {
+            k = n;
+        }
+        memcpy((struct raw_pkt_bsmp*)job->in + data->frm_fill, bsamps,
+               k * sizeof(*bsamps));
+        data->frm_fill += k;
+        bsamps += k;
+        n -= k;
+        if (data->frm_fill == frame_nsamps && raw_submit_frame(data) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Rewrite board samples that have already gone to the pool, by
+ * appending frames with just them in them. This is rare (it's for
+ * filling in gaps), so it's done right here, after whatever's in the
+ * pool is written. */
+static int raw_patch_frames(struct raw_ch_data *data,
+                            const struct raw_pkt_bsmp *bsamps, size_t n,
+                            uint64_t offset)
+{
+    const size_t frame_nsamps = data->opts.frame_nsamps;
+    const int codec = data->opts.compress;
+    int ret = -1;
+    void *zbuf = NULL;
+    if (raw_reap_frames(data, SIZE_MAX) < 0) {
+        return -1;
+    }
+    if (!data->patch_ctx) {
+        data->patch_ctx = compress_ctx_alloc(codec,
+                                             data->opts.compress_level,
+                                             sizeof(*bsamps));
+        if (!data->patch_ctx) {
+            return -1;
+        }
+    }
+    size_t zbuf_size = compress_bound(codec, frame_nsamps * sizeof(*bsamps));
+    zbuf = malloc(zbuf_size);
+    if (!zbuf) {
+        goto out;
+    }
+    while (n) {
+        size_t k = n < frame_nsamps ? n : frame_nsamps;
+        size_t len = k * sizeof(*bsamps);
+        size_t zlen = compress_encode(data->patch_ctx, zbuf, zbuf_size,
+                                      bsamps, len);
+        if ((zlen ?
+             raw_write_frame(data, codec, offset, k, zbuf, zlen) :
+             raw_write_frame(data, COMPRESS_NONE, offset, k,
+                             bsamps, len)) < 0) {
+            goto out;
+        }
+        bsamps += k;
+        n -= k;
+        offset += k;
+    }
+    ret = 0;
+ out:
+    free(zbuf);
+    return ret;
+}
+
+static int raw_write_at_frames(struct raw_ch_data *data,
+                               const struct raw_pkt_bsmp *bsamps,
+                               size_t n, uint64_t offset)
+{
+    if (offset + n > data->frm_off + data->frm_fill) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Anything in the frame that's still being filled gets patched
+     * there. */
+    if (offset + n > data->frm_off) {
+        size_t first = offset < data->frm_off ? data->frm_off - offset : 0;
+        struct compress_job *job = compress_pool_job(data->pool);
+        memcpy(((struct raw_pkt_bsmp*)job->in +
+                (offset + first - data->frm_off)),
+               bsamps + first, (n - first) * sizeof(*bsamps));
+        n = first;
+    }
+    return n ? raw_patch_frames(data, bsamps, n, offset) : 0;
+}
+
+/*
+ * ch_storage ops
+ */
+
+static void raw_get_stats(struct raw_ch_data *data,
+                          struct ch_storage_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->nbytes_in = data->nbytes_in;
+    stats->nbytes_out = data->pool ? data->nbytes_out : data->nbytes_in;
+    if (data->pool) {
+        stats->nthreads = compress_pool_nthreads(data->pool);
+        for (size_t i = 0; i < stats->nthreads; i++) {
+            struct compress_thread_stats ts;
+            compress_pool_thread_stats(data->pool, i, &ts);
+            stats->threads[i].nbytes_in = ts.nbytes_in;
+            stats->threads[i].busy_ns = ts.busy_ns;
+        }
+    }
+}
+
+static int raw_ch_stats(struct ch_storage *chns,
+                        struct ch_storage_stats *stats)
+{
+    struct raw_ch_data *data = raw_ch_data(chns);
+    if (data->fd >= 0) {
+        raw_get_stats(data, stats);
+    } else {
+        *stats = data->stats;
+    }
+    return 0;
+}
+
+/* Write the gap table, index and footer after the board samples,
+ * then the header's final version. */
+static int raw_write_tail(struct raw_ch_data *data)
+{
+    uint8_t hdr[RAW_FILE_HDR_SIZE];
+    struct iovec iov[3];
+    off_t off = lseek(data->fd, 0, SEEK_CUR);
+    if (off == -1) {
+        return -1;
+    }
+    size_t len = raw_file_meta_tail(&data->meta, (uint64_t)off, iov);
+    if (writev(data->fd, iov, 3) != (ssize_t)len) {
+        return -1;
+    }
+    raw_file_meta_header(&data->meta, hdr);
+    return pwrite(data->fd, hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) ?
+        0 : -1;
 }
 
 static int raw_ch_close(struct ch_storage *chns)
 {
-    return close(raw_ch_data(chns)->fd);
+    struct raw_ch_data *data = raw_ch_data(chns);
+    int ret = raw_flush_frames(data);
+    if (ret == 0) {
+        ret = raw_write_tail(data);
+    }
+    raw_file_meta_free(&data->meta);
+    raw_get_stats(data, &data->stats);
+    compress_pool_free(data->pool);
+    compress_ctx_free(data->patch_ctx);
+    data->pool = NULL;
+    data->patch_ctx = NULL;
+    if (close(data->fd) == -1) {
+        ret = -1;
+    }
+    data->fd = -1;
+    return ret;
 }
 
 static int raw_ch_datasync(struct ch_storage *chns)
 {
-    return fdatasync(raw_ch_data(chns)->fd);
+    struct raw_ch_data *data = raw_ch_data(chns);
+    if (raw_flush_frames(data) < 0) {
+        return -1;
+    }
+    return fdatasync(data->fd);
 }
 
 static int raw_ch_write(struct ch_storage *chns,
                         const struct raw_pkt_bsmp *bsamps,
                         size_t n)
 {
-    ssize_t status = write(raw_ch_data(chns)->fd, bsamps, n * sizeof(*bsamps));
+    struct raw_ch_data *data = raw_ch_data(chns);
+    data->nbytes_in += n * sizeof(*bsamps);
+    if (raw_file_meta_add(&data->meta, bsamps, n) == -1) {
+        return -1;
+    }
+    if (data->pool) {
+        return raw_append_frames(data, bsamps, n);
+    }
+    ssize_t status = write(data->fd, bsamps, n * sizeof(*bsamps));
     return (status < 0 ? (int)status :
             status == (ssize_t)(n * sizeof(*bsamps)) ? 0 :
             -1);
 }
+
+static int raw_ch_write_at(struct ch_storage *chns,
+                           const struct raw_pkt_bsmp *bsamps,
+                           size_t n, size_t offset)
+{
+    struct raw_ch_data *data = raw_ch_data(chns);
+    if (offset + n > data->meta.nsamps) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (raw_file_meta_rewrite(&data->meta, bsamps, n, offset) == -1) {
+        return -1;
+    }
+    if (data->pool) {
+        return raw_write_at_frames(data, bsamps, n, offset);
+    }
+    size_t len = n * sizeof(*bsamps);
+    off_t pos = (off_t)(RAW_FILE_HDR_SIZE + offset * sizeof(*bsamps));
+    ssize_t status = pwrite(data->fd, bsamps, len, pos);
+    return (status < 0 ? (int)status :
+            status == (ssize_t)len ? 0 :
+            -1);
+}
+
+static int raw_ch_write_gaps(struct ch_storage *chns,
+                             const struct ch_gap *gaps,
+                             size_t ngaps)
+{
+    /* It goes out when the file is closed. */
+    return raw_file_meta_gaps(&raw_ch_data(chns)->meta, gaps, ngaps);
+}
@@ -17,20 +17,74 @@
  * @file raw_ch_storage.h
  * @brief Raw (i.e. write()-based) channel storage backend
  *
- * This is just for benchmarking.
+ * Files are in the format described in raw_file.h: a header, the
+ * struct raw_pkt_bsmp packets that were written, back to back, then
+ * the gap table, an index and a footer. Use raw_file_open() to read
+ * them. Each packet's header also records the order of its samples:
+ * if RAW_PFLAG_B_SAMPS_BE is set in ph.p_flags, they're big-endian
+ * (see CH_STORAGE_WIRE_ORDER).
  *
- * @see ch_storage.h
+ * In compressed files (see raw_ch_storage_set_opts()), the packets
+ * are a series of frames instead (RAW_FILE_F_FRAMED), each a struct
+ * raw_ch_frame followed by frm_len bytes: frm_nsamps board samples,
+ * compressed with frm_codec (see compress.h; the record size is
+ * sizeof(struct raw_pkt_bsmp)). Each frame holds up to frame_nsamps
+ * board samples, starting at board sample frm_offset. Frames come in
+ * order, except that ch_storage_write_at() appends frames holding
+ * what it rewrote; where frames overlap, the later one wins. The
+ * frames end where the gap table starts.
+ *
+ * @see ch_storage.h, raw_file.h
  */
 
 #ifndef _LIB_RAW_CHANNEL_STORAGE_H_
 #define _LIB_RAW_CHANNEL_STORAGE_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 struct ch_storage;
 
+#define RAW_CH_FRAME_MAGIC "LSDF"
+
+/* Header of each frame in a compressed raw file, in host byte
+ * order. */
+struct raw_ch_frame {
+    char frm_magic[4];          /* RAW_CH_FRAME_MAGIC, no NUL */
+    uint32_t frm_codec;         /* COMPRESS_*; COMPRESS_NONE if the
+                                 * board samples are stored as-is */
+    uint64_t frm_offset;        /* board sample index in the store
+                                 * of the first one, from 0 */
+    uint32_t frm_nsamps;        /* board samples in the frame */
+    uint32_t frm_len;           /* bytes of data after this header */
+};
+
+/* Defaults for struct raw_ch_opts: frames as big as the HDF5
+ * backend's default chunks, and as many threads. */
+#define RAW_CH_FRAME_NSAMPS 1024
+#define RAW_CH_COMPRESS_THREADS 2
+
+/* Tunables; see raw_ch_opts_init() for defaults. */
+struct raw_ch_opts {
+    int compress;               /* COMPRESS_* codec, or COMPRESS_NONE
+                                 * to write board samples unframed */
+    int compress_level;         /* see compress_ctx_alloc() */
+    size_t compress_threads;    /* compression threads; 0 compresses
+                                 * on the storage thread */
+    size_t frame_nsamps;        /* board samples per frame */
+};
+
+/* Fill in the defaults. */
+void raw_ch_opts_init(struct raw_ch_opts *opts);
+
 /* Create new channel storage object; returns NULL on error. */
 struct ch_storage *raw_ch_storage_alloc(const char *out_file_path,
                                         mode_t mode);
 
+/* Change the tunables from their defaults. Call this before opening
+ * chns. Returns -1 (with errno EINVAL) if they don't make sense. */
+int raw_ch_storage_set_opts(struct ch_storage *chns,
+                            const struct raw_ch_opts *opts);
+
 #endif
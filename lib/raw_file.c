@@ -0,0 +1,435 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "raw_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ch_storage.h"
+
+/*
+ * Writing
+ */
+
+void raw_file_meta_init(struct raw_file_meta *meta, uint32_t flags,
+                        int codec)
+{
+    struct raw_file_header *hdr = &meta->hdr;
+    memset(meta, 0, sizeof(*meta));
+    strncpy(hdr->rf_magic, RAW_FILE_MAGIC, sizeof(hdr->rf_magic));
+    hdr->rf_bom = RAW_FILE_BOM;
+    hdr->rf_version = RAW_FILE_VERSION;
+    hdr->rf_hdr_size = RAW_FILE_HDR_SIZE;
+    hdr->rf_flags = flags;
+    hdr->rf_rec_size = sizeof(struct raw_pkt_bsmp);
+    hdr->rf_sidx_off = offsetof(struct raw_pkt_bsmp, b_sidx);
+    hdr->rf_samps_off = offsetof(struct raw_pkt_bsmp, b_samps);
+    hdr->rf_nchips = RAW_BSMP_NCHIPS;
+    hdr->rf_nchans = RAW_BSMP_NCHANS;
+    hdr->rf_samp_size = sizeof(raw_samp_t);
+    hdr->rf_codec = (flags & RAW_FILE_F_FRAMED) ? (uint16_t)codec : 0;
+}
+
+void raw_file_meta_free(struct raw_file_meta *meta)
+{
+    free(meta->index);
+    free(meta->gaps);
+    meta->index = NULL;
+    meta->gaps = NULL;
+}
+
+static int raw_file_meta_index(struct raw_file_meta *meta, uint32_t sidx,
+                               uint64_t rec)
+{
+    if (meta->nindex == meta->index_cap) {
+        size_t cap = meta->index_cap ? 2 * meta->index_cap : 64;
+        struct raw_file_index *index = realloc(meta->index,
+                                               cap * sizeof(*index));
+        if (!index) {
+            return -1;
+        }
+        meta->index = index;
+        meta->index_cap = cap;
+    }
+    struct raw_file_index *ent = &meta->index[meta->nindex++];
+    ent->ri_sidx = sidx;
+    ent->ri_pad = 0;
+    ent->ri_rec = rec;
+    return 0;
+}
+
+static void raw_file_meta_first(struct raw_file_meta *meta,
+                                const struct raw_pkt_bsmp *bsamp)
+{
+    meta->hdr.rf_cookie = raw_exp_cookie(bsamp);
+    meta->hdr.rf_board_id = bsamp->b_id;
+    meta->hdr.rf_start_sidx = bsamp->b_sidx;
+}
+
+/* Add index entries for n records, starting at record rec. If the
+ * first one's b_sidx isn't *next_sidx, it doesn't follow on from the
+ * record before; *next_sidx is left as the b_sidx that would follow
+ * on from the last. Returns -1 if out of memory. */
+static int raw_file_meta_scan(struct raw_file_meta *meta,
+                              const struct raw_pkt_bsmp *bsamps, size_t n,
+                              uint64_t rec, uint32_t *next_sidx)
+{
+    for (size_t i = 0; i < n; i++, rec++) {
+        uint32_t sidx = bsamps[i].b_sidx;
+        if ((rec % RAW_FILE_INDEX_STRIDE == 0 || sidx != *next_sidx) &&
+            raw_file_meta_index(meta, sidx, rec) == -1) {
+            return -1;
+        }
+        *next_sidx = sidx + 1;
+    }
+    return 0;
+}
+
+int raw_file_meta_add(struct raw_file_meta *meta,
+                      const struct raw_pkt_bsmp *bsamps, size_t n)
+{
+    if (n && !meta->nsamps) {
+        raw_file_meta_first(meta, bsamps);
+    }
+    if (!(meta->hdr.rf_flags & RAW_FILE_F_FRAMED) &&
+        raw_file_meta_scan(meta, bsamps, n, meta->nsamps,
+                           &meta->next_sidx) == -1) {
+        return -1;
+    }
+    meta->nsamps += n;
+    return 0;
+}
+
+int raw_file_meta_rewrite(struct raw_file_meta *meta,
+                          const struct raw_pkt_bsmp *bsamps, size_t n,
+                          uint64_t offset)
+{
+    if (!n) {
+        return 0;
+    }
+    if (offset == 0) {
+        raw_file_meta_first(meta, bsamps);
+    }
+    if (meta->hdr.rf_flags & RAW_FILE_F_FRAMED) {
+        return 0;
+    }
+
+    /* Entries from before offset stay; ours go after them, then one
+     * for the record after ours (with the b_sidx the old entries say
+     * it has), then the old entries after that. */
+    uint64_t end = offset + n;
+    size_t first = 0, last;
+    while (first < meta->nindex && meta->index[first].ri_rec < offset) {
+        first++;
+    }
+    for (last = first;
+         last < meta->nindex && meta->index[last].ri_rec <= end;
+         last++) {
+        ;
+    }
+    uint32_t after_sidx = 0;
+    if (last > 0 && end < meta->nsamps) {
+        const struct raw_file_index *ent = &meta->index[last - 1];
+        after_sidx = ent->ri_sidx + (uint32_t)(end - ent->ri_rec);
+    }
+    size_t nafter = meta->nindex - last;
+    struct raw_file_index *after = NULL;
+    if (nafter) {
+        after = malloc(nafter * sizeof(*after));
+        if (!after) {
+            return -1;
+        }
+        memcpy(after, meta->index + last, nafter * sizeof(*after));
+    }
+
+    int ret = -1;
+    uint32_t next_sidx = bsamps->b_sidx + 1; /* so ours start with one */
+    meta->nindex = first;
+    if (raw_file_meta_scan(meta, bsamps, n, offset, &next_sidx) == -1) {
+        goto out;
+    }
+    if (end < meta->nsamps) {
+        if (raw_file_meta_index(meta, after_sidx, end) == -1) {
+            goto out;
+        }
+        for (size_t i = 0; i < nafter; i++) {
+            if (raw_file_meta_index(meta, after[i].ri_sidx,
+                                    after[i].ri_rec) == -1) {
+                goto out;
+            }
+        }
+    } else {
+        meta->next_sidx = next_sidx;
+    }
+    ret = 0;
+ out:
+    free(after);
+    return ret;
+}
+
+int raw_file_meta_gaps(struct raw_file_meta *meta,
+                       const struct ch_gap *gaps, size_t ngaps)
+{
+    struct ch_gap *copy = NULL;
+    if (ngaps) {
+        copy = malloc(ngaps * sizeof(*gaps));
+        if (!copy) {
+            return -1;
+        }
+        memcpy(copy, gaps, ngaps * sizeof(*gaps));
+    }
+    free(meta->gaps);
+    meta->gaps = copy;
+    meta->ngaps = ngaps;
+    return 0;
+}
+
+void raw_file_meta_header(const struct raw_file_meta *meta, void *buf)
+{
+    memset(buf, 0, RAW_FILE_HDR_SIZE);
+    memcpy(buf, &meta->hdr, sizeof(meta->hdr));
+}
+
+size_t raw_file_meta_tail(struct raw_file_meta *meta, uint64_t off,
+                          struct iovec iov[3])
+{
+    struct raw_file_footer *footer = &meta->footer;
+    memset(footer, 0, sizeof(*footer));
+    footer->rf_nsamps = meta->nsamps;
+    footer->rf_gaps_off = off;
+    footer->rf_ngaps = meta->ngaps;
+    footer->rf_index_off = off + meta->ngaps * sizeof(*meta->gaps);
+    footer->rf_nindex = meta->nindex;
+    strncpy(footer->rf_magic, RAW_FILE_FOOTER_MAGIC,
+            sizeof(footer->rf_magic));
+    iov[0].iov_base = meta->gaps;
+    iov[0].iov_len = meta->ngaps * sizeof(*meta->gaps);
+    iov[1].iov_base = meta->index;
+    iov[1].iov_len = meta->nindex * sizeof(*meta->index);
+    iov[2].iov_base = footer;
+    iov[2].iov_len = sizeof(*footer);
+    return iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+}
+
+/*
+ * Reading
+ */
+
+/* Is [off, off + n * size) within the first len bytes? */
+static int raw_file_fits(uint64_t off, uint64_t n, size_t size,
+                         uint64_t len)
+{
+    return off <= len && n <= (len - off) / size;
+}
+
+/* Check the header, and find everything else; returns an errno
+ * value, or 0 if it's all there. */
+static int raw_file_parse(struct raw_file *rf)
+{
+    const uint8_t *base = rf->map;
+    const uint64_t len = rf->map_len;
+    const struct raw_file_header *hdr = rf->map;
+    if (len < sizeof(*hdr) ||
+        strncmp(hdr->rf_magic, RAW_FILE_MAGIC, sizeof(hdr->rf_magic))) {
+        return EINVAL;
+    }
+    if (hdr->rf_bom != RAW_FILE_BOM) {
+        return hdr->rf_bom == __builtin_bswap32(RAW_FILE_BOM) ?
+            ENOTSUP : EINVAL;
+    }
+    if (hdr->rf_version != RAW_FILE_VERSION ||
+        (hdr->rf_flags & RAW_FILE_F_FRAMED) ||
+        hdr->rf_rec_size != sizeof(struct raw_pkt_bsmp) ||
+        hdr->rf_sidx_off != offsetof(struct raw_pkt_bsmp, b_sidx) ||
+        hdr->rf_samps_off != offsetof(struct raw_pkt_bsmp, b_samps) ||
+        hdr->rf_nchips * hdr->rf_nchans != RAW_BSMP_NSAMP ||
+        hdr->rf_samp_size != sizeof(raw_samp_t)) {
+        return ENOTSUP;
+    }
+    if (hdr->rf_hdr_size < sizeof(*hdr) || hdr->rf_hdr_size > len ||
+        hdr->rf_hdr_size % sizeof(uint64_t)) {
+        return EINVAL;
+    }
+    rf->hdr = hdr;
+    rf->recs = base + hdr->rf_hdr_size;
+
+    /* Everything up to the footer is a multiple of 8 bytes long. */
+    const struct raw_file_footer *footer =
+        (const struct raw_file_footer*)(base + len - sizeof(*footer));
+    if (len - hdr->rf_hdr_size < sizeof(*footer) ||
+        len % sizeof(uint64_t) ||
+        strncmp(footer->rf_magic, RAW_FILE_FOOTER_MAGIC,
+                sizeof(footer->rf_magic))) {
+        /* Never closed; take what's there. */
+        rf->nsamps = (len - hdr->rf_hdr_size) / hdr->rf_rec_size;
+        return 0;
+    }
+    uint64_t end = len - sizeof(*footer);
+    if (!raw_file_fits(hdr->rf_hdr_size, footer->rf_nsamps,
+                       hdr->rf_rec_size, footer->rf_gaps_off) ||
+        !raw_file_fits(footer->rf_gaps_off, footer->rf_ngaps,
+                       sizeof(struct ch_gap), footer->rf_index_off) ||
+        !raw_file_fits(footer->rf_index_off, footer->rf_nindex,
+                       sizeof(struct raw_file_index), end) ||
+        footer->rf_gaps_off % sizeof(uint64_t) ||
+        footer->rf_index_off % sizeof(uint64_t)) {
+        return EINVAL;
+    }
+    rf->footer = footer;
+    rf->nsamps = footer->rf_nsamps;
+    rf->gaps = (const struct ch_gap*)(base + footer->rf_gaps_off);
+    rf->ngaps = footer->rf_ngaps;
+    rf->index = (const struct raw_file_index*)(base +
+                                               footer->rf_index_off);
+    rf->nindex = footer->rf_nindex;
+    return 0;
+}
+
+/* See if b_sidx goes up by one per record all the way through. With
+ * an index, it does if every entry agrees; without one, it does if
+ * the last record's is where the first one's says it should be,
+ * since b_sidx only goes up. */
+static void raw_file_check_seq(struct raw_file *rf)
+{
+    if (!rf->nsamps) {
+        return;
+    }
+    const uint32_t first = raw_file_bsmp(rf, 0)->b_sidx;
+    if (rf->nindex) {
+        for (size_t i = 0; i < rf->nindex; i++) {
+            const struct raw_file_index *ent = &rf->index[i];
+            if (ent->ri_sidx != first + (uint32_t)ent->ri_rec) {
+                return;
+            }
+        }
+    } else if (raw_file_bsmp(rf, rf->nsamps - 1)->b_sidx - first !=
+               (uint32_t)(rf->nsamps - 1)) {
+        return;
+    }
+    rf->seq = 1;
+    rf->first_sidx = first;
+}
+
+struct raw_file* raw_file_open(const char *path)
+{
+    struct raw_file *rf = calloc(1, sizeof(*rf));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    int err = 0;
+    if (!rf || fd == -1 || fstat(fd, &st) == -1) {
+        goto fail;
+    }
+    if ((uint64_t)st.st_size < sizeof(struct raw_file_header)) {
+        err = EINVAL;
+        goto fail;
+    }
+    rf->map_len = (size_t)st.st_size;
+    rf->map = mmap(NULL, rf->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (rf->map == MAP_FAILED) {
+        rf->map = NULL;
+        goto fail;
+    }
+    close(fd);
+    fd = -1;
+    err = raw_file_parse(rf);
+    if (err) {
+        goto fail;
+    }
+    raw_file_check_seq(rf);
+    return rf;
+
+ fail:
+    if (!err) {
+        err = errno;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    raw_file_close(rf);
+    errno = err;
+    return NULL;
+}
+
+void raw_file_close(struct raw_file *rf)
+{
+    if (!rf) {
+        return;
+    }
+    if (rf->map) {
+        munmap(rf->map, rf->map_len);
+    }
+    free(rf);
+}
+
+/* Search records [lo, hi) for sidx, by bisection. */
+static uint64_t raw_file_bisect(const struct raw_file *rf, uint32_t sidx,
+                                uint64_t lo, uint64_t hi)
+{
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (raw_file_bsmp(rf, mid)->b_sidx < sidx) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+const struct raw_pkt_bsmp* raw_file_find(const struct raw_file *rf,
+                                         uint32_t sidx, uint64_t *i)
+{
+    uint64_t rec;
+    if (rf->seq) {
+        rec = (uint32_t)(sidx - rf->first_sidx);
+    } else if (rf->nindex) {
+        /* Last entry at or before sidx; the records from it to the
+         * next one count up from its b_sidx. */
+        size_t lo = 0, hi = rf->nindex;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (rf->index[mid].ri_sidx <= sidx) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (!lo) {
+            return NULL;
+        }
+        const struct raw_file_index *ent = &rf->index[lo - 1];
+        uint64_t end = lo < rf->nindex ? rf->index[lo].ri_rec : rf->nsamps;
+        rec = ent->ri_rec + (sidx - ent->ri_sidx);
+        if (rec >= end) {
+            return NULL;
+        }
+    } else {
+        rec = raw_file_bisect(rf, sidx, 0, rf->nsamps);
+    }
+    const struct raw_pkt_bsmp *bs = raw_file_bsmp(rf, rec);
+    if (!bs || bs->b_sidx != sidx) {
+        return NULL;
+    }
+    if (i) {
+        *i = rec;
+    }
+    return bs;
+}
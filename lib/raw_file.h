@@ -0,0 +1,221 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file raw_file.h
+ * @brief Raw recording file format, and a reader for it
+ *
+ * The raw and direct storage backends (raw_ch_storage.h,
+ * direct_ch_storage.h) write files in this format:
+ *
+ * 1. A struct raw_file_header, zero-padded to rf_hdr_size bytes
+ *    (RAW_FILE_HDR_SIZE, so what follows is page-aligned).
+ *
+ * 2. The board samples, as records rf_rec_size bytes apart: record i
+ *    starts at byte rf_hdr_size + i * rf_rec_size. Each one is a
+ *    struct raw_pkt_bsmp image, with the header's layout fields
+ *    saying where its b_sidx and b_samps are, for readers that don't
+ *    have that struct. If RAW_FILE_F_FRAMED is set, they're
+ *    compressed frames instead (see raw_ch_storage.h), and don't have
+ *    a fixed stride.
+ *
+ * 3. The gap table (see ch_storage_write_gaps()): rf_ngaps struct
+ *    ch_gap, starting at rf_gaps_off.
+ *
+ * 4. A sparse index: rf_nindex struct raw_file_index, starting at
+ *    rf_index_off, in record order. There's an entry for record 0,
+ *    for every RAW_FILE_INDEX_STRIDE-th record after that, and for
+ *    every record whose b_sidx doesn't follow the last one's. Between
+ *    entries, b_sidx goes up by one per record. Framed files don't
+ *    have one.
+ *
+ * 5. A struct raw_file_footer, the last thing in the file.
+ *
+ * Everything is in the byte order rf_bom is in, except that samples
+ * are big-endian if RAW_FILE_F_SAMPS_BE is set. If the file wasn't
+ * closed, it has no footer; the records are still there, and can be
+ * counted from the file size.
+ */
+
+#ifndef _LIB_RAW_FILE_H_
+#define _LIB_RAW_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "raw_packets.h"
+
+struct ch_gap;
+
+#define RAW_FILE_MAGIC "LSDRAW"
+#define RAW_FILE_FOOTER_MAGIC "LSDRAWF"
+#define RAW_FILE_VERSION 1
+#define RAW_FILE_BOM 0x01020304
+#define RAW_FILE_HDR_SIZE 4096
+#define RAW_FILE_INDEX_STRIDE 1024
+
+/* rf_flags */
+#define RAW_FILE_F_SAMPS_BE 0x1 /* samples are big-endian */
+#define RAW_FILE_F_FRAMED 0x2   /* records are compressed frames */
+
+struct raw_file_header {
+    char rf_magic[8];           /* RAW_FILE_MAGIC, NUL-terminated */
+    uint32_t rf_bom;            /* RAW_FILE_BOM */
+    uint32_t rf_version;        /* RAW_FILE_VERSION */
+    uint32_t rf_hdr_size;       /* where records start */
+    uint32_t rf_flags;          /* RAW_FILE_F_* */
+
+    /* Records, and what's in them */
+    uint32_t rf_rec_size;       /* bytes from one to the next */
+    uint32_t rf_sidx_off;       /* where b_sidx is in one (uint32_t) */
+    uint32_t rf_samps_off;      /* where b_samps is */
+    uint16_t rf_nchips;         /* b_samps is rf_nchips chips' worth */
+    uint16_t rf_nchans;         /* of rf_nchans samples each, */
+    uint16_t rf_samp_size;      /* rf_samp_size bytes apiece */
+    uint16_t rf_codec;          /* framed: COMPRESS_* (compress.h) */
+
+    /* From the first record; filled in when the file is closed. */
+    uint64_t rf_cookie;         /* experiment cookie */
+    uint32_t rf_board_id;
+    uint32_t rf_start_sidx;     /* its b_sidx */
+};
+
+struct raw_file_index {
+    uint32_t ri_sidx;           /* this record's b_sidx */
+    uint32_t ri_pad;
+    uint64_t ri_rec;            /* record number */
+};
+
+struct raw_file_footer {
+    uint64_t rf_nsamps;         /* records */
+    uint64_t rf_gaps_off;
+    uint64_t rf_ngaps;
+    uint64_t rf_index_off;
+    uint64_t rf_nindex;
+    char rf_magic[8];           /* RAW_FILE_FOOTER_MAGIC */
+};
+
+/*
+ * Writing (for storage backends)
+ */
+
+/* What a backend keeps track of while it writes a file. */
+struct raw_file_meta {
+    struct raw_file_header hdr;
+    uint64_t nsamps;
+    struct raw_file_index *index;
+    size_t nindex;
+    size_t index_cap;
+    struct ch_gap *gaps;
+    size_t ngaps;
+
+    /* Private */
+    uint32_t next_sidx;
+    struct raw_file_footer footer;
+};
+
+/* Start a new file's metadata. flags are RAW_FILE_F_*; codec is
+ * ignored unless it's framed. */
+void raw_file_meta_init(struct raw_file_meta *meta, uint32_t flags,
+                        int codec);
+
+/* Free what raw_file_meta_init() and friends allocated. */
+void raw_file_meta_free(struct raw_file_meta *meta);
+
+/* Account for n more board samples; returns -1 if out of memory. */
+int raw_file_meta_add(struct raw_file_meta *meta,
+                      const struct raw_pkt_bsmp *bsamps, size_t n);
+
+/* Account for n board samples that replace the ones starting at
+ * board sample offset; returns -1 if out of memory. */
+int raw_file_meta_rewrite(struct raw_file_meta *meta,
+                          const struct raw_pkt_bsmp *bsamps, size_t n,
+                          uint64_t offset);
+
+/* Remember the gap table; returns -1 if out of memory. */
+int raw_file_meta_gaps(struct raw_file_meta *meta,
+                       const struct ch_gap *gaps, size_t ngaps);
+
+/* Fill in the RAW_FILE_HDR_SIZE bytes at buf with the header. */
+void raw_file_meta_header(const struct raw_file_meta *meta, void *buf);
+
+/* Get what goes after the records, at byte offset off: fills in
+ * iov[0..2] (gaps, index and footer), and returns their total
+ * length. meta must stay around until they're written. */
+size_t raw_file_meta_tail(struct raw_file_meta *meta, uint64_t off,
+                          struct iovec iov[3]);
+
+/*
+ * Reading
+ */
+
+struct raw_file {
+    const struct raw_file_header *hdr;
+    const struct raw_file_footer *footer; /* NULL if there isn't one */
+    uint64_t nsamps;
+    const struct raw_file_index *index;
+    size_t nindex;
+    const struct ch_gap *gaps;
+    size_t ngaps;
+
+    /* Private */
+    const uint8_t *recs;
+    void *map;
+    size_t map_len;
+    int seq;                    /* b_sidx goes up by one per record, */
+    uint32_t first_sidx;        /* from this */
+};
+
+/**
+ * Open and mmap() a raw file for reading.
+ *
+ * @return The file, or NULL on error. errno is EINVAL if it isn't a
+ *         raw file, or is corrupt; ENOTSUP if it's framed, or its
+ *         byte order or record layout isn't this machine's.
+ */
+struct raw_file* raw_file_open(const char *path);
+
+/** Unmap and free a file raw_file_open() returned. */
+void raw_file_close(struct raw_file *rf);
+
+/** Get board sample i (not its b_sidx) from a file, or NULL if
+ * there aren't that many. */
+static inline const struct raw_pkt_bsmp*
+raw_file_bsmp(const struct raw_file *rf, uint64_t i)
+{
+    if (i >= rf->nsamps) {
+        return NULL;
+    }
+    return (const struct raw_pkt_bsmp*)(rf->recs +
+                                        i * rf->hdr->rf_rec_size);
+}
+
+/**
+ * Find the board sample with a given b_sidx.
+ *
+ * If b_sidx goes up by one from each record to the next, this just
+ * works out which record it's in. Otherwise, it uses the index if
+ * there is one, and searches the records if not. Either way, it
+ * assumes b_sidx only goes up from one record to the next, as the
+ * daemon stores them.
+ *
+ * @param i If not NULL, where to store its record number.
+ * @return The board sample, or NULL if there isn't one.
+ */
+const struct raw_pkt_bsmp* raw_file_find(const struct raw_file *rf,
+                                         uint32_t sidx, uint64_t *i);
+
+#endif
@@ -18,10 +18,13 @@
 #include <errno.h>
 
 #include <arpa/inet.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include "bswap16.h"
 #include "logging.h"
 
 /*********************************************************************
@@ -112,8 +115,13 @@ size_t raw_pkt_size(const void *pkt)
 
 #define raw_ph_hton(ph) ((void)0)
 #define raw_ph_ntoh(ph) ((void)0)
-#define raw_samp_hton(samp_val) htons(samp_val)
-#define raw_samp_ntoh(samp_val) ntohs(samp_val)
+/* Samples are big-endian on the wire; swap whole arrays at once. */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define raw_samps_hton(samps, n) bswap16_buf((samps), (n))
+#else
+#define raw_samps_hton(samps, n) ((void)0)
+#endif
+#define raw_samps_ntoh(samps, n) raw_samps_hton(samps, n)
 #define raw_err_hton(pkt) ((void)0)
 #define raw_err_ntoh(pkt) ((void)0)
 #define raw_mtype_hton(mtype) (mtype)
@@ -142,8 +150,11 @@ static void raw_bsub_hton(struct raw_pkt_bsub *bsub)
     bsub->b_id = htonl(bsub->b_id);
     bsub->b_sidx = htonl(bsub->b_sidx);
     bsub->b_chip_live = htonl(bsub->b_chip_live);
-    for (size_t i = 0; i < RAW_BSUB_NSAMP; i++) {
-        bsub->b_samps[i] = raw_samp_hton(bsub->b_samps[i]);
+    if (bsub->ph.p_flags & RAW_PFLAG_B_SAMPS_BE) {
+        /* Samples never left network byte order. */
+        bsub->ph.p_flags &= ~RAW_PFLAG_B_SAMPS_BE;
+    } else {
+        raw_samps_hton(bsub->b_samps, RAW_BSUB_NSAMP);
     }
     bsub->b_gpio = htons(bsub->b_gpio);
 }
@@ -155,8 +166,11 @@ static void raw_bsmp_hton(struct raw_pkt_bsmp *bsmp)
     bsmp->b_id = htonl(bsmp->b_id);
     bsmp->b_sidx = htonl(bsmp->b_sidx);
     bsmp->b_chip_live = htonl(bsmp->b_chip_live);
-    for (size_t i = 0; i < RAW_BSMP_NSAMP; i++) {
-        bsmp->b_samps[i] = raw_samp_hton(bsmp->b_samps[i]);
+    if (bsmp->ph.p_flags & RAW_PFLAG_B_SAMPS_BE) {
+        /* Samples never left network byte order. */
+        bsmp->ph.p_flags &= ~RAW_PFLAG_B_SAMPS_BE;
+    } else {
+        raw_samps_hton(bsmp->b_samps, RAW_BSMP_NSAMP);
     }
 }
 
@@ -212,9 +226,7 @@ static int raw_bsub_ntoh(struct raw_pkt_bsub *bsub)
     bsub->b_id = ntohl(bsub->b_id);
     bsub->b_sidx = ntohl(bsub->b_sidx);
     bsub->b_chip_live = ntohl(bsub->b_chip_live);
-    for (size_t i = 0; i < RAW_BSUB_NSAMP; i++) {
-        bsub->b_samps[i] = raw_samp_ntoh(bsub->b_samps[i]);
-    }
+    raw_samps_ntoh(bsub->b_samps, RAW_BSUB_NSAMP);
     bsub->b_gpio = ntohs(bsub->b_gpio);
     return 0;
 }
@@ -226,9 +238,7 @@ static void raw_bsmp_ntoh(struct raw_pkt_bsmp *bsmp)
     bsmp->b_id = ntohl(bsmp->b_id);
     bsmp->b_sidx = ntohl(bsmp->b_sidx);
     bsmp->b_chip_live = ntohl(bsmp->b_chip_live);
-    for (size_t i = 0; i < RAW_BSMP_NSAMP; i++) {
-        bsmp->b_samps[i] = raw_samp_ntoh(bsmp->b_samps[i]);
-    }
+    raw_samps_ntoh(bsmp->b_samps, RAW_BSMP_NSAMP);
 }
 
 int raw_pkt_ntoh(void *pkt)
@@ -250,11 +260,90 @@ int raw_pkt_ntoh(void *pkt)
         raw_err_ntoh((struct raw_pkt_cmd*)pkt);
         return 0;
     case RAW_MTYPE_BSUB:
-        raw_bsub_hton((struct raw_pkt_bsub*)pkt);
+        return raw_bsub_ntoh((struct raw_pkt_bsub*)pkt);
+    case RAW_MTYPE_BSMP:
+        raw_bsmp_ntoh((struct raw_pkt_bsmp*)pkt);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static void raw_bsub_ntoh_hdr(struct raw_pkt_bsub *bsub)
+{
+    bsub->b_cookie_h = ntohl(bsub->b_cookie_h);
+    bsub->b_cookie_l = ntohl(bsub->b_cookie_l);
+    bsub->b_id = ntohl(bsub->b_id);
+    bsub->b_sidx = ntohl(bsub->b_sidx);
+    bsub->b_chip_live = ntohl(bsub->b_chip_live);
+    bsub->b_gpio = ntohs(bsub->b_gpio);
+    bsub->ph.p_flags |= RAW_PFLAG_B_SAMPS_BE;
+}
+
+static void raw_bsmp_ntoh_hdr(struct raw_pkt_bsmp *bsmp)
+{
+    bsmp->b_cookie_h = ntohl(bsmp->b_cookie_h);
+    bsmp->b_cookie_l = ntohl(bsmp->b_cookie_l);
+    bsmp->b_id = ntohl(bsmp->b_id);
+    bsmp->b_sidx = ntohl(bsmp->b_sidx);
+    bsmp->b_chip_live = ntohl(bsmp->b_chip_live);
+    bsmp->ph.p_flags |= RAW_PFLAG_B_SAMPS_BE;
+}
+
+int raw_pkt_ntoh_hdr(void *pkt)
+{
+    struct raw_pkt_header *ph = pkt;
+    raw_ph_ntoh(ph);
+    if ((ph->_p_magic != RAW_PKT_HEADER_MAGIC ||
+         ph->p_proto_vers > RAW_PKT_HEADER_PROTO_VERS)) {
+        return -1;
+    }
+    switch (raw_mtype(pkt)) {
+    case RAW_MTYPE_BSUB:
+        raw_bsub_ntoh_hdr((struct raw_pkt_bsub*)pkt);
         return 0;
     case RAW_MTYPE_BSMP:
-        raw_bsmp_hton((struct raw_pkt_bsmp*)pkt);
+        raw_bsmp_ntoh_hdr((struct raw_pkt_bsmp*)pkt);
         return 0;
+    default:
+        return raw_pkt_ntoh(pkt);
+    }
+}
+
+void raw_pkt_ntoh_samps(void *pkt)
+{
+    struct raw_pkt_header *ph = pkt;
+    if (!(ph->p_flags & RAW_PFLAG_B_SAMPS_BE)) {
+        return;
+    }
+    switch (raw_mtype(pkt)) {
+    case RAW_MTYPE_BSUB:
+        raw_samps_ntoh(((struct raw_pkt_bsub*)pkt)->b_samps, RAW_BSUB_NSAMP);
+        break;
+    case RAW_MTYPE_BSMP:
+        raw_samps_ntoh(((struct raw_pkt_bsmp*)pkt)->b_samps, RAW_BSMP_NSAMP);
+        break;
+    default:
+        return;
+    }
+    ph->p_flags &= ~RAW_PFLAG_B_SAMPS_BE;
+}
+
+int raw_pkt_check_wire(const void *pkt, size_t len)
+{
+    /* The header is all single bytes, so it reads the same either
+     * way; see raw_ph_ntoh(). */
+    const struct raw_pkt_header *ph = pkt;
+    if (len < sizeof(*ph) ||
+        ph->_p_magic != RAW_PKT_HEADER_MAGIC ||
+        ph->p_proto_vers > RAW_PKT_HEADER_PROTO_VERS) {
+        return -1;
+    }
+    switch (ph->p_mtype) {
+    case RAW_MTYPE_BSUB:
+        return len == sizeof(struct raw_pkt_bsub) ? RAW_MTYPE_BSUB : -1;
+    case RAW_MTYPE_BSMP:
+        return len == sizeof(struct raw_pkt_bsmp) ? RAW_MTYPE_BSMP : -1;
     default:
         return -1;
     }
@@ -344,6 +433,152 @@ ssize_t raw_bsmp_send(int sockfd, struct raw_pkt_bsmp *bsmp, int flags)
     return send(sockfd, bsmp, size, flags);
 }
 
+/*********************************************************************
+ * Kernel packet filtering
+ */
+
+/*
+ * The filter runs on UDP sockets, where offset 0 is the start of the
+ * UDP header; SKF_NET_OFF reaches back into the IP header.
+ */
+#define FILT_UDP_HLEN      8
+#define FILT_PAYLOAD(off)  (FILT_UDP_HLEN + (off))
+#define FILT_NET(off)      (SKF_NET_OFF + (off))
+#define FILT_IP4_SADDR     12
+#define FILT_IP6_SADDR     8
+#define FILT_MAX_INSNS     32
+
+struct raw_filter {
+    struct sock_filter insns[FILT_MAX_INSNS];
+    unsigned short n;
+};
+
+static void raw_filter_stmt(struct raw_filter *f, uint16_t code, uint32_t k)
+{
+    assert(f->n < FILT_MAX_INSNS);
+    f->insns[f->n++] = (struct sock_filter)BPF_STMT(code, k);
+}
+
+/* Drop the packet unless the accumulator equals k. The jump to the
+ * drop instruction gets patched in by raw_filter_finish(). */
+static void raw_filter_jeq(struct raw_filter *f, uint32_t k)
+{
+    assert(f->n < FILT_MAX_INSNS);
+    f->insns[f->n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                    k, 0, 0);
+}
+
+/* Load the value at offset off, and drop the packet unless it's k. */
+static void raw_filter_need_eq(struct raw_filter *f, uint16_t load,
+                               uint32_t off, uint32_t k)
+{
+    raw_filter_stmt(f, load, off);
+    raw_filter_jeq(f, k);
+}
+
+/* Accept whatever passed the checks; point the failed checks at the
+ * final "drop" instruction. */
+static void raw_filter_finish(struct raw_filter *f)
+{
+    raw_filter_stmt(f, BPF_RET | BPF_K, 0xFFFFFFFF);
+    raw_filter_stmt(f, BPF_RET | BPF_K, 0);
+    const unsigned short drop = f->n - 1;
+    for (unsigned short i = 0; i < drop; i++) {
+        struct sock_filter *insn = &f->insns[i];
+        if (BPF_CLASS(insn->code) == BPF_JMP) {
+            insn->jf = (uint8_t)(drop - i - 1);
+        }
+    }
+}
+
+/* Match the source address and port. */
+static int raw_filter_src(struct raw_filter *f, const struct sockaddr *src)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in*)src;
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)src;
+    const uint8_t *a6 = sin6->sin6_addr.s6_addr;
+    uint32_t a4 = 0;
+    uint16_t port;
+    int v6 = 0;
+
+    switch (src->sa_family) {
+    case AF_INET:
+        a4 = ntohl(sin->sin_addr.s_addr);
+        port = ntohs(sin->sin_port);
+        break;
+    case AF_INET6:
+        port = ntohs(sin6->sin6_port);
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            /* These arrive with IPv4 headers. */
+            memcpy(&a4, a6 + 12, sizeof(a4));
+            a4 = ntohl(a4);
+        } else {
+            v6 = 1;
+        }
+        break;
+    default:
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    /* IP version, from the top nibble of the first byte. */
+    raw_filter_stmt(f, BPF_LD | BPF_B | BPF_ABS, FILT_NET(0));
+    raw_filter_stmt(f, BPF_ALU | BPF_RSH | BPF_K, 4);
+    raw_filter_jeq(f, v6 ? 6 : 4);
+    if (v6) {
+        for (size_t i = 0; i < sizeof(struct in6_addr); i += 4) {
+            uint32_t word;
+            memcpy(&word, a6 + i, sizeof(word));
+            raw_filter_need_eq(f, BPF_LD | BPF_W | BPF_ABS,
+                               FILT_NET(FILT_IP6_SADDR + i), ntohl(word));
+        }
+    } else {
+        raw_filter_need_eq(f, BPF_LD | BPF_W | BPF_ABS,
+                           FILT_NET(FILT_IP4_SADDR), a4);
+    }
+    raw_filter_need_eq(f, BPF_LD | BPF_H | BPF_ABS, 0, port);
+    return 0;
+}
+
+int raw_data_filter_attach(int sockfd, const struct sockaddr *src,
+                           uint8_t mtype)
+{
+    struct raw_filter f = { .n = 0 };
+    if (src) {
+        size_t len;
+        switch (mtype) {
+        case RAW_MTYPE_BSUB:
+            len = sizeof(struct raw_pkt_bsub);
+            break;
+        case RAW_MTYPE_BSMP:
+            len = sizeof(struct raw_pkt_bsmp);
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+        }
+        if (raw_filter_src(&f, src) == -1) {
+            return -1;
+        }
+        raw_filter_stmt(&f, BPF_LD | BPF_W | BPF_LEN, 0);
+        raw_filter_jeq(&f, FILT_PAYLOAD(len));
+        raw_filter_need_eq(&f, BPF_LD | BPF_B | BPF_ABS,
+                           FILT_PAYLOAD(offsetof(struct raw_pkt_header,
+                                                 _p_magic)),
+                           RAW_PKT_HEADER_MAGIC);
+        raw_filter_need_eq(&f, BPF_LD | BPF_B | BPF_ABS,
+                           FILT_PAYLOAD(offsetof(struct raw_pkt_header,
+                                                 p_mtype)),
+                           mtype);
+        raw_filter_finish(&f);
+    } else {
+        raw_filter_stmt(&f, BPF_RET | BPF_K, 0);
+    }
+    struct sock_fprog prog = { .len = f.n, .filter = f.insns };
+    return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER,
+                      &prog, sizeof(prog));
+}
+
 /*********************************************************************
  * Stringification
  */
@@ -36,6 +36,8 @@
 
 #include "type_attrs.h"
 
+struct sockaddr;
+
 /*********************************************************************
  * Common packet header
  */
@@ -295,6 +297,13 @@ struct raw_pkt_cmd {
 /* Flags */
 #define RAW_PFLAG_B_LIVE  0x01  /* streaming live recording */
 #define RAW_PFLAG_B_LAST  0x02  /* no more packets to send */
+/* b_samps are still in network byte order. This is never sent on the
+ * wire; raw_pkt_ntoh_hdr() sets it so stored packets say how to read
+ * their samples. */
+#define RAW_PFLAG_B_SAMPS_BE 0x40
+/* Placeholder for a board sample the daemon never received; its
+ * samples are all zero. Also never sent on the wire. */
+#define RAW_PFLAG_B_MISSING 0x20
 
 typedef uint16_t raw_samp_t;
 
@@ -331,7 +340,9 @@ struct raw_pkt_bsub {
  * Board sample packet (RAW_MTYPE_BSMP) data
  */
 
-#define RAW_BSMP_NSAMP (32*35)
+#define RAW_BSMP_NCHIPS 32      /* chips in a board sample */
+#define RAW_BSMP_NCHANS 35      /* channels per chip, including aux */
+#define RAW_BSMP_NSAMP (RAW_BSMP_NCHIPS * RAW_BSMP_NCHANS)
 
 /** Board sample wire format struct */
 struct raw_pkt_bsmp {
@@ -506,6 +517,13 @@ static inline size_t raw_bsmp_size(__unused const struct raw_pkt_bsmp *bsmp)
     return sizeof(struct raw_pkt_bsmp);
 }
 
+/* Index into b_samps of a chip's channel. The data node converts a
+ * channel on every chip at once, so samples are channel-major. */
+static inline size_t raw_bsmp_samp_idx(unsigned chip, unsigned chan)
+{
+    return (size_t)chan * RAW_BSMP_NCHIPS + chip;
+}
+
 ///@}
 
 /** @brief Type-generic packet size
@@ -533,6 +551,41 @@ int raw_pkt_hton(void *pkt);
 int raw_pkt_ntoh(void *pkt);
 ///@}
 
+/**
+ * Like raw_pkt_ntoh(), but leaves data packet samples alone.
+ *
+ * For board samples and subsamples, only the header fields get
+ * converted, and RAW_PFLAG_B_SAMPS_BE is set in the packet's flags;
+ * the samples stay big-endian. This saves a pass over every sample
+ * for consumers which can use them as-is (e.g. storing them to
+ * disk). Other packet types are converted just as by raw_pkt_ntoh().
+ */
+int raw_pkt_ntoh_hdr(void *pkt);
+
+/**
+ * Finish what raw_pkt_ntoh_hdr() started.
+ *
+ * If pkt (with its header in host byte order) is a board sample or
+ * subsample with RAW_PFLAG_B_SAMPS_BE set, this converts its samples
+ * to host byte order and clears the flag. Other packets are left
+ * alone.
+ */
+void raw_pkt_ntoh_samps(void *pkt);
+
+/**
+ * Check a data packet straight off the wire, without converting it.
+ *
+ * This is for passing packets along untouched: pkt is still in network
+ * byte order afterwards, and so is safe to send as-is.
+ *
+ * @param pkt  Packet as received
+ * @param len  Number of bytes received
+ * @return the packet's type (RAW_MTYPE_BSUB or RAW_MTYPE_BSMP) if it
+ *         has a good header and is the right size for its type, or
+ *         -1 otherwise.
+ */
+int raw_pkt_check_wire(const void *pkt, size_t len);
+
 /* Send a command packet.
  *
  * This function modifies `packet'. You should treat the value in
@@ -564,6 +617,23 @@ ssize_t raw_bsmp_send(int sockfd, struct raw_pkt_bsmp *bsmp, int flags);
 /* Like raw_cmd_recv(), but for RAW_MTYPE_BSMP packets. */
 ssize_t raw_bsmp_recv(int sockfd, struct raw_pkt_bsmp *bsmp, int flags);
 
+/**
+ * Make the kernel drop unwanted data packets arriving on a UDP socket.
+ *
+ * This replaces any filter already attached to the socket. Afterwards,
+ * the socket only receives well-formed packets of the given type from
+ * the given address and port; everything else is dropped before it
+ * costs a syscall. Packets already queued aren't affected.
+ *
+ * @param sockfd UDP socket to filter
+ * @param src    Address (AF_INET or AF_INET6) to accept packets from,
+ *               or NULL to drop all packets.
+ * @param mtype  RAW_MTYPE_BSUB or RAW_MTYPE_BSMP; ignored if src is NULL.
+ * @return 0 on success, -1 on failure, with errno set.
+ */
+int raw_data_filter_attach(int sockfd, const struct sockaddr *src,
+                           uint8_t mtype);
+
 /*********************************************************************
  * Stringification
  */
@@ -0,0 +1,223 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
+#define SHM_RING_ROUND(n) \
+    (((n) + SHM_RING_ALIGN - 1) / SHM_RING_ALIGN * SHM_RING_ALIGN)
+
+/* Older C libraries don't wrap this. */
+static int shm_ring_memfd(const char *name, unsigned flags)
+{
+    return (int)syscall(SYS_memfd_create, name, flags);
+}
+
+static struct shm_ring *shm_ring_map(int fd, size_t len, int writer)
+{
+    struct shm_ring *ring = malloc(sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    void *map = mmap(NULL, len, writer ? PROT_READ | PROT_WRITE : PROT_READ,
+                     MAP_SHARED | (writer ? MAP_POPULATE : 0), fd, 0);
+    if (map == MAP_FAILED) {
+        free(ring);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->hdr = map;
+    ring->map_len = len;
+    ring->writer = writer;
+    ring->widx = 0;
+    ring->ridx = 0;
+    ring->gen = 0;
+    ring->nlost = 0;
+    return ring;
+}
+
+struct shm_ring *shm_ring_create(const char *name, size_t nslots,
+                                 size_t pkt_size)
+{
+    size_t n = 1;
+    while (n < nslots) {
+        n <<= 1;
+    }
+    const size_t hdr_size = SHM_RING_ROUND(sizeof(struct shm_ring_hdr));
+    const size_t slot_size = SHM_RING_ROUND(sizeof(struct shm_ring_slot) +
+                                            pkt_size);
+    if (!nslots || n > UINT32_MAX || slot_size > UINT32_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    const size_t len = hdr_size + n * slot_size;
+
+    int fd = shm_ring_memfd(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)len) == -1) {
+        goto fail;
+    }
+    /* Best effort; readers check the size anyway. */
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    struct shm_ring *ring = shm_ring_map(fd, len, 1);
+    if (!ring) {
+        goto fail;
+    }
+    struct shm_ring_hdr *hdr = ring->hdr;
+    hdr->sh_hdr_size = (uint16_t)hdr_size;
+    hdr->sh_nslots = (uint32_t)n;
+    hdr->sh_slot_size = (uint32_t)slot_size;
+    hdr->sh_widx = 0;
+    hdr->sh_gen = 0;
+    hdr->sh_mtype = 0;
+    hdr->sh_sidx = 0;
+    hdr->sh_version = SHM_RING_VERSION;
+    __atomic_store_n(&hdr->sh_magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+
+ fail:
+    close(fd);
+    return NULL;
+}
+
+struct shm_ring *shm_ring_attach(int fd)
+{
+    struct stat st;
+    struct shm_ring_hdr hdr;
+    if (fstat(fd, &st) == -1) {
+        return NULL;
+    }
+    if (st.st_size < (off_t)sizeof(hdr) ||
+        pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (hdr.sh_magic != SHM_RING_MAGIC ||
+        hdr.sh_version != SHM_RING_VERSION ||
+        hdr.sh_hdr_size < sizeof(hdr) ||
+        !hdr.sh_nslots || (hdr.sh_nslots & (hdr.sh_nslots - 1)) ||
+        hdr.sh_slot_size < sizeof(struct shm_ring_slot) ||
+        (uint64_t)st.st_size < (hdr.sh_hdr_size +
+                                (uint64_t)hdr.sh_nslots * hdr.sh_slot_size)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct shm_ring *ring = shm_ring_map(fd, (size_t)st.st_size, 0);
+    if (!ring) {
+        return NULL;
+    }
+    ring->ridx = __atomic_load_n(&ring->hdr->sh_widx, __ATOMIC_ACQUIRE);
+    ring->gen = __atomic_load_n(&ring->hdr->sh_gen, __ATOMIC_RELAXED);
+    return ring;
+}
+
+void shm_ring_free(struct shm_ring *ring)
+{
+    if (!ring) {
+        return;
+    }
+    munmap(ring->hdr, ring->map_len);
+    close(ring->fd);
+    free(ring);
+}
+
+void* shm_ring_begin(struct shm_ring *ring, uint8_t mtype)
+{
+    struct shm_ring_hdr *hdr = ring->hdr;
+    struct shm_ring_slot *slot = __shm_ring_slot(ring, ring->widx);
+    if (hdr->sh_mtype != mtype) {
+        __atomic_store_n(&hdr->sh_mtype, mtype, __ATOMIC_RELAXED);
+        shm_ring_restart(ring);
+    }
+    __atomic_store_n(&slot->ss_seq, 2 * ring->widx + 1, __ATOMIC_RELAXED);
+    /* Readers mustn't see the packet change before ss_seq does. */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return slot->ss_pkt;
+}
+
+void shm_ring_commit(struct shm_ring *ring, size_t len, uint32_t sidx)
+{
+    struct shm_ring_hdr *hdr = ring->hdr;
+    struct shm_ring_slot *slot = __shm_ring_slot(ring, ring->widx);
+    slot->ss_gen = hdr->sh_gen;
+    slot->ss_len = (uint32_t)len;
+    slot->ss_sidx = sidx;
+    __atomic_store_n(&slot->ss_seq, 2 * ring->widx + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->sh_sidx, sidx, __ATOMIC_RELAXED);
+    __atomic_store_n(&hdr->sh_widx, ++ring->widx, __ATOMIC_RELEASE);
+}
+
+void shm_ring_restart(struct shm_ring *ring)
+{
+    __atomic_add_fetch(&ring->hdr->sh_gen, 1, __ATOMIC_RELAXED);
+}
+
+size_t shm_ring_read(struct shm_ring *ring, void *buf, size_t size)
+{
+    struct shm_ring_hdr *hdr = ring->hdr;
+    while (1) {
+        uint64_t widx = __atomic_load_n(&hdr->sh_widx, __ATOMIC_ACQUIRE);
+        if (ring->ridx == widx) {
+            return 0;
+        }
+        if (widx - ring->ridx > hdr->sh_nslots) {
+            uint64_t oldest = widx - hdr->sh_nslots;
+            ring->nlost += oldest - ring->ridx;
+            ring->ridx = oldest;
+        }
+        struct shm_ring_slot *slot = __shm_ring_slot(ring, ring->ridx);
+        uint64_t seq = __atomic_load_n(&slot->ss_seq, __ATOMIC_ACQUIRE);
+        uint32_t gen = slot->ss_gen;
+        size_t len = slot->ss_len;
+        int ok = (seq == 2 * ring->ridx + 2 && len <= size &&
+                  len <= shm_ring_pkt_size(ring));
+        if (ok) {
+            memcpy(buf, slot->ss_pkt, len);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            ok = __atomic_load_n(&slot->ss_seq, __ATOMIC_RELAXED) == seq;
+        }
+        ring->ridx++;
+        if (!ok) {
+            /* Overwritten (or too big); move on. */
+            ring->nlost++;
+            continue;
+        }
+        ring->gen = gen;
+        return len;
+    }
+}
@@ -0,0 +1,185 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file shm_ring.h
+ * @brief Shared memory ring of data packets, for local readers
+ *
+ * The daemon publishes the board samples or subsamples it receives
+ * into a ring of fixed-size slots in a memfd, which readers on the
+ * same host map read-only. Reading a packet is a memcpy(); there are
+ * no system calls per packet on either side, and the daemon never
+ * waits for readers. A reader that falls more than a ring's worth
+ * behind loses packets, and finds out.
+ *
+ * The layout below is the interface; the functions are conveniences
+ * (see also libsng's sng_shm_*() wrappers). Everything is in host
+ * byte order, except that data packets' samples are left as they
+ * came: if RAW_PFLAG_B_SAMPS_BE is set in a packet's flags, they're
+ * big-endian (see raw_pkt_ntoh_samps()).
+ *
+ * Each slot has a sequence lock. To publish packet n (counting from
+ * 0), the writer sets ss_seq to 2n + 1, writes the packet, sets
+ * ss_seq to 2n + 2, then sets sh_widx to n + 1. To read packet n, a
+ * reader checks ss_seq is 2n + 2, copies the packet out, then checks
+ * ss_seq again; if it changed, the writer lapped the reader while it
+ * was copying, and the copy is garbage.
+ *
+ * There's one writer; there can be any number of readers.
+ */
+
+#ifndef _LIB_SHM_RING_H_
+#define _LIB_SHM_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "type_attrs.h"
+
+#define SHM_RING_MAGIC 0x474e5253 /* "SRNG", little-endian */
+#define SHM_RING_VERSION 1
+#define SHM_RING_ALIGN 64
+
+/** At the start of the memfd. */
+struct shm_ring_hdr {
+    uint32_t sh_magic;          /**< SHM_RING_MAGIC */
+    uint16_t sh_version;        /**< SHM_RING_VERSION */
+    uint16_t sh_hdr_size;       /**< Slots start this far in */
+    uint32_t sh_nslots;         /**< Slots in the ring; a power of two */
+    uint32_t sh_slot_size;      /**< Bytes per slot, its header included */
+
+    /* The rest changes as packets get published. */
+
+    /**
+     * Write index: packets published so far. Packet n is in slot
+     * n % sh_nslots until packet n + sh_nslots replaces it. Read it
+     * with an acquire load. */
+    uint64_t sh_widx __aligned(SHM_RING_ALIGN);
+    /**
+     * Bumped whenever the stream starts over: a different kind of
+     * packet, or (see shm_ring_restart()) a break in it. Packets
+     * from different generations don't follow on from each other. */
+    uint32_t sh_gen;
+    uint32_t sh_mtype;          /**< Current packets' RAW_MTYPE_*, or 0 */
+    uint32_t sh_sidx;           /**< Sample index of the latest packet */
+};
+
+/** A slot. Slots are sh_slot_size apart. */
+struct shm_ring_slot {
+    uint64_t ss_seq;            /**< Sequence lock; see above */
+    uint32_t ss_gen;            /**< sh_gen when this was published */
+    uint32_t ss_len;            /**< Bytes in ss_pkt */
+    uint32_t ss_sidx;           /**< Its sample index */
+    uint32_t _ss_reserved[3];
+    uint8_t ss_pkt[];           /**< The packet: a raw_pkt_bsmp, say */
+};
+
+/** A ring, as seen from this process. */
+struct shm_ring {
+    int fd;
+    struct shm_ring_hdr *hdr;
+    size_t map_len;
+    int writer;                 /* we created it, and may publish */
+
+    /* Writer */
+    uint64_t widx;              /* next packet */
+
+    /* Reader */
+    uint64_t ridx;              /* next packet to read */
+    uint32_t gen;               /* generation of the last one read */
+    uint64_t nlost;             /* packets overwritten before we got
+                                 * to them */
+};
+
+/**
+ * Create a ring, and map it read/write.
+ *
+ * The memfd is sealed against resizing, so readers can trust its
+ * size once they've checked it.
+ *
+ * @param name Name for the memfd, for debugging (see memfd_create()).
+ * @param nslots Number of slots, rounded up to a power of two.
+ * @param pkt_size Largest packet it'll hold.
+ * @return New, empty ring, or NULL on failure.
+ */
+struct shm_ring *shm_ring_create(const char *name, size_t nslots,
+                                 size_t pkt_size);
+
+/**
+ * Map an existing ring's memfd read-only, for reading.
+ *
+ * The reader starts at the ring's current write index, so it only
+ * sees packets published from now on.
+ *
+ * @param fd The memfd. On success, the ring owns it.
+ * @return The ring, or NULL if fd isn't a good one.
+ */
+struct shm_ring *shm_ring_attach(int fd);
+
+/** Unmap a ring and close its fd. */
+void shm_ring_free(struct shm_ring *ring);
+
+/** Bytes a slot can hold. */
+static inline size_t shm_ring_pkt_size(const struct shm_ring *ring)
+{
+    return ring->hdr->sh_slot_size - sizeof(struct shm_ring_slot);
+}
+
+static inline struct shm_ring_slot* __shm_ring_slot(struct shm_ring *ring,
+                                                    uint64_t idx)
+{
+    return (struct shm_ring_slot*)
+        ((uint8_t*)ring->hdr + ring->hdr->sh_hdr_size +
+         (idx & (ring->hdr->sh_nslots - 1)) * ring->hdr->sh_slot_size);
+}
+
+/**
+ * Writer: start publishing a packet of type mtype.
+ *
+ * If mtype isn't what came before, this starts a new generation.
+ *
+ * @return Where to write the packet; at most shm_ring_pkt_size()
+ *         bytes. Finish with shm_ring_commit().
+ */
+void* shm_ring_begin(struct shm_ring *ring, uint8_t mtype);
+
+/**
+ * Writer: finish publishing the packet started by shm_ring_begin().
+ *
+ * @param len Its length
+ * @param sidx Its sample index
+ */
+void shm_ring_commit(struct shm_ring *ring, size_t len, uint32_t sidx);
+
+/** Writer: start a new generation with the next packet. */
+void shm_ring_restart(struct shm_ring *ring);
+
+/**
+ * Reader: copy out the next packet.
+ *
+ * If the writer got more than a ring's worth ahead, this skips to
+ * the oldest packet still there, and adds what it skipped to
+ * ring->nlost.
+ *
+ * @param buf Where to copy it
+ * @param size Bytes at buf; packets that don't fit are skipped, and
+ *             count as lost.
+ * @return The packet's length, or 0 if there are no new packets.
+ *         ring->gen is its generation.
+ */
+size_t shm_ring_read(struct shm_ring *ring, void *buf, size_t size);
+
+#endif
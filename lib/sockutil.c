@@ -30,6 +30,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 #include "logging.h"
 
@@ -242,6 +243,118 @@ int sockutil_get_tcp_connected_p(const char *host, uint16_t port)
                                sockutil_cfg_conn);
 }
 
+static int sockutil_unix_addr(const char *path, struct sockaddr_un *sun)
+{
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+int sockutil_get_unix_passive(const char *path, int backlog)
+{
+    struct sockaddr_un sun;
+    if (sockutil_unix_addr(path, &sun)) {
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr*)&sun, sizeof(sun)) == -1 ||
+        listen(sock, backlog) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int sockutil_get_unix_connected(const char *path)
+{
+    struct sockaddr_un sun;
+    if (sockutil_unix_addr(path, &sun)) {
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*)&sun, sizeof(sun)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int sockutil_send_fd(int sockfd, int fd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+    char byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_name = NULL,
+        .msg_namelen = 0,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cmsg.buf,
+        .msg_controllen = sizeof(cmsg.buf),
+        .msg_flags = 0,
+    };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    ssize_t n;
+    do {
+        n = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    return n == 1 ? 0 : -1;
+}
+
+int sockutil_recv_fd(int sockfd)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_name = NULL,
+        .msg_namelen = 0,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cmsg.buf,
+        .msg_controllen = sizeof(cmsg.buf),
+        .msg_flags = 0,
+    };
+    ssize_t n;
+    do {
+        n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n != 1) {
+        return -1;
+    }
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS ||
+        c->cmsg_len != CMSG_LEN(sizeof(int))) {
+        errno = EPROTO;
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(c), sizeof(int));
+    return fd;
+}
+
 static int sin_addr_eq(struct sockaddr_in *a, struct sockaddr_in *b)
 {
     return a->sin_addr.s_addr == b->sin_addr.s_addr;
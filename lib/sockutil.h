@@ -130,6 +130,42 @@ int sockutil_get_tcp_passive(uint16_t port, int backlog);
  */
 int sockutil_get_tcp_connected_p(const char *host, uint16_t port);
 
+/**
+ * @brief Convenience for creating passive Unix domain stream sockets.
+ *
+ * Anything already at path is removed first.
+ *
+ * @param path Filesystem path to bind to.
+ * @param backlog Number of pending connections to allow; passed to listen().
+ * @return Socket file descriptor on success, -1 on failure.
+ */
+int sockutil_get_unix_passive(const char *path, int backlog);
+
+/**
+ * @brief Convenience for creating connected Unix domain stream sockets.
+ *
+ * @param path Filesystem path to connect to.
+ * @return Socket file descriptor on success, -1 on failure.
+ */
+int sockutil_get_unix_connected(const char *path);
+
+/**
+ * @brief Send a file descriptor over a Unix domain socket.
+ *
+ * @param sockfd Socket to send it on.
+ * @param fd File descriptor to send.
+ * @return 0 on success, -1 on failure.
+ */
+int sockutil_send_fd(int sockfd, int fd);
+
+/**
+ * @brief Receive a file descriptor sent with sockutil_send_fd().
+ *
+ * @param sockfd Socket to receive it from.
+ * @return The new file descriptor on success, -1 on failure.
+ */
+int sockutil_recv_fd(int sockfd);
+
 /**
  * @brief Get the name of the network interface associated with a socket
  * @param sockfd Socket whose network interface's name to get
@@ -0,0 +1,114 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spsc_ring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Huge page size we ask MAP_HUGETLB for; the usual x86 default. */
+#define SPSC_RING_HUGEPAGE_SIZE (2UL * 1024 * 1024)
+
+/* Map len bytes of anonymous memory for slabs, honoring *flags as
+ * best we can. On return, *flags holds what took effect, and
+ * *map_len the length to munmap(). */
+static void* spsc_ring_map(size_t len, int *flags, size_t *map_len)
+{
+    const int want = *flags;
+    const int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *ret = MAP_FAILED;
+
+    *flags = 0;
+#ifdef MAP_HUGETLB
+    if (want & SPSC_RING_HUGEPAGES) {
+        const size_t hp = SPSC_RING_HUGEPAGE_SIZE;
+        *map_len = (len + hp - 1) / hp * hp;
+        ret = mmap(NULL, *map_len, PROT_READ | PROT_WRITE,
+                   mflags | MAP_HUGETLB, -1, 0);
+        if (ret != MAP_FAILED) {
+            *flags |= SPSC_RING_HUGEPAGES;
+        }
+    }
+#endif
+    if (ret == MAP_FAILED) {
+        *map_len = len;
+        ret = mmap(NULL, *map_len, PROT_READ | PROT_WRITE, mflags, -1, 0);
+        if (ret == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        /* Transparent huge pages are the next best thing; this has to
+         * happen before the pages get faulted in. */
+        if ((want & SPSC_RING_HUGEPAGES) &&
+            !madvise(ret, *map_len, MADV_HUGEPAGE)) {
+            *flags |= SPSC_RING_HUGEPAGES;
+        }
+#endif
+    }
+
+    /* mlock() faults everything in for us. If we can't (or weren't
+     * asked to) lock, touch each page ourselves. */
+    if ((want & SPSC_RING_MLOCK) && !mlock(ret, *map_len)) {
+        *flags |= SPSC_RING_MLOCK;
+    } else {
+        memset(ret, 0, *map_len);
+    }
+    return ret;
+}
+
+struct spsc_ring *spsc_ring_alloc(size_t nslabs, size_t slab_size,
+                                  int flags)
+{
+    const size_t line = SPSC_RING_CACHE_LINE;
+    struct spsc_ring *ring = NULL;
+    size_t map_len;
+
+    if (nslabs == 0 || slab_size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    slab_size = (slab_size + line - 1) / line * line;
+    if (nslabs > SIZE_MAX / slab_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (posix_memalign((void**)&ring, line, sizeof(*ring))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->sr_slabs = spsc_ring_map(nslabs * slab_size, &flags, &map_len);
+    if (!ring->sr_slabs) {
+        free(ring);
+        errno = ENOMEM;
+        return NULL;
+    }
+    ring->sr_nslabs = nslabs;
+    ring->sr_slab_size = slab_size;
+    ring->sr_map_len = map_len;
+    ring->sr_flags = flags;
+    return ring;
+}
+
+void spsc_ring_free(struct spsc_ring *ring)
+{
+    if (!ring) {
+        return;
+    }
+    munmap(ring->sr_slabs, ring->sr_map_len);
+    free(ring);
+}
@@ -0,0 +1,171 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file spsc_ring.h
+ * @brief Lock-free single-producer, single-consumer ring of slabs
+ *
+ * A ring of fixed-size, cache-line aligned slabs of memory. The
+ * producer fills the slab at the head and publishes it; the consumer
+ * processes the slab at the tail and releases it. Neither side blocks
+ * or takes a lock. When the ring is full, spsc_ring_prod_slab()
+ * returns NULL, and what to do about that is up to the producer.
+ *
+ * At most one thread may be the producer, and at most one the
+ * consumer, at any given time. If the role moves between threads,
+ * the hand-off needs synchronizing some other way.
+ */
+
+#ifndef _LIB_SPSC_RING_H_
+#define _LIB_SPSC_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "type_attrs.h"
+
+#define SPSC_RING_CACHE_LINE 64
+
+/* Flags for spsc_ring_alloc(). */
+#define SPSC_RING_HUGEPAGES 0x1 /* Back slabs with huge pages if possible */
+#define SPSC_RING_MLOCK     0x2 /* Lock slabs into RAM */
+
+struct spsc_ring {
+    uint8_t *sr_slabs;
+    size_t sr_nslabs;
+    size_t sr_slab_size;        /* multiple of SPSC_RING_CACHE_LINE */
+    size_t sr_map_len;          /* length of sr_slabs mapping */
+    int sr_flags;               /* SPSC_RING_* flags that took effect */
+    size_t sr_hwm;              /* high-water mark; producer only */
+
+    /* Free-running counts of slabs published and released. They're
+     * on their own cache lines so the two sides don't false-share. */
+    size_t sr_head __aligned(SPSC_RING_CACHE_LINE);
+    size_t sr_tail __aligned(SPSC_RING_CACHE_LINE);
+};
+
+/**
+ * Allocate a ring.
+ *
+ * The slabs are pre-faulted, so the first pass around the ring
+ * doesn't take a page fault per page. SPSC_RING_HUGEPAGES asks for
+ * explicit (MAP_HUGETLB) huge pages, falling back on transparent huge
+ * pages, then regular ones. SPSC_RING_MLOCK asks for the slabs to be
+ * locked into RAM. Neither is fatal if the system won't oblige; check
+ * sr_flags to see what you got.
+ *
+ * @param nslabs Number of slabs in the ring; must be nonzero.
+ * @param slab_size Minimum size of each slab, in bytes. This is
+ *                  rounded up to a multiple of SPSC_RING_CACHE_LINE.
+ * @param flags Logical OR of SPSC_RING_* flags, or 0.
+ * @return New, empty ring on success, NULL on failure.
+ */
+struct spsc_ring *spsc_ring_alloc(size_t nslabs, size_t slab_size,
+                                  int flags);
+
+/** Free a ring allocated with spsc_ring_alloc(). */
+void spsc_ring_free(struct spsc_ring *ring);
+
+static inline uint8_t* __spsc_ring_slab(struct spsc_ring *ring, size_t idx)
+{
+    return ring->sr_slabs + (idx % ring->sr_nslabs) * ring->sr_slab_size;
+}
+
+/**
+ * Number of slabs currently published and not yet released.
+ *
+ * This is only a snapshot unless you're the producer or consumer.
+ */
+static inline size_t spsc_ring_count(struct spsc_ring *ring)
+{
+    size_t tail = __atomic_load_n(&ring->sr_tail, __ATOMIC_ACQUIRE);
+    size_t head = __atomic_load_n(&ring->sr_head, __ATOMIC_ACQUIRE);
+    return head - tail;
+}
+
+/**
+ * Producer: get the slab at the head of the ring.
+ *
+ * The same slab is returned until it's published.
+ *
+ * @return Slab to fill, or NULL if the ring is full.
+ */
+static inline void* spsc_ring_prod_slab(struct spsc_ring *ring)
+{
+    size_t head = __atomic_load_n(&ring->sr_head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&ring->sr_tail, __ATOMIC_ACQUIRE);
+    if (head - tail == ring->sr_nslabs) {
+        return NULL;
+    }
+    return __spsc_ring_slab(ring, head);
+}
+
+/**
+ * Producer: publish the slab returned by spsc_ring_prod_slab(),
+ * handing it to the consumer.
+ */
+static inline void spsc_ring_produce(struct spsc_ring *ring)
+{
+    size_t head = __atomic_load_n(&ring->sr_head, __ATOMIC_RELAXED) + 1;
+    size_t tail = __atomic_load_n(&ring->sr_tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring->sr_hwm) {
+        ring->sr_hwm = head - tail;
+    }
+    __atomic_store_n(&ring->sr_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Producer: most slabs that have been published but not released
+ * since the last spsc_ring_reset_hwm().
+ */
+static inline size_t spsc_ring_hwm(struct spsc_ring *ring)
+{
+    return ring->sr_hwm;
+}
+
+/** Producer: reset the high-water mark. */
+static inline void spsc_ring_reset_hwm(struct spsc_ring *ring)
+{
+    ring->sr_hwm = 0;
+}
+
+/**
+ * Consumer: get the oldest published slab.
+ *
+ * The same slab is returned until it's released.
+ *
+ * @return Slab to process, or NULL if the ring is empty.
+ */
+static inline void* spsc_ring_cons_slab(struct spsc_ring *ring)
+{
+    size_t tail = __atomic_load_n(&ring->sr_tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&ring->sr_head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return __spsc_ring_slab(ring, tail);
+}
+
+/**
+ * Consumer: release the slab returned by spsc_ring_cons_slab(),
+ * handing it back to the producer.
+ */
+static inline void spsc_ring_consume(struct spsc_ring *ring)
+{
+    size_t tail = __atomic_load_n(&ring->sr_tail, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&ring->sr_tail, tail, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,268 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "transpose16.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRANSPOSE16_X86 1
+#include <immintrin.h>
+#else
+#define TRANSPOSE16_X86 0
+#endif
+
+/* Source rows per cache block. Within a block, we walk down a few
+ * columns at a time, so each destination row gets a contiguous run
+ * written to it, while the source cache lines (one per row, so
+ * 32 KB here) stay close by for the next few columns. Transposing
+ * board samples into a channel-major HDF5 chunk, this was about
+ * twice as fast as 64 rows; much longer blocks didn't help. */
+#define TRANSPOSE16_BLOCK_ROWS 512
+
+static inline size_t transpose16_min(size_t a, size_t b)
+{
+    return a < b ? a : b;
+}
+
+static void transpose16_tile(uint16_t *dst, size_t dst_stride,
+                             const uint16_t *src, size_t src_stride,
+                             size_t nrows, size_t ncols)
+{
+    for (size_t c = 0; c < ncols; c++) {
+        for (size_t r = 0; r < nrows; r++) {
+            dst[c * dst_stride + r] = src[r * src_stride + c];
+        }
+    }
+}
+
+static void transpose16_scalar(uint16_t *dst, size_t dst_stride,
+                               const uint16_t *src, size_t src_stride,
+                               size_t nrows, size_t ncols)
+{
+    for (size_t r0 = 0; r0 < nrows; r0 += TRANSPOSE16_BLOCK_ROWS) {
+        size_t nr = transpose16_min(TRANSPOSE16_BLOCK_ROWS, nrows - r0);
+        transpose16_tile(dst + r0, dst_stride, src + r0 * src_stride,
+                         src_stride, nr, ncols);
+    }
+}
+
+#if TRANSPOSE16_X86
+
+/* Transpose an 8x8 block: interleave 16-bit, then 32-bit, then
+ * 64-bit pieces of row pairs. This is spelled out, rather than
+ * looping over arrays, since GCC at -O2 leaves the arrays on the
+ * stack. */
+#define TRANSPOSE16_LOAD(ld, i)                                 \
+    __typeof__(ld(NULL)) a##i = ld((const void*)(src + i * src_stride))
+#define TRANSPOSE16_8X8(pfx, ld)                                \
+    TRANSPOSE16_LOAD(ld, 0); TRANSPOSE16_LOAD(ld, 1);          \
+    TRANSPOSE16_LOAD(ld, 2); TRANSPOSE16_LOAD(ld, 3);          \
+    TRANSPOSE16_LOAD(ld, 4); TRANSPOSE16_LOAD(ld, 5);          \
+    TRANSPOSE16_LOAD(ld, 6); TRANSPOSE16_LOAD(ld, 7);          \
+    __typeof__(a0) t0 = pfx##_unpacklo_epi16(a0, a1);           \
+    __typeof__(a0) t1 = pfx##_unpackhi_epi16(a0, a1);           \
+    __typeof__(a0) t2 = pfx##_unpacklo_epi16(a2, a3);           \
+    __typeof__(a0) t3 = pfx##_unpackhi_epi16(a2, a3);           \
+    __typeof__(a0) t4 = pfx##_unpacklo_epi16(a4, a5);           \
+    __typeof__(a0) t5 = pfx##_unpackhi_epi16(a4, a5);           \
+    __typeof__(a0) t6 = pfx##_unpacklo_epi16(a6, a7);           \
+    __typeof__(a0) t7 = pfx##_unpackhi_epi16(a6, a7);           \
+    __typeof__(a0) u0 = pfx##_unpacklo_epi32(t0, t2);           \
+    __typeof__(a0) u1 = pfx##_unpackhi_epi32(t0, t2);           \
+    __typeof__(a0) u2 = pfx##_unpacklo_epi32(t1, t3);           \
+    __typeof__(a0) u3 = pfx##_unpackhi_epi32(t1, t3);           \
+    __typeof__(a0) u4 = pfx##_unpacklo_epi32(t4, t6);           \
+    __typeof__(a0) u5 = pfx##_unpackhi_epi32(t4, t6);           \
+    __typeof__(a0) u6 = pfx##_unpacklo_epi32(t5, t7);           \
+    __typeof__(a0) u7 = pfx##_unpackhi_epi32(t5, t7);           \
+    __typeof__(a0) r0 = pfx##_unpacklo_epi64(u0, u4);           \
+    __typeof__(a0) r1 = pfx##_unpackhi_epi64(u0, u4);           \
+    __typeof__(a0) r2 = pfx##_unpacklo_epi64(u1, u5);           \
+    __typeof__(a0) r3 = pfx##_unpackhi_epi64(u1, u5);           \
+    __typeof__(a0) r4 = pfx##_unpacklo_epi64(u2, u6);           \
+    __typeof__(a0) r5 = pfx##_unpackhi_epi64(u2, u6);           \
+    __typeof__(a0) r6 = pfx##_unpacklo_epi64(u3, u7);           \
+    __typeof__(a0) r7 = pfx##_unpackhi_epi64(u3, u7)
+
+#define TRANSPOSE16_STORE(i, v) \
+    _mm_storeu_si128((__m128i*)(dst + (i) * dst_stride), (v))
+
+__attribute__((target("sse2")))
+static void transpose16_8x8_sse2(uint16_t *dst, size_t dst_stride,
+                                 const uint16_t *src, size_t src_stride)
+{
+    TRANSPOSE16_8X8(_mm, _mm_loadu_si128);
+    TRANSPOSE16_STORE(0, r0);
+    TRANSPOSE16_STORE(1, r1);
+    TRANSPOSE16_STORE(2, r2);
+    TRANSPOSE16_STORE(3, r3);
+    TRANSPOSE16_STORE(4, r4);
+    TRANSPOSE16_STORE(5, r5);
+    TRANSPOSE16_STORE(6, r6);
+    TRANSPOSE16_STORE(7, r7);
+}
+
+__attribute__((target("sse2")))
+static void transpose16_sse2(uint16_t *dst, size_t dst_stride,
+                             const uint16_t *src, size_t src_stride,
+                             size_t nrows, size_t ncols)
+{
+    const size_t ncols8 = ncols & ~(size_t)7;
+    for (size_t r0 = 0; r0 < nrows; r0 += TRANSPOSE16_BLOCK_ROWS) {
+        size_t nr = transpose16_min(TRANSPOSE16_BLOCK_ROWS, nrows - r0);
+        size_t nr8 = nr & ~(size_t)7;
+        const uint16_t *s = src + r0 * src_stride;
+        uint16_t *d = dst + r0;
+        for (size_t c = 0; c < ncols8; c += 8) {
+            for (size_t r = 0; r < nr8; r += 8) {
+                transpose16_8x8_sse2(d + c * dst_stride + r, dst_stride,
+                                     s + r * src_stride + c, src_stride);
+            }
+        }
+        transpose16_tile(d + nr8, dst_stride, s + nr8 * src_stride,
+                         src_stride, nr - nr8, ncols8);
+        transpose16_tile(d + ncols8 * dst_stride, dst_stride, s + ncols8,
+                         src_stride, nr, ncols - ncols8);
+    }
+}
+
+/* The same as transpose16_8x8_sse2(), on two 8x8 blocks side by
+ * side: AVX2 unpacks work within 128-bit lanes, so the low lanes
+ * end up holding the left block's columns, and the high lanes the
+ * right one's. */
+#define TRANSPOSE16_STORE2(i, v)                                        \
+    do {                                                                \
+        TRANSPOSE16_STORE(i, _mm256_castsi256_si128(v));                \
+        TRANSPOSE16_STORE((i) + 8, _mm256_extracti128_si256((v), 1));   \
+    } while (0)
+
+__attribute__((target("avx2")))
+static void transpose16_8x16_avx2(uint16_t *dst, size_t dst_stride,
+                                  const uint16_t *src, size_t src_stride)
+{
+    TRANSPOSE16_8X8(_mm256, _mm256_loadu_si256);
+    TRANSPOSE16_STORE2(0, r0);
+    TRANSPOSE16_STORE2(1, r1);
+    TRANSPOSE16_STORE2(2, r2);
+    TRANSPOSE16_STORE2(3, r3);
+    TRANSPOSE16_STORE2(4, r4);
+    TRANSPOSE16_STORE2(5, r5);
+    TRANSPOSE16_STORE2(6, r6);
+    TRANSPOSE16_STORE2(7, r7);
+}
+
+__attribute__((target("avx2")))
+static void transpose16_avx2(uint16_t *dst, size_t dst_stride,
+                             const uint16_t *src, size_t src_stride,
+                             size_t nrows, size_t ncols)
+{
+    const size_t ncols16 = ncols & ~(size_t)15;
+    for (size_t r0 = 0; r0 < nrows; r0 += TRANSPOSE16_BLOCK_ROWS) {
+        size_t nr = transpose16_min(TRANSPOSE16_BLOCK_ROWS, nrows - r0);
+        size_t nr8 = nr & ~(size_t)7;
+        const uint16_t *s = src + r0 * src_stride;
+        uint16_t *d = dst + r0;
+        for (size_t c = 0; c < ncols16; c += 16) {
+            for (size_t r = 0; r < nr8; r += 8) {
+                transpose16_8x16_avx2(d + c * dst_stride + r, dst_stride,
+                                      s + r * src_stride + c, src_stride);
+            }
+        }
+        transpose16_tile(d + nr8, dst_stride, s + nr8 * src_stride,
+                         src_stride, nr - nr8, ncols16);
+        transpose16_tile(d + ncols16 * dst_stride, dst_stride, s + ncols16,
+                         src_stride, nr, ncols - ncols16);
+    }
+    _mm256_zeroupper();
+}
+
+#endif  /* TRANSPOSE16_X86 */
+
+typedef void (*transpose16_fn)(uint16_t*, size_t, const uint16_t*, size_t,
+                               size_t, size_t);
+
+static const transpose16_fn transpose16_fns[TRANSPOSE16_NIMPLS] = {
+    [TRANSPOSE16_SCALAR] = transpose16_scalar,
+#if TRANSPOSE16_X86
+    [TRANSPOSE16_SSE2] = transpose16_sse2,
+    [TRANSPOSE16_AVX2] = transpose16_avx2,
+#endif
+};
+
+int transpose16_impl_supported(enum transpose16_impl impl)
+{
+    switch (impl) {
+    case TRANSPOSE16_SCALAR:
+        return 1;
+#if TRANSPOSE16_X86
+    case TRANSPOSE16_SSE2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+    case TRANSPOSE16_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+const char* transpose16_impl_str(enum transpose16_impl impl)
+{
+    switch (impl) {
+    case TRANSPOSE16_SCALAR:
+        return "scalar";
+    case TRANSPOSE16_SSE2:
+        return "sse2";
+    case TRANSPOSE16_AVX2:
+        return "avx2";
+    default:
+        return "<unknown>";
+    }
+}
+
+/* -1 until the first transpose16() or transpose16_get_impl() call
+ * picks one. Racing to pick is harmless, since everybody picks the
+ * same. */
+static int transpose16_cur_impl = -1;
+
+enum transpose16_impl transpose16_get_impl(void)
+{
+    int impl = __atomic_load_n(&transpose16_cur_impl, __ATOMIC_RELAXED);
+    if (impl < 0) {
+        impl = TRANSPOSE16_NIMPLS - 1;
+        while (!transpose16_impl_supported(impl)) {
+            impl--;
+        }
+        __atomic_store_n(&transpose16_cur_impl, impl, __ATOMIC_RELAXED);
+    }
+    return impl;
+}
+
+int transpose16_set_impl(enum transpose16_impl impl)
+{
+    if (impl >= TRANSPOSE16_NIMPLS || !transpose16_impl_supported(impl)) {
+        return -1;
+    }
+    __atomic_store_n(&transpose16_cur_impl, (int)impl, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void transpose16(uint16_t *dst, size_t dst_stride,
+                 const uint16_t *src, size_t src_stride,
+                 size_t nrows, size_t ncols)
+{
+    transpose16_fns[transpose16_get_impl()](dst, dst_stride, src, src_stride,
+                                            nrows, ncols);
+}
@@ -0,0 +1,76 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file transpose16.h
+ * @brief Transposing matrices of 16-bit values
+ *
+ * Board samples arrive one time step (every channel) at a time, but
+ * analysis wants one channel (every time step) at a time. These
+ * routines turn the former into the latter, a cache-sized block at a
+ * time, using SIMD instructions when the CPU has them.
+ *
+ * As with bswap16_buf(), the implementation is picked at runtime the
+ * first time transpose16() is called, and every implementation
+ * produces identical results.
+ */
+
+#ifndef _LIB_TRANSPOSE16_H_
+#define _LIB_TRANSPOSE16_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Transpose implementations, from slowest to fastest. */
+enum transpose16_impl {
+    TRANSPOSE16_SCALAR = 0,     /**< Portable C */
+    TRANSPOSE16_SSE2,           /**< x86 SSE2, 8x8 blocks */
+    TRANSPOSE16_AVX2,           /**< x86 AVX2, 8x16 blocks */
+
+    TRANSPOSE16_NIMPLS
+};
+
+/**
+ * Transpose an nrows by ncols matrix.
+ *
+ * Afterwards, dst[c * dst_stride + r] == src[r * src_stride + c] for
+ * every r < nrows and c < ncols. Strides are in elements, not bytes,
+ * and needn't be multiples of anything; src and dst mustn't overlap.
+ */
+void transpose16(uint16_t *dst, size_t dst_stride,
+                 const uint16_t *src, size_t src_stride,
+                 size_t nrows, size_t ncols);
+
+/** Get a short name for an implementation, e.g. "sse2". */
+const char* transpose16_impl_str(enum transpose16_impl impl);
+
+/** Nonzero if impl can run on this CPU. */
+int transpose16_impl_supported(enum transpose16_impl impl);
+
+/** Get the implementation transpose16() is using (or will use). */
+enum transpose16_impl transpose16_get_impl(void);
+
+/**
+ * Make transpose16() use a particular implementation.
+ *
+ * This is for testing and benchmarking; the default choice is the
+ * fastest available. Don't call it while other threads might be
+ * calling transpose16().
+ *
+ * @return 0 on success, -1 if impl isn't supported on this CPU.
+ */
+int transpose16_set_impl(enum transpose16_impl impl);
+
+#endif
@@ -27,6 +27,7 @@
 #ifdef __GNUC__
 #define __packed __attribute__((packed))
 #define __unused __attribute__((unused))
+#define __aligned(x) __attribute__((aligned(x)))
 #endif
 
 #endif  /* _TYPE_ATTRS_H_ */
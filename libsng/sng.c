@@ -32,6 +32,8 @@
 #include <unistd.h>
 
 #include "client_socket.h"
+#include "raw_packets.h"
+#include "shm_ring.h"
 #include "sockutil.h"
 #include "type_attrs.h"
 
@@ -140,3 +142,62 @@ int sng_store_samples(ControlCmdStore *store,
     }
     return ret;
 }
+
+/* It's just a ring, as far as we're concerned. */
+struct sng_shm {
+    struct shm_ring *ring;
+};
+
+struct sng_shm *sng_shm_open(const char *path)
+{
+    struct sng_shm *shm = malloc(sizeof(*shm));
+    if (!shm) {
+        return NULL;
+    }
+    int sock = sockutil_get_unix_connected(path);
+    if (sock == -1) {
+        goto fail;
+    }
+    int fd = sockutil_recv_fd(sock);
+    close(sock);
+    if (fd == -1) {
+        goto fail;
+    }
+    shm->ring = shm_ring_attach(fd);
+    if (!shm->ring) {
+        close(fd);
+        goto fail;
+    }
+    return shm;
+
+ fail:
+    free(shm);
+    return NULL;
+}
+
+size_t sng_shm_read(struct sng_shm *shm, void *buf, size_t size)
+{
+    size_t len = shm_ring_read(shm->ring, buf, size);
+    if (len >= sizeof(struct raw_pkt_header)) {
+        raw_pkt_ntoh_samps(buf);
+    }
+    return len;
+}
+
+uint32_t sng_shm_gen(const struct sng_shm *shm)
+{
+    return shm->ring->gen;
+}
+
+uint64_t sng_shm_nlost(const struct sng_shm *shm)
+{
+    return shm->ring->nlost;
+}
+
+void sng_shm_close(struct sng_shm *shm)
+{
+    if (shm) {
+        shm_ring_free(shm->ring);
+        free(shm);
+    }
+}
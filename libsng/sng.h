@@ -22,6 +22,8 @@
 #ifndef _LIBSNG_SNG_H_
 #define _LIBSNG_SNG_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include "proto/control.pb-c.h"
@@ -64,4 +66,57 @@ void sng_init_cmd_store(ControlCmdStore *store);
  */
 int sng_store_samples(ControlCmdStore *store, ControlResponse *response);
 
+/**
+ * @name Shared memory sample reader
+ *
+ * When the daemon runs with --shm, it publishes every board sample
+ * or subsample it accepts in a shared memory ring, which readers on
+ * the same host can take them from without a system call per
+ * packet. The daemon never waits for readers; one that falls too far
+ * behind loses packets, and sng_shm_nlost() says how many.
+ *
+ * Packets come out as raw packets (see raw_packets.h), entirely in
+ * host byte order.
+ */
+///@{
+
+/** A shared memory reader. */
+struct sng_shm;
+
+/**
+ * Start reading samples from the daemon's shared memory ring.
+ *
+ * You'll get packets published from now on.
+ *
+ * @param path The daemon's --shm socket path
+ * @return New reader, or NULL on failure.
+ */
+struct sng_shm *sng_shm_open(const char *path);
+
+/**
+ * Get the next packet, if there is one. This doesn't block; poll.
+ *
+ * @param shm Reader
+ * @param buf Where to put the packet; a union of struct raw_pkt_bsmp
+ *            and struct raw_pkt_bsub is big enough.
+ * @param size Bytes at buf
+ * @return The packet's size, or 0 if there isn't a new one yet.
+ */
+size_t sng_shm_read(struct sng_shm *shm, void *buf, size_t size);
+
+/**
+ * Generation of the last packet read. It changes when the stream
+ * starts over (for instance, from board subsamples to board
+ * samples); packets of different generations don't follow on.
+ */
+uint32_t sng_shm_gen(const struct sng_shm *shm);
+
+/** How many packets were overwritten before shm could read them. */
+uint64_t sng_shm_nlost(const struct sng_shm *shm);
+
+/** Stop reading, and free shm. */
+void sng_shm_close(struct sng_shm *shm);
+
+///@}
+
 #endif
@@ -32,4 +32,13 @@
 #define CONFIG_LOG_REG_IO_TXNS 0
 #endif
 
+/* Maximum number of board sample packets to pull off the data socket
+ * per recvmmsg() call while storing samples, and of packets per
+ * recvmmsg()/sendmmsg() pair while forwarding them raw. Set to 1 to get one
+ * syscall per board sample (the old recvfrom() behavior), e.g. when
+ * benchmarking. */
+#ifndef CONFIG_SAMPLE_RECV_BATCH
+#define CONFIG_SAMPLE_RECV_BATCH 32
+#endif
+
 #endif
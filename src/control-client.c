@@ -18,6 +18,7 @@
 #include "control-client.h"
 #include "control-private.h"
 
+#include <limits.h>
 #include <stdlib.h>
 
 #include <event2/event.h>
@@ -29,6 +30,8 @@
 #include "raw_packets.h"
 #include "sockutil.h"
 #include "ch_storage.h"
+#include "compress.h"
+#include "direct_ch_storage.h"
 #include "hdf5_ch_storage.h"
 #include "raw_ch_storage.h"
 
@@ -56,6 +59,11 @@
  * client. */
 #define MAX_FAILED_STORAGE_RETRIES 20
 
+/* Board samples a canned store misses get read again once it reaches
+ * the end. If it takes more than this many reads to get them all,
+ * give up and report the dropped packets. */
+#define MAX_GAP_REREADS 100
+
 struct client_priv {
     ControlCommand *c_cmd; /* Latest unpacked protocol message, or
                             * NULL. Shared with worker thread. */
@@ -107,6 +115,29 @@ struct client_priv {
                               * anything to disk. */
     size_t bs_nwritten_cache; /* Cached number of written samples,
                                * for handling restarts. */
+    size_t bs_peak_bufs;      /* Peak sample buffer queue depth,
+                               * across restarts. */
+    int64_t bs_first_write_usec; /* Time to first stored sample in the
+                                  * first restart that stored any,
+                                  * or -1. */
+    size_t bs_nrestarts;      /* Restarts after dropped packets. */
+    size_t bs_nreordered;     /* Board samples that arrived out of
+                               * order, across restarts. */
+    size_t bs_npauses;        /* Times storage fell behind reading. */
+    size_t bs_nforeign;       /* Packets ignored for their source. */
+    size_t bs_nforwarded;     /* Board samples forwarded meanwhile, */
+    size_t bs_nfwd_dropped;   /* and ones that couldn't be. */
+    ssize_t bs_base_sample;   /* First board sample index of a canned
+                               * store, for finding gaps in the
+                               * output; -1 when storing live data. */
+    struct ch_gap *bs_gaps;   /* Gaps in the store so far. For canned
+                               * stores, only the ones that still
+                               * need to be read again. bs_ngaps of
+                               * the bs_gaps_cap entries are used. */
+    size_t bs_ngaps;
+    size_t bs_gaps_cap;
+    int bs_rereading;         /* Are we reading a gap again? */
+    size_t bs_nrereads;       /* Gap re-reads started. */
 };
 
 /********************************************************************
@@ -175,6 +206,7 @@ static void client_free_priv(struct control_session *cs)
         evbuffer_free(cpriv->c_pbuflen_buf);
     }
     client_halt_ongoing_transfer(cs);
+    free(cpriv->bs_gaps);
     free(cpriv);
     cs->cpriv = NULL;
 }
@@ -210,18 +242,119 @@ static void client_reset_state_locked(struct control_session *cs)
     cpriv->bs_pending_events = 0;
     client_unpend_restart(cs);
     cpriv->bs_nwritten_cache = 0;
+    cpriv->bs_peak_bufs = 0;
+    cpriv->bs_first_write_usec = -1;
+    cpriv->bs_nrestarts = 0;
+    cpriv->bs_nreordered = 0;
+    cpriv->bs_npauses = 0;
+    cpriv->bs_nforeign = 0;
+    cpriv->bs_nforwarded = 0;
+    cpriv->bs_nfwd_dropped = 0;
+    cpriv->bs_base_sample = -1;
+    cpriv->bs_ngaps = 0;
+    cpriv->bs_rereading = 0;
+    cpriv->bs_nrereads = 0;
     drain_evbuf(cpriv->c_pbuf);
     drain_evbuf(cpriv->c_pbuflen_buf);
 }
 
-static struct ch_storage *client_new_ch_storage(const char *path,
-                                                StorageBackend backend)
+/* Apply a store command's HDF5 tuning fields over the defaults. The
+ * dataset is sized for nsamples board samples, if that's nonzero. */
+static void client_hdf5_opts(struct hdf5_ch_opts *opts,
+                             const ControlCmdStore *store, size_t nsamples)
+{
+    hdf5_ch_opts_init(opts);
+    if (store->has_hdf5_chunk_samples) {
+        opts->chunk_nsamps = store->hdf5_chunk_samples;
+    }
+    if (store->has_hdf5_cache_bytes) {
+        opts->cache_bytes = store->hdf5_cache_bytes;
+    }
+    if (store->has_hdf5_alloc_early) {
+        opts->alloc_early = store->hdf5_alloc_early;
+    }
+    if (store->has_hdf5_meta_block_size) {
+        opts->meta_block_size = store->hdf5_meta_block_size;
+    }
+    if (store->has_hdf5_latest_format) {
+        opts->latest_format = store->hdf5_latest_format;
+    }
+    if (store->has_hdf5_direct_chunk) {
+        opts->direct_chunk = store->hdf5_direct_chunk;
+    }
+    if (store->has_hdf5_deflate) {
+        opts->deflate = (int)store->hdf5_deflate;
+    }
+    if (store->has_hdf5_channel_major && store->hdf5_channel_major) {
+        opts->layout = HDF5_CH_LAYOUT_CHANNELS;
+    }
+    if (store->has_hdf5_channel_chunk_samples) {
+        opts->col_chunk_nsamps = store->hdf5_channel_chunk_samples;
+    }
+    if (store->has_compression) {
+        opts->compress = (int)store->compression;
+    }
+    if (store->has_compress_level) {
+        opts->compress_level = (int)store->compress_level;
+    }
+    if (store->has_compress_threads) {
+        opts->compress_threads = store->compress_threads;
+    }
+    opts->expected_nsamps = nsamples;
+}
+
+/* Likewise, for a raw file's compression fields. */
+static void client_raw_opts(struct raw_ch_opts *opts,
+                            const ControlCmdStore *store)
+{
+    raw_ch_opts_init(opts);
+    if (store->has_compression) {
+        opts->compress = (int)store->compression;
+    }
+    if (store->has_compress_level) {
+        opts->compress_level = (int)store->compress_level;
+    }
+    if (store->has_compress_threads) {
+        opts->compress_threads = store->compress_threads;
+    }
+    if (store->has_raw_frame_samples) {
+        opts->frame_nsamps = store->raw_frame_samples;
+    }
+}
+
+static struct ch_storage *client_new_ch_storage(const ControlCmdStore *store,
+                                                size_t nsamples)
 {
+    const char *path = store->path;
+    StorageBackend backend = store->backend;
     struct ch_storage *chns;
     if (backend == STORAGE_BACKEND__STORE_HDF5) {
+        struct hdf5_ch_opts opts;
+        client_hdf5_opts(&opts, store, nsamples);
         chns = hdf5_ch_storage_alloc(path, HDF5_DATASET_NAME);
+        if (chns && hdf5_ch_storage_set_opts(chns, &opts) == -1) {
+            log_ERR("HDF5 library can't do the requested store settings");
+            ch_storage_free(chns);
+            chns = NULL;
+        }
     } else if (backend == STORAGE_BACKEND__STORE_RAW) {
+        struct raw_ch_opts opts;
+        client_raw_opts(&opts, store);
         chns = raw_ch_storage_alloc(path, 0644);
+        if (chns && raw_ch_storage_set_opts(chns, &opts) == -1) {
+            log_ERR("can't do the requested raw store settings");
+            ch_storage_free(chns);
+            chns = NULL;
+        }
+    } else if (backend == STORAGE_BACKEND__STORE_DIRECT) {
+        struct direct_ch_opts opts;
+        direct_ch_opts_init(&opts);
+        opts.expected_nsamps = nsamples;
+        chns = direct_ch_storage_alloc(path, 0644);
+        if (chns && direct_ch_storage_set_opts(chns, &opts) == -1) {
+            ch_storage_free(chns);
+            chns = NULL;
+        }
     } else {
         assert(0);
         return NULL;
@@ -230,6 +363,9 @@ static struct ch_storage *client_new_ch_storage(const char *path,
         log_ERR("can't open channel storage at %s: %m", path);
         return NULL;
     }
+    if (store->has_wire_order && store->wire_order) {
+        chns->ch_flags |= CH_STORAGE_WIRE_ORDER;
+    }
     return chns;
 }
 
@@ -239,7 +375,8 @@ static int client_open_ch_storage(struct ch_storage *chns,
     unsigned flags;
     if (backend == STORAGE_BACKEND__STORE_HDF5) {
         flags = H5F_ACC_TRUNC;
-    } else if (backend == STORAGE_BACKEND__STORE_RAW) {
+    } else if (backend == STORAGE_BACKEND__STORE_RAW ||
+               backend == STORAGE_BACKEND__STORE_DIRECT) {
         flags = O_CREAT | O_RDWR | O_TRUNC;
     } else {
         assert(0);
@@ -487,9 +624,31 @@ static void client_send_store_res(struct control_session *cs, short events)
     assert(cpriv->bs_cfg);
     assert(store);
     assert(store->has_backend);
+    if (cpriv->bs_rereading && cpriv->bs_cfg->nsamples) {
+        /* We didn't finish reading the last gap again, so what's
+         * left of it is still missing. */
+        assert(cpriv->bs_ngaps < cpriv->bs_gaps_cap);
+        struct ch_gap *gap = &cpriv->bs_gaps[cpriv->bs_ngaps++];
+        gap->start = (uint64_t)cpriv->bs_cfg->start_sample;
+        gap->len = cpriv->bs_cfg->nsamples;
+    }
+    uint64_t nmissing = 0;
+    for (size_t i = 0; i < cpriv->bs_ngaps; i++) {
+        nmissing += cpriv->bs_gaps[i].len;
+    }
+    if (cpriv->bs_ngaps &&
+        ch_storage_write_gaps(cpriv->bs_cfg->chns, cpriv->bs_gaps,
+                              cpriv->bs_ngaps) == -1) {
+        log_ERR("%s: can't write gap table", __func__);
+    }
     if (ch_storage_close(cpriv->bs_cfg->chns) == -1) {
         log_ERR("%s: can't close channel storage", __func__);
     }
+    struct ch_storage_stats cstats;
+    int have_cstats = (store->has_compression &&
+                       store->compression !=
+                       STORAGE_COMPRESSION__COMPRESS_NONE &&
+                       ch_storage_stats(cpriv->bs_cfg->chns, &cstats) == 0);
     ch_storage_free(cpriv->bs_cfg->chns);
     free(cpriv->bs_cfg);
     cpriv->bs_cfg = NULL;
@@ -497,11 +656,82 @@ static void client_send_store_res(struct control_session *cs, short events)
     cpriv->bs_restarted = 0;
     client_unpend_restart(cs);
     cpriv->bs_nwritten_cache = 0;
+    size_t peak_bufs = cpriv->bs_peak_bufs;
+    int64_t first_write_usec = cpriv->bs_first_write_usec;
+    size_t nrestarts = cpriv->bs_nrestarts;
+    size_t nreordered = cpriv->bs_nreordered;
+    size_t npauses = cpriv->bs_npauses;
+    size_t nforeign = cpriv->bs_nforeign;
+    size_t nforwarded = cpriv->bs_nforwarded;
+    size_t nfwd_dropped = cpriv->bs_nfwd_dropped;
+    size_t nrereads = cpriv->bs_nrereads;
+    size_t ngaps = cpriv->bs_ngaps;
+    cpriv->bs_peak_bufs = 0;
+    cpriv->bs_first_write_usec = -1;
+    cpriv->bs_nrestarts = 0;
+    cpriv->bs_nreordered = 0;
+    cpriv->bs_npauses = 0;
+    cpriv->bs_nforeign = 0;
+    cpriv->bs_nforwarded = 0;
+    cpriv->bs_nfwd_dropped = 0;
+    cpriv->bs_base_sample = -1;
+    cpriv->bs_ngaps = 0;
+    cpriv->bs_rereading = 0;
+    cpriv->bs_nrereads = 0;
 
     /* Send the result. */
     res_store.has_status = 1;
     res_store.has_nsamples = 1;
     res_store.nsamples = nsamples;
+    res_store.has_peak_buffers = 1;
+    res_store.peak_buffers = peak_bufs;
+    if (first_write_usec >= 0) {
+        res_store.has_first_write_usec = 1;
+        res_store.first_write_usec = (uint64_t)first_write_usec;
+    }
+    res_store.has_restarts = 1;
+    res_store.restarts = nrestarts;
+    res_store.has_reordered = 1;
+    res_store.reordered = nreordered;
+    res_store.has_stalls = 1;
+    res_store.stalls = npauses;
+    res_store.has_foreign = 1;
+    res_store.foreign = nforeign;
+    if (nforwarded || nfwd_dropped) {
+        res_store.has_forwarded = 1;
+        res_store.forwarded = nforwarded;
+        res_store.has_forward_drops = 1;
+        res_store.forward_drops = nfwd_dropped;
+    }
+    res_store.has_rereads = 1;
+    res_store.rereads = nrereads;
+    res_store.has_gaps = 1;
+    res_store.gaps = ngaps;
+    res_store.has_missing = 1;
+    res_store.missing = nmissing;
+    float thread_mbps[CH_STORAGE_MAX_THREADS];
+    if (have_cstats) {
+        res_store.has_sample_bytes = 1;
+        res_store.sample_bytes = cstats.nbytes_in;
+        res_store.has_stored_bytes = 1;
+        res_store.stored_bytes = cstats.nbytes_out;
+        for (size_t i = 0; i < cstats.nthreads; i++) {
+            /* bytes per microsecond is MB/s */
+            thread_mbps[i] = (cstats.threads[i].busy_ns ?
+                              (float)(cstats.threads[i].nbytes_in * 1000.0 /
+                                      cstats.threads[i].busy_ns) :
+                              0.0f);
+            log_INFO("compression thread %zu: %.1f MB/s", i,
+                     thread_mbps[i]);
+        }
+        res_store.n_compress_thread_mbps = cstats.nthreads;
+        res_store.compress_thread_mbps = thread_mbps;
+        log_INFO("stored %llu bytes of samples in %llu (%.2f:1)",
+                 (unsigned long long)cstats.nbytes_in,
+                 (unsigned long long)cstats.nbytes_out,
+                 (cstats.nbytes_out ?
+                  (double)cstats.nbytes_in / cstats.nbytes_out : 0.0));
+    }
     res_store.path = cpriv->c_cmd->store->path;
     if (events & SAMPLE_BS_DONE) {
         res_store.status = CONTROL_RES_STORE__STATUS__DONE;
@@ -652,7 +882,12 @@ static void client_update_bs_status(struct control_session *cs,
                                     size_t nwritten)
 {
     struct client_priv *cpriv = cs->cpriv;
-    cpriv->bs_nwritten_cache += nwritten;
+    if (cpriv->bs_rereading) {
+        /* Those were already counted the first time around. */
+        cpriv->bs_cfg->overwrite_at += nwritten;
+    } else {
+        cpriv->bs_nwritten_cache += nwritten;
+    }
     cpriv->bs_cfg->nsamples -= nwritten;
     cpriv->bs_cfg->start_sample += nwritten;
 }
@@ -759,6 +994,7 @@ static void client_do_sample_store_restart(struct control_session *cs,
     } else {
         cpriv->bs_restarted++;
     }
+    cpriv->bs_nrestarts++;
     if (client_is_response_pending(cs)) {
         assert(cpriv->bs_restart_pending != -1);
         assert(cpriv->bs_response_pend_evt);
@@ -780,6 +1016,74 @@ static void client_do_sample_store_restart(struct control_session *cs,
     }
 }
 
+/* Remember the gaps a transfer left, so we can read them again later
+ * (canned stores) or list them in the file (live ones). There's
+ * always room for one more afterwards, in case a re-read has to give
+ * back part of its gap. Returns -1 if we're out of memory.
+ *
+ * NOT SYNCHRONIZED (mtx) */
+static int client_save_gaps(struct control_session *cs,
+                            const struct sample_bsamp_stats *stats)
+{
+    struct client_priv *cpriv = cs->cpriv;
+    size_t need = cpriv->bs_ngaps + stats->ngaps;
+    if (need >= cpriv->bs_gaps_cap) {
+        struct ch_gap *gaps = realloc(cpriv->bs_gaps,
+                                      (need + 1) * sizeof(*gaps));
+        if (!gaps) {
+            log_ERR("out of memory; can't save %zu board sample gaps",
+                    stats->ngaps);
+            return -1;
+        }
+        cpriv->bs_gaps = gaps;
+        cpriv->bs_gaps_cap = need + 1;
+    }
+    memcpy(cpriv->bs_gaps + cpriv->bs_ngaps, stats->gaps,
+           stats->ngaps * sizeof(*stats->gaps));
+    cpriv->bs_ngaps = need;
+    return 0;
+}
+
+/* A canned sample storage operation reached the end, but skipped
+ * over some dropped packets. Read the next gap again, and write it
+ * over the placeholders the transfer left there.
+ *
+ * NOT SYNCHRONIZED (mtx) */
+static void client_do_sample_store_reread(struct control_session *cs,
+                                          size_t nwritten)
+{
+    /* You can't call this while transactions are ongoing. */
+    struct client_priv *cpriv = cs->cpriv;
+    assert(cpriv->bs_ngaps);
+    assert(nwritten == cpriv->bs_cfg->nsamples);
+    assert(cpriv->bs_base_sample >= 0);
+    client_update_bs_status(cs, nwritten);
+    control_clear_transactions(cs, 1);
+    if (client_is_response_pending(cs)) {
+        assert(cpriv->bs_restart_pending != -1);
+        assert(cpriv->bs_response_pend_evt);
+        client_unpend_restart(cs);
+    }
+    if (cpriv->bs_nrereads == MAX_GAP_REREADS) {
+        log_WARNING("read gaps again %u times; leaving %zu unfilled",
+                    MAX_GAP_REREADS, cpriv->bs_ngaps);
+        client_send_store_res(cs, SAMPLE_BS_PKTDROP);
+        return;
+    }
+    struct ch_gap *gap = &cpriv->bs_gaps[--cpriv->bs_ngaps];
+    cpriv->bs_cfg->start_sample = (ssize_t)gap->start;
+    cpriv->bs_cfg->nsamples = gap->len;
+    cpriv->bs_cfg->overwrite_at =
+        (ssize_t)gap->start - cpriv->bs_base_sample;
+    cpriv->bs_rereading = 1;
+    cpriv->bs_restarted = 1;
+    cpriv->bs_nrereads++;
+    log_DEBUG("reading %zu board samples starting at %zu again",
+              (size_t)gap->len, (size_t)gap->start);
+    cs->wake_why |= CONTROL_WHY_CLIENT_CMD;
+    control_must_signal(cs);
+}
+
 /* Used so the sample.h API can report sample storage results.  */
 static void client_sample_store_callback(short events, size_t nwritten,
                                          void *csvp)
@@ -793,13 +1097,37 @@ static void client_sample_store_callback(short events, size_t nwritten,
     assert(cpriv->c_cmd);
     store = cpriv->c_cmd->store;
     assert(store);
+    int called_again = client_is_response_pending(cs);
+    if (!called_again) {
+        /* The transfer just ended; see how it went. */
+        struct sample_bsamp_stats stats;
+        sample_get_bsamp_stats(cs->smpl, &stats);
+        if (stats.peak_bufs > cpriv->bs_peak_bufs) {
+            cpriv->bs_peak_bufs = stats.peak_bufs;
+        }
+        if (cpriv->bs_first_write_usec == -1) {
+            cpriv->bs_first_write_usec = stats.first_write_usec;
+        }
+        cpriv->bs_nreordered += stats.nreordered;
+        cpriv->bs_npauses += stats.npauses;
+        cpriv->bs_nforeign += stats.nforeign;
+        cpriv->bs_nforwarded += stats.nforwarded;
+        cpriv->bs_nfwd_dropped += stats.nfwd_dropped;
+        if (client_save_gaps(cs, &stats) == -1) {
+            events = SAMPLE_BS_ERR;
+        }
+    }
 
-    if (client_is_response_pending(cs) && cpriv->bs_restart_pending != -1) {
+    if (called_again && cpriv->bs_restart_pending != -1) {
         /* We're being called again after a previous restart attempt
          * couldn't go forward due to an unfinished transaction. */
         assert(!control_is_txn_timeout_pending(cs));
         assert((size_t)(cpriv->bs_restart_pending) == nwritten);
-        client_do_sample_store_restart(cs, nwritten);
+        if (events & SAMPLE_BS_DONE) {
+            client_do_sample_store_reread(cs, nwritten);
+        } else {
+            client_do_sample_store_restart(cs, nwritten);
+        }
     } else if (store->has_start_sample && (events & SAMPLE_BS_PKTDROP)) {
         /* We're storing canned samples and we dropped a packet.
          * Update and restart the transfer. */
@@ -811,11 +1139,20 @@ static void client_sample_store_callback(short events, size_t nwritten,
         } else {
             client_do_sample_store_restart(cs, nwritten);
         }
+    } else if (store->has_start_sample && (events & SAMPLE_BS_DONE) &&
+               cpriv->bs_ngaps) {
+        /* We're storing canned samples and got to the end, but
+         * skipped some along the way. Go back for them. */
+        if (control_is_txn_timeout_pending(cs)) {
+            client_schedule_sample_store_restart(cs, events, nwritten);
+        } else {
+            client_do_sample_store_reread(cs, nwritten);
+        }
     } else {
         /* Otherwise, we're done with this command. Send the response
          * now if we can, or after we've finished our next register
          * I/O transaction otherwise. */
-        cpriv->bs_nwritten_cache += nwritten;
+        client_update_bs_status(cs, nwritten);
         if (control_is_txn_timeout_pending(cs)) {
             client_schedule_sample_store_finished(cs, events);
         } else {
@@ -859,6 +1196,20 @@ static int client_start(struct control_session *cs)
     priv->bs_response_pend_evt = NULL;
     priv->bs_pending_events = 0;
     priv->bs_nwritten_cache = 0;
+    priv->bs_peak_bufs = 0;
+    priv->bs_first_write_usec = -1;
+    priv->bs_nrestarts = 0;
+    priv->bs_nreordered = 0;
+    priv->bs_npauses = 0;
+    priv->bs_nforeign = 0;
+    priv->bs_nforwarded = 0;
+    priv->bs_nfwd_dropped = 0;
+    priv->bs_base_sample = -1;
+    priv->bs_gaps = NULL;
+    priv->bs_ngaps = 0;
+    priv->bs_gaps_cap = 0;
+    priv->bs_rereading = 0;
+    priv->bs_nrereads = 0;
     cs->cpriv = priv;
     client_reset_state_locked(cs); /* worker isn't started; don't
                                     * bother locking */
@@ -1376,6 +1727,39 @@ static int client_start_txns_store(struct control_session *cs)
     return 0;
 }
 
+/* NOT SYNCHRONIZED
+ *
+ * Like client_start_txns_store(), but for reading a gap in a canned
+ * store again once the rest is done. The network and UDP setup from
+ * last time still holds, so just point the SATA reads at the gap.
+ * No response is sent on error.
+ */
+static int client_start_txns_reread(struct control_session *cs)
+{
+    struct client_priv *cpriv = cs->cpriv;
+    const size_t ntxns = 5;
+    struct control_txn *txns = malloc(ntxns * sizeof(struct control_txn));
+    size_t txno = 0;
+    if (!txns) {
+        return -1;
+    }
+    assert(cpriv->bs_restarted);
+
+    /* As in client_start_txns_store(), the order matters. */
+    client_sata_w(txns + txno++, RAW_RADDR_SATA_MODE, RAW_SATA_MODE_WAIT);
+    client_sata_w(txns + txno++,
+                  RAW_RADDR_SATA_R_IDX, cpriv->bs_cfg->start_sample);
+    client_sata_w(txns + txno++,
+                  RAW_RADDR_SATA_R_LEN, cpriv->bs_cfg->nsamples);
+    /* UDP is still enabled, but this is what gets us to expect the
+     * board samples (see client_process_res_store()). */
+    client_udp_w(txns + txno++, RAW_RADDR_UDP_ENABLE, 1);
+    client_sata_w(txns + txno++, RAW_RADDR_SATA_MODE, RAW_SATA_MODE_READ);
+
+    client_start_txns(cs, txns, txno, ntxns);
+    return 0;
+}
+
 /* Check that the last transaction succeeded. Send an error response
  * and return -1 if it didn't. Return 0 if the transaction
  * succeeded. */
@@ -1508,6 +1892,130 @@ static void client_process_res_regio(struct control_session *cs)
     client_send_response(cs, &cr);
 }
 
+static enum sample_forward client_sample_forward(SampleType stype)
+{
+    switch (stype) {
+    case SAMPLE_TYPE__BOARD_SAMPLE:
+        return SAMPLE_FWD_BSMP;
+    case SAMPLE_TYPE__BOARD_SUBSAMPLE:
+        return SAMPLE_FWD_BSUB;
+    case SAMPLE_TYPE__BOARD_SUBSAMPLE_RAW:
+        return SAMPLE_FWD_BSUB_RAW;
+    case SAMPLE_TYPE__BOARD_SAMPLE_RAW:
+        return SAMPLE_FWD_BSMP_RAW;
+    default:
+        return SAMPLE_FWD_NOTHING;
+    }
+}
+
+/* Get the forwarding options a ControlCmdForward wants. On success,
+ * returns 0 and fills in opts; free opts->chans when you're done with
+ * it. On failure, sends an error response and returns -1. */
+static int client_forward_opts(struct control_session *cs,
+                               ControlCmdForward *forward,
+                               struct sample_fwd_opts *opts)
+{
+    size_t n = forward->n_chips;
+    memset(opts, 0, sizeof(*opts));
+    if (forward->n_channels != n) {
+        CLIENT_RES_ERR_C_PROTO(cs, "chips and channels must be parallel");
+        return -1;
+    }
+    opts->every_nth = forward->has_every_nth ? forward->every_nth : 1;
+    opts->decimate = forward->has_decimate ? forward->decimate : 1;
+    opts->envelope = forward->has_envelope && forward->envelope;
+    opts->compact = forward->has_compact && forward->compact;
+    if (opts->decimate > 1 &&
+        forward->sample_type != SAMPLE_TYPE__BOARD_SAMPLE &&
+        forward->sample_type != SAMPLE_TYPE__BOARD_SAMPLE_RAW) {
+        CLIENT_RES_ERR_C_VALUE(cs, "decimation needs board samples");
+        return -1;
+    }
+    if (opts->envelope &&
+        (opts->decimate <= 1 ||
+         forward->sample_type != SAMPLE_TYPE__BOARD_SAMPLE || n)) {
+        CLIENT_RES_ERR_C_VALUE(cs, "envelopes need decimated BOARD_SAMPLE "
+                               "and all channels");
+        return -1;
+    }
+    if (opts->decimate > 1 && opts->every_nth > 1) {
+        CLIENT_RES_ERR_C_VALUE(cs, "can't decimate and use every_nth");
+        return -1;
+    }
+    if (opts->compact &&
+        forward->sample_type != SAMPLE_TYPE__BOARD_SUBSAMPLE &&
+        (forward->sample_type != SAMPLE_TYPE__BOARD_SAMPLE || !n)) {
+        CLIENT_RES_ERR_C_VALUE(cs, "compact encoding needs BOARD_SUBSAMPLE "
+                               "or a channel list");
+        return -1;
+    }
+    if (!n) {
+        return 0;
+    }
+    if (forward->sample_type != SAMPLE_TYPE__BOARD_SAMPLE) {
+        CLIENT_RES_ERR_C_VALUE(cs, "channel lists need BOARD_SAMPLE");
+        return -1;
+    }
+    struct sample_chan *chans = malloc(n * sizeof(*chans));
+    if (!chans) {
+        CLIENT_RES_ERR_DAEMON(cs, "out of memory");
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        chans[i].chip = forward->chips[i];
+        chans[i].chan = forward->channels[i];
+    }
+    opts->chans = chans;
+    opts->nchans = n;
+    return 0;
+}
+
+static void client_process_cmd_subscribe(struct control_session *cs,
+                                         ControlCmdForward *forward)
+{
+    if (!forward->has_dest_udp_addr4) {
+        CLIENT_RES_ERR_C_PROTO(cs, "subscribing needs a UDP address/port");
+        return;
+    }
+    struct sockaddr_in saddr = {
+        .sin_family = AF_INET,
+        .sin_port = htons((uint16_t)forward->dest_udp_port),
+        .sin_addr.s_addr = htonl(forward->dest_udp_addr4),
+    };
+    memset(&saddr.sin_zero, 0, sizeof(saddr.sin_zero));
+    struct sockaddr *sa = (struct sockaddr*)&saddr;
+
+    if (!forward->subscribe) {
+        if (sample_remove_subscriber(cs->smpl, sa)) {
+            CLIENT_RES_ERR_C_VALUE(cs, "no such subscriber");
+            return;
+        }
+        client_send_success(cs);
+        return;
+    }
+    enum sample_forward fwd = client_sample_forward(forward->sample_type);
+    if (fwd == SAMPLE_FWD_NOTHING) {
+        CLIENT_RES_ERR_C_VALUE(cs, "unknown sample_type");
+        return;
+    }
+    if (forward->has_multicast_ttl &&
+        sample_set_multicast_ttl(cs->smpl, forward->multicast_ttl)) {
+        CLIENT_RES_ERR_C_VALUE(cs, "can't set multicast TTL");
+        return;
+    }
+    struct sample_fwd_opts opts;
+    if (client_forward_opts(cs, forward, &opts)) {
+        return;
+    }
+    int err = sample_add_subscriber(cs->smpl, sa, fwd, &opts);
+    free((void*)opts.chans);
+    if (err) {
+        CLIENT_RES_ERR_C_VALUE(cs, "too many subscribers, or bad channels");
+        return;
+    }
+    client_send_success(cs);
+}
+
 static void client_process_cmd_forward(struct control_session *cs)
 {
     struct client_priv *cpriv = cs->cpriv;
@@ -1535,6 +2043,12 @@ static void client_process_cmd_forward(struct control_session *cs)
         forward->sample_type = SAMPLE_TYPE__BOARD_SUBSAMPLE;
     }
 
+    /* Subscriber management doesn't touch the data node. */
+    if (forward->has_subscribe) {
+        client_process_cmd_subscribe(cs, forward);
+        return;
+    }
+
     /*
      * Reconfigure sample conversion address/port if necessary
      */
@@ -1561,6 +2075,22 @@ static void client_process_cmd_forward(struct control_session *cs)
      * Prepare transactions
      */
     if (forward->enable) {
+        struct sample_fwd_opts opts;
+        enum sample_forward fwd = client_sample_forward(forward->sample_type);
+        if (fwd == SAMPLE_FWD_NOTHING) {
+            CLIENT_RES_ERR_C_VALUE(cs, "unknown sample_type");
+            return;
+        }
+        if (client_forward_opts(cs, forward, &opts)) {
+            return;
+        }
+        int err = sample_cfg_forward_opts(cs->smpl, fwd, &opts);
+        free((void*)opts.chans);
+        if (err) {
+            CLIENT_RES_ERR_C_VALUE(cs, "bad chip or channel, or out of "
+                                   "memory");
+            return;
+        }
         client_clear_dnode_addr_storage(cs);
         uint32_t daq_udp_mode;
         switch (forward->sample_type) {
@@ -1632,13 +2162,8 @@ static void client_process_res_forward(struct control_session *cs)
         CLIENT_RES_ERR_DAEMON(cs, "can't configure data node address");
         return;
     }
-    SampleType stype = forward->sample_type;
-    enum sample_forward fwd = !forward->enable ? SAMPLE_FWD_NOTHING :
-        (stype == SAMPLE_TYPE__BOARD_SAMPLE ? SAMPLE_FWD_BSMP :
-         stype == SAMPLE_TYPE__BOARD_SUBSAMPLE ? SAMPLE_FWD_BSUB :
-         stype == SAMPLE_TYPE__BOARD_SUBSAMPLE_RAW ? SAMPLE_FWD_BSUB_RAW :
-         stype == SAMPLE_TYPE__BOARD_SAMPLE_RAW ? SAMPLE_FWD_BSMP_RAW :
-         SAMPLE_FWD_NOTHING);
+    enum sample_forward fwd = (!forward->enable ? SAMPLE_FWD_NOTHING :
+                               client_sample_forward(forward->sample_type));
     if (fwd == SAMPLE_FWD_NOTHING && forward->enable) {
         CLIENT_RES_ERR_C_PROTO(cs, "unknown sample_type");
         return;
@@ -1673,12 +2198,77 @@ static void client_process_cmd_store(struct control_session *cs)
         CLIENT_RES_ERR_C_PROTO(cs, "nsamples and start_sample both omitted");
         goto bail;
     }
+    if (store->has_hdf5_chunk_samples &&
+        (store->hdf5_chunk_samples == 0 ||
+         (store->hdf5_chunk_samples >
+          UINT32_MAX / sizeof(struct raw_pkt_bsmp)))) {
+        CLIENT_RES_ERR_C_PROTO(cs, "invalid hdf5_chunk_samples");
+        goto bail;
+    }
+    if (store->has_hdf5_deflate && store->hdf5_deflate > 9) {
+        CLIENT_RES_ERR_C_PROTO(cs, "invalid hdf5_deflate");
+        goto bail;
+    }
+    if (store->has_hdf5_channel_chunk_samples &&
+        (store->hdf5_channel_chunk_samples == 0 ||
+         (store->hdf5_channel_chunk_samples >
+          UINT32_MAX / (HDF5_CH_COL_CHUNK_NCHANS * sizeof(raw_samp_t))))) {
+        CLIENT_RES_ERR_C_PROTO(cs, "invalid hdf5_channel_chunk_samples");
+        goto bail;
+    }
+    if (store->has_hdf5_channel_major && store->hdf5_channel_major &&
+        store->has_hdf5_direct_chunk && store->hdf5_direct_chunk) {
+        CLIENT_RES_ERR_C_PROTO(cs, "hdf5_direct_chunk doesn't work with "
+                               "hdf5_channel_major");
+        goto bail;
+    }
+    if (store->has_compression &&
+        (store->compression < 0 ||
+         (int)store->compression >= COMPRESS_NCODECS)) {
+        CLIENT_RES_ERR_C_PROTO(cs, "invalid compression");
+        goto bail;
+    }
+    if (store->has_compress_level && store->compress_level > INT_MAX) {
+        CLIENT_RES_ERR_C_PROTO(cs, "invalid compress_level");
+        goto bail;
+    }
+    if (store->has_compress_threads &&
+        store->compress_threads > CH_STORAGE_MAX_THREADS) {
+        CLIENT_RES_ERR_C_PROTO(cs, "invalid compress_threads");
+        goto bail;
+    }
+    if (store->has_raw_frame_samples &&
+        (store->raw_frame_samples == 0 ||
+         (store->raw_frame_samples >
+          UINT32_MAX / sizeof(struct raw_pkt_bsmp)))) {
+        CLIENT_RES_ERR_C_PROTO(cs, "invalid raw_frame_samples");
+        goto bail;
+    }
+    if (store->has_compression &&
+        store->compression != STORAGE_COMPRESSION__COMPRESS_NONE &&
+        store->has_hdf5_deflate && store->hdf5_deflate) {
+        CLIENT_RES_ERR_C_PROTO(cs, "compression doesn't work with "
+                               "hdf5_deflate");
+        goto bail;
+    }
 
     /* Massage the command to set defaults */
     if (!store->has_backend) {
         store->has_backend = 1;
         store->backend = DEFAULT_STORAGE_BACKEND;
     }
+    if (store->backend == STORAGE_BACKEND__STORE_HDF5 &&
+        store->has_compression &&
+        store->compression == STORAGE_COMPRESSION__COMPRESS_DELTA_ZSTD) {
+        CLIENT_RES_ERR_C_PROTO(cs, "delta compression is raw-only");
+        goto bail;
+    }
+    if (store->backend == STORAGE_BACKEND__STORE_DIRECT &&
+        store->has_compression &&
+        store->compression != STORAGE_COMPRESSION__COMPRESS_NONE) {
+        CLIENT_RES_ERR_C_PROTO(cs, "STORE_DIRECT can't compress");
+        goto bail;
+    }
 
     if (!cpriv->bs_restarted) {
         /* If this isn't a restarted storage operation, then create
@@ -1694,7 +2284,26 @@ static void client_process_cmd_store(struct control_session *cs)
                                 (ssize_t)store->start_sample : -1);
 
         assert(!cpriv->bs_cfg);
-        chns = client_new_ch_storage(store->path, store->backend);
+        if (sample_cfg_bsamp_bufs(cs->smpl,
+                                  store->has_nbuffers ? store->nbuffers : 0,
+                                  (store->has_buffer_msec ?
+                                   store->buffer_msec : 0)) == -1) {
+            CLIENT_RES_ERR_DAEMON(cs, "can't allocate sample buffers");
+            goto bail;
+        }
+        cpriv->bs_peak_bufs = 0;
+        cpriv->bs_first_write_usec = -1;
+        cpriv->bs_nrestarts = 0;
+        cpriv->bs_nreordered = 0;
+        cpriv->bs_npauses = 0;
+        cpriv->bs_nforeign = 0;
+        cpriv->bs_nforwarded = 0;
+        cpriv->bs_nfwd_dropped = 0;
+        cpriv->bs_base_sample = start_sample;
+        cpriv->bs_ngaps = 0;
+        cpriv->bs_rereading = 0;
+        cpriv->bs_nrereads = 0;
+        chns = client_new_ch_storage(store, nsamples);
         if (!chns) {
             CLIENT_RES_ERR_DAEMON_OOM(cs);
             goto bail;
@@ -1713,6 +2322,12 @@ static void client_process_cmd_store(struct control_session *cs)
         bs_cfg->nsamples = nsamples;
         bs_cfg->start_sample = start_sample;
         bs_cfg->chns = chns;
+        /* Canned samples can be read again, so there's no need to
+         * stop for dropped packets until the end. Live ones can't,
+         * so skipping them is up to the client. */
+        bs_cfg->fill_gaps = (start_sample != -1 ||
+                             (store->has_fill_gaps && store->fill_gaps));
+        bs_cfg->overwrite_at = -1;
         cpriv->bs_cfg = bs_cfg;
     } else {
         /* Otherwise, we're restarting a channel storage operation
@@ -1730,7 +2345,9 @@ static void client_process_cmd_store(struct control_session *cs)
             goto bail;
         }
     } else {
-        if (client_start_txns_store(cs) == -1) {
+        if ((cpriv->bs_rereading ?
+             client_start_txns_reread(cs) :
+             client_start_txns_store(cs)) == -1) {
             if (cpriv->bs_restarted) {
                 /* If we failed to restart the storage, the client needs
                  * to know how far along we got. */
@@ -89,20 +89,37 @@ static void usage(int exit_status)
            "Options:\n"
            "  -A, --dnode-address"
            "\tConnect to data node at this address, default %s\n"
+           "  -B, --rx-busy-poll"
+           "\tSet SO_BUSY_POLL on the data socket to this many usec\n"
            "  -c, --client-port"
            "\tListen here for client control socket connections, default %d\n"
            "  -d, --dnode-port"
            "\tConnect to data node on this port, default %d\n"
+           "  -F, --rx-fifo"
+           "\tRun the receive thread SCHED_FIFO at this priority\n"
            "  -h, --help"
            "\t\tPrint this message and quit\n"
            "  -I, --sample-iface"
            "\tNetwork interface to receive samples on, default %s\n"
+           "  -M, --shm"
+           "\t\tPublish samples in shared memory; local readers get it\n"
+           "\t\tby connecting to a Unix domain socket at this path\n"
            "  -N, --dont-daemonize"
            "\tSkip daemonization; logs also go to stderr\n"
+           "  -P, --rx-cpu"
+           "\tPin the receive thread to this CPU\n"
+           "  -R, --rx-thread"
+           "\tReceive samples on a dedicated thread, not the event loop\n"
            "  -s, --sample-port"
-           "\tCreate data node data socket here, default %d\n",
+           "\tCreate data node data socket here, default %d\n"
+           "  -U, --rx-unfiltered"
+           "\tDon't filter data socket packets in the kernel\n"
+           "  -W, --rx-reorder-window"
+           "\tTolerate board samples arriving up to this many packets\n"
+           "\t\tearly, default %u (0 treats any reordering as a drop)\n",
            program_name, DUMMY_DNODE_ADDRESS, DAEMON_CLIENT_PORT,
-           DNODE_LISTEN_PORT, DAEMON_SAMPLE_IFACE, DAEMON_SAMPLE_PORT);
+           DNODE_LISTEN_PORT, DAEMON_SAMPLE_IFACE, DAEMON_SAMPLE_PORT,
+           SAMPLE_RX_REORDER_DEFAULT);
     exit(exit_status);
 }
 
@@ -111,8 +128,10 @@ static void usage(int exit_status)
           .dnode_addr = DUMMY_DNODE_ADDRESS,                    \
           .dnode_port = DNODE_LISTEN_PORT,                      \
           .sample_iface = DAEMON_SAMPLE_IFACE,                  \
+          .shm_path = NULL,                                     \
           .sample_port = DAEMON_SAMPLE_PORT,                    \
           .dont_daemonize = 0,                                  \
+          .rx = SAMPLE_RX_CFG_DEFAULT,                          \
         }
 
 struct arguments {
@@ -120,20 +139,26 @@ struct arguments {
     char     *dnode_addr;       /* Connect to dnode at this address */
     uint16_t  dnode_port;       /* Connect to dnode at this port */
     char     *sample_iface;     /* Use this interface to receive samples */
+    char     *shm_path;         /* Shared memory readers connect here */
     uint16_t  sample_port;      /* Receive dnode samples here */
     int       dont_daemonize;   /* Skip daemonization. */
+    struct sample_rx_cfg rx;    /* Sample receive configuration */
 };
 
 static void parse_args(struct arguments* args, int argc, char *const argv[])
 {
     int print_usage = 0;
-    const char shortopts[] = "A:c:d:hI:Ns:";
+    const char shortopts[] = "A:B:c:d:F:hI:M:NP:Rs:UW:";
     struct option longopts[] = {
         /* Keep these sorted with shortopts. */
         { .name = "dnode-address", /* -A */
           .has_arg = required_argument,
           .flag = NULL,
           .val = 'A' },
+        { .name = "rx-busy-poll", /* -B */
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'B' },
         { .name = "client-port", /* -c */
           .has_arg = required_argument,
           .flag = NULL,
@@ -142,6 +167,10 @@ static void parse_args(struct arguments* args, int argc, char *const argv[])
           .has_arg = required_argument,
           .flag = NULL,
           .val = 'd' },
+        { .name = "rx-fifo",    /* -F */
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'F' },
         { .name = "help",       /* -h */
           .has_arg = no_argument,
           .flag = &print_usage,
@@ -150,14 +179,34 @@ static void parse_args(struct arguments* args, int argc, char *const argv[])
           .has_arg = required_argument,
           .flag = NULL,
           .val = 'I' },
+        { .name = "shm",        /* -M */
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'M' },
         { .name = "dont-daemonize", /* -N */
           .has_arg = no_argument,
           .flag = &args->dont_daemonize,
           .val = 1 },
+        { .name = "rx-cpu",     /* -P */
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'P' },
+        { .name = "rx-thread",  /* -R */
+          .has_arg = no_argument,
+          .flag = &args->rx.thread,
+          .val = 1 },
         { .name = "sample-port", /* -s */
           .has_arg = required_argument,
           .flag = NULL,
           .val = 's' },
+        { .name = "rx-unfiltered", /* -U */
+          .has_arg = no_argument,
+          .flag = &args->rx.unfiltered,
+          .val = 1 },
+        { .name = "rx-reorder-window", /* -W */
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'W' },
         {0, 0, 0, 0},
     };
     /* TODO add error handling in strtol() argument conversion */
@@ -179,23 +228,44 @@ static void parse_args(struct arguments* args, int argc, char *const argv[])
                 panic("out of memory");
             }
             break;
+        case 'B':
+            args->rx.busy_poll_usec = strtol(optarg, (char**)0, 10);
+            break;
         case 'c':
             args->client_port = strtol(optarg, (char**)0, 10);
             break;
         case 'd':
             args->dnode_port = strtol(optarg, (char**)0, 10);
             break;
+        case 'F':
+            args->rx.fifo_prio = strtol(optarg, (char**)0, 10);
+            break;
         case 'h':
             usage(EXIT_SUCCESS);
         case 'I':
             args->sample_iface = optarg;
             break;
+        case 'M':
+            args->shm_path = optarg;
+            break;
         case 'N':
             args->dont_daemonize = 1;
             break;
+        case 'P':
+            args->rx.cpu = strtol(optarg, (char**)0, 10);
+            break;
+        case 'R':
+            args->rx.thread = 1;
+            break;
         case 's':
             args->sample_port = strtol(optarg, (char**)0, 10);
             break;
+        case 'U':
+            args->rx.unfiltered = 1;
+            break;
+        case 'W':
+            args->rx.reorder_window = strtoul(optarg, (char**)0, 10);
+            break;
         case '?': /* Fall through. */
         default:
             usage(EXIT_FAILURE);
@@ -248,12 +318,18 @@ run_event_loop(struct arguments *args)
         log_EMERG("unknown network interface %s", args->sample_iface);
         goto nosample;
     }
-    struct sample_session *sample = sample_new(base, iface, args->sample_port);
+    struct sample_session *sample = sample_new(base, iface, args->sample_port,
+                                               &args->rx);
     if (!sample) {
         log_EMERG("can't create sample session, iface %u, port %u",
                   iface, args->sample_port);
         goto nosample;
     }
+    if (args->shm_path &&
+        sample_publish_shm(sample, args->shm_path, 0) == -1) {
+        log_EMERG("can't publish samples in shared memory");
+        goto nocontrol;
+    }
     struct control_session *control = control_new(base, args->client_port,
                                                   args->dnode_addr,
                                                   args->dnode_port,
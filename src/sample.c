@@ -16,22 +16,35 @@
 #include "sample.h"
 
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <event2/event.h>
 #include <event2/util.h>
 
 #include "ch_storage.h"
+#include "config.h"
+#include "decimate.h"
+#include "dnode_pack.h"
 #include "logging.h"
 #include "raw_packets.h"
 #include "safe_pthread.h"
+#include "shm_ring.h"
 #include "sockutil.h"
+#include "spsc_ring.h"
 #include "type_attrs.h"
 #include "proto/control.pb-c.h"
 #include "proto/data.pb-c.h"
@@ -50,6 +63,12 @@ static void sample_timeout_callback(evutil_socket_t, short, void*);
 #define SAMPLE_THREAD_ERR  EV_WRITE
 #define SAMPLE_THREAD_SLEEPING EV_TIMEOUT
 static void sample_worker_callback(evutil_socket_t, short, void*);
+static void sample_resume_reader(struct sample_session*);
+static void sample_update_filter(struct sample_session*);
+static void* sample_fwd_main(void*);
+static void sample_fwd_tee_prepare(struct sample_session*);
+static void sample_fwd_tee(struct sample_session*, const struct raw_pkt_bsmp*);
+static void sample_fwd_flush(struct sample_session*);
 
 union sample_packet {
     struct raw_pkt_bsub bsub;
@@ -64,7 +83,7 @@ enum sample_worker_why {
                                  * please wake it up to ACK that
                                  * you're done and are going to
                                  * sleep. */
-    SAMPLE_WHY_BSAMPS = 0x04,   /* Board samples waiting to be written */
+    SAMPLE_WHY_BSAMPS = 0x04,   /* Board sample slabs waiting to be written */
 };
 
 /* Reasons why we're stopping board sample storage */
@@ -76,23 +95,109 @@ enum sample_stop_why {
     SAMPLE_STOP_PKT_ERR,
 };
 
-#define SAMPLE_PBUF_ARR_SIZE (1024 * 1024)
 #define SAMPLE_BSAMP_KHZ 30 /* sample frequency; TODO: don't hard-code here */
-#define SAMPLE_BSAMP_SEC_P_BUF 0.5 /* seconds of data per sample buffer */
-#define SAMPLE_BSAMP_MAXLEN ((size_t)(SAMPLE_BSAMP_KHZ * 1000 * \
-                                      SAMPLE_BSAMP_SEC_P_BUF))
+#define SAMPLE_BSAMP_MSEC_P_SLAB 50 /* default milliseconds of data per slab */
+#define SAMPLE_BSAMP_NSLABS 20 /* default slabs in the ring */
 #define SAMPLE_BSAMP_TIMEOUT_SEC 3 /* WISHLIST: be smarter */
 #define SAMPLE_BSAMP_TIMEOUT_USEC 0
 #define SAMPLE_MAX_CONSECUTIVE_BAD_PKTS 20
+#define SAMPLE_BSAMP_NFILLERS 32 /* placeholders written at a time */
+#define SAMPLE_FWD_SLAB_PKTS CONFIG_SAMPLE_RECV_BATCH /* per fwd_ring slab */
+#define SAMPLE_FWD_NSLABS 64    /* slabs in fwd_ring */
+#define SAMPLE_FWD_MAX_DESTS (SAMPLE_MAX_SUBSCRIBERS + 1) /* + the client */
+#define SAMPLE_FWD_MAP_SAMPS 1024 /* compact bsubs resend their channel
+                                   * map every this many board samples */
+
+/* A subset of board sample channels to forward (see
+ * sample_cfg_forward_opts()), as an index map into b_samps, and the
+ * chip/channel arrays for the BoardSubsample it gets shipped as.
+ * Reference counted, since slabs in fwd_ring can outlive it. */
+struct sample_proj {
+    unsigned refs;              /* atomic */
+    uint32_t cfg_gen;           /* for compact BoardSubsamples */
+    int map_sent;               /* atomic; they've had chips/chans once */
+    size_t n;
+    uint32_t *chips;            /* n of each of these */
+    uint32_t *chans;
+    uint16_t *idx;
+};
+
+/* A decimated board sample stream (see sample_cfg_forward_opts()).
+ * Destinations that want the same one share it, so it's computed
+ * once per board sample however many of them there are. Reference
+ * counted like struct sample_proj. The reader and the forwarding
+ * thread can both feed it, so the state lives under mtx. */
+struct sample_decim {
+    unsigned refs;              /* atomic */
+    unsigned factor;
+    int envelope;
+
+    pthread_mutex_t mtx;
+    struct decim *dec;
+    int started;                /* fed since a multiple of factor */
+    int have_last;              /* last_sidx is valid */
+    uint32_t last_sidx;         /* most recent board sample fed */
+    int last_ready;             /* ... and whether it finished out */
+    raw_samp_t in[RAW_BSMP_NSAMP]; /* host order */
+    struct raw_pkt_bsmp out;    /* most recent output, host order */
+    raw_samp_t out_max[RAW_BSMP_NSAMP]; /* its maximums, for envelopes */
+};
+
+/* Somewhere forwarded packets go: the client, or a subscriber. */
+struct sample_fwd_dest {
+    struct sockaddr_storage addr;
+    enum sample_forward what;
+    unsigned every_nth;         /* only samples with index % this == 0 */
+    struct sample_proj *proj;   /* SAMPLE_FWD_BSMP only, or NULL */
+    struct sample_decim *decim; /* board samples only, or NULL */
+    int compact;                /* compact BoardSubsamples */
+};
+
+/* Scratch space for sending a batch of packets to their destinations
+ * (see sample_fwd_fanout()). The reader and the forwarding thread
+ * each have one. */
+struct sample_fwd_out {
+    void *pkts[SAMPLE_FWD_SLAB_PKTS]; /* the batch, in network order */
+    struct mmsghdr mmsgs[SAMPLE_FWD_SLAB_PKTS];
+    struct iovec iovs[SAMPLE_FWD_SLAB_PKTS];
+    union sample_packet host;   /* host order copy for protobuf */
+    uint32_t bsub_chips[RAW_BSUB_NSAMP];
+    uint32_t bsub_chans[RAW_BSUB_NSAMP];
+    uint32_t bsub_samps[RAW_BSUB_NSAMP];
+    uint32_t proj_samps[RAW_BSMP_NSAMP];
+    uint16_t packed_samps[RAW_BSMP_NSAMP]; /* compact, little-endian */
+    struct raw_pkt_bsmp dec;    /* decimated output, host order */
+    raw_samp_t dec_max[RAW_BSMP_NSAMP];
+    struct dnode_pack pk;       /* host, packed */
+    struct dnode_pack dest_pk;  /* packed for just one dest */
+};
+
+/* A slab in the forwarding ring: board samples on their way to
+ * clients while they're being stored, and where to send them. */
+struct sample_fwd_slab {
+    size_t len;                 /* number of valid bsmps */
+    size_t ndests;
+    struct sample_fwd_dest dests[SAMPLE_FWD_MAX_DESTS];
+    struct raw_pkt_bsmp bsmps[SAMPLE_FWD_SLAB_PKTS]; /* host order */
+};
+
+/* A slab in the board sample ring. */
+struct sample_slab {
+    size_t len;                 /* number of valid bsmps */
+    struct raw_pkt_bsmp bsmps[]; /* bsamp_slab_cap of these */
+};
+
+static inline size_t sample_slab_size(size_t cap)
+{
+    return sizeof(struct sample_slab) + cap * sizeof(struct raw_pkt_bsmp);
+}
+
 struct sample_session {
     /*
      * Lock ordering: smpl_mtx, then worker_mtx, then bsamp_mtx.
      *
-     * WISHLIST simplify the locking, probably by having the worker
-     * flip the sample buffers instead of the packet receive handlers
-     * (unlike the packet receivers, which can't block the event loop,
-     * the worker is free to sleep while grabbing the double-buffer
-     * write lock).
+     * The reader never takes bsamp_mtx; board samples move from the
+     * reader to the worker through the lock-free bsamp_ring.
      */
 
     struct event_base *base;
@@ -103,20 +208,60 @@ struct sample_session {
     evutil_socket_t ddatafd; /* Daemon data socket, open entire session.
                               *
                               * Event loop thread only. */
-    struct iovec dpktbuf; /* Points to raw packet buffer for ddatafd.
-                           * Event loop thread only. */
 
-    /* Buffers for initializing and packing data protocol
-     * messages. Event loop thread only. */
-    uint32_t c_bsub_chips[RAW_BSUB_NSAMP];
-    uint32_t c_bsub_chans[RAW_BSUB_NSAMP];
-    uint32_t c_bsub_samps[RAW_BSUB_NSAMP];
-    uint8_t c_bsmp_samps[RAW_BSMP_NSAMP * sizeof(raw_samp_t)];
-    uint8_t *c_sample_pbuf_arr;
+    /* recvmmsg() scatter state for batched board sample
+     * reception. Event loop thread only. */
+    struct mmsghdr c_bsmp_mmsgs[CONFIG_SAMPLE_RECV_BATCH];
+    struct iovec c_bsmp_iovs[CONFIG_SAMPLE_RECV_BATCH];
+    struct sockaddr_storage c_bsmp_addrs[CONFIG_SAMPLE_RECV_BATCH];
+
+    /* Forwarding reuses the state above to receive a batch into
+     * c_fwd_pkts (CONFIG_SAMPLE_RECV_BATCH of them), then sends the
+     * good ones back out of the same buffers, to c_fwd_dests, with
+     * c_fwd_out. While board samples are being stored, c_fwd_dests
+     * says where to tee them to instead. Event loop thread only. */
+    union sample_packet *c_fwd_pkts;
+    struct sample_fwd_out *c_fwd_out;
+    struct sample_fwd_dest c_fwd_dests[SAMPLE_FWD_MAX_DESTS];
+    size_t c_fwd_ndests;
+
+    /* The chip/channel configuration of the subsamples most recently
+     * forwarded in the compact encoding, its cfg_gen (0 if there
+     * isn't one yet), and the index of the first subsample that had
+     * it. Event loop thread only. */
+    struct raw_bsub_cfg c_bsub_cfg[RAW_BSUB_NSAMP];
+    uint32_t c_bsub_gen;
+    uint32_t c_bsub_gen_sidx;
+
+    /* Most recent cfg_gen handed out; see sample_fwd_new_gen().
+     * Atomic. */
+    uint32_t fwd_cfg_gen;
 
     /* Data socket event. Event loop thread only. */
     struct event *ddataevt;
 
+    /* Shared memory ring the reader publishes packets to, or NULL
+     * (see sample_publish_shm()), and the Unix domain socket readers
+     * get it from. Treat as constant once set. */
+    struct shm_ring *shm;
+    char *shm_path;
+    evutil_socket_t shm_lfd;
+    struct event *shm_evt;
+
+    /*
+     * Dedicated receive thread, if rx_cfg.thread is set. When it's
+     * running, there's no ddataevt, and the receive thread owns
+     * everything documented as "event loop thread only" on the data
+     * socket path. It doesn't touch the event base except through
+     * event_active().
+     *
+     * Treat as constant after sample_new().
+     */
+    struct sample_rx_cfg rx_cfg;
+    pthread_t rx_thread;
+    int rx_running;             /* rx_thread was started */
+    int rx_wakefd;              /* eventfd; rx_thread exits when readable */
+
     /*
      * This group of fields is shared with worker threads (as in
      * plural, i.e., NOT JUST THE SAMPLE WORKER THREAD), and are
@@ -130,6 +275,15 @@ struct sample_session {
                                     * subsamples to here. If unset,
                                     * .ss_family==AF_UNSPEC. */
     enum sample_forward forward_what; /**< What kind of packets to forward. */
+    /**
+     * Options for forwarding to the client (see
+     * sample_cfg_forward_opts()). They only apply while
+     * fwd_copts.what == forward_what; addr is unused. */
+    struct sample_fwd_dest fwd_copts;
+    /**
+     * Subscribers (see sample_add_subscriber()); fwd_nsubs of them. */
+    struct sample_fwd_dest fwd_subs[SAMPLE_MAX_SUBSCRIBERS];
+    size_t fwd_nsubs;
     sample_bsamp_cb smpl_cb; /**<
                                * Callback function for sample
                                * retrieval and storage. */
@@ -137,12 +291,62 @@ struct sample_session {
     /**
      * For detecting timeouts during board sample reception. */
     struct event *smpl_timeout_evt;
+    /**
+     * When the receive thread is running, it doesn't re-arm
+     * smpl_timeout_evt. It updates this instead, and
+     * sample_timeout_callback() checks it. */
+    struct timespec smpl_last_rx;
+    /**
+     * A cleared smpl_timeout_evt the receive thread couldn't free
+     * itself, or NULL. The event loop thread frees it. */
+    struct event *smpl_timeout_zombie;
     /**
      * Worker activates this so we can notify the caller of
      * sample_expect_bsamps() when things have happened.*/
     struct event *smpl_worker_evt;
     size_t smpl_next_sidx;      /**< Next board sample index */
     enum sample_stop_why smpl_stop_why; /**< Why are we stopping storage? */
+    /**
+     * Number of board samples in the slab at the head of bsamp_ring. */
+    size_t smpl_slab_len;
+    /**
+     * Nonzero if the reader has stopped reading ddatafd because
+     * bsamp_ring is full; the worker resumes it. */
+    int smpl_paused;
+    /**
+     * Board samples which arrived early (see sample_reorder_check()):
+     * rx_cfg.reorder_window of them, with a flag for each saying
+     * whether it's in use, and how many are. */
+    struct raw_pkt_bsmp *reorder_bufs;
+    uint8_t *reorder_have;
+    size_t reorder_nstashed;
+    /**
+     * Board samples skipped so far in a bsamp_cfg.fill_gaps
+     * transfer; smpl_ngaps of the smpl_gaps_cap entries are used. */
+    struct ch_gap *smpl_gaps;
+    size_t smpl_ngaps;
+    size_t smpl_gaps_cap;
+    /**
+     * Set (with the receive thread's eventfd written) to make the
+     * receive thread exit. */
+    int smpl_rx_exit;
+    /**
+     * Nonzero once we've complained about not being able to attach
+     * a packet filter to ddatafd. */
+    int smpl_filter_warned;
+    /*
+     * Board sample receive statistics for the current (or most
+     * recent) storage operation; logged when it ends.
+     */
+    size_t rstat_nsyscalls;     /**< recvmmsg() calls, including EAGAIN */
+    size_t rstat_npkts;         /**< Packets received, good or bad */
+    size_t rstat_maxbatch;      /**< Most packets received in one call */
+    size_t rstat_npauses;       /**< Times the reader paused for the worker */
+    size_t rstat_nreordered;    /**< Packets stashed until a gap filled */
+    size_t rstat_ndups;         /**< Duplicate packets thrown away */
+    size_t rstat_nforeign;      /**< Packets not from the data node */
+    int rstat_got_first;        /**< Nonzero once rstat_first_rx is set */
+    struct timespec rstat_first_rx; /**< When the first sample arrived */
 
     /*
      * Worker thread
@@ -154,46 +358,75 @@ struct sample_session {
     pthread_t              worker;     /**< Worker thread */
     pthread_cond_t         worker_cv;  /**< Worker waits on this */
     enum sample_worker_why worker_why; /**< Why worker_cv was signaled */
-    /**
-     * worker_using_buf[i] == 0 initially, and subsequently == 1 iff
-     * there's data in bsamp_bufs[i] that the worker has yet to finish
-     * writing to disk.
-     *
-     * Reader thread (i.e. event loop thread) sets these to 1, worker
-     * thread clears them when it's done.
-     */
-    int worker_using_buf[2];
     /**
      * Number of samples worker has written during this sample storage
      * operation, or 0. */
     size_t worker_nwritten;
+    /**
+     * When the worker's first write during this operation finished;
+     * only valid if worker_nwritten is nonzero. */
+    struct timespec worker_first_write;
 
     /*
-     * Board sample double-buffering
+     * Board sample ring
      *
-     * This group of fields is shared between the worker and reader
-     * threads. (The reader grabs samples off the network in ->base's
-     * event loop thread).
+     * The reader (whoever is running sample_ddatafd_callback()) is
+     * the producer. It fills the slab at the head of bsamp_ring, and
+     * publishes it when it's full or holds the last sample we
+     * want. The worker is the consumer; it stores slabs from the tail
+     * and releases them. Neither waits for the other.
      *
-     * The worker takes a read lock when it's storing
-     * bsamp_bufs[bsamp_widx] to disk. It never writes to any of these
-     * fields.
+     * If the ring fills up, the reader stops reading ddatafd, letting
+     * packets back up in the socket's receive buffer, until the worker
+     * releases a slab. Packets only get dropped if that overflows too.
      *
-     * The reader thread has exclusive ownership over the non-worker
-     * buffer and its length. It tries to take a write lock when it's
-     * time to flip buffers. Failure to do so means samples get lost.
+     * bsamp_mtx serializes consumers (the worker, and
+     * sample_finished_with_bsamps() throwing away leftovers), and
+     * protects bsamp_cfg.chns. Changing bsamp_cfg needs smpl_mtx too.
+     *
+     * sample_cfg_bsamp_bufs() replaces bsamp_ring between transfers,
+     * holding smpl_mtx and bsamp_mtx; either one is enough to use it.
      */
-    pthread_rwlock_t bsamp_mtx;
-    struct raw_pkt_bsmp *bsamp_bufs[2]; /**< Buffer expected board samples. */
-    size_t bsamp_buflen[2];  /**< Number of samples in each bsamp_bufs. */
-    size_t bsamp_widx;       /**< Worker index into bsamp_bufs/bsamp_buflen. */
+    struct spsc_ring *bsamp_ring;
+    size_t bsamp_slab_cap;      /**< Board samples per slab */
+    pthread_mutex_t bsamp_mtx;
     /** Cached sample storage configuration. */
     struct sample_bsamp_cfg bsamp_cfg;
+    /** SAMPLE_BSAMP_NFILLERS placeholders the worker stores in place
+     * of skipped board samples. Protected by bsamp_mtx. */
+    struct raw_pkt_bsmp *bsamp_fillers;
+
+    /*
+     * Forwarding stage
+     *
+     * While board samples are being stored, the reader also tees
+     * them to fwd_ring if anybody wants them (see sample_fwd_tee()).
+     * fwd_thread is the consumer; it sends them on, so a slow client
+     * can't hold up storage. If fwd_ring is full, the reader drops
+     * the packets meant for clients, and counts them.
+     *
+     * Lock order: fwd_mtx nests inside smpl_mtx.
+     */
+    struct spsc_ring *fwd_ring;
+    size_t fwd_slab_len;        /* Packets in fwd_ring's head slab;
+                                 * reader only */
+    pthread_t fwd_thread;
+    int fwd_running;            /* fwd_thread was started */
+    pthread_mutex_t fwd_mtx;    /* Protects fwd_exit */
+    pthread_cond_t fwd_cv;      /* fwd_thread waits on this */
+    int fwd_exit;               /* fwd_thread should exit */
+    struct sample_fwd_out *fwd_out; /* Forwarding thread only. */
+    /* Forwarding statistics for the current (or most recent) storage
+     * operation. The reader counts packets queued and dropped because
+     * fwd_ring was full; fwd_thread (atomically) counts the ones it
+     * couldn't send, to whichever destination missed the most. */
+    size_t fstat_nqueued;
+    size_t fstat_nfull;
+    size_t fstat_nfailed;
 
     /*
      * Debugging; event loop thread only.
      */
-    uint32_t debug_last_sub_idx;
     int debug_print_ddatafd;    /* debug printing in ddatafd callback */
 };
 
@@ -249,29 +482,140 @@ static inline void sample_must_signal_worker(struct sample_session *smpl)
     safe_p_cond_signal(&smpl->worker_cv);
 }
 
-static inline void sample_must_rdlock_dbuf(struct sample_session *smpl)
+static inline void sample_must_lock_bsamps(struct sample_session *smpl)
 {
-    safe_p_rwlock_rdlock(&smpl->bsamp_mtx);
+    safe_p_mutex_lock(&smpl->bsamp_mtx);
 }
 
-static inline void sample_must_wrlock_dbuf(struct sample_session *smpl)
+static inline void sample_must_unlock_bsamps(struct sample_session *smpl)
 {
-    safe_p_rwlock_wrlock(&smpl->bsamp_mtx);
+    safe_p_mutex_unlock(&smpl->bsamp_mtx);
 }
 
-static inline int sample_must_trywrlock_dbuf(struct sample_session *smpl)
+/*
+ * Worker thread
+ */
+
+/* Store n board samples, "off" board samples into the transfer.
+ * NOT SYNCHRONIZED (bsamp_mtx) */
+static int sample_worker_put(struct sample_session *smpl,
+                             const struct raw_pkt_bsmp *bsmps,
+                             size_t n, size_t off)
 {
-    return safe_p_rwlock_trywrlock(&smpl->bsamp_mtx);
+    struct sample_bsamp_cfg *cfg = &smpl->bsamp_cfg;
+    if (cfg->overwrite_at >= 0) {
+        return ch_storage_write_at(cfg->chns, bsmps, n,
+                                   (size_t)cfg->overwrite_at + off);
+    }
+    return ch_storage_write(cfg->chns, bsmps, n);
 }
 
-static inline void sample_must_rwunlock_dbuf(struct sample_session *smpl)
+/* Store a slab's board samples, which start "nwritten" board samples
+ * into the transfer. Any the reader skipped over (see
+ * sample_skip_gap()) get placeholders, built from the sample after
+ * the gap. Returns how many board samples were stored, placeholders
+ * included, or -1 on error.
+ *
+ * NOT SYNCHRONIZED (bsamp_mtx) */
+static ssize_t sample_worker_write(struct sample_session *smpl,
+                                   const struct raw_pkt_bsmp *bsmps,
+                                   size_t len, size_t nwritten)
 {
-    safe_p_rwlock_unlock(&smpl->bsamp_mtx);
+    struct raw_pkt_bsmp *fill = smpl->bsamp_fillers;
+    size_t off = nwritten;
+    size_t k = 0;
+    while (k < len) {
+        uint32_t want = (uint32_t)(smpl->bsamp_cfg.start_sample + off);
+        size_t missing = (uint32_t)(bsmps[k].b_sidx - want);
+        while (missing) {
+            size_t n = (missing < SAMPLE_BSAMP_NFILLERS ?
+                        missing : SAMPLE_BSAMP_NFILLERS);
+            for (size_t f = 0; f < n; f++) {
+                memcpy(&fill[f], &bsmps[k], sizeof(fill[f]));
+                memset(fill[f].b_samps, 0, sizeof(fill[f].b_samps));
+                fill[f].ph.p_flags |= RAW_PFLAG_B_MISSING;
+                fill[f].b_sidx = want++;
+            }
+            if (sample_worker_put(smpl, fill, n, off)) {
+                return -1;
+            }
+            off += n;
+            missing -= n;
+        }
+        size_t run = 1;
+        while (k + run < len &&
+               bsmps[k + run].b_sidx == (uint32_t)(bsmps[k].b_sidx + run)) {
+            run++;
+        }
+        if (sample_worker_put(smpl, &bsmps[k], run, off)) {
+            return -1;
+        }
+        off += run;
+        k += run;
+    }
+    return (ssize_t)(off - nwritten);
 }
 
-/*
- * Worker thread
- */
+/* Store and release every slab in the ring. */
+static void sample_worker_store_slabs(struct sample_session *smpl)
+{
+    while (1) {
+        int write_err = 0;
+
+        sample_must_lock_worker(smpl);
+        size_t nwritten = smpl->worker_nwritten;
+        sample_must_unlock_worker(smpl);
+
+        /* Try to store the samples. */
+        sample_must_lock_bsamps(smpl);
+        struct sample_slab *slab = spsc_ring_cons_slab(smpl->bsamp_ring);
+        if (!slab) {
+            sample_must_unlock_bsamps(smpl);
+            return;
+        }
+        ssize_t len = 0;
+        if (slab->len) {
+            len = sample_worker_write(smpl, slab->bsmps, slab->len,
+                                      nwritten);
+            write_err = len == -1;
+        }
+        spsc_ring_consume(smpl->bsamp_ring);
+        sample_must_unlock_bsamps(smpl);
+
+        sample_must_lock_worker(smpl);
+        if (!write_err) {
+            if (!smpl->worker_nwritten && len) {
+                clock_gettime(CLOCK_MONOTONIC, &smpl->worker_first_write);
+            }
+            smpl->worker_nwritten += (size_t)len;
+            log_DEBUG("%s: stored %zd samples, total %zu", __func__,
+                      len, smpl->worker_nwritten);
+        } else {
+            log_DEBUG("%s: ERROR storing packets: %m", __func__);
+        }
+        sample_must_unlock_worker(smpl);
+
+        /* Wake up the reader thread and let it know what happened. */
+        short what = write_err ? SAMPLE_THREAD_ERR : SAMPLE_THREAD_DONE;
+        if (what == SAMPLE_THREAD_ERR) {
+            /*
+             * FIXME this won't hit the main thread right away,
+             * and in the meantime, it might ask us to write some
+             * more stuff. Maybe add a "worker's ignoring you now
+             * KTHXBYE" flag we can protect with worker_mtx?
+             */
+            log_DEBUG("%s: notifying main thread about write error",
+                      __func__);
+        }
+        sample_must_lock(smpl);
+        if (smpl->smpl_paused) {
+            /* There's room in the ring again. */
+            sample_resume_reader(smpl);
+        }
+        event_active(smpl->smpl_worker_evt, what, 0);
+        sample_must_unlock(smpl);
+    }
+}
 
 static void* sample_worker_main(void *smplvp)
 {
@@ -288,55 +632,15 @@ static void* sample_worker_main(void *smplvp)
             pthread_exit(NULL);
         }
         if (smpl->worker_why & SAMPLE_WHY_BSAMPS) {
-            int write_err = 0;
-
-            /* Reader thread has a buffer of samples waiting for us to
-             * store. */
+            /* Reader thread has published slabs of samples waiting
+             * for us to store. */
             smpl->worker_why &= ~SAMPLE_WHY_BSAMPS;
             sample_must_unlock_worker(smpl);
 
-            /* Try to store the samples. */
-            sample_must_rdlock_dbuf(smpl);
-            size_t i = smpl->bsamp_widx;
-            size_t len = smpl->bsamp_buflen[i];
-            if (len) {
-                write_err = ch_storage_write(smpl->bsamp_cfg.chns,
-                                             smpl->bsamp_bufs[i], len);
-            }
-            sample_must_rwunlock_dbuf(smpl);
-
-            /* Set the state which tells the reader thread we're not
-             * using the buffer anymore. */
-            sample_must_lock_worker(smpl);
-            smpl->worker_using_buf[i] = 0;
-            if (!write_err) {
-                smpl->worker_nwritten += len;
-                log_DEBUG("%s: stored %zu samples, total %zu", __func__,
-                          len, smpl->worker_nwritten);
-            } else {
-                log_DEBUG("%s: ERROR storing packets: %m", __func__);
-            }
-            sample_must_unlock_worker(smpl);
-
-            /* Wake up the reader thread and let it know what happened. */
-            short what = write_err ? SAMPLE_THREAD_ERR : SAMPLE_THREAD_DONE;
-            if (what == SAMPLE_THREAD_ERR) {
-                /*
-                 * FIXME this won't hit the main thread right away,
-                 * and in the meantime, it might ask us to write some
-                 * more stuff. Maybe add a "worker's ignoring you now
-                 * KTHXBYE" flag we can protect with worker_mtx?
-                 */
-                log_DEBUG("%s: notifying main thread about write error",
-                          __func__);
-            }
-            sample_must_lock(smpl);
-            event_active(smpl->smpl_worker_evt, what, 0);
-            sample_must_unlock(smpl);
+            sample_worker_store_slabs(smpl);
 
             /* Re-grab the worker lock (which we released so we could
-             * block in ch_storage_write(), above) for the next
-             * conditional. */
+             * block in ch_storage_write()) for the next conditional. */
             sample_must_lock_worker(smpl);
         }
         if (smpl->worker_why & SAMPLE_WHY_STOP) {
@@ -356,6 +660,75 @@ static void* sample_worker_main(void *smplvp)
     return NULL;
 }
 
+/*
+ * Receive thread
+ */
+
+static void sample_rx_setup_thread(struct sample_session *smpl)
+{
+    const struct sample_rx_cfg *cfg = &smpl->rx_cfg;
+    int err;
+    if (cfg->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cfg->cpu, &cpus);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err) {
+            log_WARNING("can't pin receive thread to CPU %d: %s",
+                        cfg->cpu, strerror(err));
+        }
+    }
+    if (cfg->fifo_prio > 0) {
+        struct sched_param param = { .sched_priority = cfg->fifo_prio };
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err) {
+            log_WARNING("can't set receive thread SCHED_FIFO priority %d: %s",
+                        cfg->fifo_prio, strerror(err));
+        }
+    }
+    log_INFO("receiving samples on dedicated thread; CPU %d, FIFO prio %d",
+             cfg->cpu, cfg->fifo_prio);
+}
+
+static void* sample_rx_main(void *smplvp)
+{
+    struct sample_session *smpl = smplvp;
+    struct pollfd pfds[2] = {
+        { .fd = smpl->ddatafd, .events = POLLIN, .revents = 0 },
+        { .fd = smpl->rx_wakefd, .events = POLLIN, .revents = 0 },
+    };
+    sample_rx_setup_thread(smpl);
+    while (1) {
+        sample_must_lock(smpl);
+        int exit = smpl->smpl_rx_exit;
+        /* poll() ignores negative fds; leave the data socket alone
+         * while the worker catches up. */
+        pfds[0].fd = smpl->smpl_paused ? -1 : smpl->ddatafd;
+        sample_must_unlock(smpl);
+        if (exit) {
+            break;
+        }
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            sample_fatal_err("receive thread can't poll data socket", errno);
+        }
+        if (pfds[1].revents) {
+            /* Paused/resumed, or sample_free() wants us to quit. */
+            uint64_t ignored;
+            if (read(smpl->rx_wakefd, &ignored, sizeof(ignored)) == -1 &&
+                errno != EAGAIN) {
+                sample_fatal_err("receive thread can't read eventfd", errno);
+            }
+        }
+        if (pfds[0].revents) {
+            sample_ddatafd_callback(smpl->ddatafd, EV_READ, smpl);
+        }
+    }
+    return NULL;
+}
+
 /*
  * Other helpers
  */
@@ -380,50 +753,279 @@ static inline int sample_expecting_bsamps(struct sample_session *smpl)
             smpl->smpl_stop_why == SAMPLE_STOP_NONE);
 }
 
+static uint8_t sample_what_mtype(enum sample_forward what)
+{
+    switch (what) {
+    case SAMPLE_FWD_BSMP:       /* fall through */
+    case SAMPLE_FWD_BSMP_RAW:
+        return RAW_MTYPE_BSMP;
+    case SAMPLE_FWD_BSUB:       /* fall through */
+    case SAMPLE_FWD_BSUB_RAW:
+        return RAW_MTYPE_BSUB;
+    case SAMPLE_FWD_NOTHING:    /* shouldn't happen; fall through */
+    default:
+        assert(0);
+        return RAW_MTYPE_ERR;
+    }
+}
+
+static inline int sample_what_is_raw(enum sample_forward what)
+{
+    return what == SAMPLE_FWD_BSMP_RAW || what == SAMPLE_FWD_BSUB_RAW;
+}
+
+/* Hand out a new, nonzero cfg_gen for compact BoardSubsamples.
+ * NOT SYNCHRONIZED (atomic) */
+static uint32_t sample_fwd_new_gen(struct sample_session *smpl)
+{
+    uint32_t gen;
+    do {
+        gen = __atomic_add_fetch(&smpl->fwd_cfg_gen, 1, __ATOMIC_RELAXED);
+    } while (!gen);
+    return gen;
+}
+
+/* Build a projection onto chans, with one reference, or return NULL
+ * if there's a bad chip or channel, or we're out of memory. */
+static struct sample_proj* sample_proj_new(struct sample_session *smpl,
+                                           const struct sample_chan *chans,
+                                           size_t nchans)
+{
+    if (!nchans || nchans > RAW_BSMP_NSAMP) {
+        return NULL;
+    }
+    for (size_t i = 0; i < nchans; i++) {
+        if (chans[i].chip >= RAW_BSMP_NCHIPS ||
+            chans[i].chan >= RAW_BSMP_NCHANS) {
+            return NULL;
+        }
+    }
+    struct sample_proj *proj =
+        malloc(sizeof(*proj) + nchans * (2 * sizeof(uint32_t) +
+                                         sizeof(uint16_t)));
+    if (!proj) {
+        return NULL;
+    }
+    proj->refs = 1;
+    proj->cfg_gen = sample_fwd_new_gen(smpl);
+    proj->map_sent = 0;
+    proj->n = nchans;
+    proj->chips = (uint32_t*)(proj + 1);
+    proj->chans = proj->chips + nchans;
+    proj->idx = (uint16_t*)(proj->chans + nchans);
+    for (size_t i = 0; i < nchans; i++) {
+        proj->chips[i] = chans[i].chip;
+        proj->chans[i] = chans[i].chan;
+        proj->idx[i] = (uint16_t)raw_bsmp_samp_idx(chans[i].chip,
+                                                   chans[i].chan);
+    }
+    return proj;
+}
+
+static void sample_proj_get(struct sample_proj *proj)
+{
+    if (proj) {
+        __atomic_add_fetch(&proj->refs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void sample_proj_put(struct sample_proj *proj)
+{
+    if (proj && !__atomic_sub_fetch(&proj->refs, 1, __ATOMIC_ACQ_REL)) {
+        free(proj);
+    }
+}
+
+/* Make a board sample decimator, with one reference, or return NULL
+ * if we're out of memory. */
+static struct sample_decim* sample_decim_new(unsigned factor, int envelope)
+{
+    struct sample_decim *sd = malloc(sizeof(*sd));
+    if (!sd) {
+        return NULL;
+    }
+    sd->dec = decim_new(RAW_BSMP_NSAMP, factor, envelope);
+    if (!sd->dec) {
+        free(sd);
+        return NULL;
+    }
+    if (pthread_mutex_init(&sd->mtx, NULL)) {
+        decim_free(sd->dec);
+        free(sd);
+        return NULL;
+    }
+    sd->refs = 1;
+    sd->factor = factor;
+    sd->envelope = envelope;
+    sd->started = 0;
+    sd->have_last = 0;
+    sd->last_sidx = 0;
+    sd->last_ready = 0;
+    return sd;
+}
+
+static void sample_decim_get(struct sample_decim *sd)
+{
+    if (sd) {
+        __atomic_add_fetch(&sd->refs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void sample_decim_put(struct sample_decim *sd)
+{
+    if (sd && !__atomic_sub_fetch(&sd->refs, 1, __ATOMIC_ACQ_REL)) {
+        pthread_mutex_destroy(&sd->mtx);
+        decim_free(sd->dec);
+        free(sd);
+    }
+}
+
+/* Take or drop references to what a destination points to. */
+static void sample_fwd_dest_get(struct sample_fwd_dest *dest)
+{
+    sample_proj_get(dest->proj);
+    sample_decim_get(dest->decim);
+}
+
+static void sample_fwd_dest_put(struct sample_fwd_dest *dest)
+{
+    sample_proj_put(dest->proj);
+    sample_decim_put(dest->decim);
+}
+
+/* NOT SYNCHRONIZED (smpl_mtx) */
+static uint8_t sample_forward_mtype(struct sample_session *smpl)
+{
+    return sample_what_mtype(smpl->forward_what);
+}
+
+/* Find everyone who wants forwarded packets of type mtype: the
+ * client, if forwarding that type to it is enabled, and any
+ * subscribers to it. Copies them into dests (which has room for
+ * SAMPLE_FWD_MAX_DESTS), unless it's NULL, and returns how many there
+ * are.
+ * NOT SYNCHRONIZED (smpl_mtx) */
+static size_t sample_fwd_dests(struct sample_session *smpl, uint8_t mtype,
+                               struct sample_fwd_dest *dests)
+{
+    size_t n = 0;
+    if (smpl->forward_what != SAMPLE_FWD_NOTHING &&
+        smpl->caddr.ss_family != AF_UNSPEC &&
+        sample_forward_mtype(smpl) == mtype) {
+        if (dests && smpl->fwd_copts.what == smpl->forward_what) {
+            dests[n] = smpl->fwd_copts;
+        } else if (dests) {
+            memset(&dests[n], 0, sizeof(dests[n]));
+            dests[n].what = smpl->forward_what;
+            dests[n].every_nth = 1;
+        }
+        if (dests) {
+            dests[n].addr = smpl->caddr;
+        }
+        n++;
+    }
+    for (size_t i = 0; i < smpl->fwd_nsubs; i++) {
+        if (sample_what_mtype(smpl->fwd_subs[i].what) != mtype) {
+            continue;
+        }
+        if (dests) {
+            dests[n] = smpl->fwd_subs[i];
+        }
+        n++;
+    }
+    return n;
+}
+
 /* NOT SYNCHRONIZED (smpl_mtx) */
 static inline int sample_forwarding_data(struct sample_session *smpl)
 {
     return (smpl->forward_what != SAMPLE_FWD_NOTHING &&
             smpl->dnaddr.ss_family != AF_UNSPEC &&
-            smpl->caddr.ss_family != AF_UNSPEC);
+            sample_fwd_dests(smpl, sample_forward_mtype(smpl), NULL) > 0);
+}
+
+static inline int sample_rx_threaded(struct sample_session *smpl)
+{
+    return smpl->rx_running;
+}
+
+static inline int sample_on_rx_thread(struct sample_session *smpl)
+{
+    return (sample_rx_threaded(smpl) &&
+            pthread_equal(pthread_self(), smpl->rx_thread));
+}
+
+/* Wake the receive thread so it rechecks smpl_paused and smpl_rx_exit. */
+static void sample_rx_wake(struct sample_session *smpl)
+{
+    uint64_t one = 1;
+    if (write(smpl->rx_wakefd, &one, sizeof(one)) != sizeof(one)) {
+        sample_fatal_err("can't wake receive thread", errno);
+    }
 }
 
-/* NOT SYNCHRONIZED (wr bsamp_mtx) */
+/* Stop reading ddatafd until the worker makes room in the ring.
+ * Reader only. NOT SYNCHRONIZED (smpl_mtx) */
+static void sample_pause_reader(struct sample_session *smpl)
+{
+    assert(!smpl->smpl_paused);
+    LOCAL_DEBUG("%s: sample ring full; waiting for worker", __func__);
+    smpl->smpl_paused = 1;
+    smpl->rstat_npauses++;
+    if (!sample_rx_threaded(smpl)) {
+        event_del(smpl->ddataevt);
+    }
+}
+
+/* Undo sample_pause_reader().
+ * NOT SYNCHRONIZED (smpl_mtx) */
+static void sample_resume_reader(struct sample_session *smpl)
+{
+    assert(smpl->smpl_paused);
+    smpl->smpl_paused = 0;
+    if (sample_rx_threaded(smpl)) {
+        sample_rx_wake(smpl);
+    } else if (event_add(smpl->ddataevt, NULL)) {
+        log_ERR("can't resume reading data socket");
+    }
+}
+
+/* NOT SYNCHRONIZED (smpl_mtx, bsamp_mtx) */
 static void sample_init_bsamp_cfg(struct sample_session *smpl)
 {
     smpl->bsamp_cfg.nsamples = 0;
     smpl->bsamp_cfg.start_sample = 0;
     smpl->bsamp_cfg.chns = NULL;
+    smpl->bsamp_cfg.fill_gaps = 0;
+    smpl->bsamp_cfg.overwrite_at = -1;
 }
 
 /*
- * Release non-timeout resources acquired while expecting board samples.
+ * Release non-timeout resources acquired while expecting board
+ * samples, throwing away any the worker hasn't stored yet.
  *
- * IMPORTANT: this takes the write lock on the sample buffer, so DO
- * NOT CALL THIS FUNCTION FROM THE EVENT LOOP THREAD unless the worker
- * is sleeping, or you'll block the event loop if the worker is
- * writing samples.
+ * IMPORTANT: this waits for the worker to finish storing the slab
+ * it's working on, if any, so DO NOT CALL THIS FUNCTION FROM THE EVENT
+ * LOOP THREAD unless the worker is sleeping, or you'll block the event
+ * loop.
  */
-/* ACQUIRES worker_mtx, ACQUIRES (wr) bsamp_mtx */
+/* NOT SYNCHRONIZED (smpl_mtx), ACQUIRES worker_mtx, bsamp_mtx */
 static void sample_finished_with_bsamps(struct sample_session *smpl)
 {
-    sample_must_wrlock_dbuf(smpl);
-    assert(smpl->bsamp_bufs[0] && smpl->bsamp_bufs[1]);
-    free(smpl->bsamp_bufs[0]);
-    free(smpl->bsamp_bufs[1]);
-    smpl->bsamp_bufs[0] = NULL;
-    smpl->bsamp_bufs[1] = NULL;
-    smpl->bsamp_buflen[0] = 0;
-    smpl->bsamp_buflen[1] = 0;
-    smpl->bsamp_widx = 0;
-    sample_init_bsamp_cfg(smpl);
-    sample_must_rwunlock_dbuf(smpl);
-
     sample_must_lock_worker(smpl);
-    smpl->worker_using_buf[0] = 0;
-    smpl->worker_using_buf[1] = 0;
     smpl->worker_why &= ~SAMPLE_WHY_BSAMPS;
     sample_must_unlock_worker(smpl);
+
+    sample_must_lock_bsamps(smpl);
+    while (spsc_ring_cons_slab(smpl->bsamp_ring)) {
+        spsc_ring_consume(smpl->bsamp_ring);
+    }
+    sample_init_bsamp_cfg(smpl);
+    sample_must_unlock_bsamps(smpl);
+
+    if (smpl->smpl_paused) {
+        sample_resume_reader(smpl);
+    }
 }
 
 /* NOT SYNCHRONIZED (smpl_mtx) */
@@ -434,16 +1036,44 @@ static int sample_reset_timeout(struct sample_session *smpl)
         .tv_usec = SAMPLE_BSAMP_TIMEOUT_USEC,
     };
     assert(smpl->smpl_timeout_evt);
+    if (sample_rx_threaded(smpl)) {
+        clock_gettime(CLOCK_MONOTONIC, &smpl->smpl_last_rx);
+        if (sample_on_rx_thread(smpl)) {
+            /* Adding events from another thread wakes up the event
+             * loop; let sample_timeout_callback() re-arm itself. */
+            return 0;
+        }
+    }
     return evtimer_add(smpl->smpl_timeout_evt, &timeout);
 }
 
+/* Event loop thread only.
+ * NOT SYNCHRONIZED (smpl_mtx) */
+static void sample_reap_timeout(struct sample_session *smpl)
+{
+    if (smpl->smpl_timeout_zombie) {
+        event_free(smpl->smpl_timeout_zombie);
+        smpl->smpl_timeout_zombie = NULL;
+    }
+}
+
 /* NOT SYNCHRONIZED (smpl_mtx) */
 static void sample_clear_timeout(struct sample_session *smpl)
 {
-    if (smpl->smpl_timeout_evt) {
+    if (!smpl->smpl_timeout_evt) {
+        return;
+    }
+    if (sample_on_rx_thread(smpl)) {
+        /* event_free() can block waiting for sample_timeout_callback()
+         * to finish, but that needs smpl_mtx, which we hold. Leave the
+         * event for the event loop thread to free. */
+        assert(!smpl->smpl_timeout_zombie);
+        smpl->smpl_timeout_zombie = smpl->smpl_timeout_evt;
+    } else {
         event_free(smpl->smpl_timeout_evt);
-        smpl->smpl_timeout_evt = NULL;
     }
+    smpl->smpl_timeout_evt = NULL;
+    sample_update_filter(smpl);
 }
 
 /*
@@ -474,12 +1104,13 @@ static void __sample_reject_bsamps_internal(struct sample_session *smpl)
 /* Timeout or dropped packet occurred while reading board samples. Get
  * the worker thread to acknowledge and go back to sleep.
  *
- * NOT SYNCHRONIZED (smpl_mtx), ACQUIRES worker_mtx, (wr) bsamp_mtx */
+ * NOT SYNCHRONIZED (smpl_mtx), ACQUIRES worker_mtx */
 static void sample_stop_worker(struct sample_session *smpl,
                                enum sample_stop_why why)
 {
     log_WARNING("%s during sample storage", sample_stop_why_str(why));
     smpl->smpl_stop_why = why;
+    sample_update_filter(smpl);
     sample_must_lock_worker(smpl);
     smpl->worker_why |= SAMPLE_WHY_STOP;
     sample_must_unlock_worker(smpl);
@@ -493,6 +1124,8 @@ static int sample_init_pthreads(struct sample_session *smpl)
     int work_destroy = 0;
     int dbuf_destroy = 0;
     int cv_destroy = 0;
+    int fwd_destroy = 0;
+    int fcv_destroy = 0;
     int t_destroy = 0;
 
     smpl_destroy = !pthread_mutex_init(&smpl->smpl_mtx, NULL);
@@ -507,10 +1140,18 @@ static int sample_init_pthreads(struct sample_session *smpl)
     if (!cv_destroy) {
         goto out;
     }
-    dbuf_destroy = !pthread_rwlock_init(&smpl->bsamp_mtx, NULL);
+    dbuf_destroy = !pthread_mutex_init(&smpl->bsamp_mtx, NULL);
     if (!dbuf_destroy) {
         goto out;
     }
+    fwd_destroy = !pthread_mutex_init(&smpl->fwd_mtx, NULL);
+    if (!fwd_destroy) {
+        goto out;
+    }
+    fcv_destroy = !pthread_cond_init(&smpl->fwd_cv, NULL);
+    if (!fcv_destroy) {
+        goto out;
+    }
     t_destroy = !pthread_create(&smpl->worker, NULL, sample_worker_main,
                                 smpl);
     if (!t_destroy) {
@@ -529,7 +1170,13 @@ static int sample_init_pthreads(struct sample_session *smpl)
             pthread_cond_destroy(&smpl->worker_cv);
         }
         if (dbuf_destroy) {
-            pthread_rwlock_destroy(&smpl->bsamp_mtx);
+            pthread_mutex_destroy(&smpl->bsamp_mtx);
+        }
+        if (fwd_destroy) {
+            pthread_mutex_destroy(&smpl->fwd_mtx);
+        }
+        if (fcv_destroy) {
+            pthread_cond_destroy(&smpl->fwd_cv);
         }
         /* No need to clean up smpl->worker; we did that last, so
          * either it hasn't been created or creation failed. */
@@ -544,30 +1191,71 @@ static void sample_init(struct sample_session *smpl)
     smpl->base = NULL;
     smpl->ddataif = 0;
     smpl->ddatafd = -1;
-    smpl->dpktbuf.iov_base = NULL;
-    smpl->dpktbuf.iov_len = 0;
-    smpl->c_sample_pbuf_arr = NULL;
+    smpl->c_fwd_pkts = NULL;
+    smpl->c_fwd_out = NULL;
+    smpl->c_fwd_ndests = 0;
+    memset(smpl->c_bsub_cfg, 0, sizeof(smpl->c_bsub_cfg));
+    smpl->c_bsub_gen = 0;
+    smpl->c_bsub_gen_sidx = 0;
+    smpl->fwd_cfg_gen = 0;
     smpl->ddataevt = NULL;
+    smpl->shm = NULL;
+    smpl->shm_path = NULL;
+    smpl->shm_lfd = -1;
+    smpl->shm_evt = NULL;
+    smpl->rx_running = 0;
+    smpl->rx_wakefd = -1;
     smpl->dnaddr.ss_family = AF_UNSPEC;
     smpl->caddr.ss_family = AF_UNSPEC;
     smpl->forward_what = SAMPLE_FWD_NOTHING;
+    memset(&smpl->fwd_copts, 0, sizeof(smpl->fwd_copts));
+    smpl->fwd_copts.what = SAMPLE_FWD_NOTHING;
+    smpl->fwd_nsubs = 0;
     smpl->smpl_cb = NULL;
     smpl->smpl_cb_arg = NULL;
     smpl->smpl_timeout_evt = NULL;
+    smpl->smpl_last_rx.tv_sec = 0;
+    smpl->smpl_last_rx.tv_nsec = 0;
+    smpl->smpl_timeout_zombie = NULL;
     smpl->smpl_worker_evt = NULL;
     smpl->smpl_next_sidx = 0;
     smpl->smpl_stop_why = SAMPLE_STOP_NONE;
+    smpl->smpl_slab_len = 0;
+    smpl->smpl_paused = 0;
+    smpl->reorder_bufs = NULL;
+    smpl->reorder_have = NULL;
+    smpl->reorder_nstashed = 0;
+    smpl->smpl_gaps = NULL;
+    smpl->smpl_ngaps = 0;
+    smpl->smpl_gaps_cap = 0;
+    smpl->smpl_rx_exit = 0;
+    smpl->smpl_filter_warned = 0;
+    smpl->rstat_nsyscalls = 0;
+    smpl->rstat_npkts = 0;
+    smpl->rstat_maxbatch = 0;
+    smpl->rstat_npauses = 0;
+    smpl->rstat_nreordered = 0;
+    smpl->rstat_ndups = 0;
+    smpl->rstat_nforeign = 0;
+    smpl->rstat_got_first = 0;
+    smpl->rstat_first_rx.tv_sec = 0;
+    smpl->rstat_first_rx.tv_nsec = 0;
     smpl->worker_why = SAMPLE_WHY_NONE;
-    smpl->worker_using_buf[0] = 0;
-    smpl->worker_using_buf[1] = 0;
     smpl->worker_nwritten = 0;
-    smpl->bsamp_bufs[0] = NULL;
-    smpl->bsamp_bufs[1] = NULL;
-    smpl->bsamp_buflen[0] = 0;
-    smpl->bsamp_buflen[1] = 0;
-    smpl->bsamp_widx = 0;
+    smpl->worker_first_write.tv_sec = 0;
+    smpl->worker_first_write.tv_nsec = 0;
+    smpl->bsamp_ring = NULL;
+    smpl->bsamp_slab_cap = 0;
     sample_init_bsamp_cfg(smpl);
-    smpl->debug_last_sub_idx = 0;
+    smpl->bsamp_fillers = NULL;
+    smpl->fwd_ring = NULL;
+    smpl->fwd_slab_len = 0;
+    smpl->fwd_running = 0;
+    smpl->fwd_exit = 0;
+    smpl->fwd_out = NULL;
+    smpl->fstat_nqueued = 0;
+    smpl->fstat_nfull = 0;
+    smpl->fstat_nfailed = 0;
     smpl->debug_print_ddatafd = 1;
 }
 
@@ -575,10 +1263,33 @@ static void sample_init(struct sample_session *smpl)
  * Public API
  */
 
+/* The board sample ring gets allocated up front and reused, so make
+ * sure touching it while packets are arriving won't fault. */
+static struct spsc_ring* sample_alloc_ring(size_t nslabs, size_t cap)
+{
+    struct spsc_ring *ring =
+        spsc_ring_alloc(nslabs, sample_slab_size(cap),
+                        SPSC_RING_HUGEPAGES | SPSC_RING_MLOCK);
+    if (!ring) {
+        return NULL;
+    }
+    if (!(ring->sr_flags & SPSC_RING_MLOCK)) {
+        log_WARNING("can't lock sample buffers into RAM (%m); "
+                    "paging may cause dropped packets");
+    }
+    log_INFO("allocated %zu MiB of sample buffers (%s pages%s)",
+             ring->sr_map_len >> 20,
+             ring->sr_flags & SPSC_RING_HUGEPAGES ? "huge" : "regular",
+             ring->sr_flags & SPSC_RING_MLOCK ? ", locked" : "");
+    return ring;
+}
+
 struct sample_session *sample_new(struct event_base *base,
                                   unsigned iface,
-                                  uint16_t port)
+                                  uint16_t port,
+                                  const struct sample_rx_cfg *rx_cfg)
 {
+    const struct sample_rx_cfg default_rx_cfg = SAMPLE_RX_CFG_DEFAULT;
     /* Allocate/init the sample_session and initialize pthreads before doing
      * anything else. */
     struct sample_session *smpl = malloc(sizeof(struct sample_session));
@@ -595,6 +1306,7 @@ struct sample_session *sample_new(struct event_base *base,
     /* Bring up the sample_session. */
     smpl->base = base;
     smpl->ddataif = iface;
+    smpl->rx_cfg = rx_cfg ? *rx_cfg : default_rx_cfg;
     smpl->ddatafd = sockutil_get_udp_socket(port);
     if (smpl->ddatafd == -1) {
         log_ERR("can't create data socket");
@@ -604,27 +1316,63 @@ struct sample_session *sample_new(struct event_base *base,
         log_ERR("data socket doesn't support nonblocking I/O");
         goto fail;
     }
-    smpl->dpktbuf.iov_base = malloc(sizeof(union sample_packet));
-    if (!smpl->dpktbuf.iov_base) {
+    sample_update_filter(smpl);
+    if (smpl->rx_cfg.busy_poll_usec > 0 &&
+        setsockopt(smpl->ddatafd, SOL_SOCKET, SO_BUSY_POLL,
+                   &smpl->rx_cfg.busy_poll_usec,
+                   sizeof(smpl->rx_cfg.busy_poll_usec)) == -1) {
+        log_WARNING("can't set data socket SO_BUSY_POLL to %d usec: %m",
+                    smpl->rx_cfg.busy_poll_usec);
+    }
+    smpl->c_fwd_pkts = malloc(CONFIG_SAMPLE_RECV_BATCH *
+                              sizeof(*smpl->c_fwd_pkts));
+    smpl->c_fwd_out = malloc(sizeof(*smpl->c_fwd_out));
+    if (!smpl->c_fwd_pkts || !smpl->c_fwd_out) {
         goto fail;
     }
-    smpl->dpktbuf.iov_len = sizeof(union sample_packet);
-    smpl->c_sample_pbuf_arr = malloc(SAMPLE_PBUF_ARR_SIZE);
-    if (!smpl->c_sample_pbuf_arr) {
+    smpl->bsamp_slab_cap = (size_t)SAMPLE_BSAMP_KHZ * SAMPLE_BSAMP_MSEC_P_SLAB;
+    smpl->bsamp_ring = sample_alloc_ring(SAMPLE_BSAMP_NSLABS,
+                                         smpl->bsamp_slab_cap);
+    if (!smpl->bsamp_ring) {
+        log_ERR("can't allocate board sample ring: %m");
         goto fail;
     }
-    smpl->ddataevt = event_new(base, smpl->ddatafd, EV_READ | EV_PERSIST,
-                               sample_ddatafd_callback, smpl);
-    if (!smpl->ddataevt) {
-        log_ERR("can't create data socket event");
+    smpl->bsamp_fillers = malloc(SAMPLE_BSAMP_NFILLERS *
+                                 sizeof(struct raw_pkt_bsmp));
+    if (!smpl->bsamp_fillers) {
         goto fail;
     }
-    if (event_add(smpl->ddataevt, NULL)) {
+    smpl->fwd_ring = spsc_ring_alloc(SAMPLE_FWD_NSLABS,
+                                     sizeof(struct sample_fwd_slab), 0);
+    smpl->fwd_out = malloc(sizeof(*smpl->fwd_out));
+    if (!smpl->fwd_ring || !smpl->fwd_out) {
+        log_ERR("can't allocate forwarding buffers");
         goto fail;
     }
-    smpl->smpl_worker_evt = event_new(smpl->base, -1,
-                                      (SAMPLE_THREAD_DONE |
-                                       SAMPLE_THREAD_ERR |
+    int fwd_err = pthread_create(&smpl->fwd_thread, NULL, sample_fwd_main,
+                                 smpl);
+    if (fwd_err) {
+        log_ERR("can't create forwarding thread: %s", strerror(fwd_err));
+        goto fail;
+    }
+    smpl->fwd_running = 1;
+    if (smpl->rx_cfg.reorder_window > SAMPLE_RX_REORDER_MAX) {
+        log_WARNING("reorder window %u too big; using %u",
+                    smpl->rx_cfg.reorder_window, SAMPLE_RX_REORDER_MAX);
+        smpl->rx_cfg.reorder_window = SAMPLE_RX_REORDER_MAX;
+    }
+    if (smpl->rx_cfg.reorder_window) {
+        smpl->reorder_bufs = malloc(smpl->rx_cfg.reorder_window *
+                                    sizeof(struct raw_pkt_bsmp));
+        smpl->reorder_have = calloc(smpl->rx_cfg.reorder_window, 1);
+        if (!smpl->reorder_bufs || !smpl->reorder_have) {
+            log_ERR("can't allocate board sample reorder window");
+            goto fail;
+        }
+    }
+    smpl->smpl_worker_evt = event_new(smpl->base, -1,
+                                      (SAMPLE_THREAD_DONE |
+                                       SAMPLE_THREAD_ERR |
                                        SAMPLE_THREAD_SLEEPING |
                                        EV_PERSIST),
                                       sample_worker_callback, smpl);
@@ -633,6 +1381,37 @@ struct sample_session *sample_new(struct event_base *base,
         log_ERR("%s: can't configure thread callback", __func__);
         goto fail;
     }
+    if (smpl->rx_cfg.thread) {
+        smpl->rx_wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (smpl->rx_wakefd == -1) {
+            log_ERR("can't create receive thread eventfd: %m");
+            goto fail;
+        }
+        /* The thread takes smpl_mtx before it does anything that
+         * checks whether it's the receive thread, so holding it here
+         * makes sure rx_running and rx_thread are set by then. */
+        sample_must_lock(smpl);
+        smpl->rx_running = 1;
+        int err = pthread_create(&smpl->rx_thread, NULL, sample_rx_main, smpl);
+        if (err) {
+            smpl->rx_running = 0;
+        }
+        sample_must_unlock(smpl);
+        if (err) {
+            log_ERR("can't create receive thread: %s", strerror(err));
+            goto fail;
+        }
+        return smpl;
+    }
+    smpl->ddataevt = event_new(base, smpl->ddatafd, EV_READ | EV_PERSIST,
+                               sample_ddatafd_callback, smpl);
+    if (!smpl->ddataevt) {
+        log_ERR("can't create data socket event");
+        goto fail;
+    }
+    if (event_add(smpl->ddataevt, NULL)) {
+        goto fail;
+    }
     return smpl;
 
  fail:
@@ -642,7 +1421,44 @@ struct sample_session *sample_new(struct event_base *base,
 
 void sample_free(struct sample_session *smpl)
 {
-    /* Bring down the worker thread first. */
+    /* Bring down the receive thread first, if there is one. */
+    if (sample_rx_threaded(smpl)) {
+        sample_must_lock(smpl);
+        smpl->smpl_rx_exit = 1;
+        sample_rx_wake(smpl);
+        sample_must_unlock(smpl);
+        safe_p_join(smpl->rx_thread, NULL);
+        smpl->rx_running = 0;
+    }
+    if (smpl->rx_wakefd != -1) {
+        close(smpl->rx_wakefd);
+    }
+
+    /* Then the forwarding thread, which only the reader feeds. */
+    if (smpl->fwd_running) {
+        safe_p_mutex_lock(&smpl->fwd_mtx);
+        smpl->fwd_exit = 1;
+        safe_p_cond_signal(&smpl->fwd_cv);
+        safe_p_mutex_unlock(&smpl->fwd_mtx);
+        safe_p_join(smpl->fwd_thread, NULL);
+        smpl->fwd_running = 0;
+    }
+    /* Let go of projections and decimators, including any left in
+     * fwd_ring. */
+    struct sample_fwd_slab *fslab;
+    while (smpl->fwd_ring &&
+           (fslab = spsc_ring_cons_slab(smpl->fwd_ring)) != NULL) {
+        for (size_t d = 0; d < fslab->ndests; d++) {
+            sample_fwd_dest_put(&fslab->dests[d]);
+        }
+        spsc_ring_consume(smpl->fwd_ring);
+    }
+    sample_fwd_dest_put(&smpl->fwd_copts);
+    for (size_t i = 0; i < smpl->fwd_nsubs; i++) {
+        sample_fwd_dest_put(&smpl->fwd_subs[i]);
+    }
+
+    /* Then the worker thread. */
     sample_must_lock_worker(smpl);
     smpl->worker_why |= SAMPLE_WHY_EXIT;
     sample_must_unlock_worker(smpl);
@@ -656,19 +1472,38 @@ void sample_free(struct sample_session *smpl)
         sample_reject_bsamps_internal(smpl);
     }
     assert(!sample_expecting_bsamps(smpl));
+    sample_reap_timeout(smpl);
     sample_must_unlock(smpl);
     if (smpl->ddataevt) {
         event_free(smpl->ddataevt);
     }
-    free(smpl->c_sample_pbuf_arr);
-    free(smpl->dpktbuf.iov_base);
+    free(smpl->c_fwd_pkts);
+    free(smpl->c_fwd_out);
     if (smpl->ddatafd != -1 && evutil_closesocket(smpl->ddatafd)) {
         log_ERR("can't close data socket");
     }
+    if (smpl->shm_evt) {
+        event_free(smpl->shm_evt);
+    }
+    if (smpl->shm_lfd != -1) {
+        evutil_closesocket(smpl->shm_lfd);
+        unlink(smpl->shm_path);
+    }
+    free(smpl->shm_path);
+    shm_ring_free(smpl->shm);
     pthread_mutex_destroy(&smpl->smpl_mtx);
     pthread_mutex_destroy(&smpl->worker_mtx);
     pthread_cond_destroy(&smpl->worker_cv);
-    pthread_rwlock_destroy(&smpl->bsamp_mtx);
+    pthread_mutex_destroy(&smpl->bsamp_mtx);
+    pthread_mutex_destroy(&smpl->fwd_mtx);
+    pthread_cond_destroy(&smpl->fwd_cv);
+    spsc_ring_free(smpl->bsamp_ring);
+    spsc_ring_free(smpl->fwd_ring);
+    free(smpl->fwd_out);
+    free(smpl->reorder_bufs);
+    free(smpl->reorder_have);
+    free(smpl->smpl_gaps);
+    free(smpl->bsamp_fillers);
     free(smpl);
 }
 
@@ -731,38 +1566,21 @@ int sample_set_addr(struct sample_session *smpl,
         goto out;
     }
     memcpy(dst, addr, sockutil_addrlen(addr));
+    sample_update_filter(smpl);
  out:
     sample_must_unlock(smpl);
     return ret;
 }
 
-/* NOT SYNCHRONIZED (smpl_mtx) */
-static uint8_t sample_forward_mtype(struct sample_session *smpl)
-{
-    switch (smpl->forward_what) {
-    case SAMPLE_FWD_BSMP:       /* fall through */
-    case SAMPLE_FWD_BSMP_RAW:
-        return RAW_MTYPE_BSMP;
-    case SAMPLE_FWD_BSUB:       /* fall through */
-    case SAMPLE_FWD_BSUB_RAW:
-        return RAW_MTYPE_BSUB;
-    case SAMPLE_FWD_NOTHING:    /* shouldn't happen; fall through */
-    default:
-        assert(0);
-        return RAW_MTYPE_ERR;
-    }
-}
-
 /* NOT SYNCHRONIZED (smpl_mtx) */
 static int sample_enable_forwarding(struct sample_session *smpl,
                                     enum sample_forward what)
 {
     if (smpl->dnaddr.ss_family == AF_UNSPEC ||
-        smpl->caddr.ss_family == AF_UNSPEC) {
+        (smpl->caddr.ss_family == AF_UNSPEC && !smpl->fwd_nsubs)) {
         return -1;
     }
     smpl->forward_what = what;
-    smpl->debug_last_sub_idx = 0;
     return 0;
 }
 
@@ -773,6 +1591,35 @@ static int sample_disable_forwarding(struct sample_session *smpl)
     return 0;
 }
 
+/*
+ * Tell the kernel which packets on ddatafd we want right now: board
+ * samples or forwarded packets from the data node, or nothing at all.
+ * Anything else gets dropped before it costs us a syscall. The
+ * receive paths still check everything, in case this fails.
+ *
+ * NOT SYNCHRONIZED (smpl_mtx)
+ */
+static void sample_update_filter(struct sample_session *smpl)
+{
+    struct sockaddr *src = NULL;
+    uint8_t mtype = 0;
+    if (smpl->rx_cfg.unfiltered) {
+        return;
+    }
+    if (sample_expecting_bsamps(smpl)) {
+        src = (struct sockaddr*)&smpl->dnaddr;
+        mtype = RAW_MTYPE_BSMP;
+    } else if (sample_forwarding_data(smpl)) {
+        src = (struct sockaddr*)&smpl->dnaddr;
+        mtype = sample_forward_mtype(smpl);
+    }
+    if (raw_data_filter_attach(smpl->ddatafd, src, mtype) == -1 &&
+        !smpl->smpl_filter_warned) {
+        log_WARNING("can't filter data socket packets in the kernel: %m");
+        smpl->smpl_filter_warned = 1;
+    }
+}
+
 __unused
 static const char* sample_forward_what_str(enum sample_forward what)
 {
@@ -809,6 +1656,7 @@ int sample_cfg_forwarding(struct sample_session *smpl,
     ret = (what != SAMPLE_FWD_NOTHING ?
            sample_enable_forwarding(smpl, what) :
            sample_disable_forwarding(smpl));
+    sample_update_filter(smpl);
     sample_must_unlock(smpl);
     if (!ret) {
         if (what == SAMPLE_FWD_NOTHING) {
@@ -820,55 +1668,383 @@ int sample_cfg_forwarding(struct sample_session *smpl,
     return ret;
 }
 
-/* ACQUIRES (worker_mtx) */
-static void sample_setup_bsamp_worker(struct sample_session *smpl)
+/* NOT SYNCHRONIZED (smpl_mtx) */
+static struct sample_fwd_dest*
+sample_find_subscriber(struct sample_session *smpl, struct sockaddr *addr)
 {
-    sample_must_lock_worker(smpl);
-    assert(!(smpl->worker_why & (SAMPLE_WHY_STOP | SAMPLE_WHY_BSAMPS)));
-    assert(smpl->worker_using_buf[0] == 0 && smpl->worker_using_buf[1] == 0);
-    smpl->worker_using_buf[0] = 0;
-    smpl->worker_using_buf[1] = 0;
-    smpl->worker_nwritten = 0;
-    sample_must_unlock_worker(smpl);
+    for (size_t i = 0; i < smpl->fwd_nsubs; i++) {
+        struct sample_fwd_dest *sub = &smpl->fwd_subs[i];
+        if (sub->addr.ss_family == addr->sa_family &&
+            sockutil_addr_eq((struct sockaddr*)&sub->addr, addr, 0)) {
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+/* Find a decimator destinations already share, if there is one.
+ * NOT SYNCHRONIZED (smpl_mtx) */
+static struct sample_decim* sample_find_decim(struct sample_session *smpl,
+                                              unsigned factor, int envelope)
+{
+    struct sample_decim *sd = smpl->fwd_copts.decim;
+    if (sd && sd->factor == factor && sd->envelope == envelope) {
+        return sd;
+    }
+    for (size_t i = 0; i < smpl->fwd_nsubs; i++) {
+        sd = smpl->fwd_subs[i].decim;
+        if (sd && sd->factor == factor && sd->envelope == envelope) {
+            return sd;
+        }
+    }
+    return NULL;
+}
+
+/* Fill in everything but the address of a destination for what, from
+ * opts (NULL for the defaults). It gets a reference to its projection
+ * and decimator, if it has them. Returns 0 on success, or -1 if opts
+ * don't make sense for what, or we're out of memory.
+ * NOT SYNCHRONIZED (smpl_mtx) */
+static int sample_fwd_dest_init(struct sample_session *smpl,
+                                struct sample_fwd_dest *dest,
+                                enum sample_forward what,
+                                const struct sample_fwd_opts *opts)
+{
+    static const struct sample_fwd_opts defaults = { .every_nth = 1 };
+    if (!opts) {
+        opts = &defaults;
+    }
+    unsigned decimate = opts->decimate ? opts->decimate : 1;
+    int envelope = !!opts->envelope;
+    int bsmp = what == SAMPLE_FWD_BSMP || what == SAMPLE_FWD_BSMP_RAW;
+
+    dest->what = what;
+    dest->every_nth = opts->every_nth ? opts->every_nth : 1;
+    dest->proj = NULL;
+    dest->decim = NULL;
+    dest->compact = !!opts->compact;
+    if ((opts->nchans && what != SAMPLE_FWD_BSMP) ||
+        (decimate > 1 && (!bsmp || dest->every_nth > 1)) ||
+        (envelope && (decimate == 1 || what != SAMPLE_FWD_BSMP ||
+                      opts->nchans)) ||
+        (dest->compact && what != SAMPLE_FWD_BSUB && !opts->nchans)) {
+        return -1;
+    }
+    if (opts->nchans) {
+        dest->proj = sample_proj_new(smpl, opts->chans, opts->nchans);
+        if (!dest->proj) {
+            return -1;
+        }
+    }
+    if (decimate > 1) {
+        dest->decim = sample_find_decim(smpl, decimate, envelope);
+        if (dest->decim) {
+            sample_decim_get(dest->decim);
+        } else {
+            dest->decim = sample_decim_new(decimate, envelope);
+        }
+        if (!dest->decim) {
+            sample_proj_put(dest->proj);
+            dest->proj = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int sample_cfg_forward_opts(struct sample_session *smpl,
+                            enum sample_forward what,
+                            const struct sample_fwd_opts *opts)
+{
+    int ret;
+    struct sample_fwd_dest copts;
+    if (what == SAMPLE_FWD_NOTHING) {
+        return -1;
+    }
+    memset(&copts, 0, sizeof(copts));
+    sample_must_lock(smpl);
+    ret = sample_fwd_dest_init(smpl, &copts, what, opts);
+    if (!ret) {
+        /* Swap in the new options; drop the old ones below. */
+        struct sample_fwd_dest tmp = smpl->fwd_copts;
+        smpl->fwd_copts = copts;
+        copts = tmp;
+    }
+    sample_must_unlock(smpl);
+    if (!ret) {
+        sample_fwd_dest_put(&copts);
+    }
+    return ret;
 }
 
-/* ACQUIRES (wr bsamp_mtx) */
-static int sample_setup_dbuf(struct sample_session *smpl,
-                             struct sample_bsamp_cfg *cfg)
+int sample_add_subscriber(struct sample_session *smpl,
+                          struct sockaddr *addr,
+                          enum sample_forward what,
+                          const struct sample_fwd_opts *opts)
 {
-    const size_t bufsize = SAMPLE_BSAMP_MAXLEN * sizeof(struct raw_pkt_bsmp);
     int ret = 0;
-    if (sample_must_trywrlock_dbuf(smpl) == EBUSY) {
-        log_ERR("%s: not expecting samples, but can't wrlock sample buffers",
-                __func__);
+    struct sample_fwd_dest dest, old;
+    if (what == SAMPLE_FWD_NOTHING ||
+        (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)) {
         return -1;
     }
-    assert(!smpl->bsamp_bufs[0] && !smpl->bsamp_bufs[1]);
-    smpl->bsamp_buflen[0] = 0;
-    smpl->bsamp_buflen[1] = 0;
-    smpl->bsamp_widx = 0;
-    smpl->bsamp_bufs[0] = malloc(bufsize);
-    smpl->bsamp_bufs[1] = malloc(bufsize);
-    if (!smpl->bsamp_bufs[0] || !smpl->bsamp_bufs[1]) {
-        log_ERR("%s: out of memory", __func__);
-        free(smpl->bsamp_bufs[0]);
-        free(smpl->bsamp_bufs[1]);
-        smpl->bsamp_bufs[0] = NULL;
-        smpl->bsamp_bufs[1] = NULL;
-        sample_init_bsamp_cfg(smpl);
+    memset(&dest, 0, sizeof(dest));
+    memset(&old, 0, sizeof(old));
+    memcpy(&dest.addr, addr, sockutil_addrlen(addr));
+    sample_must_lock(smpl);
+    if (sample_fwd_dest_init(smpl, &dest, what, opts)) {
+        ret = -1;
+        goto out;
+    }
+    struct sample_fwd_dest *sub = sample_find_subscriber(smpl, addr);
+    if (sub) {
+        old = *sub;
+    } else if (smpl->fwd_nsubs < SAMPLE_MAX_SUBSCRIBERS) {
+        sub = &smpl->fwd_subs[smpl->fwd_nsubs++];
+    } else {
+        old = dest;
         ret = -1;
         goto out;
     }
-    memcpy(&smpl->bsamp_cfg, cfg, sizeof(smpl->bsamp_cfg));
+    *sub = dest;
+    sample_update_filter(smpl);
+ out:
+    sample_must_unlock(smpl);
+    /* Drop what the subscriber had before (or what we couldn't use). */
+    sample_fwd_dest_put(&old);
+    if (!ret) {
+        log_DEBUG("subscriber wants %s packets (every %u, decimated %u)",
+                  sample_forward_what_str(what), dest.every_nth,
+                  dest.decim ? dest.decim->factor : 1);
+    }
+    return ret;
+}
+
+int sample_remove_subscriber(struct sample_session *smpl,
+                             struct sockaddr *addr)
+{
+    int ret = 0;
+    sample_must_lock(smpl);
+    struct sample_fwd_dest *sub = sample_find_subscriber(smpl, addr);
+    if (!sub) {
+        ret = -1;
+        goto out;
+    }
+    size_t i = (size_t)(sub - smpl->fwd_subs);
+    sample_fwd_dest_put(sub);
+    memmove(sub, sub + 1, (smpl->fwd_nsubs - i - 1) * sizeof(*sub));
+    smpl->fwd_nsubs--;
+    sample_update_filter(smpl);
+ out:
+    sample_must_unlock(smpl);
+    return ret;
+}
+
+int sample_set_multicast_ttl(struct sample_session *smpl, unsigned ttl)
+{
+    int val = (int)ttl;
+    if (ttl > 255) {
+        return -1;
+    }
+    if (setsockopt(smpl->ddatafd, IPPROTO_IP, IP_MULTICAST_TTL,
+                   &val, sizeof(val)) == -1) {
+        log_WARNING("can't set data socket multicast TTL to %u: %m", ttl);
+        return -1;
+    }
+    return 0;
+}
+
+/* Hand the shared memory ring's memfd to a reader. */
+static void sample_shm_accept(evutil_socket_t lfd, __unused short what,
+                              void *smplvp)
+{
+    struct sample_session *smpl = smplvp;
+    int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    if (sockutil_send_fd(fd, smpl->shm->fd)) {
+        log_WARNING("can't send shared memory ring to reader: %m");
+    }
+    close(fd);
+}
+
+int sample_publish_shm(struct sample_session *smpl, const char *path,
+                       size_t nslots)
+{
+    if (smpl->shm) {
+        return -1;
+    }
+    smpl->shm = shm_ring_create("leafysd-samples",
+                                nslots ? nslots : SAMPLE_SHM_NSLOTS,
+                                sizeof(union sample_packet));
+    if (!smpl->shm) {
+        log_ERR("can't create shared memory ring: %m");
+        goto fail;
+    }
+    smpl->shm_path = strdup(path);
+    if (!smpl->shm_path) {
+        goto fail;
+    }
+    smpl->shm_lfd = sockutil_get_unix_passive(path, 16);
+    if (smpl->shm_lfd == -1) {
+        log_ERR("can't listen for shared memory readers at %s: %m", path);
+        goto fail;
+    }
+    evutil_make_socket_nonblocking(smpl->shm_lfd);
+    smpl->shm_evt = event_new(smpl->base, smpl->shm_lfd,
+                              EV_READ | EV_PERSIST, sample_shm_accept, smpl);
+    if (!smpl->shm_evt || event_add(smpl->shm_evt, NULL)) {
+        goto fail;
+    }
+    log_INFO("publishing samples in shared memory; readers connect to %s",
+             path);
+    return 0;
+
+ fail:
+    if (smpl->shm_evt) {
+        event_free(smpl->shm_evt);
+        smpl->shm_evt = NULL;
+    }
+    if (smpl->shm_lfd != -1) {
+        evutil_closesocket(smpl->shm_lfd);
+        unlink(path);
+        smpl->shm_lfd = -1;
+    }
+    free(smpl->shm_path);
+    smpl->shm_path = NULL;
+    shm_ring_free(smpl->shm);
+    smpl->shm = NULL;
+    return -1;
+}
+
+/* Publish a data packet of type mtype in the shared memory ring, if
+ * there is one. If wire is set, pkt is just as it came off the wire;
+ * otherwise, it's been through raw_pkt_ntoh() or raw_pkt_ntoh_hdr().
+ * Reader only. */
+static void sample_shm_publish(struct sample_session *smpl,
+                               const void *pkt, uint8_t mtype, int wire)
+{
+    if (!smpl->shm) {
+        return;
+    }
+    size_t len = (mtype == RAW_MTYPE_BSMP ? sizeof(struct raw_pkt_bsmp) :
+                  sizeof(struct raw_pkt_bsub));
+    /* b_sidx is in the same place in a board subsample. */
+    struct raw_pkt_bsmp *dst = shm_ring_begin(smpl->shm, mtype);
+    memcpy(dst, pkt, len);
+    if (wire) {
+        /* It's been checked, so this can't fail. */
+        raw_pkt_ntoh_hdr(dst);
+    }
+    shm_ring_commit(smpl->shm, len, dst->b_sidx);
+}
+
+int sample_cfg_bsamp_bufs(struct sample_session *smpl,
+                          size_t nbufs, unsigned buf_msec)
+{
+    int ret = -1;
+    if (!nbufs) {
+        nbufs = SAMPLE_BSAMP_NSLABS;
+    }
+    if (!buf_msec) {
+        buf_msec = SAMPLE_BSAMP_MSEC_P_SLAB;
+    }
+    size_t cap = (size_t)SAMPLE_BSAMP_KHZ * buf_msec;
+
+    sample_must_lock(smpl);
+    if (smpl->smpl_cb) {
+        /* The worker may still be using the ring. */
+        log_ERR("%s: board sample transfer in progress", __func__);
+        goto out;
+    }
+    if (nbufs != smpl->bsamp_ring->sr_nslabs ||
+        cap != smpl->bsamp_slab_cap) {
+        struct spsc_ring *ring = sample_alloc_ring(nbufs, cap);
+        if (!ring) {
+            log_ERR("can't allocate %zu sample buffers of %u ms each: %m",
+                    nbufs, buf_msec);
+            goto out;
+        }
+        sample_must_lock_bsamps(smpl);
+        assert(!spsc_ring_cons_slab(smpl->bsamp_ring));
+        spsc_ring_free(smpl->bsamp_ring);
+        smpl->bsamp_ring = ring;
+        smpl->bsamp_slab_cap = cap;
+        sample_must_unlock_bsamps(smpl);
+    }
+    log_DEBUG("buffering up to %zu ms of board samples (%zu x %u ms)",
+              nbufs * buf_msec, nbufs, buf_msec);
+    ret = 0;
  out:
-    sample_must_rwunlock_dbuf(smpl);
+    sample_must_unlock(smpl);
     return ret;
 }
 
+/* ACQUIRES worker_mtx */
+void sample_get_bsamp_stats(struct sample_session *smpl,
+                            struct sample_bsamp_stats *stats)
+{
+    stats->peak_bufs = spsc_ring_hwm(smpl->bsamp_ring);
+    stats->nreordered = smpl->rstat_nreordered;
+    stats->gaps = smpl->smpl_gaps;
+    stats->ngaps = smpl->smpl_ngaps;
+    stats->npauses = smpl->rstat_npauses;
+    stats->nforeign = smpl->rstat_nforeign;
+    size_t nfailed = __atomic_load_n(&smpl->fstat_nfailed, __ATOMIC_RELAXED);
+    stats->nforwarded = smpl->fstat_nqueued - nfailed;
+    stats->nfwd_dropped = smpl->fstat_nfull + nfailed;
+    stats->first_write_usec = -1;
+    sample_must_lock_worker(smpl);
+    if (smpl->worker_nwritten && smpl->rstat_got_first) {
+        const struct timespec *rx = &smpl->rstat_first_rx;
+        const struct timespec *wr = &smpl->worker_first_write;
+        stats->first_write_usec =
+            ((int64_t)(wr->tv_sec - rx->tv_sec) * 1000000 +
+             (wr->tv_nsec - rx->tv_nsec) / 1000);
+    }
+    sample_must_unlock_worker(smpl);
+}
+
+/* ACQUIRES (worker_mtx) */
+static void sample_setup_bsamp_worker(struct sample_session *smpl)
+{
+    sample_must_lock_worker(smpl);
+    assert(!(smpl->worker_why & (SAMPLE_WHY_STOP | SAMPLE_WHY_BSAMPS)));
+    smpl->worker_nwritten = 0;
+    sample_must_unlock_worker(smpl);
+}
+
+/* NOT SYNCHRONIZED (smpl_mtx) */
+static void sample_reorder_reset(struct sample_session *smpl)
+{
+    if (smpl->reorder_have) {
+        memset(smpl->reorder_have, 0, smpl->rx_cfg.reorder_window);
+    }
+    smpl->reorder_nstashed = 0;
+}
+
+/* NOT SYNCHRONIZED (smpl_mtx), ACQUIRES bsamp_mtx */
+static void sample_setup_bsamp_ring(struct sample_session *smpl,
+                                    struct sample_bsamp_cfg *cfg)
+{
+    sample_must_lock_bsamps(smpl);
+    assert(!spsc_ring_cons_slab(smpl->bsamp_ring));
+    memcpy(&smpl->bsamp_cfg, cfg, sizeof(smpl->bsamp_cfg));
+    sample_must_unlock_bsamps(smpl);
+
+    /* Holding smpl_mtx makes us the producer. */
+    assert(!smpl->smpl_paused);
+    spsc_ring_reset_hwm(smpl->bsamp_ring);
+    smpl->smpl_slab_len = 0;
+    sample_reorder_reset(smpl);
+}
+
 /* NOT SYNCHRONIZED (smpl_mtx) */
 static int sample_setup_bsamp_events(struct sample_session *smpl)
 {
     assert(!smpl->smpl_timeout_evt);
+    sample_reap_timeout(smpl);
     smpl->smpl_timeout_evt = evtimer_new(smpl->base, sample_timeout_callback,
                                          smpl);
     if (!smpl->smpl_timeout_evt) {
@@ -915,10 +2091,8 @@ int sample_expect_bsamps(struct sample_session *smpl,
     /* Set up worker */
     sample_setup_bsamp_worker(smpl);
 
-    /* Set up sample double-buffering */
-    if (sample_setup_dbuf(smpl, cfg)) {
-        goto out;
-    }
+    /* Set up the sample ring */
+    sample_setup_bsamp_ring(smpl, cfg);
 
     /* Set up timeout and thread notifier events */
     if (sample_setup_bsamp_events(smpl)) {
@@ -930,6 +2104,19 @@ int sample_expect_bsamps(struct sample_session *smpl,
     smpl->smpl_cb = cb;
     smpl->smpl_cb_arg = arg;
     smpl->smpl_next_sidx = (size_t)cfg->start_sample;
+    smpl->rstat_nsyscalls = 0;
+    smpl->rstat_npkts = 0;
+    smpl->rstat_maxbatch = 0;
+    smpl->rstat_npauses = 0;
+    smpl->rstat_nreordered = 0;
+    smpl->rstat_ndups = 0;
+    smpl->rstat_nforeign = 0;
+    smpl->rstat_got_first = 0;
+    smpl->smpl_ngaps = 0;
+    smpl->fstat_nqueued = 0;
+    smpl->fstat_nfull = 0;
+    __atomic_store_n(&smpl->fstat_nfailed, 0, __ATOMIC_RELAXED);
+    sample_update_filter(smpl);
     ret = 0;
  out:
     sample_must_unlock(smpl);
@@ -966,9 +2153,36 @@ static void sample_timeout_callback(__unused evutil_socket_t ignored,
 {
     struct sample_session *smpl = smplvp;
     assert(events == EV_TIMEOUT);
+    sample_must_lock(smpl);
+    sample_reap_timeout(smpl);
+    if (!sample_expecting_bsamps(smpl)) {
+        /* The transfer ended while we were waiting for smpl_mtx. */
+        goto out;
+    }
+    if (sample_rx_threaded(smpl)) {
+        /* The receive thread doesn't re-arm the timeout, so see if
+         * anything arrived since it was last armed. */
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t idle_usec =
+            ((int64_t)(now.tv_sec - smpl->smpl_last_rx.tv_sec) * 1000000 +
+             (now.tv_nsec - smpl->smpl_last_rx.tv_nsec) / 1000);
+        int64_t limit_usec = ((int64_t)SAMPLE_BSAMP_TIMEOUT_SEC * 1000000 +
+                              SAMPLE_BSAMP_TIMEOUT_USEC);
+        if (idle_usec < limit_usec) {
+            struct timeval left = {
+                .tv_sec = (limit_usec - idle_usec) / 1000000,
+                .tv_usec = (limit_usec - idle_usec) % 1000000,
+            };
+            evtimer_add(smpl->smpl_timeout_evt, &left);
+            goto out;
+        }
+    }
     /* Stop the transfer and get the worker to acknowledge it's time
      * to stop. */
     sample_stop_worker(smpl, SAMPLE_STOP_TIMEOUT);
+ out:
+    sample_must_unlock(smpl);
 }
 
 /* The worker uses this to let the reader know about things that
@@ -988,15 +2202,14 @@ static void sample_worker_callback(__unused evutil_socket_t ignored,
      * Decide what to do about whatever happened to the worker.
      */
     if (what & SAMPLE_THREAD_DONE) {
-        /* Worker finished storing its buffer; mark it unused. */
+        /* Worker drained the ring; see if that was the last of it. */
+        sample_must_lock(smpl);
         sample_must_lock_worker(smpl);
-        sample_must_rdlock_dbuf(smpl);
-        smpl->worker_using_buf[smpl->bsamp_widx] = 0;
         if (smpl->worker_nwritten == smpl->bsamp_cfg.nsamples) {
             cb_flags |= SAMPLE_BS_DONE;
         }
-        sample_must_rwunlock_dbuf(smpl);
         sample_must_unlock_worker(smpl);
+        sample_must_unlock(smpl);
     }
     if (what & SAMPLE_THREAD_SLEEPING) {
         /* Worker acknowledges halt and has gone to sleep. */
@@ -1035,12 +2248,51 @@ static void sample_worker_callback(__unused evutil_socket_t ignored,
     sample_must_lock_worker(smpl);
     size_t nwritten = smpl->worker_nwritten;
     sample_must_unlock_worker(smpl);
-    sample_must_rdlock_dbuf(smpl);
-    assert(!(cb_flags & SAMPLE_BS_DONE) ||
-           (nwritten == smpl->bsamp_cfg.nsamples));
-    sample_must_rwunlock_dbuf(smpl);
 
     sample_must_lock(smpl);
+    assert(!(cb_flags & SAMPLE_BS_DONE) ||
+           (nwritten == smpl->bsamp_cfg.nsamples));
+    log_INFO("received %zu board sample packets in %zu syscalls "
+             "(%.3f syscalls/sample, max batch %zu of %d)",
+             smpl->rstat_npkts, smpl->rstat_nsyscalls,
+             (smpl->rstat_npkts ?
+              (double)smpl->rstat_nsyscalls / smpl->rstat_npkts : 0.0),
+             smpl->rstat_maxbatch, CONFIG_SAMPLE_RECV_BATCH);
+    log_INFO("sample ring high water mark %zu of %zu slabs; "
+             "paused reading %zu times",
+             spsc_ring_hwm(smpl->bsamp_ring), smpl->bsamp_ring->sr_nslabs,
+             smpl->rstat_npauses);
+    if (smpl->rstat_nforeign) {
+        log_INFO("ignored %zu packets from addresses other than "
+                 "the data node's", smpl->rstat_nforeign);
+    }
+    if (smpl->rstat_nreordered || smpl->rstat_ndups) {
+        log_INFO("%zu board samples arrived out of order, "
+                 "%zu were duplicates (reorder window %u)",
+                 smpl->rstat_nreordered, smpl->rstat_ndups,
+                 smpl->rx_cfg.reorder_window);
+    }
+    if (smpl->smpl_ngaps) {
+        size_t nmissing = 0;
+        for (size_t g = 0; g < smpl->smpl_ngaps; g++) {
+            nmissing += smpl->smpl_gaps[g].len;
+        }
+        log_INFO("%zu board samples missing, in %zu gaps",
+                 nmissing, smpl->smpl_ngaps);
+    }
+    struct sample_bsamp_stats stats;
+    sample_get_bsamp_stats(smpl, &stats);
+    if (stats.nforwarded || stats.nfwd_dropped) {
+        log_INFO("forwarded %zu board samples while storing them; "
+                 "%zu dropped because forwarding fell behind, "
+                 "%zu more couldn't be sent",
+                 stats.nforwarded, smpl->fstat_nfull,
+                 stats.nfwd_dropped - smpl->fstat_nfull);
+    }
+    if (stats.first_write_usec >= 0) {
+        log_INFO("first board samples stored %.3f ms after arriving",
+                 stats.first_write_usec / 1000.0);
+    }
     if (sample_expecting_bsamps(smpl)) {
         /* If we're still expecting samples, we need to clear the
          * timeout as well as reject further ones. */
@@ -1050,6 +2302,7 @@ static void sample_worker_callback(__unused evutil_socket_t ignored,
          * the samples have been read. */
         sample_finished_with_bsamps(smpl);
     }
+    sample_reap_timeout(smpl);
     assert(smpl->smpl_cb);
     smpl->smpl_cb(cb_flags, nwritten, smpl->smpl_cb_arg);
     smpl->smpl_cb = NULL;
@@ -1085,7 +2338,7 @@ static void sample_log_address_mismatch(struct sample_session *smpl,
               dnaddr_addrstr, got_addrstr);
 }
 
-/* NOT SYNCHRONIZED (rd bsamp_mtx) */
+/* NOT SYNCHRONIZED (smpl_mtx) */
 static inline size_t sample_last_sidx(struct sample_session *smpl)
 {
     struct sample_bsamp_cfg *bcfg = &smpl->bsamp_cfg;
@@ -1093,7 +2346,7 @@ static inline size_t sample_last_sidx(struct sample_session *smpl)
     return (size_t)bcfg->start_sample + bcfg->nsamples - 1;
 }
 
-/* NOT SYNCHRONIZED (smpl_mtx, rd bsamp_mtx) */
+/* NOT SYNCHRONIZED (smpl_mtx) */
 static inline size_t sample_samps_left(struct sample_session *smpl)
 {
     struct sample_bsamp_cfg *bcfg = &smpl->bsamp_cfg;
@@ -1105,167 +2358,380 @@ static inline size_t sample_samps_left(struct sample_session *smpl)
     }
 }
 
-/* Read new samples into the free buffer.
+/*
+ * Board samples can arrive a little out of order without any being
+ * lost. Up to rx_cfg.reorder_window of them may arrive ahead of the
+ * one we're waiting for; those get stashed in reorder_bufs, at
+ * index (b_sidx % reorder_window), until the gap fills. A packet
+ * further ahead than that means the one we wanted is gone.
+ */
+#define SEQ_NEXT 0              /* the one we were waiting for */
+#define SEQ_EARLY 1             /* stashed for later */
+#define SEQ_DUPLICATE 2         /* already have it */
+#define SEQ_DROPPED 3           /* too far ahead */
+#define SEQ_GAP 4               /* too far ahead, but we can skip to it */
+
+/* Stash bsmp until the board samples before it show up. Returns -1
+ * if we've already got it.
  * NOT SYNCHRONIZED (smpl_mtx) */
-#define GOT_BSAMPS 0
-#define FILLED_BUFFER 1
-#define GOT_LAST_BSAMP 2
-#define DROPPED_PKT (-1)
-#define SOCKET_ERR (-2)
-#define GOT_NOTHING (-3)
-#define GOT_PKT_ERR (-4)
-static int sample_ddatafd_grab_bsamps(struct sample_session *smpl)
+static int sample_reorder_stash(struct sample_session *smpl,
+                                struct raw_pkt_bsmp *bsmp)
 {
-    struct sockaddr_storage sas;
-    socklen_t sas_len = sizeof(sas);
-    int ret = GOT_NOTHING;
-
-    sample_must_rdlock_dbuf(smpl);
-    size_t myidx = 0x1 ^ smpl->bsamp_widx;
-    struct raw_pkt_bsmp *mybufs = smpl->bsamp_bufs[myidx];
-    const size_t s_left = sample_samps_left(smpl);
-    const size_t b_start = smpl->bsamp_buflen[myidx];
-    const size_t b_avail = SAMPLE_BSAMP_MAXLEN - b_start;
-    const size_t b_end = b_start + (b_avail > s_left ? s_left : b_avail);
+    size_t slot = bsmp->b_sidx % smpl->rx_cfg.reorder_window;
+    if (smpl->reorder_have[slot]) {
+        return -1;
+    }
+    memcpy(&smpl->reorder_bufs[slot], bsmp, sizeof(*bsmp));
+    smpl->reorder_have[slot] = 1;
+    smpl->reorder_nstashed++;
+    return 0;
+}
 
-    size_t i = b_start;
-    size_t n_bad = 0; /* number of bad packets since last good packet. */
-    while (i < b_end) {
-        if (n_bad > SAMPLE_MAX_CONSECUTIVE_BAD_PKTS) {
-            log_WARNING("%s: too many bad packets; returning early", __func__);
-            break;
+/* NOT SYNCHRONIZED (smpl_mtx) */
+static int sample_reorder_check(struct sample_session *smpl,
+                                struct raw_pkt_bsmp *bsmp)
+{
+    const size_t window = smpl->rx_cfg.reorder_window;
+    const uint32_t ahead = bsmp->b_sidx - (uint32_t)smpl->smpl_next_sidx;
+    if (ahead == 0) {
+        return SEQ_NEXT;
+    }
+    if ((int32_t)ahead < 0) {
+        if (!window) {
+            return SEQ_DROPPED;
         }
+        /* We've already stored this one. */
+        smpl->rstat_ndups++;
+        return SEQ_DUPLICATE;
+    }
+    if (ahead >= sample_samps_left(smpl)) {
+        return SEQ_DROPPED;
+    }
+    if (ahead >= window) {
+        return smpl->bsamp_cfg.fill_gaps ? SEQ_GAP : SEQ_DROPPED;
+    }
+    if (sample_reorder_stash(smpl, bsmp) == -1) {
+        smpl->rstat_ndups++;
+        return SEQ_DUPLICATE;
+    }
+    smpl->rstat_nreordered++;
+    return SEQ_EARLY;
+}
 
-        ssize_t s = recvfrom(smpl->ddatafd, &mybufs[i],
-                             sizeof(struct raw_pkt_bsmp), 0,
-                             (struct sockaddr*)&sas, &sas_len);
-        if (s == -1) {
-            switch (errno) {
-#if EWOULDBLOCK != EAGAIN
-            case EWOULDBLOCK:   /* fall through */
-#endif
+/* Give up on the board samples we're waiting for, since bsmp arrived
+ * too far ahead of them, and record them as a gap so whoever asked
+ * for them can get them some other way.
+ *
+ * If anything's stashed, only the samples before the first stashed
+ * one are skipped, and bsmp gets stashed behind it; that way a single
+ * lost packet costs a single board sample. If bsmp is too far ahead
+ * even for that, whatever's stashed falls in the gap too.
+ *
+ * Returns SEQ_NEXT if bsmp is now next in line, SEQ_EARLY if it got
+ * stashed, or SEQ_DROPPED if we're out of memory to record the gap.
+ * NOT SYNCHRONIZED (smpl_mtx) */
+static int sample_skip_gap(struct sample_session *smpl,
+                           struct raw_pkt_bsmp *bsmp)
+{
+    const size_t window = smpl->rx_cfg.reorder_window;
+    uint32_t skip = bsmp->b_sidx - (uint32_t)smpl->smpl_next_sidx;
+    if (smpl->reorder_nstashed) {
+        uint32_t first = 0;
+        while (!smpl->reorder_have[(smpl->smpl_next_sidx + first) %
+                                   window]) {
+            first++;
+        }
+        if (first && skip - first < window) {
+            skip = first;
+        } else {
+            sample_reorder_reset(smpl);
+        }
+    }
+    if (smpl->smpl_ngaps == smpl->smpl_gaps_cap) {
+        size_t cap = smpl->smpl_gaps_cap ? 2 * smpl->smpl_gaps_cap : 16;
+        struct ch_gap *gaps = realloc(smpl->smpl_gaps,
+                                      cap * sizeof(*gaps));
+        if (!gaps) {
+            log_ERR("out of memory recording board sample gap");
+            return SEQ_DROPPED;
+        }
+        smpl->smpl_gaps = gaps;
+        smpl->smpl_gaps_cap = cap;
+    }
+    struct ch_gap *gap = &smpl->smpl_gaps[smpl->smpl_ngaps++];
+    gap->start = smpl->smpl_next_sidx;
+    gap->len = skip;
+    log_DEBUG("%s: skipping %zu board samples starting at %zu",
+              __func__, (size_t)gap->len, (size_t)gap->start);
+    smpl->smpl_next_sidx += skip;
+    if (bsmp->b_sidx == (uint32_t)smpl->smpl_next_sidx) {
+        return SEQ_NEXT;
+    }
+    /* Can't fail: bsmp's slot belonged to a sample before the gap. */
+    (void)sample_reorder_stash(smpl, bsmp);
+    return SEQ_EARLY;
+}
+
+/* Move stashed board samples which are next in line into bufs[*i],
+ * bufs[*i + 1], ..., stopping before bufs[end].
+ * NOT SYNCHRONIZED (smpl_mtx) */
+static void sample_reorder_drain(struct sample_session *smpl,
+                                 struct raw_pkt_bsmp *bufs,
+                                 size_t *i, size_t end)
+{
+    const size_t window = smpl->rx_cfg.reorder_window;
+    while (smpl->reorder_nstashed && *i < end) {
+        size_t slot = smpl->smpl_next_sidx % window;
+        if (!smpl->reorder_have[slot]) {
+            break;
+        }
+        memcpy(&bufs[*i], &smpl->reorder_bufs[slot], sizeof(bufs[0]));
+        smpl->reorder_have[slot] = 0;
+        smpl->reorder_nstashed--;
+        smpl->smpl_next_sidx++;
+        (*i)++;
+    }
+}
+
+/* Receive up to nwant (at most CONFIG_SAMPLE_RECV_BATCH) packets
+ * straight into consecutive slots of bufs, with a single syscall.
+ * Source addresses end up in smpl->c_bsmp_addrs. Returns the number
+ * of packets received, or -1 on error (with errno set).
+ *
+ * Event loop thread only. */
+static int sample_recv_bsamp_batch(struct sample_session *smpl,
+                                   struct raw_pkt_bsmp *bufs, size_t nwant)
+{
+    assert(nwant > 0 && nwant <= CONFIG_SAMPLE_RECV_BATCH);
+    for (size_t j = 0; j < nwant; j++) {
+        struct msghdr *hdr = &smpl->c_bsmp_mmsgs[j].msg_hdr;
+        smpl->c_bsmp_iovs[j].iov_base = &bufs[j];
+        smpl->c_bsmp_iovs[j].iov_len = sizeof(struct raw_pkt_bsmp);
+        hdr->msg_name = &smpl->c_bsmp_addrs[j];
+        hdr->msg_namelen = sizeof(smpl->c_bsmp_addrs[j]);
+        hdr->msg_iov = &smpl->c_bsmp_iovs[j];
+        hdr->msg_iovlen = 1;
+        hdr->msg_control = NULL;
+        hdr->msg_controllen = 0;
+        hdr->msg_flags = 0;
+    }
+    smpl->rstat_nsyscalls++;
+    int n = recvmmsg(smpl->ddatafd, smpl->c_bsmp_mmsgs, (unsigned)nwant,
+                     0, NULL);
+    if (n > 0) {
+        smpl->rstat_npkts += (size_t)n;
+        if ((size_t)n > smpl->rstat_maxbatch) {
+            smpl->rstat_maxbatch = (size_t)n;
+        }
+    }
+    return n;
+}
+
+/* Read new samples into the ring's free slab. The caller must make
+ * sure there is one.
+ * NOT SYNCHRONIZED (smpl_mtx) */
+#define GOT_BSAMPS 0
+#define FILLED_BUFFER 1
+#define GOT_LAST_BSAMP 2
+#define DROPPED_PKT (-1)
+#define SOCKET_ERR (-2)
+#define GOT_NOTHING (-3)
+#define GOT_PKT_ERR (-4)
+static int sample_ddatafd_grab_bsamps(struct sample_session *smpl)
+{
+    int ret = GOT_NOTHING;
+
+    struct sample_slab *slab = spsc_ring_prod_slab(smpl->bsamp_ring);
+    assert(slab);
+    struct raw_pkt_bsmp *mybufs = slab->bsmps;
+    const size_t s_left = sample_samps_left(smpl);
+    const size_t b_start = smpl->smpl_slab_len;
+    const size_t b_avail = smpl->bsamp_slab_cap - b_start;
+    const size_t b_end = b_start + (b_avail > s_left ? s_left : b_avail);
+    size_t i = b_start;
+    size_t n_bad = 0; /* number of bad packets since last good packet. */
+    /* Start with anything stashed that didn't fit in the last slab. */
+    sample_reorder_drain(smpl, mybufs, &i, b_end);
+    sample_fwd_tee_prepare(smpl);
+    /* If the storage backend can take samples in network byte order,
+     * only convert the packet headers. */
+    int (*ntoh)(void*) =
+        ((smpl->bsamp_cfg.chns->ch_flags & CH_STORAGE_WIRE_ORDER) ?
+         raw_pkt_ntoh_hdr : raw_pkt_ntoh);
+    while (i < b_end) {
+        if (n_bad > SAMPLE_MAX_CONSECUTIVE_BAD_PKTS) {
+            log_WARNING("%s: too many bad packets; returning early", __func__);
+            break;
+        }
+
+        size_t nwant = b_end - i;
+        if (nwant > CONFIG_SAMPLE_RECV_BATCH) {
+            nwant = CONFIG_SAMPLE_RECV_BATCH;
+        }
+        int nrecv = sample_recv_bsamp_batch(smpl, &mybufs[i], nwant);
+        if (nrecv == -1) {
+            switch (errno) {
+#if EWOULDBLOCK != EAGAIN
+            case EWOULDBLOCK:   /* fall through */
+#endif
             case EAGAIN:
                 goto done;
             case EINTR:
                 continue;
             default:
-                log_WARNING("%s: recvfrom: %m", __func__);
+                log_WARNING("%s: recvmmsg: %m", __func__);
                 ret = SOCKET_ERR;
                 goto done;
             }
         }
 
         /*
-         * Check the packet.
+         * Check the batch, which starts at mybufs[first]. Good
+         * packets get compacted down over any bad ones, so
+         * mybufs[b_start..i) stays contiguous.
          */
-        if (!sockutil_addr_eq((struct sockaddr*)&smpl->dnaddr,
-                              (struct sockaddr*)&sas, 0)) {
-            sample_log_address_mismatch(smpl, (struct sockaddr*)&sas);
-            n_bad++;
-            continue;
-        }
-        /* Make sure the packet is a well-formed board sample. */
-        if (raw_pkt_ntoh(&mybufs[i])) {
-            log_WARNING("dropping malformed data packet");
-            n_bad++;
-            continue;
-        }
-        uint8_t mtype = raw_mtype(&mybufs[i]);
-        if (mtype != RAW_MTYPE_BSMP) {
-            log_DEBUG("ignoring data packet with wrong mtype %s",
-                      raw_mtype_str(mtype));
-            n_bad++;
-            continue;
-        }
-        if (raw_pkt_is_err(&mybufs[i])) {
-            log_INFO("board sample %u has error flag set", mybufs[i].b_sidx);
-            ret = GOT_PKT_ERR;
-            break;
-        }
-        /* If this is the first packet, and we don't care about
-         * indexes, then start counting from here. */
-        if (smpl->bsamp_cfg.start_sample == -1) {
-            smpl->bsamp_cfg.start_sample = mybufs[i].b_sidx;
-            smpl->smpl_next_sidx = mybufs[i].b_sidx;
-        }
-        /* Check for dropped or reordered packets. */
-        if (mybufs[i].b_sidx != smpl->smpl_next_sidx++) {
-            log_DEBUG("%s: dropped packet; expected index %zu, got %u",
-                      __func__, smpl->smpl_next_sidx - 1, mybufs[i].b_sidx);
-            ret = DROPPED_PKT;
-            break;
-        }
+        const size_t first = i;
+        for (size_t j = 0; j < (size_t)nrecv; j++) {
+            struct raw_pkt_bsmp *bsmp = &mybufs[first + j];
+            struct sockaddr *sa =
+                (struct sockaddr*)&smpl->c_bsmp_addrs[j];
+            if (!sockutil_addr_eq((struct sockaddr*)&smpl->dnaddr, sa, 0)) {
+                sample_log_address_mismatch(smpl, sa);
+                smpl->rstat_nforeign++;
+                n_bad++;
+                continue;
+            }
+            /* Make sure the packet is a well-formed board sample. */
+            if (ntoh(bsmp)) {
+                log_WARNING("dropping malformed data packet");
+                n_bad++;
+                continue;
+            }
+            uint8_t mtype = raw_mtype(bsmp);
+            if (mtype != RAW_MTYPE_BSMP) {
+                log_DEBUG("ignoring data packet with wrong mtype %s",
+                          raw_mtype_str(mtype));
+                n_bad++;
+                continue;
+            }
+            if (raw_pkt_is_err(bsmp)) {
+                log_INFO("board sample %u has error flag set", bsmp->b_sidx);
+                ret = GOT_PKT_ERR;
+                goto done;
+            }
+            /* If this is the first packet, and we don't care about
+             * indexes, then start counting from here. */
+            if (smpl->bsamp_cfg.start_sample == -1) {
+                smpl->bsamp_cfg.start_sample = bsmp->b_sidx;
+                smpl->smpl_next_sidx = bsmp->b_sidx;
+            }
+            /* Check for dropped or reordered packets. */
+            int seq = sample_reorder_check(smpl, bsmp);
+            if (seq == SEQ_GAP) {
+                seq = sample_skip_gap(smpl, bsmp);
+            }
+            switch (seq) {
+            case SEQ_NEXT:
+                break;
+            case SEQ_EARLY:
+                /* Stashed; it'll be slotted in once the gap fills.
+                 * Its slot's free now, so make room in the stash. */
+                n_bad = 0;
+                sample_reorder_drain(smpl, mybufs, &i, first + j + 1);
+                continue;
+            case SEQ_DUPLICATE:
+                n_bad++;
+                continue;
+            case SEQ_DROPPED:
+                log_DEBUG("%s: dropped packet; expected index %zu, got %u",
+                          __func__, smpl->smpl_next_sidx, bsmp->b_sidx);
+                ret = DROPPED_PKT;
+                goto done;
+            }
 
-        /*
-         * Packet retrieved successfully!
-         */
-        i++;
-        n_bad = 0;
+            /*
+             * Packet retrieved successfully!
+             */
+            if (first + j != i) {
+                memcpy(&mybufs[i], bsmp, sizeof(*bsmp));
+            }
+            i++;
+            smpl->smpl_next_sidx++;
+            n_bad = 0;
+            /* mybufs[i..first + j] are free now; fill them from the
+             * stash. */
+            sample_reorder_drain(smpl, mybufs, &i, first + j + 1);
+        }
+        sample_reorder_drain(smpl, mybufs, &i, b_end);
     }
  done:
     /* Check if we actually got any board samples. */
     if (i > b_start && ret != GOT_PKT_ERR) {
         ret = GOT_BSAMPS;
+        if (!smpl->rstat_got_first) {
+            clock_gettime(CLOCK_MONOTONIC, &smpl->rstat_first_rx);
+            smpl->rstat_got_first = 1;
+        }
     }
-    /* If we did, update the buffer length, and see if it's time to flip
-     * the buffer, or if we're done altogether. */
+    /* If we did, update the slab length, and see if it's time to
+     * publish the slab, or if we're done altogether. */
     if (ret == GOT_BSAMPS) {
-        smpl->bsamp_buflen[myidx] = i;
+        /* Now they're in order, with duplicates weeded out, so this
+         * is when forwarding subscribers and shared memory readers
+         * get them too. */
+        for (size_t k = b_start; k < i; k++) {
+            sample_fwd_tee(smpl, &mybufs[k]);
+            sample_shm_publish(smpl, &mybufs[k], RAW_MTYPE_BSMP, 0);
+        }
+        smpl->smpl_slab_len = i;
         if (smpl->smpl_next_sidx > sample_last_sidx(smpl)) {
             ret = GOT_LAST_BSAMP;
-        } else if (smpl->bsamp_buflen[myidx] == SAMPLE_BSAMP_MAXLEN) {
+        } else if (smpl->smpl_slab_len == smpl->bsamp_slab_cap) {
             ret = FILLED_BUFFER;
         }
     }
-    sample_must_rwunlock_dbuf(smpl);
+    sample_fwd_flush(smpl);
     return ret;
 }
 
-static void sample_flip_bsamp_bufs(struct sample_session *smpl)
+/* Hand the slab we've been filling to the worker.
+ * NOT SYNCHRONIZED (smpl_mtx), ACQUIRES worker_mtx */
+static void sample_publish_slab(struct sample_session *smpl)
 {
-    /* Try to swap buffers with the worker thread. */
+    struct sample_slab *slab = spsc_ring_prod_slab(smpl->bsamp_ring);
+    assert(slab);
+    slab->len = smpl->smpl_slab_len;
+    spsc_ring_produce(smpl->bsamp_ring);
+    smpl->smpl_slab_len = 0;
     sample_must_lock_worker(smpl);
-    if (smpl->worker_using_buf[smpl->bsamp_widx]) {
-        log_DEBUG("%s: worker's using the other buffer; dropping packets",
-                  __func__);
-        sample_must_unlock_worker(smpl);
-        sample_stop_worker(smpl, SAMPLE_STOP_PKTDROP);
-        return;
-    }
-    if (sample_must_trywrlock_dbuf(smpl) == EBUSY) {
-        log_DEBUG("%s: can't write-lock buffer; dropping packets",
-                  __func__);
-        sample_must_unlock_worker(smpl);
-        sample_stop_worker(smpl, SAMPLE_STOP_PKTDROP);
-        return;
-    }
-    smpl->bsamp_buflen[smpl->bsamp_widx] = 0;
-    smpl->bsamp_widx ^= 1;
-    smpl->worker_using_buf[smpl->bsamp_widx] = 1;
     smpl->worker_why |= SAMPLE_WHY_BSAMPS;
-    sample_must_rwunlock_dbuf(smpl);
     sample_must_unlock_worker(smpl);
     sample_must_signal_worker(smpl);
-    return;
 }
 
 /* NOT SYNCHRONIZED (smpl_mtx) */
 static void sample_ddatafd_store_bsamps(struct sample_session *smpl)
 {
+    if (!spsc_ring_prod_slab(smpl->bsamp_ring)) {
+        /* The worker's behind. Leave the packets in the socket
+         * receive buffer until it frees up a slab. */
+        sample_pause_reader(smpl);
+        return;
+    }
     switch (sample_ddatafd_grab_bsamps(smpl)) {
     case GOT_BSAMPS:
-        /* Samples are safely buffered; we're done. */
+        /* Samples are safely in the ring; we're done. */
         sample_reset_timeout(smpl);
         return;
     case FILLED_BUFFER:
-        /* Read buffer is full; get the worker to store the samples. */
+        /* Slab is full; get the worker to store the samples. */
         sample_reset_timeout(smpl);
-        sample_flip_bsamp_bufs(smpl);
+        sample_publish_slab(smpl);
         return;
     case GOT_LAST_BSAMP:
         /* That's the last one; time to stop. */
         sample_clear_timeout(smpl);
-        sample_flip_bsamp_bufs(smpl);
+        sample_publish_slab(smpl);
         return;
     case DROPPED_PKT:
         sample_stop_worker(smpl, SAMPLE_STOP_PKTDROP);
@@ -1282,94 +2748,7 @@ static void sample_ddatafd_store_bsamps(struct sample_session *smpl)
     }
 }
 
-/* NOT SYNCHRONIZED */
-static int sample_get_data_packet(struct sample_session *smpl)
-{
-    struct iovec *iov = &smpl->dpktbuf;
-    struct sockaddr_storage sas;
-    struct sockaddr *sas_sa = (struct sockaddr*)&sas;
-    socklen_t sas_len = sizeof(sas);
-    ssize_t s;
-    struct sockaddr *dnaddr = (struct sockaddr*)&smpl->dnaddr;
-    const uint8_t mtype_expected = sample_forward_mtype(smpl);
-    assert(iov->iov_base);
-    while (1) {
-        s = recvfrom(smpl->ddatafd, iov->iov_base, iov->iov_len, 0,
-                     sas_sa, &sas_len);
-        if (s == -1) {
-            switch (errno) {
-#if EWOULDBLOCK != EAGAIN
-            case EWOULDBLOCK:   /* fall through */
-#endif
-            case EAGAIN:
-                log_WARNING("%s: spurious call; invoked with no data to read",
-                            __func__);
-                return -1;
-            case EINTR:
-                continue;
-            default:
-                log_WARNING("%s: error: %m", __func__);
-                return -1;
-            }
-        }
-        break;
-    }
-    if ((size_t)s > iov->iov_len) {
-        log_WARNING("truncated read getting sample from data node");
-        return -1;
-    }
-    if (sas.ss_family != AF_INET && sas.ss_family != AF_INET6) {
-        log_WARNING("data packet has unexpected remote address family %d",
-                    sas.ss_family);
-        return -1;
-    }
-    if (!sockutil_addr_eq(dnaddr, sas_sa, 0)) {
-        sample_log_address_mismatch(smpl, sas_sa);
-        return -1;
-    }
-    if (raw_pkt_ntoh(iov->iov_base)) {
-        log_INFO("dropping malformed data node packet");
-        return -1;
-    }
-    uint8_t mtype = raw_mtype(iov->iov_base);
-    if (mtype != mtype_expected) {
-        log_DEBUG("unexpected data message type %s (%u); expecting %s",
-                  raw_mtype_str(mtype), mtype, raw_mtype_str(mtype_expected));
-        return -1;
-    }
-    return 0;
-}
-
-/* Ship the latest data packet raw and direct to the client. */
-static void sample_forward_raw_packet(struct sample_session *smpl)
-{
-    /* Actually, make a copy and ship that.
-     *
-     * If this is too slow, we can optimize by skipping the original
-     * raw_pkt_ntoh() and just sending smpl->dpktbuf.iov_base, but
-     * that requires more care when validating the packet. */
-    struct sockaddr *caddr = (struct sockaddr*)&smpl->caddr;
-    socklen_t caddr_len = sockutil_addrlen(caddr);
-    void *copy;
-    size_t copylen;
-    union sample_packet pkt;
-    uint8_t mtype = raw_mtype(smpl->dpktbuf.iov_base);
-    if (mtype == RAW_MTYPE_BSMP) {
-        copy = &pkt.bsmp;
-        copylen = sizeof(pkt.bsmp);
-    } else if (mtype == RAW_MTYPE_BSUB) {
-        copy = &pkt.bsub;
-        copylen = sizeof(pkt.bsub);
-    } else {
-        assert(0);
-    }
-    memcpy(copy, smpl->dpktbuf.iov_base, copylen);
-    __unused int rph = raw_pkt_hton(copy);
-    assert(rph == 0);
-    __unused ssize_t n = sendto(smpl->ddatafd, copy, sizeof(copy), 0,
-                                caddr, caddr_len);
-}
-
+/* Everything but the chips, channels and samples. */
 static void sample_init_pmsg_from_bsub(BoardSubsample *msg_bsub,
                                        struct raw_pkt_bsub *bsub)
 {
@@ -1388,14 +2767,6 @@ static void sample_init_pmsg_from_bsub(BoardSubsample *msg_bsub,
     msg_bsub->samp_idx = bsub->b_sidx;
     msg_bsub->has_chip_live = 1;
     msg_bsub->chip_live = bsub->b_chip_live;
-    msg_bsub->n_chips = RAW_BSUB_NSAMP;
-    msg_bsub->n_channels = RAW_BSUB_NSAMP;
-    msg_bsub->n_samples = RAW_BSUB_NSAMP;
-    for (size_t i = 0; i < RAW_BSUB_NSAMP; i++) {
-        msg_bsub->chips[i] = bsub->b_cfg[i].bs_chip;
-        msg_bsub->channels[i] = bsub->b_cfg[i].bs_chan;
-        msg_bsub->samples[i] = bsub->b_samps[i];
-    }
     msg_bsub->has_gpio = 1;
     msg_bsub->gpio = bsub->b_gpio;
     msg_bsub->has_dac_channel = 1;
@@ -1404,71 +2775,7 @@ static void sample_init_pmsg_from_bsub(BoardSubsample *msg_bsub,
     msg_bsub->dac_value = bsub->b_dac;
 }
 
-/* NOT SYNCHRONIZED */
-static int sample_pack_and_ship_pmsg(struct sample_session *smpl,
-                                     DnodeSample *dnsample)
-{
-    struct sockaddr *caddr = (struct sockaddr*)&smpl->caddr;
-    size_t dnsample_psize = dnode_sample__get_packed_size(dnsample);
-    if (dnsample_psize > SAMPLE_PBUF_ARR_SIZE) {
-        log_WARNING("packed subsample buffer size %zu exceeds "
-                    "preallocated buffer size %d; "
-                    "falling back on malloc().",
-                    dnsample_psize, SAMPLE_PBUF_ARR_SIZE);
-        uint8_t *out = malloc(dnsample_psize);
-        if (!out) {
-            log_ERR("out of memory");
-            return -1;
-        }
-        dnode_sample__pack(dnsample, out);
-        int ret = sendto(smpl->ddatafd, out, dnsample_psize, 0,
-                         caddr, sockutil_addrlen(caddr));
-        free(out);
-        return ret;
-    }
-    dnode_sample__pack(dnsample, smpl->c_sample_pbuf_arr);
-    ssize_t s = sendto(smpl->ddatafd, smpl->c_sample_pbuf_arr,
-                       dnsample_psize, 0, caddr, sockutil_addrlen(caddr));
-
-    return s == (ssize_t)dnsample_psize ? 0 : -1;
-}
-
-/* NOT SYNCHRONIZED */
-static int sample_convert_and_ship_subsample(struct sample_session *smpl)
-{
-    struct raw_pkt_bsub *bsub = (struct raw_pkt_bsub*)smpl->dpktbuf.iov_base;
-    BoardSubsample msg_bsub = BOARD_SUBSAMPLE__INIT;
-    msg_bsub.chips = smpl->c_bsub_chips;
-    msg_bsub.channels = smpl->c_bsub_chans;
-    msg_bsub.samples = smpl->c_bsub_samps;
-    DnodeSample dnsample = DNODE_SAMPLE__INIT;
-    sample_init_pmsg_from_bsub(&msg_bsub, bsub);
-    dnsample.subsample = &msg_bsub;
-    dnsample.has_type = 1;
-    dnsample.type = DNODE_SAMPLE__TYPE__SUBSAMPLE;
-    uint32_t idx_gap = msg_bsub.samp_idx - smpl->debug_last_sub_idx - 1;
-    if (idx_gap) {
-        log_DEBUG("bsub GAP: %u", idx_gap);
-    }
-    smpl->debug_last_sub_idx = msg_bsub.samp_idx;
-    return sample_pack_and_ship_pmsg(smpl, &dnsample);
-}
-
-/* NOT SYNCHRONIZED */
-static void sample_ddatafd_forward_bsub(struct sample_session *smpl)
-{
-    assert(smpl->forward_what == SAMPLE_FWD_BSUB ||
-           smpl->forward_what == SAMPLE_FWD_BSUB_RAW);
-    if (smpl->forward_what == SAMPLE_FWD_BSUB) {
-        /* Convert the raw packet to protobuf and ship that to the client. */
-        if (sample_convert_and_ship_subsample(smpl)) {
-            log_DEBUG("%s: can't forward board subsample to client", __func__);
-        }
-    } else {
-        sample_forward_raw_packet(smpl);
-    }
-}
-
+/* The message's samples point into bsmp; they aren't copied. */
 static void sample_init_pmsg_from_bsmp(BoardSample *msg_bsmp,
                                        struct raw_pkt_bsmp *bsmp)
 {
@@ -1496,64 +2803,618 @@ static void sample_init_pmsg_from_bsmp(BoardSample *msg_bsmp,
     msg_bsmp->chip_live = bsmp->b_chip_live;
 
     msg_bsmp->has_samples = 1;
-    ProtobufCBinaryData *samples = &msg_bsmp->samples;
-    memcpy(samples->data, bsmp->b_samps, samples->len);
+    msg_bsmp->samples.data = (uint8_t*)bsmp->b_samps;
+    msg_bsmp->samples.len = sizeof(bsmp->b_samps);
+}
+
+/* Does dest want the packet (in network byte order) at pkt? */
+static inline int sample_fwd_wants(const struct sample_fwd_dest *dest,
+                                   const void *pkt)
+{
+    /* b_sidx is in the same place in a board subsample. */
+    const struct raw_pkt_bsmp *bsmp = pkt;
+    return (dest->every_nth <= 1 ||
+            ntohl(bsmp->b_sidx) % dest->every_nth == 0);
+}
+
+/* Copy the packet (of type mtype, in network byte order) at pkt to
+ * out->host, in host byte order. Returns 0 on success, -1 if it's
+ * malformed.
+ * NOT SYNCHRONIZED */
+static int sample_fwd_host(struct sample_fwd_out *out, const void *pkt,
+                           uint8_t mtype)
+{
+    memcpy(&out->host, pkt, (mtype == RAW_MTYPE_BSMP ?
+                             sizeof(struct raw_pkt_bsmp) :
+                             sizeof(struct raw_pkt_bsub)));
+    return raw_pkt_ntoh(&out->host) ? -1 : 0;
 }
 
-static int sample_convert_and_ship_sample(struct sample_session *smpl)
+/* Convert out->host (of type mtype) to protobuf, and pack it into
+ * out->pk. Returns the packed size, or 0 on error.
+ * NOT SYNCHRONIZED */
+static size_t sample_fwd_pack(struct sample_fwd_out *out, uint8_t mtype)
 {
-    struct raw_pkt_bsmp *bsmp = (struct raw_pkt_bsmp*)smpl->dpktbuf.iov_base;
+    BoardSubsample msg_bsub = BOARD_SUBSAMPLE__INIT;
     BoardSample msg_bsmp = BOARD_SAMPLE__INIT;
-    assert(sizeof(smpl->c_bsmp_samps) >= RAW_BSMP_NSAMP * sizeof(raw_samp_t));
-    msg_bsmp.samples.data = smpl->c_bsmp_samps;
-    msg_bsmp.samples.len = sizeof(smpl->c_bsmp_samps);
-    sample_init_pmsg_from_bsmp(&msg_bsmp, bsmp);
     DnodeSample dnsample = DNODE_SAMPLE__INIT;
-    dnsample.sample = &msg_bsmp;
+
     dnsample.has_type = 1;
-    dnsample.type = DNODE_SAMPLE__TYPE__SAMPLE;
-    uint32_t idx_gap = msg_bsmp.samp_idx - smpl->debug_last_sub_idx - 1;
-    if (idx_gap) {
-        log_DEBUG("bsmp GAP: %u", idx_gap);
+    if (mtype == RAW_MTYPE_BSMP) {
+        sample_init_pmsg_from_bsmp(&msg_bsmp, &out->host.bsmp);
+        dnsample.type = DNODE_SAMPLE__TYPE__SAMPLE;
+        dnsample.sample = &msg_bsmp;
+    } else {
+        struct raw_pkt_bsub *bsub = &out->host.bsub;
+        sample_init_pmsg_from_bsub(&msg_bsub, bsub);
+        msg_bsub.n_chips = RAW_BSUB_NSAMP;
+        msg_bsub.chips = out->bsub_chips;
+        msg_bsub.n_channels = RAW_BSUB_NSAMP;
+        msg_bsub.channels = out->bsub_chans;
+        msg_bsub.n_samples = RAW_BSUB_NSAMP;
+        msg_bsub.samples = out->bsub_samps;
+        for (size_t i = 0; i < RAW_BSUB_NSAMP; i++) {
+            out->bsub_chips[i] = bsub->b_cfg[i].bs_chip;
+            out->bsub_chans[i] = bsub->b_cfg[i].bs_chan;
+            out->bsub_samps[i] = bsub->b_samps[i];
+        }
+        dnsample.type = DNODE_SAMPLE__TYPE__SUBSAMPLE;
+        dnsample.subsample = &msg_bsub;
+    }
+    size_t psize = dnode_pack(&out->pk, &dnsample);
+    if (!psize) {
+        log_WARNING("can't pack forwarded sample");
     }
-    smpl->debug_last_sub_idx = msg_bsmp.samp_idx;
-    return sample_pack_and_ship_pmsg(smpl, &dnsample);
+    return psize;
+}
+
+/* Does a compact BoardSubsample for dest, for the board samples from
+ * sidx on, need its chip and channel lists? They go out every
+ * SAMPLE_FWD_MAP_SAMPS board samples, for clients that missed them
+ * (or just showed up). The packets dest gets each stand for span
+ * board samples, so it's due if that many from sidx cross a
+ * multiple. */
+static inline int sample_fwd_map_due(const struct sample_fwd_dest *dest,
+                                     uint32_t sidx)
+{
+    unsigned span = dest->decim ? dest->decim->factor : dest->every_nth;
+    uint32_t r = sidx % SAMPLE_FWD_MAP_SAMPS;
+    return r == 0 || r + span > SAMPLE_FWD_MAP_SAMPS;
 }
 
-static void sample_ddatafd_forward_bsamp(struct sample_session *smpl)
+/* Make msg_bsub compact: put its samples (n of them, in host byte
+ * order, which samps[idx[k]] gets, or samps[k] if idx is NULL) in
+ * packed_samples, and tag it with gen. Leaves its chips and channels
+ * alone.
+ * NOT SYNCHRONIZED */
+static void sample_pmsg_compact(struct sample_fwd_out *out,
+                                BoardSubsample *msg_bsub, uint32_t gen,
+                                const raw_samp_t *samps,
+                                const uint16_t *idx, size_t n)
 {
-    assert(smpl->forward_what == SAMPLE_FWD_BSMP ||
-           smpl->forward_what == SAMPLE_FWD_BSMP_RAW);
-    if (smpl->forward_what == SAMPLE_FWD_BSMP) {
-        if (sample_convert_and_ship_sample(smpl)) {
-            log_DEBUG("%s: can't forward board sample to client", __func__);
+    for (size_t k = 0; k < n; k++) {
+        out->packed_samps[k] = htole16(samps[idx ? idx[k] : k]);
+    }
+    msg_bsub->n_samples = 0;
+    msg_bsub->has_packed_samples = 1;
+    msg_bsub->packed_samples.data = (uint8_t*)out->packed_samps;
+    msg_bsub->packed_samples.len = n * sizeof(out->packed_samps[0]);
+    msg_bsub->has_cfg_gen = 1;
+    msg_bsub->cfg_gen = gen;
+}
+
+/* Convert out->host.bsub to a compact BoardSubsample for dest, and
+ * pack it into out->dest_pk. Returns the packed size. A change in
+ * the subsamples' chip/channel configuration starts a new cfg_gen;
+ * its lists go to each destination with the first packet it gets
+ * after that, and when they're due anyway.
+ * Event loop thread only. NOT SYNCHRONIZED */
+static size_t sample_fwd_pack_compact(struct sample_session *smpl,
+                                      struct sample_fwd_out *out,
+                                      const struct sample_fwd_dest *dest)
+{
+    struct raw_pkt_bsub *bsub = &out->host.bsub;
+    BoardSubsample msg_bsub = BOARD_SUBSAMPLE__INIT;
+    DnodeSample dnsample = DNODE_SAMPLE__INIT;
+
+    if (!smpl->c_bsub_gen ||
+        memcmp(smpl->c_bsub_cfg, bsub->b_cfg, sizeof(bsub->b_cfg))) {
+        memcpy(smpl->c_bsub_cfg, bsub->b_cfg, sizeof(bsub->b_cfg));
+        smpl->c_bsub_gen = sample_fwd_new_gen(smpl);
+        smpl->c_bsub_gen_sidx = bsub->b_sidx;
+    }
+    sample_init_pmsg_from_bsub(&msg_bsub, bsub);
+    sample_pmsg_compact(out, &msg_bsub, smpl->c_bsub_gen, bsub->b_samps,
+                        NULL, RAW_BSUB_NSAMP);
+    if (bsub->b_sidx - smpl->c_bsub_gen_sidx < dest->every_nth ||
+        sample_fwd_map_due(dest, bsub->b_sidx)) {
+        msg_bsub.n_chips = RAW_BSUB_NSAMP;
+        msg_bsub.chips = out->bsub_chips;
+        msg_bsub.n_channels = RAW_BSUB_NSAMP;
+        msg_bsub.channels = out->bsub_chans;
+        for (size_t i = 0; i < RAW_BSUB_NSAMP; i++) {
+            out->bsub_chips[i] = bsub->b_cfg[i].bs_chip;
+            out->bsub_chans[i] = bsub->b_cfg[i].bs_chan;
         }
+    }
+    dnsample.has_type = 1;
+    dnsample.type = DNODE_SAMPLE__TYPE__SUBSAMPLE;
+    dnsample.subsample = &msg_bsub;
+    return dnode_pack(&out->dest_pk, &dnsample);
+}
+
+/* Gather the channels dest->proj picks out of bsmp (a board sample in
+ * host byte order, which came out of dest->decim if it has one) into
+ * a BoardSubsample, and pack it into out->dest_pk. Returns the packed
+ * size.
+ * NOT SYNCHRONIZED */
+static size_t sample_fwd_pack_proj(struct sample_fwd_out *out,
+                                   const struct raw_pkt_bsmp *bsmp,
+                                   const struct sample_fwd_dest *dest)
+{
+    struct sample_proj *proj = dest->proj;
+    uint8_t pflags = raw_pflags(bsmp);
+    BoardSubsample msg_bsub = BOARD_SUBSAMPLE__INIT;
+    DnodeSample dnsample = DNODE_SAMPLE__INIT;
+
+    msg_bsub.has_is_live = 1;
+    msg_bsub.is_live = !!(pflags & RAW_PFLAG_B_LIVE);
+    msg_bsub.has_is_last = 1;
+    msg_bsub.is_last = !!(pflags & RAW_PFLAG_B_LAST);
+    msg_bsub.has_is_err = 1;
+    msg_bsub.is_err = !!raw_pkt_is_err(bsmp);
+    msg_bsub.has_exp_cookie = 1;
+    msg_bsub.exp_cookie = raw_exp_cookie(bsmp);
+    msg_bsub.has_board_id = 1;
+    msg_bsub.board_id = bsmp->b_id;
+    msg_bsub.has_samp_idx = 1;
+    msg_bsub.samp_idx = bsmp->b_sidx;
+    msg_bsub.has_chip_live = 1;
+    msg_bsub.chip_live = bsmp->b_chip_live;
+    if (dest->compact) {
+        sample_pmsg_compact(out, &msg_bsub, proj->cfg_gen, bsmp->b_samps,
+                            proj->idx, proj->n);
     } else {
-        sample_forward_raw_packet(smpl);
+        for (size_t k = 0; k < proj->n; k++) {
+            out->proj_samps[k] = bsmp->b_samps[proj->idx[k]];
+        }
+        msg_bsub.n_samples = proj->n;
+        msg_bsub.samples = out->proj_samps;
     }
+    if (!dest->compact ||
+        !__atomic_exchange_n(&proj->map_sent, 1, __ATOMIC_RELAXED) ||
+        sample_fwd_map_due(dest, bsmp->b_sidx)) {
+        msg_bsub.n_chips = proj->n;
+        msg_bsub.chips = proj->chips;
+        msg_bsub.n_channels = proj->n;
+        msg_bsub.channels = proj->chans;
+    }
+    if (dest->decim) {
+        msg_bsub.has_decimation = 1;
+        msg_bsub.decimation = dest->decim->factor;
+    }
+    dnsample.has_type = 1;
+    dnsample.type = DNODE_SAMPLE__TYPE__SUBSAMPLE;
+    dnsample.subsample = &msg_bsub;
+    return dnode_pack(&out->dest_pk, &dnsample);
 }
 
-/* NOT SYNCHRONIZED */
+/* Pack out->dec, which came out of sd, into a BoardSample in
+ * out->dest_pk. Returns the packed size.
+ * NOT SYNCHRONIZED */
+static size_t sample_fwd_pack_decim(struct sample_fwd_out *out,
+                                    const struct sample_decim *sd)
+{
+    BoardSample msg_bsmp = BOARD_SAMPLE__INIT;
+    DnodeSample dnsample = DNODE_SAMPLE__INIT;
+
+    sample_init_pmsg_from_bsmp(&msg_bsmp, &out->dec);
+    msg_bsmp.has_decimation = 1;
+    msg_bsmp.decimation = sd->factor;
+    if (sd->envelope) {
+        msg_bsmp.has_envelope_max = 1;
+        msg_bsmp.envelope_max.data = (uint8_t*)out->dec_max;
+        msg_bsmp.envelope_max.len = sizeof(out->dec_max);
+    }
+    dnsample.has_type = 1;
+    dnsample.type = DNODE_SAMPLE__TYPE__SAMPLE;
+    dnsample.sample = &msg_bsmp;
+    return dnode_pack(&out->dest_pk, &dnsample);
+}
+
+/* Feed the board sample at pkt (in network byte order) to sd. If that
+ * finishes an output, copy it to out->dec (and its maximums to
+ * out->dec_max, for an envelope) in host byte order, and return 1;
+ * otherwise, return 0. Feeding the same board sample again, for
+ * another destination sharing sd, gets the same result.
+ * NOT SYNCHRONIZED (sd->mtx) */
+static int sample_fwd_decim(struct sample_fwd_out *out,
+                            struct sample_decim *sd,
+                            const struct raw_pkt_bsmp *pkt)
+{
+    const uint32_t sidx = ntohl(pkt->b_sidx);
+    int ready = 0;
+
+    safe_p_mutex_lock(&sd->mtx);
+    if (sd->have_last && sidx == sd->last_sidx) {
+        ready = sd->last_ready;
+        goto out;
+    }
+    if (sd->have_last && (int32_t)(sidx - sd->last_sidx) < 0) {
+        /* We're past it already (it's from a store that's over, say),
+         * so it's too late to use. */
+        goto out;
+    }
+    if (!sd->have_last || sidx != sd->last_sidx + 1) {
+        /* Don't filter across a gap. */
+        decim_reset(sd->dec);
+        sd->started = 0;
+    }
+    sd->have_last = 1;
+    sd->last_sidx = sidx;
+    sd->last_ready = 0;
+    /* Start at a multiple of the factor, so every output covers the
+     * same board samples however it got started. */
+    if (!sd->started && sidx % sd->factor) {
+        goto out;
+    }
+    sd->started = 1;
+    for (size_t i = 0; i < RAW_BSMP_NSAMP; i++) {
+        sd->in[i] = ntohs(pkt->b_samps[i]);
+    }
+    if (!decim_push(sd->dec, sd->in, sd->out.b_samps, sd->out_max)) {
+        goto out;
+    }
+    /* Take the header from the last board sample that went in (so
+     * the flags are current), but number outputs by the first. */
+    memcpy(&sd->out, pkt, offsetof(struct raw_pkt_bsmp, b_samps));
+    raw_pkt_ntoh_hdr(&sd->out);
+    sd->out.ph.p_flags &= ~RAW_PFLAG_B_SAMPS_BE;
+    sd->out.b_sidx = sidx - (sd->factor - 1);
+    sd->last_ready = ready = 1;
+ out:
+    if (ready) {
+        memcpy(&out->dec, &sd->out, sizeof(out->dec));
+        if (sd->envelope) {
+            memcpy(out->dec_max, sd->out_max, sizeof(out->dec_max));
+        }
+    }
+    safe_p_mutex_unlock(&sd->mtx);
+    return ready;
+}
+
+/* Send a datagram made of niov iovecs, totalling len bytes, to addr.
+ * Returns 0 on success, -1 on failure (including len being 0, i.e.,
+ * nothing got packed).
+ * NOT SYNCHRONIZED */
+static int sample_fwd_sendv(struct sample_session *smpl,
+                            struct sockaddr *addr,
+                            const struct iovec *iov, size_t niov,
+                            size_t len)
+{
+    struct msghdr hdr = {
+        .msg_name = addr,
+        .msg_namelen = sockutil_addrlen(addr),
+        .msg_iov = (struct iovec*)iov,
+        .msg_iovlen = niov,
+        .msg_control = NULL,
+        .msg_controllen = 0,
+        .msg_flags = 0,
+    };
+    if (!len || sendmsg(smpl->ddatafd, &hdr, 0) != (ssize_t)len) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Send out->pkts (npkts packets of type mtype, in network byte order)
+ * to each of dests that wants them.
+ *
+ * Raw destinations each get one sendmmsg() batch, straight out of the
+ * packet buffers. Each packet is converted to protobuf at most once,
+ * then sent to every protobuf destination that wants it, with its
+ * samples gathered straight from out->host (see dnode_pack.h); ones
+ * that only want some channels get just those, packed separately.
+ * Destinations that want a decimated stream get each output as soon
+ * as their decimator produces it, in whichever form they asked for.
+ *
+ * Returns the most packets any one destination missed because they
+ * couldn't be sent; like any other UDP sender, we drop what doesn't
+ * fit.
+ * NOT SYNCHRONIZED */
+static size_t sample_fwd_fanout(struct sample_session *smpl,
+                                struct sample_fwd_out *out,
+                                size_t npkts, uint8_t mtype,
+                                struct sample_fwd_dest *dests,
+                                size_t ndests)
+{
+    const size_t len = (mtype == RAW_MTYPE_BSMP ?
+                        sizeof(struct raw_pkt_bsmp) :
+                        sizeof(struct raw_pkt_bsub));
+    size_t nfailed[SAMPLE_FWD_MAX_DESTS] = { 0 };
+    size_t nproto = 0, ndecim = 0;
+
+    assert(npkts <= SAMPLE_FWD_SLAB_PKTS);
+    assert(ndests <= SAMPLE_FWD_MAX_DESTS);
+    for (size_t d = 0; d < ndests; d++) {
+        struct sample_fwd_dest *dest = &dests[d];
+        struct sockaddr *addr = (struct sockaddr*)&dest->addr;
+        if (dest->decim) {
+            ndecim++;
+            continue;
+        }
+        if (!sample_what_is_raw(dest->what)) {
+            nproto++;
+            continue;
+        }
+        size_t nsend = 0;
+        for (size_t i = 0; i < npkts; i++) {
+            if (!sample_fwd_wants(dest, out->pkts[i])) {
+                continue;
+            }
+            struct msghdr *hdr = &out->mmsgs[nsend].msg_hdr;
+            out->iovs[nsend].iov_base = out->pkts[i];
+            out->iovs[nsend].iov_len = len;
+            hdr->msg_name = addr;
+            hdr->msg_namelen = sockutil_addrlen(addr);
+            hdr->msg_iov = &out->iovs[nsend];
+            hdr->msg_iovlen = 1;
+            hdr->msg_control = NULL;
+            hdr->msg_controllen = 0;
+            hdr->msg_flags = 0;
+            nsend++;
+        }
+        size_t nsent = 0;
+        while (nsent < nsend) {
+            int s = sendmmsg(smpl->ddatafd, &out->mmsgs[nsent],
+                             (unsigned)(nsend - nsent), 0);
+            if (s == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                nfailed[d] = nsend - nsent;
+                break;
+            }
+            nsent += (size_t)s;
+        }
+    }
+
+    for (size_t i = 0; nproto && i < npkts; i++) {
+        int host = 0;           /* 1: out->host is pkts[i]; -1: it's bad */
+        size_t psize = 0;       /* whole message, once it's packed */
+        for (size_t d = 0; d < ndests; d++) {
+            struct sample_fwd_dest *dest = &dests[d];
+            struct sockaddr *addr = (struct sockaddr*)&dest->addr;
+            if (dest->decim || sample_what_is_raw(dest->what) ||
+                !sample_fwd_wants(dest, out->pkts[i])) {
+                continue;
+            }
+            if (!host) {
+                host = sample_fwd_host(out, out->pkts[i], mtype) ? -1 : 1;
+            }
+            if (host < 0) {
+                nfailed[d]++;
+                continue;
+            }
+            const struct dnode_pack *pk;
+            if (dest->proj) {
+                pk = &out->dest_pk;
+                sample_fwd_pack_proj(out, &out->host.bsmp, dest);
+            } else if (dest->compact) {
+                pk = &out->dest_pk;
+                sample_fwd_pack_compact(smpl, out, dest);
+            } else {
+                if (!psize) {
+                    psize = sample_fwd_pack(out, mtype);
+                }
+                pk = &out->pk;
+            }
+            if (sample_fwd_sendv(smpl, addr, pk->iov, pk->niov, pk->len)) {
+                nfailed[d]++;
+            }
+        }
+    }
+
+    /* Destinations at the same rate share a decimator, which takes
+     * each board sample once (see sample_fwd_decim()), so each packet
+     * goes to all of them before the next one goes to any. */
+    for (size_t i = 0; ndecim && i < npkts; i++) {
+        for (size_t d = 0; d < ndests; d++) {
+            struct sample_fwd_dest *dest = &dests[d];
+            struct sockaddr *addr = (struct sockaddr*)&dest->addr;
+            if (!dest->decim ||
+                !sample_fwd_decim(out, dest->decim, out->pkts[i])) {
+                continue;
+            }
+            const struct dnode_pack *pk = &out->dest_pk;
+            int err;
+            if (sample_what_is_raw(dest->what)) {
+                struct iovec iov = {
+                    .iov_base = &out->dec, .iov_len = sizeof(out->dec),
+                };
+                err = (raw_pkt_hton(&out->dec) ||
+                       sample_fwd_sendv(smpl, addr, &iov, 1, iov.iov_len));
+            } else {
+                if (dest->proj) {
+                    sample_fwd_pack_proj(out, &out->dec, dest);
+                } else {
+                    sample_fwd_pack_decim(out, dest->decim);
+                }
+                err = sample_fwd_sendv(smpl, addr, pk->iov, pk->niov,
+                                       pk->len);
+            }
+            if (err) {
+                nfailed[d]++;
+            }
+        }
+    }
+
+    size_t worst = 0;
+    for (size_t d = 0; d < ndests; d++) {
+        if (nfailed[d] > worst) {
+            worst = nfailed[d];
+        }
+    }
+    return worst;
+}
+
+/* Forward a batch of packets from the data node to everyone who wants
+ * them. They get checked where they lie, still in network byte order;
+ * raw destinations get them from the same buffers they arrived in.
+ *
+ * Event loop thread only. NOT SYNCHRONIZED (smpl_mtx) */
 static void sample_ddatafd_forward(struct sample_session *smpl)
 {
-    /* Fill the data node sample packet buffer. */
-    if (sample_get_data_packet(smpl) == -1) {
+    struct sockaddr *dnaddr = (struct sockaddr*)&smpl->dnaddr;
+    struct sample_fwd_out *out = smpl->c_fwd_out;
+    const uint8_t mtype = sample_forward_mtype(smpl);
+    int nrecv;
+
+    for (size_t j = 0; j < CONFIG_SAMPLE_RECV_BATCH; j++) {
+        struct msghdr *hdr = &smpl->c_bsmp_mmsgs[j].msg_hdr;
+        smpl->c_bsmp_iovs[j].iov_base = &smpl->c_fwd_pkts[j];
+        smpl->c_bsmp_iovs[j].iov_len = sizeof(smpl->c_fwd_pkts[j]);
+        hdr->msg_name = &smpl->c_bsmp_addrs[j];
+        hdr->msg_namelen = sizeof(smpl->c_bsmp_addrs[j]);
+        hdr->msg_iov = &smpl->c_bsmp_iovs[j];
+        hdr->msg_iovlen = 1;
+        hdr->msg_control = NULL;
+        hdr->msg_controllen = 0;
+        hdr->msg_flags = 0;
+    }
+    do {
+        nrecv = recvmmsg(smpl->ddatafd, smpl->c_bsmp_mmsgs,
+                         CONFIG_SAMPLE_RECV_BATCH, 0, NULL);
+    } while (nrecv == -1 && errno == EINTR);
+    if (nrecv == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_WARNING("%s: recvmmsg: %m", __func__);
+        }
         return;
     }
-    /* Forward the packet. */
-    switch (smpl->forward_what) {
-    case SAMPLE_FWD_BSMP_RAW:
-    case SAMPLE_FWD_BSMP:
-        sample_ddatafd_forward_bsamp(smpl);
-        break;
-    case SAMPLE_FWD_BSUB_RAW:
-    case SAMPLE_FWD_BSUB:
-        sample_ddatafd_forward_bsub(smpl);
-        break;
-    default:
-        log_DEBUG("%s: spurious call!", __func__);
-        break;
+
+    size_t npkts = 0;
+    for (int j = 0; j < nrecv; j++) {
+        struct msghdr *in = &smpl->c_bsmp_mmsgs[j].msg_hdr;
+        size_t len = smpl->c_bsmp_mmsgs[j].msg_len;
+        void *pkt = &smpl->c_fwd_pkts[j];
+        if (!sockutil_addr_eq(dnaddr, in->msg_name, 0)) {
+            sample_log_address_mismatch(smpl, in->msg_name);
+            continue;
+        }
+        if ((in->msg_flags & MSG_TRUNC) ||
+            raw_pkt_check_wire(pkt, len) != mtype) {
+            log_DEBUG("not forwarding malformed or unexpected "
+                      "data node packet");
+            continue;
+        }
+        sample_shm_publish(smpl, pkt, mtype, 1);
+        out->pkts[npkts++] = pkt;
+    }
+    smpl->c_fwd_ndests = sample_fwd_dests(smpl, mtype, smpl->c_fwd_dests);
+    size_t nfailed = sample_fwd_fanout(smpl, out, npkts, mtype,
+                                       smpl->c_fwd_dests,
+                                       smpl->c_fwd_ndests);
+    if (nfailed) {
+        log_DEBUG("%s: dropped %zu packets", __func__, nfailed);
+    }
+}
+
+/*
+ * Forwarding stage
+ */
+
+/* Hand the forwarding ring's head slab to the forwarding thread, if
+ * there's anything in it.
+ * NOT SYNCHRONIZED (smpl_mtx) */
+static void sample_fwd_flush(struct sample_session *smpl)
+{
+    if (!smpl->fwd_slab_len) {
+        return;
+    }
+    struct sample_fwd_slab *slab = spsc_ring_prod_slab(smpl->fwd_ring);
+    assert(slab);
+    slab->len = smpl->fwd_slab_len;
+    slab->ndests = smpl->c_fwd_ndests;
+    memcpy(slab->dests, smpl->c_fwd_dests,
+           smpl->c_fwd_ndests * sizeof(slab->dests[0]));
+    for (size_t d = 0; d < slab->ndests; d++) {
+        sample_fwd_dest_get(&slab->dests[d]);
+    }
+    spsc_ring_produce(smpl->fwd_ring);
+    smpl->fwd_slab_len = 0;
+    safe_p_mutex_lock(&smpl->fwd_mtx);
+    safe_p_cond_signal(&smpl->fwd_cv);
+    safe_p_mutex_unlock(&smpl->fwd_mtx);
+}
+
+/* If anybody wants board samples (see sample_fwd_tee_prepare()),
+ * queue a copy of bsmp, which is being stored, for them. If the
+ * forwarding thread is too far behind, drop it instead.
+ * NOT SYNCHRONIZED (smpl_mtx) */
+static void sample_fwd_tee(struct sample_session *smpl,
+                           const struct raw_pkt_bsmp *bsmp)
+{
+    if (!smpl->c_fwd_ndests) {
+        return;
     }
+    struct sample_fwd_slab *slab = spsc_ring_prod_slab(smpl->fwd_ring);
+    if (!slab) {
+        smpl->fstat_nfull++;
+        return;
+    }
+    memcpy(&slab->bsmps[smpl->fwd_slab_len++], bsmp, sizeof(*bsmp));
+    smpl->fstat_nqueued++;
+    if (smpl->fwd_slab_len == SAMPLE_FWD_SLAB_PKTS) {
+        sample_fwd_flush(smpl);
+    }
+}
+
+/* Work out where board samples being stored should be teed to.
+ * Reader only. NOT SYNCHRONIZED (smpl_mtx) */
+static void sample_fwd_tee_prepare(struct sample_session *smpl)
+{
+    smpl->c_fwd_ndests = sample_fwd_dests(smpl, RAW_MTYPE_BSMP,
+                                          smpl->c_fwd_dests);
+}
+
+/* Send a slab's worth of board samples on to their destinations.
+ * Forwarding thread only. */
+static void sample_fwd_ship(struct sample_session *smpl,
+                            struct sample_fwd_slab *slab)
+{
+    struct sample_fwd_out *out = smpl->fwd_out;
+    for (size_t i = 0; i < slab->len; i++) {
+        raw_pkt_hton(&slab->bsmps[i]);
+        out->pkts[i] = &slab->bsmps[i];
+    }
+    size_t nfailed = sample_fwd_fanout(smpl, out, slab->len, RAW_MTYPE_BSMP,
+                                       slab->dests, slab->ndests);
+    if (nfailed) {
+        __atomic_add_fetch(&smpl->fstat_nfailed, nfailed, __ATOMIC_RELAXED);
+    }
+    for (size_t d = 0; d < slab->ndests; d++) {
+        sample_fwd_dest_put(&slab->dests[d]);
+    }
+}
+
+static void* sample_fwd_main(void *smplvp)
+{
+    struct sample_session *smpl = smplvp;
+    safe_p_mutex_lock(&smpl->fwd_mtx);
+    while (!smpl->fwd_exit) {
+        struct sample_fwd_slab *slab = spsc_ring_cons_slab(smpl->fwd_ring);
+        if (!slab) {
+            safe_p_cond_wait(&smpl->fwd_cv, &smpl->fwd_mtx);
+            continue;
+        }
+        safe_p_mutex_unlock(&smpl->fwd_mtx);
+        sample_fwd_ship(smpl, slab);
+        spsc_ring_consume(smpl->fwd_ring);
+        safe_p_mutex_lock(&smpl->fwd_mtx);
+    }
+    safe_p_mutex_unlock(&smpl->fwd_mtx);
+    return NULL;
 }
 
 static void sample_ddatafd_empty_recv_queue(struct sample_session *smpl)
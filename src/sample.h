@@ -28,6 +28,46 @@
 struct sample_session;
 struct event_base;
 
+/**
+ * Data socket receive configuration.
+ *
+ * By default, the data socket is read from the event loop thread,
+ * where it competes with client and data node control traffic. Set
+ * "thread" to receive on a dedicated thread instead; it only talks to
+ * the event loop to report storage completion and timeouts.
+ */
+struct sample_rx_cfg {
+    int thread;         /**< Nonzero to receive on a dedicated thread. */
+    int cpu;            /**< Pin the receive thread to this CPU, or -1. */
+    int fifo_prio;      /**< Run the receive thread SCHED_FIFO at this
+                         *   priority, or 0 to leave it alone. */
+    int busy_poll_usec; /**< SO_BUSY_POLL value for the data socket,
+                         *   or 0 to leave it alone. Polling also needs
+                         *   the net.core.busy_poll sysctl. */
+    unsigned reorder_window; /**< How many board samples may arrive
+                              *   ahead of a missing one before it
+                              *   counts as dropped; 0 means any
+                              *   reordering is a drop. At most
+                              *   SAMPLE_RX_REORDER_MAX. */
+    int unfiltered;     /**< Nonzero to leave the data socket without
+                         *   a kernel packet filter, so every packet
+                         *   gets checked in user space. */
+};
+
+/** Default and largest allowed sample_rx_cfg.reorder_window. */
+#define SAMPLE_RX_REORDER_DEFAULT 64
+#define SAMPLE_RX_REORDER_MAX 4096
+
+/** Default receive configuration: event loop thread, no tuning. */
+#define SAMPLE_RX_CFG_DEFAULT                      \
+    { .thread = 0,                                 \
+      .cpu = -1,                                   \
+      .fifo_prio = 0,                              \
+      .busy_poll_usec = 0,                         \
+      .reorder_window = SAMPLE_RX_REORDER_DEFAULT, \
+      .unfiltered = 0,                             \
+    }
+
 /**
  * Create a new sample packet handler.
  *
@@ -40,11 +80,13 @@ struct event_base;
  * @param base Event loop base
  * @param iface Interface number (see <net/if.h>) for sample data socket.
  * @param port Port to bind to on iface.
+ * @param rx_cfg Receive configuration, or NULL for SAMPLE_RX_CFG_DEFAULT.
  * @return New sample handler on success, NULL on failure.
  */
 struct sample_session* sample_new(struct event_base *base,
                                   unsigned iface,
-                                  uint16_t port);
+                                  uint16_t port,
+                                  const struct sample_rx_cfg *rx_cfg);
 /**
  * Free resources allocated by a sample packet handler.
  *
@@ -84,8 +126,17 @@ enum sample_forward {
 /**
  * Enable or disable live data forwarding.
  *
- * If enabling, you must previously have configured client and data
- * node addresses with sample_set_addr().
+ * If enabling, you must previously have configured the data node
+ * address with sample_set_addr(), and either configured the client
+ * address the same way or added a subscriber with
+ * sample_add_subscriber().
+ *
+ * Which kind of packets you pick here (board samples or subsamples)
+ * decides which kind the data node's stream carries, so it's what
+ * subscribers get too.
+ *
+ * Forwarding board samples (SAMPLE_FWD_BSMP or SAMPLE_FWD_BSMP_RAW)
+ * carries on while they're being stored with sample_expect_bsamps().
  *
  * @param smpl Sample handler
  * @param what What to forward; use SAMPLE_NOTHING to disable.
@@ -93,7 +144,149 @@ enum sample_forward {
 int sample_cfg_forwarding(struct sample_session *smpl,
                           enum sample_forward what);
 
+/** A chip's channel; see struct sample_fwd_opts. */
+struct sample_chan {
+    unsigned chip;
+    unsigned chan;
+};
+
+/**
+ * Options for what a forwarding destination gets. Zero-initialize
+ * it for the defaults: everything, at full rate.
+ */
+struct sample_fwd_opts {
+    /**
+     * Only send (sub)samples whose index is a multiple of this; 0 or
+     * 1 means all of them. Can't be combined with decimate. */
+    unsigned every_nth;
+
+    /**
+     * If there are any (nchans > 0), only send these channels of each
+     * board sample, in this order; repeats are allowed. SAMPLE_FWD_BSMP
+     * only. Instead of a whole BoardSample, the destination gets a
+     * BoardSubsample holding just these channels. The daemon works
+     * out where each one is in a board sample up front, so picking
+     * them out later is cheap. */
+    const struct sample_chan *chans;
+    size_t nchans;
+
+    /**
+     * If more than 1, send one board sample per this many, low-pass
+     * filtered so nothing aliases (see decimate.h), numbered by the
+     * index of the first board sample it covers; that's always a
+     * multiple of decimate. SAMPLE_FWD_BSMP or SAMPLE_FWD_BSMP_RAW
+     * only. Destinations with the same decimate and envelope share
+     * the work, so each rate costs the same however many want it. */
+    unsigned decimate;
+
+    /**
+     * With decimate, send each channel's minimum and maximum over
+     * those board samples instead of filtering them, for drawing
+     * traces without losing spikes. SAMPLE_FWD_BSMP only, and not
+     * with chans. */
+    int envelope;
+
+    /**
+     * Send BoardSubsamples (SAMPLE_FWD_BSUB, or SAMPLE_FWD_BSMP with
+     * chans) in the compact encoding: samples packed as bytes, with
+     * the chip/channel lists only when they change and now and then
+     * after that (see BoardSubsample.cfg_gen in data.proto). */
+    int compact;
+};
+
+/**
+ * Set options for forwarding to the client.
+ *
+ * They take effect while sample_cfg_forwarding() is forwarding what
+ * to the client; otherwise, the client gets the defaults.
+ *
+ * @param smpl Sample handler
+ * @param what What the options are for; mustn't be SAMPLE_FWD_NOTHING.
+ * @param opts Options, or NULL for the defaults.
+ * @return 0 on success, -1 on failure (options that don't make sense
+ *         for what, a chip or channel out of range, too many
+ *         channels, or out of memory).
+ */
+int sample_cfg_forward_opts(struct sample_session *smpl,
+                            enum sample_forward what,
+                            const struct sample_fwd_opts *opts);
+
+/** Most subscribers sample_add_subscriber() will take. */
+#define SAMPLE_MAX_SUBSCRIBERS 16
+
+/**
+ * Send forwarded packets to another destination as well as the
+ * client.
+ *
+ * Subscribers get every forwarded packet of the kind they ask for
+ * (board samples or subsamples, either way), whether or not
+ * forwarding to the client is enabled: while sample_cfg_forwarding()
+ * has the data node streaming that kind, and, for board samples,
+ * while they're being stored. Each packet is converted to protobuf
+ * at most once, however many destinations want it that way.
+ *
+ * The address may be an IP multicast group; see
+ * sample_set_multicast_ttl().
+ *
+ * @param smpl Sample handler
+ * @param addr Where to send packets. If it's already a subscriber,
+ *             this changes what it gets.
+ * @param what What to send there; mustn't be SAMPLE_FWD_NOTHING.
+ * @param opts Options, as for sample_cfg_forward_opts(), or NULL for
+ *             the defaults.
+ * @return 0 on success, -1 on failure (including there already being
+ *         SAMPLE_MAX_SUBSCRIBERS subscribers).
+ */
+int sample_add_subscriber(struct sample_session *smpl,
+                          struct sockaddr *addr,
+                          enum sample_forward what,
+                          const struct sample_fwd_opts *opts);
+
+/**
+ * Stop sending forwarded packets to a subscriber.
+ *
+ * @return 0 on success, -1 if addr isn't a subscriber.
+ * @see sample_add_subscriber()
+ */
+int sample_remove_subscriber(struct sample_session *smpl,
+                             struct sockaddr *addr);
+
+/**
+ * Set the IP multicast TTL for packets sent to multicast
+ * subscribers. This is a property of the data socket, so it applies
+ * to all of them. The kernel's default is 1 (don't leave the local
+ * network).
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int sample_set_multicast_ttl(struct sample_session *smpl, unsigned ttl);
+
+/** Default number of packets in the sample_publish_shm() ring. */
+#define SAMPLE_SHM_NSLOTS 8192
+
+/**
+ * Publish received data packets in a shared memory ring, for readers
+ * on this host (see shm_ring.h).
+ *
+ * Every board sample or subsample the daemon accepts from the data
+ * node goes in, whether it's being forwarded or stored, with its
+ * header in host byte order. Board samples being stored go in once
+ * each, in board sample index order, as they're stored. Readers get the ring by connecting to a
+ * Unix domain socket at path, which hands them its memfd; see
+ * libsng's sng_shm_open().
+ *
+ * Call this at most once, before asking for any samples.
+ *
+ * @param smpl Sample handler
+ * @param path Where to put the socket
+ * @param nslots Packets the ring holds, or 0 for SAMPLE_SHM_NSLOTS
+ * @return 0 on success, -1 on failure.
+ */
+int sample_publish_shm(struct sample_session *smpl, const char *path,
+                       size_t nslots);
+
 struct ch_storage;
+struct ch_gap;
 
 /**
  * Configuration structure for a future board sample transfer
@@ -115,6 +308,21 @@ struct sample_bsamp_cfg {
      * This must be open and ready for ch_storage_write() and
      * ch_storage_datasync() calls. */
     struct ch_storage *chns;
+
+    /**
+     * If nonzero, a board sample arriving too far ahead of the one
+     * we're waiting for doesn't end the transfer. The missing ones
+     * are stored as placeholders (with RAW_PFLAG_B_MISSING set), and
+     * their indexes show up in sample_bsamp_stats.gaps. */
+    int fill_gaps;
+
+    /**
+     * Offset (in board samples) into chns to overwrite, or -1.
+     *
+     * If -1, board samples get appended with ch_storage_write().
+     * Otherwise, they overwrite ones already in chns, using
+     * ch_storage_write_at(). */
+    ssize_t overwrite_at;
 };
 
 #define SAMPLE_BS_DONE 0x1      /**< Finished writing all samples */
@@ -174,4 +382,87 @@ int sample_expect_bsamps(struct sample_session *smpl,
  */
 ssize_t sample_reject_bsamps(struct sample_session *smpl);
 
+/**
+ * Configure board sample buffering for future transfers.
+ *
+ * Board samples wait in a queue of in-memory buffers between the
+ * network and the storage backend, so a transfer survives storage
+ * stalls of up to about nbufs * buf_msec milliseconds.
+ *
+ * The buffers are allocated (on huge pages, if possible), pre-faulted
+ * and locked into RAM here, not when a transfer starts, and get reused
+ * by every transfer until the configuration changes. Calling this
+ * again with the same configuration is cheap. sample_new() sets up the
+ * default configuration.
+ *
+ * You can't call this while a board sample transfer is in progress
+ * (i.e. between sample_expect_bsamps() and its callback firing).
+ *
+ * @param smpl Sample handler
+ * @param nbufs Number of buffers, or 0 for the default.
+ * @param buf_msec Milliseconds of board samples in each buffer,
+ *                 or 0 for the default.
+ * @return 0 on success, -1 on failure (including running out of
+ *         memory, in which case the old configuration still holds).
+ */
+int sample_cfg_bsamp_bufs(struct sample_session *smpl,
+                          size_t nbufs, unsigned buf_msec);
+
+/** Statistics about the most recent board sample transfer. */
+struct sample_bsamp_stats {
+    /**
+     * Largest number of buffers waiting to be stored at any one
+     * time. */
+    size_t peak_bufs;
+
+    /**
+     * Microseconds between the first board sample arriving and the
+     * worker finishing storing the first buffer, or -1 if nothing
+     * was stored. */
+    int64_t first_write_usec;
+
+    /**
+     * Number of board samples which arrived early, and were held
+     * back until the ones before them showed up. */
+    size_t nreordered;
+
+    /**
+     * Board samples stored as placeholders because they never
+     * arrived (see sample_bsamp_cfg.fill_gaps), in increasing index
+     * order. This points into the sample handler, and is only valid
+     * until the next sample_expect_bsamps() call. */
+    const struct ch_gap *gaps;
+    size_t ngaps;
+
+    /**
+     * Times storage fell far enough behind that the sample handler
+     * stopped reading packets until it caught up. */
+    size_t npauses;
+
+    /**
+     * Packets ignored because they didn't come from the data node. */
+    size_t nforeign;
+
+    /**
+     * If board samples were being forwarded (see
+     * sample_cfg_forwarding() and sample_add_subscriber()) during the
+     * transfer, how many were sent on, and how many were dropped
+     * because forwarding fell behind or they couldn't be sent (to
+     * the destination that missed the most). Forwarding never holds
+     * up storage. The last few may still be on their way. */
+    size_t nforwarded;
+    size_t nfwd_dropped;
+};
+
+/**
+ * Get statistics about the most recent board sample transfer.
+ *
+ * Call this only from the sample_bsamp_cb, or when no transfer is
+ * in progress.
+ *
+ * @see sample_cfg_bsamp_bufs()
+ */
+void sample_get_bsamp_stats(struct sample_session *smpl,
+                            struct sample_bsamp_stats *stats);
+
 #endif
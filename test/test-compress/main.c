@@ -0,0 +1,309 @@
+#include "compress.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ch_storage.h"
+#include "compress_pool.h"
+#include "raw_ch_storage.h"
+#include "raw_file.h"
+#include "raw_packets.h"
+#include "test.h"
+#include "type_attrs.h"
+
+#define RAWFILE "test-compress.raw"
+#define REC_SIZE 10
+
+/* Slowly varying 16-bit words, like samples, with some noise. */
+static void fill(uint8_t *buf, size_t len, unsigned seed)
+{
+    uint16_t v = (uint16_t)seed;
+    srand(seed);
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        v += (uint16_t)(rand() % 5 - 2);
+        memcpy(buf + i, &v, sizeof(v));
+    }
+    if (len & 1) {
+        buf[len - 1] = (uint8_t)seed;
+    }
+}
+
+/* Every codec, on lengths that aren't whole records, data that
+ * compresses and data that doesn't. */
+START_TEST(test_roundtrip)
+{
+    static const size_t lens[] = { 1, 2, REC_SIZE - 1, REC_SIZE + 1,
+                                   1000, 65537 };
+    for (int codec = COMPRESS_LZ4; codec < COMPRESS_NCODECS; codec++) {
+        ck_assert_int_eq(compress_codec_from_str(compress_codec_str(codec)),
+                         codec);
+        struct compress_ctx *ctx = compress_ctx_alloc(codec, 0, REC_SIZE);
+        ck_assert(ctx != NULL);
+        for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+            const size_t len = lens[l];
+            const size_t bound = compress_bound(codec, len);
+            uint8_t *src = malloc(len);
+            uint8_t *z = malloc(bound);
+            uint8_t *dst = malloc(len);
+            ck_assert(src && z && dst);
+
+            fill(src, len, (unsigned)(codec * 100 + l));
+            size_t zlen = compress_encode(ctx, z, bound, src, len);
+            if (len >= 1000) {
+                ck_assert_int_gt(zlen, 0);
+                ck_assert_int_lt(zlen, len);
+            }
+            if (zlen) {
+                ck_assert_int_eq(compress_decoded_size(codec, z, zlen), len);
+                memset(dst, 0, len);
+                ck_assert_int_eq(compress_decode(codec, REC_SIZE, dst, len,
+                                                 z, zlen), len);
+                ck_assert(!memcmp(src, dst, len));
+                /* Too small a destination, and truncated input. */
+                ck_assert_int_eq(compress_decode(codec, REC_SIZE, dst,
+                                                 len - 1, z, zlen), 0);
+                ck_assert_int_eq(compress_decode(codec, REC_SIZE, dst, len,
+                                                 z, zlen / 2), 0);
+            }
+
+            /* Random bytes don't compress; we say so. */
+            for (size_t i = 0; i < len; i++) {
+                src[i] = (uint8_t)rand();
+            }
+            ck_assert_int_eq(compress_encode(ctx, z, bound, src, len), 0);
+            free(src);
+            free(z);
+            free(dst);
+        }
+        compress_ctx_free(ctx);
+    }
+    ck_assert(compress_ctx_alloc(COMPRESS_NONE, 0, REC_SIZE) == NULL);
+    ck_assert(compress_ctx_alloc(COMPRESS_DELTA_ZSTD, 0, 3) == NULL);
+    ck_assert_int_eq(compress_codec_from_str("bogus"), -1);
+}
+END_TEST
+
+/* Jobs come back in the order they went in, however many threads
+ * there are, and the stats add up. */
+START_TEST(test_pool_order)
+{
+    static const size_t nthreads[] = { 0, 1, 4 };
+    const size_t max_in = 4096;
+    const size_t njobs = 200;
+    uint8_t want[4096], got[4096];
+    for (size_t t = 0; t < sizeof(nthreads) / sizeof(nthreads[0]); t++) {
+        struct compress_pool *pool =
+            compress_pool_alloc(COMPRESS_SHUFFLE_ZSTD, 1, REC_SIZE, max_in,
+                                nthreads[t]);
+        ck_assert(pool != NULL);
+        ck_assert_int_eq(compress_pool_nthreads(pool),
+                         nthreads[t] ? nthreads[t] : 1);
+        size_t nsubmitted = 0, nreaped = 0;
+        uint64_t nbytes = 0;
+        while (nreaped < njobs) {
+            struct compress_job *job = NULL;
+            if (nsubmitted < njobs) {
+                job = compress_pool_job(pool);
+            }
+            if (job) {
+                /* Every tenth job won't compress (nor may short ones). */
+                job->in_len = 1 + (nsubmitted * 37) % max_in;
+                job->tag = nsubmitted;
+                fill(job->in, job->in_len, (unsigned)nsubmitted);
+                if (nsubmitted % 10 == 0) {
+                    for (size_t i = 0; i < job->in_len; i++) {
+                        ((uint8_t*)job->in)[i] = (uint8_t)rand();
+                    }
+                }
+                nbytes += job->in_len;
+                compress_pool_submit(pool, job);
+                nsubmitted++;
+                continue;
+            }
+            job = compress_pool_reap(pool, 1);
+            ck_assert(job != NULL);
+            ck_assert_int_eq(job->tag, nreaped);
+            fill(want, 1 + (nreaped * 37) % max_in, (unsigned)nreaped);
+            if (nreaped % 10 == 0) {
+                ck_assert(!job->compressed);
+            }
+            if (job->compressed) {
+                ck_assert_int_eq(compress_decode(COMPRESS_SHUFFLE_ZSTD,
+                                                 REC_SIZE, got, sizeof(got),
+                                                 job->out, job->out_len),
+                                 job->in_len);
+                ck_assert(!memcmp(got, want, job->in_len));
+            } else {
+                ck_assert(job->out == job->in);
+                ck_assert_int_eq(job->out_len, job->in_len);
+            }
+            compress_pool_release(pool, job);
+            nreaped++;
+        }
+        ck_assert(compress_pool_reap(pool, 1) == NULL);
+
+        struct compress_thread_stats ts;
+        uint64_t total = 0, total_jobs = 0;
+        for (size_t i = 0; i < compress_pool_nthreads(pool); i++) {
+            compress_pool_thread_stats(pool, i, &ts);
+            total += ts.nbytes_in;
+            total_jobs += ts.njobs;
+        }
+        ck_assert_int_eq(total, nbytes);
+        ck_assert_int_eq(total_jobs, njobs);
+        compress_pool_free(pool);
+    }
+}
+END_TEST
+
+/* Read a framed raw file back into bsamps, applying frames in order;
+ * returns how many board samples it covers. */
+static size_t read_frames(struct raw_pkt_bsmp *bsamps, size_t max,
+                          int codec, size_t *nframes)
+{
+    int fd = open(RAWFILE, O_RDONLY);
+    struct stat st;
+    ck_assert(fd != -1);
+    ck_assert(fstat(fd, &st) == 0);
+    uint8_t *buf = malloc(st.st_size);
+    ck_assert(buf != NULL);
+    ck_assert(read(fd, buf, st.st_size) == st.st_size);
+    close(fd);
+
+    /* Frames go from the header to the gap table, which has the one
+     * gap test_raw_frames writes; there's no index. */
+    struct raw_file_header hdr;
+    struct raw_file_footer footer;
+    ck_assert_int_ge(st.st_size, RAW_FILE_HDR_SIZE + sizeof(footer));
+    memcpy(&hdr, buf, sizeof(hdr));
+    memcpy(&footer, buf + st.st_size - sizeof(footer), sizeof(footer));
+    ck_assert(!strcmp(hdr.rf_magic, RAW_FILE_MAGIC));
+    ck_assert_int_eq(hdr.rf_flags, RAW_FILE_F_FRAMED);
+    ck_assert_int_eq(hdr.rf_codec, codec);
+    ck_assert_int_eq(hdr.rf_start_sidx, 0);
+    ck_assert(!strcmp(footer.rf_magic, RAW_FILE_FOOTER_MAGIC));
+    ck_assert_int_eq(footer.rf_ngaps, 1);
+    ck_assert_int_eq(footer.rf_nindex, 0);
+    ck_assert_int_eq(footer.rf_index_off,
+                     footer.rf_gaps_off + sizeof(struct ch_gap));
+    size_t end = footer.rf_gaps_off;
+
+    size_t n = 0;
+    *nframes = 0;
+    for (size_t pos = hdr.rf_hdr_size; pos < end; (*nframes)++) {
+        struct raw_ch_frame frm;
+        ck_assert_int_le(pos + sizeof(frm), end);
+        memcpy(&frm, buf + pos, sizeof(frm));
+        pos += sizeof(frm);
+        ck_assert(!memcmp(frm.frm_magic, RAW_CH_FRAME_MAGIC,
+                          sizeof(frm.frm_magic)));
+        ck_assert_int_le(pos + frm.frm_len, end);
+        ck_assert_int_le(frm.frm_offset + frm.frm_nsamps, max);
+        size_t len = frm.frm_nsamps * sizeof(*bsamps);
+        ck_assert_int_eq(compress_decode(frm.frm_codec, sizeof(*bsamps),
+                                         bsamps + frm.frm_offset, len,
+                                         buf + pos, frm.frm_len), len);
+        pos += frm.frm_len;
+        if (frm.frm_offset + frm.frm_nsamps > n) {
+            n = frm.frm_offset + frm.frm_nsamps;
+        }
+    }
+    ck_assert_int_eq(n, footer.rf_nsamps);
+    free(buf);
+    return n;
+}
+
+/* Compressed raw files hold the same board samples an uncompressed
+ * one would, overwrites and all. */
+START_TEST(test_raw_frames)
+{
+    enum { NWRITE = 23 };
+    static struct raw_pkt_bsmp bs[NWRITE], got[NWRITE];
+    static const uint32_t want[NWRITE] = {
+        0, 1, 20, 21, 22, 5, 6, 7, 8, 9, 10, 11,
+        12, 13, 14, 15, 16, 17, 18, 5, 6, 7, 22,
+    };
+    static const int codec[] = { COMPRESS_DELTA_ZSTD, COMPRESS_SHUFFLE_LZ4 };
+    static const size_t nthreads[] = { 2, 0 };
+    for (size_t i = 0; i < NWRITE; i++) {
+        raw_packet_init(&bs[i], RAW_MTYPE_BSMP, 0);
+        bs[i].b_sidx = i;
+        fill((uint8_t*)bs[i].b_samps, sizeof(bs[i].b_samps), 7);
+        bs[i].b_samps[0] = (raw_samp_t)i;
+    }
+    for (size_t t = 0; t < sizeof(codec) / sizeof(codec[0]); t++) {
+        struct ch_storage *chns = raw_ch_storage_alloc(RAWFILE, 0644);
+        struct raw_ch_opts opts;
+        ck_assert(chns != NULL);
+        raw_ch_opts_init(&opts);
+        opts.frame_nsamps = 0;
+        ck_assert(raw_ch_storage_set_opts(chns, &opts) == -1);
+        opts.frame_nsamps = 6;
+        opts.compress = codec[t];
+        opts.compress_threads = nthreads[t];
+        ck_assert(raw_ch_storage_set_opts(chns, &opts) == 0);
+        ck_assert(ch_storage_open(chns, O_CREAT | O_RDWR | O_TRUNC) != -1);
+        ck_assert(ch_storage_write(chns, bs, 3) == 0);
+        ck_assert(ch_storage_datasync(chns) == 0);
+        ck_assert(ch_storage_write(chns, bs + 3, 9) == 0);
+        ck_assert(ch_storage_write(chns, bs + 12, 11) == 0);
+        ck_assert(ch_storage_write_at(chns, bs + 20, 3, 2) == 0);
+        ck_assert(ch_storage_write_at(chns, bs + 5, 3, 19) == 0);
+        ck_assert(ch_storage_write_at(chns, bs, 3, 21) == -1);
+        struct ch_gap gap = { .start = 1, .len = 2 };
+        ck_assert(ch_storage_write_gaps(chns, &gap, 1) == 0);
+        ck_assert(ch_storage_close(chns) == 0);
+
+        struct ch_storage_stats stats;
+        ck_assert(ch_storage_stats(chns, &stats) == 0);
+        ck_assert_int_eq(stats.nbytes_in, sizeof(bs));
+        ck_assert_int_lt(stats.nbytes_out, stats.nbytes_in / 2);
+        ck_assert_int_eq(stats.nthreads, nthreads[t] ? nthreads[t] : 1);
+        ch_storage_free(chns);
+
+        /* The 3 synced samples, 3 full frames, a patch at 2, a patch
+         * at 19 up to the pending frame, and that frame, which the
+         * second patch's last sample went straight into. */
+        size_t nframes;
+        memset(got, 0, sizeof(got));
+        ck_assert_int_eq(read_frames(got, NWRITE, codec[t], &nframes),
+                         NWRITE);
+        ck_assert_int_eq(nframes, 1 + 3 + 2 + 1);
+        for (size_t i = 0; i < NWRITE; i++) {
+            ck_assert_int_eq(got[i].b_sidx, want[i]);
+            ck_assert(!memcmp(&got[i], &bs[want[i]], sizeof(got[i])));
+        }
+        /* The reader only does fixed-stride files. */
+        ck_assert(raw_file_open(RAWFILE) == NULL);
+        ck_assert_int_eq(errno, ENOTSUP);
+    }
+    unlink(RAWFILE);
+}
+END_TEST
+
+Suite* compress_suite(void)
+{
+    Suite *s = suite_create("compress");
+    TCase *tc = tcase_create("compress");
+    tcase_set_timeout(tc, 60);
+    tcase_add_test(tc, test_roundtrip);
+    tcase_add_test(tc, test_pool_order);
+    tcase_add_test(tc, test_raw_frames);
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+int main(__unused int argc, __unused char *argv[])
+{
+    Suite *s = compress_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    int n_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,197 @@
+#include "decimate.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "type_attrs.h"
+
+/* Odd on purpose, so the SIMD padding gets exercised. */
+#define NCHANS 13
+#define MID 32768.0
+#define AMPL 10000.0
+
+/* Feed nframes of a sine at freq cycles/frame (DC if freq is 0) to
+ * every channel, each with its own phase. Returns the number of
+ * outputs; peak gets the biggest distance of a settled output from
+ * MID. */
+static size_t feed_sine(struct decim *dec, size_t nframes, double freq,
+                        double *peak)
+{
+    uint16_t in[NCHANS], out[NCHANS], out_max[NCHANS];
+    size_t nout = 0;
+    *peak = 0.0;
+    for (size_t i = 0; i < nframes; i++) {
+        for (size_t c = 0; c < NCHANS; c++) {
+            in[c] = (uint16_t)lrint(MID + AMPL *
+                                    sin(2 * M_PI * freq * i + c));
+        }
+        if (!decim_push(dec, in, out, out_max)) {
+            continue;
+        }
+        nout++;
+        /* Skip the start, where the priming is still in there. */
+        if (i < nframes / 2) {
+            continue;
+        }
+        for (size_t c = 0; c < NCHANS; c++) {
+            double d = fabs(out[c] - MID);
+            *peak = d > *peak ? d : *peak;
+        }
+    }
+    return nout;
+}
+
+START_TEST(test_new_free)
+{
+    ck_assert(decim_new(0, 10, 0) == NULL);
+    ck_assert(decim_new(NCHANS, 0, 0) == NULL);
+    decim_free(NULL);
+    struct decim *dec = decim_new(NCHANS, 1, 0);
+    ck_assert(dec != NULL);
+    ck_assert_int_eq(decim_delay(dec), 0);
+    decim_free(dec);
+    dec = decim_new(NCHANS, 100, 1);
+    ck_assert(dec != NULL);
+    ck_assert_int_eq(decim_delay(dec), 0);
+    decim_free(dec);
+    dec = decim_new(NCHANS, 100, 0);
+    ck_assert(dec != NULL);
+    ck_assert_int_gt(decim_delay(dec), 0);
+    decim_free(dec);
+}
+END_TEST
+
+START_TEST(test_dc)
+{
+    static const unsigned factors[] = { 1, 2, 7, 10, 13, 30, 100 };
+    for (size_t f = 0; f < sizeof(factors) / sizeof(factors[0]); f++) {
+        struct decim *dec = decim_new(NCHANS, factors[f], 0);
+        ck_assert(dec != NULL);
+        uint16_t in[NCHANS], out[NCHANS];
+        for (size_t c = 0; c < NCHANS; c++) {
+            in[c] = (uint16_t)(c * 5000 + 7);
+        }
+        size_t nout = 0;
+        for (size_t i = 0; i < 100 * factors[f]; i++) {
+            if (!decim_push(dec, in, out, NULL)) {
+                continue;
+            }
+            nout++;
+            for (size_t c = 0; c < NCHANS; c++) {
+                ck_assert_int_eq(out[c], in[c]);
+            }
+        }
+        ck_assert_int_eq(nout, 100);
+        decim_free(dec);
+    }
+}
+END_TEST
+
+START_TEST(test_passband)
+{
+    struct decim *dec = decim_new(NCHANS, 30, 0);
+    double peak;
+    /* Half the new Nyquist rate. */
+    size_t nout = feed_sine(dec, 30000, 0.25 / 30, &peak);
+    ck_assert_int_eq(nout, 1000);
+    ck_assert_msg(peak > 0.95 * AMPL && peak < 1.05 * AMPL,
+                  "passband peak %f", peak);
+    decim_free(dec);
+}
+END_TEST
+
+START_TEST(test_stopband)
+{
+    static const double freqs[] = { 1.4, 2.5, 4.0, 11.0 };
+    for (size_t f = 0; f < sizeof(freqs) / sizeof(freqs[0]); f++) {
+        /* In units of the new Nyquist rate, so all of these alias
+         * without filtering. (Just above 1 is still the filters'
+         * transition band; that only aliases into the top of the
+         * new band, which the transition band covers anyway.) */
+        struct decim *dec = decim_new(NCHANS, 30, 0);
+        double peak;
+        feed_sine(dec, 30000, freqs[f] / 60, &peak);
+        ck_assert_msg(peak < 0.01 * AMPL, "%f: stopband peak %f",
+                      freqs[f], peak);
+        decim_free(dec);
+    }
+}
+END_TEST
+
+START_TEST(test_reset)
+{
+    struct decim *dec = decim_new(NCHANS, 10, 0);
+    uint16_t lo[NCHANS], hi[NCHANS], out[NCHANS];
+    for (size_t c = 0; c < NCHANS; c++) {
+        lo[c] = 1000;
+        hi[c] = 60000;
+    }
+    for (size_t i = 0; i < 1000; i++) {
+        decim_push(dec, lo, out, NULL);
+    }
+    /* Pushing a different level straight away would ring; after a
+     * reset, it starts out settled. */
+    decim_reset(dec);
+    for (size_t i = 0; i < 100; i++) {
+        if (decim_push(dec, hi, out, NULL)) {
+            for (size_t c = 0; c < NCHANS; c++) {
+                ck_assert_int_eq(out[c], hi[c]);
+            }
+        }
+    }
+    decim_free(dec);
+}
+END_TEST
+
+START_TEST(test_envelope)
+{
+    struct decim *dec = decim_new(NCHANS, 7, 1);
+    uint16_t in[NCHANS], out[NCHANS], out_max[NCHANS];
+    size_t nout = 0;
+    for (size_t i = 0; i < 700; i++) {
+        for (size_t c = 0; c < NCHANS; c++) {
+            /* One spike per channel per output frame. */
+            size_t j = i % 7;
+            in[c] = (uint16_t)(j == c % 7 ? 50000 + c :
+                               j == (c + 3) % 7 ? 100 + c : 30000);
+        }
+        if (!decim_push(dec, in, out, out_max)) {
+            continue;
+        }
+        nout++;
+        ck_assert_int_eq(i % 7, 6);
+        for (size_t c = 0; c < NCHANS; c++) {
+            ck_assert_int_eq(out[c], 100 + c);
+            ck_assert_int_eq(out_max[c], 50000 + c);
+        }
+    }
+    ck_assert_int_eq(nout, 100);
+    decim_free(dec);
+}
+END_TEST
+
+Suite* decimate_suite(void)
+{
+    Suite *s = suite_create("decimate");
+    TCase *tc = tcase_create("decimate");
+    tcase_add_test(tc, test_new_free);
+    tcase_add_test(tc, test_dc);
+    tcase_add_test(tc, test_passband);
+    tcase_add_test(tc, test_stopband);
+    tcase_add_test(tc, test_reset);
+    tcase_add_test(tc, test_envelope);
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+int main(__unused int argc, __unused char *argv[])
+{
+    Suite *s = decimate_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    int n_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
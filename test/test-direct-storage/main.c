@@ -0,0 +1,149 @@
+#include "direct_ch_storage.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ch_storage.h"
+#include "raw_file.h"
+#include "raw_packets.h"
+#include "test.h"
+#include "type_attrs.h"
+
+#define DIRECTFILE "test-direct-storage.raw"
+#define NWRITE 23
+
+static struct raw_pkt_bsmp bs[NWRITE];
+
+static void setup_bsamps(void)
+{
+    for (size_t i = 0; i < NWRITE; i++) {
+        raw_packet_init(&bs[i], RAW_MTYPE_BSMP, 0);
+        bs[i].b_sidx = (uint32_t)i;
+        for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+            bs[i].b_samps[j] = (raw_samp_t)(i * j);
+        }
+    }
+}
+
+static void teardown_bsamps(void)
+{
+    unlink(DIRECTFILE);
+}
+
+/* Write what test_raw_frames in test-compress does, and check the
+ * file reads back as a raw file with the same board samples and gap
+ * table. Small buffers, so they go round the ring a few
+ * times, and patches land both in the buffer being filled and in
+ * blocks already written. */
+static void check_direct(int direct_io, int io_uring, size_t nbufs)
+{
+    static const uint32_t want[NWRITE] = {
+        0, 1, 20, 21, 22, 5, 6, 7, 8, 9, 10, 11,
+        12, 13, 14, 15, 16, 17, 18, 5, 6, 7, 22,
+    };
+    struct ch_storage *chns = direct_ch_storage_alloc(DIRECTFILE, 0644);
+    struct direct_ch_opts opts;
+    ck_assert(chns != NULL);
+    direct_ch_opts_init(&opts);
+    opts.buf_size = DIRECT_CH_ALIGN + 1;
+    ck_assert(direct_ch_storage_set_opts(chns, &opts) == -1);
+    opts.buf_size = 2 * DIRECT_CH_ALIGN;
+    opts.nbufs = 1;
+    ck_assert(direct_ch_storage_set_opts(chns, &opts) == -1);
+    opts.nbufs = nbufs;
+    opts.prealloc_size = 3 * DIRECT_CH_ALIGN;
+    opts.direct_io = direct_io;
+    opts.io_uring = io_uring;
+    ck_assert(direct_ch_storage_set_opts(chns, &opts) == 0);
+    ck_assert(ch_storage_open(chns, O_CREAT | O_RDWR | O_TRUNC) != -1);
+    ck_assert(ch_storage_write(chns, bs, 3) == 0);
+    ck_assert(ch_storage_datasync(chns) == 0);
+    ck_assert(ch_storage_write(chns, bs + 3, 9) == 0);
+    ck_assert(ch_storage_write(chns, bs + 12, 11) == 0);
+    ck_assert(ch_storage_write_at(chns, bs + 20, 3, 2) == 0);
+    ck_assert(ch_storage_write_at(chns, bs + 5, 3, 19) == 0);
+    ck_assert(ch_storage_write_at(chns, bs, 3, 21) == -1);
+    struct ch_gap gap = { .start = 1, .len = 2 };
+    ck_assert(ch_storage_write_gaps(chns, &gap, 1) == 0);
+    ck_assert(ch_storage_close(chns) == 0);
+    ch_storage_free(chns);
+
+    struct stat st;
+    ck_assert(stat(DIRECTFILE, &st) == 0);
+    ck_assert_int_eq(st.st_size,
+                     (RAW_FILE_HDR_SIZE + sizeof(bs) + sizeof(gap) +
+                      5 * sizeof(struct raw_file_index) +
+                      sizeof(struct raw_file_footer)));
+    struct raw_file *rf = raw_file_open(DIRECTFILE);
+    ck_assert(rf != NULL);
+    ck_assert(rf->footer != NULL);
+    ck_assert_int_eq(rf->hdr->rf_flags, 0);
+    ck_assert_int_eq(rf->hdr->rf_board_id, bs[0].b_id);
+    ck_assert_int_eq(rf->hdr->rf_start_sidx, 0);
+    ck_assert_int_eq(rf->nsamps, NWRITE);
+    for (size_t i = 0; i < NWRITE; i++) {
+        const struct raw_pkt_bsmp *got = raw_file_bsmp(rf, i);
+        ck_assert_int_eq(got->b_sidx, want[i]);
+        ck_assert(!memcmp(got, &bs[want[i]], sizeof(*got)));
+    }
+    ck_assert(raw_file_bsmp(rf, NWRITE) == NULL);
+    ck_assert_int_eq(rf->ngaps, 1);
+    ck_assert_int_eq(rf->gaps[0].start, gap.start);
+    ck_assert_int_eq(rf->gaps[0].len, gap.len);
+    /* The index has an entry for each run of consecutive b_sidx the
+     * patches left behind. */
+    static const uint32_t index[][2] = {
+        { 0, 0 }, { 2, 20 }, { 5, 5 }, { 19, 5 }, { 22, 22 },
+    };
+    ck_assert_int_eq(rf->nindex, sizeof(index) / sizeof(index[0]));
+    for (size_t i = 0; i < rf->nindex; i++) {
+        ck_assert_int_eq(rf->index[i].ri_rec, index[i][0]);
+        ck_assert_int_eq(rf->index[i].ri_sidx, index[i][1]);
+    }
+    raw_file_close(rf);
+}
+
+START_TEST(test_direct_uring)
+{
+    check_direct(1, 1, 2);
+    check_direct(1, 1, 5);
+}
+END_TEST
+
+START_TEST(test_direct_pwrite)
+{
+    check_direct(1, 0, 2);
+}
+END_TEST
+
+START_TEST(test_direct_buffered)
+{
+    check_direct(0, 1, 3);
+}
+END_TEST
+
+Suite* direct_storage_suite(void)
+{
+    Suite *s = suite_create("direct_storage");
+    TCase *tc = tcase_create("direct_storage");
+    tcase_add_checked_fixture(tc, setup_bsamps, teardown_bsamps);
+    tcase_add_test(tc, test_direct_uring);
+    tcase_add_test(tc, test_direct_pwrite);
+    tcase_add_test(tc, test_direct_buffered);
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+int main(__unused int argc, __unused char *argv[])
+{
+    Suite *s = direct_storage_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    int n_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
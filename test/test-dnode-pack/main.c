@@ -0,0 +1,194 @@
+#include "dnode_pack.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "raw_packets.h"
+#include "test.h"
+#include "type_attrs.h"
+
+static uint8_t samps[RAW_BSMP_NSAMP * sizeof(raw_samp_t)];
+static uint8_t env_max[RAW_BSMP_NSAMP * sizeof(raw_samp_t)];
+static uint32_t chips[RAW_BSMP_NSAMP];
+static uint32_t chans[RAW_BSMP_NSAMP];
+static uint32_t bsub_samps[RAW_BSMP_NSAMP];
+static uint16_t packed[RAW_BSMP_NSAMP];
+
+static struct dnode_pack pk;
+static uint8_t expected[64 * 1024];
+static uint8_t actual[64 * 1024];
+
+static void setup(void)
+{
+    for (size_t i = 0; i < sizeof(samps); i++) {
+        samps[i] = (uint8_t)(i * 7);
+        env_max[i] = (uint8_t)(i * 13);
+    }
+    for (size_t i = 0; i < RAW_BSMP_NSAMP; i++) {
+        chips[i] = i % RAW_BSMP_NCHIPS;
+        chans[i] = i % RAW_BSMP_NCHANS;
+        /* Cover varints of every length up to 5 bytes. */
+        bsub_samps[i] = (uint32_t)(i * 3835769u);
+        packed[i] = (uint16_t)(i * 40503u);
+    }
+}
+
+/* Pack msg both ways and make sure they agree. */
+static void check_pack(const DnodeSample *msg)
+{
+    size_t len = dnode_sample__get_packed_size(msg);
+    ck_assert_int_le(len, sizeof(expected));
+    ck_assert_int_eq(dnode_sample__pack(msg, expected), len);
+    ck_assert_int_eq(dnode_pack(&pk, msg), len);
+    ck_assert_int_le(pk.niov, DNODE_PACK_NIOVS);
+    ck_assert_int_eq(dnode_pack_flatten(&pk, actual, sizeof(actual)), len);
+    ck_assert(memcmp(expected, actual, len) == 0);
+}
+
+START_TEST(test_bsmp)
+{
+    DnodeSample dnsample = DNODE_SAMPLE__INIT;
+    BoardSample bsmp = BOARD_SAMPLE__INIT;
+    dnsample.has_type = 1;
+    dnsample.type = DNODE_SAMPLE__TYPE__SAMPLE;
+    dnsample.sample = &bsmp;
+    check_pack(&dnsample);      /* all defaults */
+
+    bsmp.has_is_live = 1;
+    bsmp.is_live = 1;
+    bsmp.has_is_last = 1;
+    bsmp.is_last = 0;
+    bsmp.has_is_err = 1;
+    bsmp.is_err = 0;
+    bsmp.has_exp_cookie = 1;
+    bsmp.exp_cookie = 0x0123456789abcdefULL;
+    bsmp.has_board_id = 1;
+    bsmp.board_id = 7;
+    bsmp.has_samp_idx = 1;
+    bsmp.samp_idx = 4000000000U;
+    bsmp.has_chip_live = 1;
+    bsmp.chip_live = 0xFFFFFFFF;
+    bsmp.has_samples = 1;
+    bsmp.samples.data = samps;
+    bsmp.samples.len = sizeof(samps);
+    check_pack(&dnsample);
+    /* The samples went by reference. */
+    int found = 0;
+    for (size_t i = 0; i < pk.niov; i++) {
+        found |= pk.iov[i].iov_base == samps;
+    }
+    ck_assert(found);
+
+    bsmp.has_decimation = 1;
+    bsmp.decimation = 300;
+    bsmp.has_envelope_max = 1;
+    bsmp.envelope_max.data = env_max;
+    bsmp.envelope_max.len = sizeof(env_max);
+    check_pack(&dnsample);
+}
+END_TEST
+
+START_TEST(test_bsub)
+{
+    static const size_t ns[] = { 0, 1, 32, RAW_BSMP_NSAMP };
+    for (size_t i = 0; i < sizeof(ns) / sizeof(ns[0]); i++) {
+        DnodeSample dnsample = DNODE_SAMPLE__INIT;
+        BoardSubsample bsub = BOARD_SUBSAMPLE__INIT;
+        dnsample.has_type = 1;
+        dnsample.type = DNODE_SAMPLE__TYPE__SUBSAMPLE;
+        dnsample.subsample = &bsub;
+        bsub.has_is_live = 1;
+        bsub.is_live = 1;
+        bsub.has_is_last = 1;
+        bsub.is_last = 1;
+        bsub.has_is_err = 1;
+        bsub.is_err = 1;
+        bsub.has_exp_cookie = 1;
+        bsub.exp_cookie = 5;
+        bsub.has_board_id = 1;
+        bsub.board_id = 0;
+        bsub.has_samp_idx = 1;
+        bsub.samp_idx = 129;
+        bsub.has_chip_live = 1;
+        bsub.chip_live = 3;
+        bsub.n_chips = ns[i];
+        bsub.chips = chips;
+        bsub.n_channels = ns[i];
+        bsub.channels = chans;
+        bsub.n_samples = ns[i];
+        bsub.samples = bsub_samps;
+        bsub.has_gpio = 1;
+        bsub.gpio = 0xFFFF;
+        bsub.has_dac_channel = 1;
+        bsub.dac_channel = 2;
+        bsub.has_dac_value = 1;
+        bsub.dac_value = 65535;
+        check_pack(&dnsample);
+        bsub.has_decimation = 1;
+        bsub.decimation = 10;
+        check_pack(&dnsample);
+
+        /* Compact, with the channel map and without. */
+        bsub.n_samples = 0;
+        bsub.has_packed_samples = 1;
+        bsub.packed_samples.data = (uint8_t*)packed;
+        bsub.packed_samples.len = ns[i] * sizeof(packed[0]);
+        bsub.has_cfg_gen = 1;
+        bsub.cfg_gen = 300000;
+        check_pack(&dnsample);
+        bsub.n_chips = 0;
+        bsub.n_channels = 0;
+        check_pack(&dnsample);
+    }
+}
+END_TEST
+
+START_TEST(test_roundtrip)
+{
+    DnodeSample dnsample = DNODE_SAMPLE__INIT;
+    BoardSample bsmp = BOARD_SAMPLE__INIT;
+    dnsample.has_type = 1;
+    dnsample.type = DNODE_SAMPLE__TYPE__SAMPLE;
+    dnsample.sample = &bsmp;
+    bsmp.has_samp_idx = 1;
+    bsmp.samp_idx = 12345;
+    bsmp.has_samples = 1;
+    bsmp.samples.data = samps;
+    bsmp.samples.len = sizeof(samps);
+    size_t len = dnode_pack(&pk, &dnsample);
+    ck_assert_int_gt(len, sizeof(samps));
+    ck_assert_int_eq(dnode_pack_flatten(&pk, actual, sizeof(actual)), len);
+    ck_assert_int_eq(dnode_pack_flatten(&pk, actual, len - 1), 0);
+
+    DnodeSample *out = dnode_sample__unpack(NULL, len, actual);
+    ck_assert(out != NULL);
+    ck_assert(out->sample != NULL);
+    ck_assert_int_eq(out->sample->samp_idx, 12345);
+    ck_assert_int_eq(out->sample->samples.len, sizeof(samps));
+    ck_assert(memcmp(out->sample->samples.data, samps, sizeof(samps)) == 0);
+    dnode_sample__free_unpacked(out, NULL);
+}
+END_TEST
+
+Suite* dnode_pack_suite(void)
+{
+    Suite *s = suite_create("dnode_pack");
+    TCase *tc = tcase_create("dnode_pack");
+    tcase_add_checked_fixture(tc, setup, NULL);
+    tcase_add_test(tc, test_bsmp);
+    tcase_add_test(tc, test_bsub);
+    tcase_add_test(tc, test_roundtrip);
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+int main(__unused int argc, __unused char *argv[])
+{
+    Suite *s = dnode_pack_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    int n_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -6,9 +6,11 @@
 #include "test.h"
 
 #include "ch_storage.h"
+#include "compress.h"
 #include "hdf5_ch_storage.h"
 #include "logging.h"
 #include "raw_packets.h"
+#include "transpose16.h"
 #include "type_attrs.h"
 
 #define H5FILE "test.hdf5"
@@ -59,11 +61,580 @@ START_TEST(test_hdf5_end_to_end)
 }
 END_TEST
 
+/* Store samples in network byte order, and make sure HDF5 hands them
+ * back in host order. */
+START_TEST(test_hdf5_wire_order)
+{
+    struct ch_storage *chns = hdf5_ch_storage_alloc(H5FILE, H5DNAME);
+    const size_t nwrite = 3;
+
+    ck_assert(chns != NULL);
+    chns->ch_flags |= CH_STORAGE_WIRE_ORDER;
+    ck_assert(ch_storage_open(chns, H5F_ACC_TRUNC) == 0);
+    for (size_t i = 0; i < nwrite; i++) {
+        struct raw_pkt_bsmp wire = bsmp;
+        wire.b_sidx = i;
+        for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+            wire.b_samps[j] = (raw_samp_t)(i * RAW_BSMP_NSAMP + j);
+        }
+        ck_assert(raw_pkt_hton(&wire) == 0);
+        ck_assert(raw_pkt_ntoh_hdr(&wire) == 0);
+        ck_assert(ch_storage_write(chns, &wire, 1) == 0);
+    }
+    ck_assert(ch_storage_close(chns) == 0);
+    ch_storage_free(chns);
+
+    /* Read the samples back into a native-order array. */
+    static raw_samp_t got[3][RAW_BSMP_NSAMP];
+    hsize_t nsamps = RAW_BSMP_NSAMP;
+    hid_t file = H5Fopen(H5FILE, H5F_ACC_RDONLY, H5P_DEFAULT);
+    ck_assert(file >= 0);
+    hid_t dset = H5Dopen2(file, H5DNAME, H5P_DEFAULT);
+    ck_assert(dset >= 0);
+    hid_t arrtype = H5Tarray_create2(H5T_NATIVE_UINT16, 1, &nsamps);
+    ck_assert(arrtype >= 0);
+    hid_t memtype = H5Tcreate(H5T_COMPOUND, sizeof(got[0]));
+    ck_assert(memtype >= 0);
+    ck_assert(H5Tinsert(memtype, "samples", 0, arrtype) >= 0);
+    hid_t space = H5Dget_space(dset);
+    ck_assert(H5Sget_simple_extent_npoints(space) == (hssize_t)nwrite);
+    ck_assert(H5Dread(dset, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                      got) >= 0);
+    for (size_t i = 0; i < nwrite; i++) {
+        for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+            ck_assert_int_eq(got[i][j], i * RAW_BSMP_NSAMP + j);
+        }
+    }
+    H5Sclose(space);
+    H5Tclose(memtype);
+    H5Tclose(arrtype);
+    H5Dclose(dset);
+    H5Fclose(file);
+}
+END_TEST
+
+/* Overwrite some samples in the middle, and make sure writing past
+ * the end is refused. */
+START_TEST(test_hdf5_write_at)
+{
+    struct ch_storage *chns = hdf5_ch_storage_alloc(H5FILE, H5DNAME);
+    struct raw_pkt_bsmp bs[4];
+    const size_t nwrite = 4;
+
+    ck_assert(chns != NULL);
+    ck_assert(ch_storage_open(chns, H5F_ACC_TRUNC) == 0);
+    for (size_t i = 0; i < nwrite; i++) {
+        bs[i] = bsmp;
+        bs[i].b_sidx = i;
+    }
+    ck_assert(ch_storage_write(chns, bs, nwrite) == 0);
+    bs[0].b_sidx = 10;
+    bs[1].b_sidx = 11;
+    ck_assert(ch_storage_write_at(chns, bs, 2, 1) == 0);
+    ck_assert(ch_storage_write_at(chns, bs, 2, nwrite - 1) == -1);
+    ck_assert(ch_storage_close(chns) == 0);
+    ch_storage_free(chns);
+
+    /* Read back the sample indexes. */
+    uint32_t got[4];
+    hid_t file = H5Fopen(H5FILE, H5F_ACC_RDONLY, H5P_DEFAULT);
+    ck_assert(file >= 0);
+    hid_t dset = H5Dopen2(file, H5DNAME, H5P_DEFAULT);
+    ck_assert(dset >= 0);
+    hid_t memtype = H5Tcreate(H5T_COMPOUND, sizeof(got[0]));
+    ck_assert(memtype >= 0);
+    ck_assert(H5Tinsert(memtype, "samp_index", 0, H5T_NATIVE_UINT32) >= 0);
+    hid_t space = H5Dget_space(dset);
+    ck_assert(H5Sget_simple_extent_npoints(space) == (hssize_t)nwrite);
+    ck_assert(H5Dread(dset, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                      got) >= 0);
+    ck_assert_int_eq(got[0], 0);
+    ck_assert_int_eq(got[1], 10);
+    ck_assert_int_eq(got[2], 11);
+    ck_assert_int_eq(got[3], 3);
+    H5Sclose(space);
+    H5Tclose(memtype);
+    H5Dclose(dset);
+    H5Fclose(file);
+}
+END_TEST
+
+START_TEST(test_hdf5_gaps)
+{
+    struct ch_storage *chns = hdf5_ch_storage_alloc(H5FILE, H5DNAME);
+    const struct ch_gap gaps[2] = { { 5, 1 }, { 100, 32 } };
+
+    ck_assert(chns != NULL);
+    ck_assert(ch_storage_open(chns, H5F_ACC_TRUNC) == 0);
+    ck_assert(ch_storage_write(chns, &bsmp, 1) == 0);
+    ck_assert(ch_storage_write_gaps(chns, gaps, 2) == 0);
+    ck_assert(ch_storage_close(chns) == 0);
+    ch_storage_free(chns);
+
+    /* Read back the gap table. */
+    struct ch_gap got[2];
+    hid_t file = H5Fopen(H5FILE, H5F_ACC_RDONLY, H5P_DEFAULT);
+    ck_assert(file >= 0);
+    hid_t dset = H5Dopen2(file, H5DNAME "_gaps", H5P_DEFAULT);
+    ck_assert(dset >= 0);
+    hid_t memtype = H5Tcreate(H5T_COMPOUND, sizeof(got[0]));
+    ck_assert(memtype >= 0);
+    ck_assert(H5Tinsert(memtype, "start", HOFFSET(struct ch_gap, start),
+                        H5T_NATIVE_UINT64) >= 0);
+    ck_assert(H5Tinsert(memtype, "len", HOFFSET(struct ch_gap, len),
+                        H5T_NATIVE_UINT64) >= 0);
+    hid_t space = H5Dget_space(dset);
+    ck_assert(H5Sget_simple_extent_npoints(space) == 2);
+    ck_assert(H5Dread(dset, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                      got) >= 0);
+    ck_assert(got[0].start == 5 && got[0].len == 1);
+    ck_assert(got[1].start == 100 && got[1].len == 32);
+    H5Sclose(space);
+    H5Tclose(memtype);
+    H5Dclose(dset);
+    H5Fclose(file);
+}
+END_TEST
+
+/* Tune the dataset, and make sure the file comes out right anyway:
+ * chunked as asked, and trimmed down from the expected size. */
+START_TEST(test_hdf5_opts)
+{
+    struct ch_storage *chns = hdf5_ch_storage_alloc(H5FILE, H5DNAME);
+    struct hdf5_ch_opts opts;
+    struct raw_pkt_bsmp bs[6];
+    const size_t nwrite = 6;
+
+    ck_assert(chns != NULL);
+    hdf5_ch_opts_init(&opts);
+    opts.chunk_nsamps = 0;
+    ck_assert(hdf5_ch_storage_set_opts(chns, &opts) == -1);
+    opts.chunk_nsamps = 4;
+    opts.cache_bytes = 0;
+    opts.alloc_early = 1;
+    opts.latest_format = 1;
+    opts.expected_nsamps = 10;
+    ck_assert(hdf5_ch_storage_set_opts(chns, &opts) == 0);
+    ck_assert(ch_storage_open(chns, H5F_ACC_TRUNC) == 0);
+    for (size_t i = 0; i < nwrite; i++) {
+        bs[i] = bsmp;
+        bs[i].b_sidx = i;
+    }
+    ck_assert(ch_storage_write(chns, bs, 3) == 0);
+    ck_assert(ch_storage_write(chns, bs + 3, 3) == 0);
+    ck_assert(ch_storage_close(chns) == 0);
+    ch_storage_free(chns);
+
+    uint32_t got[6];
+    hsize_t chunk;
+    hid_t file = H5Fopen(H5FILE, H5F_ACC_RDONLY, H5P_DEFAULT);
+    ck_assert(file >= 0);
+    hid_t dset = H5Dopen2(file, H5DNAME, H5P_DEFAULT);
+    ck_assert(dset >= 0);
+    hid_t cprops = H5Dget_create_plist(dset);
+    ck_assert(H5Pget_chunk(cprops, 1, &chunk) == 1);
+    ck_assert_int_eq(chunk, 4);
+    hid_t memtype = H5Tcreate(H5T_COMPOUND, sizeof(got[0]));
+    ck_assert(memtype >= 0);
+    ck_assert(H5Tinsert(memtype, "samp_index", 0, H5T_NATIVE_UINT32) >= 0);
+    hid_t space = H5Dget_space(dset);
+    ck_assert(H5Sget_simple_extent_npoints(space) == (hssize_t)nwrite);
+    ck_assert(H5Dread(dset, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                      got) >= 0);
+    for (size_t i = 0; i < nwrite; i++) {
+        ck_assert_int_eq(got[i], i);
+    }
+    H5Sclose(space);
+    H5Tclose(memtype);
+    H5Pclose(cprops);
+    H5Dclose(dset);
+    H5Fclose(file);
+}
+END_TEST
+
+/* Same file contents, whichever way they get written: direct chunk
+ * writes or not, compressed or not, with overwrites both of chunks
+ * already in the file and of the one still being filled. */
+START_TEST(test_hdf5_direct_chunk)
+{
+    static const int direct[] = { 0, 1, 1 };
+    static const int deflate[] = { 0, 0, 6 };
+    for (size_t t = 0; t < sizeof(direct) / sizeof(direct[0]); t++) {
+        struct ch_storage *chns = hdf5_ch_storage_alloc(H5FILE, H5DNAME);
+        struct hdf5_ch_opts opts;
+        struct raw_pkt_bsmp bs[11];
+        const size_t nwrite = 11;
+
+        ck_assert(chns != NULL);
+        hdf5_ch_opts_init(&opts);
+        opts.chunk_nsamps = 4;
+        opts.direct_chunk = direct[t];
+        opts.deflate = deflate[t];
+        ck_assert(hdf5_ch_storage_set_opts(chns, &opts) == 0);
+        ck_assert(ch_storage_open(chns, H5F_ACC_TRUNC) == 0);
+        for (size_t i = 0; i < nwrite; i++) {
+            bs[i] = bsmp;
+            bs[i].b_sidx = i;
+        }
+        ck_assert(ch_storage_write(chns, bs, 3) == 0);
+        ck_assert(ch_storage_write(chns, bs + 3, 5) == 0);
+        ck_assert(ch_storage_write(chns, bs + 8, 3) == 0);
+        bs[0].b_sidx = 100;
+        bs[1].b_sidx = 101;
+        bs[2].b_sidx = 102;
+        ck_assert(ch_storage_write_at(chns, bs, 3, 2) == 0);
+        ck_assert(ch_storage_write_at(chns, bs, 3, 7) == 0);
+        ck_assert(ch_storage_write_at(chns, bs, 3, 9) == -1);
+        ck_assert(ch_storage_close(chns) == 0);
+        ch_storage_free(chns);
+
+        static const uint32_t want[11] = {
+            0, 1, 100, 101, 102, 5, 6, 100, 101, 102, 10,
+        };
+        uint32_t got[11];
+        hid_t file = H5Fopen(H5FILE, H5F_ACC_RDONLY, H5P_DEFAULT);
+        ck_assert(file >= 0);
+        hid_t dset = H5Dopen2(file, H5DNAME, H5P_DEFAULT);
+        ck_assert(dset >= 0);
+        hid_t cprops = H5Dget_create_plist(dset);
+        ck_assert_int_eq(H5Pget_nfilters(cprops), !!deflate[t]);
+        hid_t memtype = H5Tcreate(H5T_COMPOUND, sizeof(got[0]));
+        ck_assert(memtype >= 0);
+        ck_assert(H5Tinsert(memtype, "samp_index", 0,
+                            H5T_NATIVE_UINT32) >= 0);
+        hid_t space = H5Dget_space(dset);
+        ck_assert(H5Sget_simple_extent_npoints(space) == (hssize_t)nwrite);
+        ck_assert(H5Dread(dset, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                          got) >= 0);
+        for (size_t i = 0; i < nwrite; i++) {
+            ck_assert_int_eq(got[i], want[i]);
+        }
+        H5Sclose(space);
+        H5Tclose(memtype);
+        H5Pclose(cprops);
+        H5Dclose(dset);
+        H5Fclose(file);
+    }
+}
+END_TEST
+
+/* Every transpose16() implementation against the obvious loop, on
+ * sizes that don't fit the SIMD block sizes evenly. */
+START_TEST(test_transpose16)
+{
+    static const size_t sizes[][2] = {
+        { 1, 1 }, { 8, 8 }, { 7, 9 }, { 8, 16 }, { 67, 1120 }, { 130, 37 },
+    };
+    const size_t pad = 3;         /* strides needn't be the widths */
+    const enum transpose16_impl saved = transpose16_get_impl();
+    for (int impl = 0; impl < TRANSPOSE16_NIMPLS; impl++) {
+        if (transpose16_set_impl(impl)) {
+            continue;
+        }
+        for (size_t t = 0; t < sizeof(sizes) / sizeof(sizes[0]); t++) {
+            const size_t nrows = sizes[t][0], ncols = sizes[t][1];
+            const size_t src_stride = ncols + pad, dst_stride = nrows + pad;
+            uint16_t *src = malloc(nrows * src_stride * sizeof(*src));
+            uint16_t *dst = calloc(ncols * dst_stride, sizeof(*dst));
+            ck_assert(src && dst);
+            for (size_t i = 0; i < nrows * src_stride; i++) {
+                src[i] = (uint16_t)(i * 40503u);
+            }
+            transpose16(dst, dst_stride, src, src_stride, nrows, ncols);
+            for (size_t r = 0; r < nrows; r++) {
+                for (size_t c = 0; c < ncols; c++) {
+                    ck_assert_msg(dst[c * dst_stride + r] ==
+                                  src[r * src_stride + c],
+                                  "%s: %zux%zu, at %zu,%zu",
+                                  transpose16_impl_str(impl),
+                                  nrows, ncols, r, c);
+                }
+            }
+            free(src);
+            free(dst);
+        }
+    }
+    ck_assert_int_eq(transpose16_set_impl(saved), 0);
+}
+END_TEST
+
+/* Write with the channel-major layout, with overwrites both of
+ * chunks already in the file and of the one still being filled, and
+ * read channels back one at a time. */
+START_TEST(test_hdf5_channel_major)
+{
+    static const int wire_order[] = { 0, 1, 0 };
+    static const int deflate[] = { 0, 0, 6 };
+    for (size_t t = 0; t < sizeof(deflate) / sizeof(deflate[0]); t++) {
+        struct ch_storage *chns = hdf5_ch_storage_alloc(H5FILE, H5DNAME);
+        struct hdf5_ch_opts opts;
+        struct raw_pkt_bsmp bs[11];
+        const size_t nwrite = 11;
+
+        ck_assert(chns != NULL);
+        hdf5_ch_opts_init(&opts);
+        opts.layout = HDF5_CH_LAYOUT_CHANNELS;
+        opts.col_chunk_nchans = 7;
+        opts.col_chunk_nsamps = 4;
+        opts.deflate = deflate[t];
+        opts.direct_chunk = 1;
+        ck_assert(hdf5_ch_storage_set_opts(chns, &opts) == -1);
+        opts.direct_chunk = 0;
+        ck_assert(hdf5_ch_storage_set_opts(chns, &opts) == 0);
+        if (wire_order[t]) {
+            chns->ch_flags |= CH_STORAGE_WIRE_ORDER;
+        }
+        ck_assert(ch_storage_open(chns, H5F_ACC_TRUNC) == 0);
+        for (size_t i = 0; i < nwrite; i++) {
+            bs[i] = bsmp;
+            bs[i].b_sidx = i;
+            for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+                bs[i].b_samps[j] = (raw_samp_t)(i * RAW_BSMP_NSAMP + j);
+            }
+            if (wire_order[t]) {
+                ck_assert(raw_pkt_hton(&bs[i]) == 0);
+                ck_assert(raw_pkt_ntoh_hdr(&bs[i]) == 0);
+            }
+        }
+        ck_assert(ch_storage_write(chns, bs, 3) == 0);
+        ck_assert(ch_storage_datasync(chns) == 0);
+        ck_assert(ch_storage_write(chns, bs + 3, 5) == 0);
+        ck_assert(ch_storage_write(chns, bs + 8, 3) == 0);
+        ck_assert(ch_storage_write_at(chns, bs + 8, 3, 2) == 0);
+        ck_assert(ch_storage_write_at(chns, bs + 2, 3, 7) == 0);
+        ck_assert(ch_storage_write_at(chns, bs, 3, 9) == -1);
+        ck_assert(ch_storage_close(chns) == 0);
+        ch_storage_free(chns);
+
+        /* Which of bs[] ended up where. */
+        static const uint32_t want[11] = {
+            0, 1, 8, 9, 10, 5, 6, 2, 3, 4, 10,
+        };
+        hid_t file = H5Fopen(H5FILE, H5F_ACC_RDONLY, H5P_DEFAULT);
+        ck_assert(file >= 0);
+        hid_t group = H5Gopen2(file, H5DNAME, H5P_DEFAULT);
+        ck_assert(group >= 0);
+        uint32_t board_id;
+        hid_t attr = H5Aopen(group, "board_id", H5P_DEFAULT);
+        ck_assert(attr >= 0);
+        ck_assert(H5Aread(attr, H5T_NATIVE_UINT32, &board_id) >= 0);
+        ck_assert_int_eq(board_id, BOARD_ID);
+        H5Aclose(attr);
+
+        uint32_t sidx[11];
+        hid_t dset = H5Dopen2(group, "samp_index", H5P_DEFAULT);
+        ck_assert(dset >= 0);
+        hid_t space = H5Dget_space(dset);
+        ck_assert(H5Sget_simple_extent_npoints(space) == (hssize_t)nwrite);
+        ck_assert(H5Dread(dset, H5T_NATIVE_UINT32, H5S_ALL, H5S_ALL,
+                          H5P_DEFAULT, sidx) >= 0);
+        for (size_t i = 0; i < nwrite; i++) {
+            ck_assert_int_eq(sidx[i], want[i]);
+        }
+        H5Sclose(space);
+        H5Dclose(dset);
+
+        dset = H5Dopen2(group, "samples", H5P_DEFAULT);
+        ck_assert(dset >= 0);
+        hid_t cprops = H5Dget_create_plist(dset);
+        hsize_t chunk[2];
+        ck_assert(H5Pget_chunk(cprops, 2, chunk) == 2);
+        ck_assert_int_eq(chunk[0], 7);
+        ck_assert_int_eq(chunk[1], 4);
+        ck_assert_int_eq(H5Pget_nfilters(cprops), !!deflate[t]);
+        H5Pclose(cprops);
+        space = H5Dget_space(dset);
+        hsize_t dims[2];
+        ck_assert(H5Sget_simple_extent_dims(space, dims, NULL) == 2);
+        ck_assert_int_eq(dims[0], RAW_BSMP_NSAMP);
+        ck_assert_int_eq(dims[1], nwrite);
+        static const size_t chans[] = { 0, 6, 7, RAW_BSMP_NSAMP - 1 };
+        for (size_t c = 0; c < sizeof(chans) / sizeof(chans[0]); c++) {
+            raw_samp_t got[11];
+            hsize_t start[2] = { chans[c], 0 };
+            hsize_t count[2] = { 1, nwrite };
+            hsize_t mdim = nwrite;
+            hid_t mspace = H5Screate_simple(1, &mdim, NULL);
+            ck_assert(H5Sselect_hyperslab(space, H5S_SELECT_SET, start,
+                                          NULL, count, NULL) >= 0);
+            ck_assert(H5Dread(dset, H5T_NATIVE_UINT16, mspace, space,
+                              H5P_DEFAULT, got) >= 0);
+            for (size_t i = 0; i < nwrite; i++) {
+                ck_assert_int_eq(got[i], (raw_samp_t)(want[i] *
+                                                      RAW_BSMP_NSAMP +
+                                                      chans[c]));
+            }
+            H5Sclose(mspace);
+        }
+        H5Sclose(space);
+        H5Dclose(dset);
+        H5Gclose(group);
+        H5Fclose(file);
+    }
+}
+END_TEST
+
+/* Compressed files read back through HDF5's own filter pipeline,
+ * whichever thread compressed each chunk, with overwrites both of
+ * chunks already handed off and of the one still being filled. */
+START_TEST(test_hdf5_compress)
+{
+    static const int codec[] = {
+        COMPRESS_SHUFFLE_LZ4, COMPRESS_SHUFFLE_ZSTD, COMPRESS_LZ4,
+        COMPRESS_SHUFFLE_ZSTD,
+    };
+    static const size_t nthreads[] = { 0, 3, 1, 2 };
+    static const int layout[] = {
+        HDF5_CH_LAYOUT_ROWS, HDF5_CH_LAYOUT_ROWS, HDF5_CH_LAYOUT_ROWS,
+        HDF5_CH_LAYOUT_CHANNELS,
+    };
+    enum { NWRITE = 23 };
+    static struct raw_pkt_bsmp bs[NWRITE];
+    static const uint32_t want[NWRITE] = {
+        0, 1, 20, 21, 22, 5, 6, 7, 8, 9, 10, 11,
+        12, 13, 14, 15, 16, 17, 18, 5, 6, 7, 22,
+    };
+    for (size_t i = 0; i < NWRITE; i++) {
+        bs[i] = bsmp;
+        bs[i].b_sidx = i;
+        for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+            bs[i].b_samps[j] = (raw_samp_t)(32768 + j % 64 + i * 3);
+        }
+    }
+
+    struct ch_storage *chns = hdf5_ch_storage_alloc(H5FILE, H5DNAME);
+    struct hdf5_ch_opts opts;
+    ck_assert(chns != NULL);
+    hdf5_ch_opts_init(&opts);
+    opts.compress = COMPRESS_DELTA_ZSTD;
+    ck_assert(hdf5_ch_storage_set_opts(chns, &opts) == -1);
+    opts.compress = COMPRESS_SHUFFLE_LZ4;
+    opts.deflate = 1;
+    ck_assert(hdf5_ch_storage_set_opts(chns, &opts) == -1);
+    ch_storage_free(chns);
+
+    for (size_t t = 0; t < sizeof(codec) / sizeof(codec[0]); t++) {
+        chns = hdf5_ch_storage_alloc(H5FILE, H5DNAME);
+        ck_assert(chns != NULL);
+        hdf5_ch_opts_init(&opts);
+        opts.chunk_nsamps = 4;
+        opts.col_chunk_nchans = 7;
+        opts.col_chunk_nsamps = 4;
+        opts.layout = layout[t];
+        opts.compress = codec[t];
+        opts.compress_threads = nthreads[t];
+        ck_assert(hdf5_ch_storage_set_opts(chns, &opts) == 0);
+        ck_assert(ch_storage_open(chns, H5F_ACC_TRUNC) == 0);
+        ck_assert(ch_storage_write(chns, bs, 3) == 0);
+        ck_assert(ch_storage_datasync(chns) == 0);
+        ck_assert(ch_storage_write(chns, bs + 3, 9) == 0);
+        ck_assert(ch_storage_write(chns, bs + 12, 11) == 0);
+        ck_assert(ch_storage_write_at(chns, bs + 20, 3, 2) == 0);
+        ck_assert(ch_storage_write_at(chns, bs + 5, 3, 19) == 0);
+        ck_assert(ch_storage_close(chns) == 0);
+
+        struct ch_storage_stats stats;
+        ck_assert(ch_storage_stats(chns, &stats) == 0);
+        ck_assert_int_eq(stats.nbytes_in, sizeof(bs));
+        ck_assert_int_gt(stats.nbytes_out, 0);
+        ck_assert_int_lt(stats.nbytes_out, stats.nbytes_in);
+        if (layout[t] == HDF5_CH_LAYOUT_ROWS) {
+            /* (The channel-major chunks here are tiny, and don't
+             * compress nearly as well.) */
+            uint64_t nbytes = 0;
+            ck_assert_int_lt(stats.nbytes_out, stats.nbytes_in / 4);
+            ck_assert_int_eq(stats.nthreads,
+                             nthreads[t] ? nthreads[t] : 1);
+            for (size_t i = 0; i < stats.nthreads; i++) {
+                nbytes += stats.threads[i].nbytes_in;
+            }
+            ck_assert_int_ge(nbytes, sizeof(bs));
+        } else {
+            ck_assert_int_eq(stats.nthreads, 0);
+        }
+        ch_storage_free(chns);
+
+        static raw_samp_t samps[RAW_BSMP_NSAMP * NWRITE];
+        uint32_t sidx[NWRITE];
+        hid_t file = H5Fopen(H5FILE, H5F_ACC_RDONLY, H5P_DEFAULT);
+        ck_assert(file >= 0);
+        hid_t dset;
+        if (layout[t] == HDF5_CH_LAYOUT_ROWS) {
+            struct {
+                uint32_t sidx;
+                raw_samp_t samps[RAW_BSMP_NSAMP];
+            } *got = malloc(NWRITE * sizeof(*got));
+            hsize_t nsamps = RAW_BSMP_NSAMP;
+            hid_t arrtype = H5Tarray_create2(H5T_NATIVE_UINT16, 1, &nsamps);
+            hid_t memtype = H5Tcreate(H5T_COMPOUND, sizeof(*got));
+            ck_assert(got != NULL);
+            ck_assert(H5Tinsert(memtype, "samp_index", 0,
+                                H5T_NATIVE_UINT32) >= 0);
+            ck_assert(H5Tinsert(memtype, "samples",
+                                offsetof(__typeof__(*got), samps),
+                                arrtype) >= 0);
+            dset = H5Dopen2(file, H5DNAME, H5P_DEFAULT);
+            ck_assert(dset >= 0);
+            ck_assert(H5Dread(dset, memtype, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                              got) >= 0);
+            for (size_t i = 0; i < NWRITE; i++) {
+                sidx[i] = got[i].sidx;
+                for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+                    samps[j * NWRITE + i] = got[i].samps[j];
+                }
+            }
+            H5Tclose(memtype);
+            H5Tclose(arrtype);
+            free(got);
+        } else {
+            hid_t col = H5Dopen2(file, H5DNAME "/samp_index", H5P_DEFAULT);
+            ck_assert(col >= 0);
+            ck_assert(H5Dread(col, H5T_NATIVE_UINT32, H5S_ALL, H5S_ALL,
+                              H5P_DEFAULT, sidx) >= 0);
+            H5Dclose(col);
+            dset = H5Dopen2(file, H5DNAME "/samples", H5P_DEFAULT);
+            ck_assert(dset >= 0);
+            ck_assert(H5Dread(dset, H5T_NATIVE_UINT16, H5S_ALL, H5S_ALL,
+                              H5P_DEFAULT, samps) >= 0);
+        }
+        for (size_t i = 0; i < NWRITE; i++) {
+            ck_assert_int_eq(sidx[i], want[i]);
+            for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+                ck_assert_int_eq(samps[j * NWRITE + i],
+                                 bs[want[i]].b_samps[j]);
+            }
+        }
+
+        /* The last filter is the compressor, by its registered ID. */
+        const int shuffled = codec[t] != COMPRESS_LZ4;
+        hid_t cprops = H5Dget_create_plist(dset);
+        unsigned flags;
+        size_t ncd = 0;
+        ck_assert_int_eq(H5Pget_nfilters(cprops), shuffled ? 2 : 1);
+        ck_assert(H5Pget_filter2(cprops, shuffled, &flags, &ncd, NULL, 0,
+                                 NULL, NULL) ==
+                  (codec[t] == COMPRESS_SHUFFLE_ZSTD ?
+                   COMPRESS_H5Z_ZSTD : COMPRESS_H5Z_LZ4));
+        H5Pclose(cprops);
+        H5Dclose(dset);
+        H5Fclose(file);
+    }
+}
+END_TEST
+
 Suite* hdf5_suite(void)
 {
     Suite *s = suite_create("hdf5");
     TCase *tc_hdf5 = tcase_create("hdf5");
     tcase_add_test(tc_hdf5, test_hdf5_end_to_end);
+    tcase_add_test(tc_hdf5, test_hdf5_wire_order);
+    tcase_add_test(tc_hdf5, test_hdf5_write_at);
+    tcase_add_test(tc_hdf5, test_hdf5_gaps);
+    tcase_add_test(tc_hdf5, test_hdf5_opts);
+    tcase_add_test(tc_hdf5, test_hdf5_direct_chunk);
+    tcase_add_test(tc_hdf5, test_transpose16);
+    tcase_add_test(tc_hdf5, test_hdf5_channel_major);
+    tcase_add_test(tc_hdf5, test_hdf5_compress);
     suite_add_tcase(s, tc_hdf5);
     return s;
 }
@@ -0,0 +1,258 @@
+#include "raw_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ch_storage.h"
+#include "raw_ch_storage.h"
+#include "raw_packets.h"
+#include "test.h"
+#include "type_attrs.h"
+
+#define RAWFILE "test-raw-file.raw"
+#define NSAMPS 3000
+#define JUMP_AT 1500            /* b_sidx skips ahead here, */
+#define JUMP 100                /* by this much */
+#define PATCH_AT 1490           /* then ch_storage_write_at() moves */
+#define PATCH_N 20              /* these records' b_sidx up */
+#define PATCH 50                /* by this much */
+
+static struct raw_pkt_bsmp bs[NSAMPS];
+
+static uint32_t want_sidx(size_t i)
+{
+    return (uint32_t)(i + (i >= JUMP_AT ? JUMP : 0) + 7);
+}
+
+static void setup_bsamps(void)
+{
+    for (size_t i = 0; i < NSAMPS; i++) {
+        raw_packet_init(&bs[i], RAW_MTYPE_BSMP, 0);
+        bs[i].b_cookie_h = 0xc0;
+        bs[i].b_cookie_l = 0x1e;
+        bs[i].b_id = 3;
+        bs[i].b_sidx = want_sidx(i);
+        for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+            bs[i].b_samps[j] = (raw_samp_t)(i + j);
+        }
+    }
+}
+
+static void teardown_bsamps(void)
+{
+    unlink(RAWFILE);
+}
+
+/* Store bs with the raw backend, a few hundred at a time, then patch
+ * PATCH_N of them. */
+static void write_file(void)
+{
+    struct ch_storage *chns = raw_ch_storage_alloc(RAWFILE, 0644);
+    ck_assert(chns != NULL);
+    ck_assert(ch_storage_open(chns, O_CREAT | O_RDWR | O_TRUNC) != -1);
+    for (size_t i = 0; i < NSAMPS; i += 300) {
+        ck_assert(ch_storage_write(chns, bs + i, 300) == 0);
+    }
+    struct raw_pkt_bsmp patch[PATCH_N];
+    memcpy(patch, bs + PATCH_AT, sizeof(patch));
+    for (size_t i = 0; i < PATCH_N; i++) {
+        patch[i].b_sidx = (uint32_t)(PATCH_AT + i + PATCH + 7);
+    }
+    ck_assert(ch_storage_write_at(chns, patch, PATCH_N, PATCH_AT) == 0);
+    memcpy(bs + PATCH_AT, patch, sizeof(patch));
+    struct ch_gap gap = { .start = JUMP_AT, .len = JUMP };
+    ck_assert(ch_storage_write_gaps(chns, &gap, 1) == 0);
+    ck_assert(ch_storage_close(chns) == 0);
+    ch_storage_free(chns);
+}
+
+/* Every board sample is where its b_sidx says it is, and the ones
+ * that aren't there can't be found. */
+static void check_find(const struct raw_file *rf)
+{
+    for (size_t i = 0; i < rf->nsamps; i++) {
+        uint64_t rec = UINT64_MAX;
+        const struct raw_pkt_bsmp *got = raw_file_find(rf, bs[i].b_sidx,
+                                                       &rec);
+        ck_assert(got == raw_file_bsmp(rf, i));
+        ck_assert_int_eq(rec, i);
+        ck_assert(!memcmp(got, &bs[i], sizeof(*got)));
+    }
+    ck_assert(raw_file_find(rf, 0, NULL) == NULL);
+    ck_assert(raw_file_find(rf, want_sidx(PATCH_AT), NULL) == NULL);
+    ck_assert(raw_file_find(rf, want_sidx(JUMP_AT) - 1, NULL) == NULL);
+    ck_assert(raw_file_find(rf, bs[rf->nsamps - 1].b_sidx + 1,
+                            NULL) == NULL);
+}
+
+START_TEST(test_raw_file)
+{
+    write_file();
+    struct raw_file *rf = raw_file_open(RAWFILE);
+    ck_assert(rf != NULL);
+    ck_assert(!strcmp(rf->hdr->rf_magic, RAW_FILE_MAGIC));
+    ck_assert_int_eq(rf->hdr->rf_hdr_size, RAW_FILE_HDR_SIZE);
+    ck_assert_int_eq(rf->hdr->rf_flags, 0);
+    ck_assert_int_eq(rf->hdr->rf_nchips * rf->hdr->rf_nchans,
+                     RAW_BSMP_NSAMP);
+    ck_assert(rf->hdr->rf_cookie == raw_exp_cookie(&bs[0]));
+    ck_assert_int_eq(rf->hdr->rf_board_id, 3);
+    ck_assert_int_eq(rf->hdr->rf_start_sidx, 7);
+    ck_assert(rf->footer != NULL);
+    ck_assert_int_eq(rf->nsamps, NSAMPS);
+    ck_assert(raw_file_bsmp(rf, NSAMPS) == NULL);
+    ck_assert_int_eq(rf->ngaps, 1);
+    ck_assert_int_eq(rf->gaps[0].start, JUMP_AT);
+    ck_assert_int_eq(rf->gaps[0].len, JUMP);
+
+    /* Every RAW_FILE_INDEX_STRIDE-th record, and where b_sidx jumps:
+     * at the patch, after it, and at JUMP_AT (inside the patch, so
+     * the entry after it takes its place). */
+    static const uint64_t index[] = {
+        0, PATCH_AT, PATCH_AT + PATCH_N, 2048,
+    };
+    ck_assert_int_eq(rf->nindex, sizeof(index) / sizeof(index[0]) + 1);
+    for (size_t i = 0, j = 0; i < rf->nindex; i++) {
+        if (rf->index[i].ri_rec == 1024) {
+            continue;
+        }
+        ck_assert_int_eq(rf->index[i].ri_rec, index[j++]);
+        ck_assert_int_eq(rf->index[i].ri_sidx,
+                         bs[rf->index[i].ri_rec].b_sidx);
+    }
+    check_find(rf);
+    raw_file_close(rf);
+}
+END_TEST
+
+/* A file that was never closed has no footer, so its records are
+ * counted from its size, and searched without an index. */
+START_TEST(test_raw_file_unclosed)
+{
+    write_file();
+    const size_t nsamps = 1700;
+    ck_assert(truncate(RAWFILE, (RAW_FILE_HDR_SIZE +
+                                 nsamps * sizeof(struct raw_pkt_bsmp) +
+                                 100)) == 0);
+    struct raw_file *rf = raw_file_open(RAWFILE);
+    ck_assert(rf != NULL);
+    ck_assert(rf->footer == NULL);
+    ck_assert_int_eq(rf->nsamps, nsamps);
+    ck_assert_int_eq(rf->nindex, 0);
+    ck_assert_int_eq(rf->ngaps, 0);
+    check_find(rf);
+    raw_file_close(rf);
+}
+END_TEST
+
+/* With no discontinuities, finding a board sample is arithmetic;
+ * check it gets the same answers, with a footer and without. */
+START_TEST(test_raw_file_seq)
+{
+    for (size_t i = 0; i < NSAMPS; i++) {
+        bs[i].b_sidx = (uint32_t)(i + 7);
+    }
+    struct ch_storage *chns = raw_ch_storage_alloc(RAWFILE, 0644);
+    ck_assert(chns != NULL);
+    ck_assert(ch_storage_open(chns, O_CREAT | O_RDWR | O_TRUNC) != -1);
+    ck_assert(ch_storage_write(chns, bs, NSAMPS) == 0);
+    ck_assert(ch_storage_close(chns) == 0);
+    ch_storage_free(chns);
+
+    for (int closed = 1; closed >= 0; closed--) {
+        if (!closed) {
+            ck_assert(truncate(RAWFILE,
+                               (RAW_FILE_HDR_SIZE +
+                                (NSAMPS - 1) *
+                                sizeof(struct raw_pkt_bsmp))) == 0);
+        }
+        struct raw_file *rf = raw_file_open(RAWFILE);
+        ck_assert(rf != NULL);
+        ck_assert((rf->footer != NULL) == closed);
+        ck_assert_int_eq(rf->nsamps, NSAMPS - !closed);
+        for (size_t i = 0; i < rf->nsamps; i++) {
+            uint64_t rec = UINT64_MAX;
+            ck_assert(raw_file_find(rf, bs[i].b_sidx, &rec) ==
+                      raw_file_bsmp(rf, i));
+            ck_assert_int_eq(rec, i);
+        }
+        ck_assert(raw_file_find(rf, 6, NULL) == NULL);
+        ck_assert(raw_file_find(rf, 0, NULL) == NULL);
+        ck_assert(raw_file_find(rf, (uint32_t)(rf->nsamps + 7),
+                                NULL) == NULL);
+        raw_file_close(rf);
+    }
+}
+END_TEST
+
+/* Overwrite len bytes at off with x, and try to open the result. */
+static struct raw_file* open_corrupt(off_t off, const void *x, size_t len)
+{
+    int fd = open(RAWFILE, O_WRONLY);
+    ck_assert(fd != -1);
+    ck_assert(pwrite(fd, x, len, off) == (ssize_t)len);
+    close(fd);
+    errno = 0;
+    return raw_file_open(RAWFILE);
+}
+
+START_TEST(test_raw_file_bad)
+{
+    errno = 0;
+    ck_assert(raw_file_open(RAWFILE) == NULL);
+    ck_assert_int_eq(errno, ENOENT);
+
+    /* Footer offsets past the end */
+    write_file();
+    struct stat st;
+    ck_assert(stat(RAWFILE, &st) == 0);
+    off_t footer = st.st_size - (off_t)sizeof(struct raw_file_footer);
+    uint64_t bad = UINT64_MAX / 2;
+    ck_assert(open_corrupt(footer + offsetof(struct raw_file_footer,
+                                             rf_index_off),
+                           &bad, sizeof(bad)) == NULL);
+    ck_assert_int_eq(errno, EINVAL);
+
+    /* Another machine's byte order */
+    uint32_t bom = __builtin_bswap32(RAW_FILE_BOM);
+    ck_assert(open_corrupt(offsetof(struct raw_file_header, rf_bom),
+                           &bom, sizeof(bom)) == NULL);
+    ck_assert_int_eq(errno, ENOTSUP);
+
+    /* Not a raw file at all */
+    ck_assert(open_corrupt(0, "LSDRAX", 6) == NULL);
+    ck_assert_int_eq(errno, EINVAL);
+    ck_assert(truncate(RAWFILE, 10) == 0);
+    errno = 0;
+    ck_assert(raw_file_open(RAWFILE) == NULL);
+    ck_assert_int_eq(errno, EINVAL);
+}
+END_TEST
+
+Suite* raw_file_suite(void)
+{
+    Suite *s = suite_create("raw_file");
+    TCase *tc = tcase_create("raw_file");
+    tcase_add_checked_fixture(tc, setup_bsamps, teardown_bsamps);
+    tcase_add_test(tc, test_raw_file);
+    tcase_add_test(tc, test_raw_file_unclosed);
+    tcase_add_test(tc, test_raw_file_seq);
+    tcase_add_test(tc, test_raw_file_bad);
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+int main(__unused int argc, __unused char *argv[])
+{
+    Suite *s = raw_file_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    int n_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -2,12 +2,15 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <netinet/in.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include "test.h"
 
+#include "bswap16.h"
+
 /* A socket pair to send and receive packets. */
 int sockfd[2];
 
@@ -247,6 +250,190 @@ START_TEST(test_roundtrips)
 }
 END_TEST
 
+/* Every byte swap implementation the CPU supports must agree with the
+ * scalar one, including on lengths that leave a partial vector at the
+ * end, and when the array isn't aligned. */
+START_TEST(test_bswap_impls)
+{
+    enum { MAXLEN = RAW_BSMP_NSAMP + 17 };
+    static uint16_t orig[MAXLEN + 1];
+    static uint16_t want[MAXLEN + 1];
+    static uint16_t got[MAXLEN + 1];
+    const enum bswap16_impl saved = bswap16_get_impl();
+    const size_t lens[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 33,
+                            RAW_BSUB_NSAMP, RAW_BSMP_NSAMP, MAXLEN };
+
+    srand(0x1eaf);
+    for (size_t i = 0; i <= MAXLEN; i++) {
+        orig[i] = (uint16_t)rand();
+    }
+    for (int impl = 0; impl < BSWAP16_NIMPLS; impl++) {
+        if (!bswap16_impl_supported(impl)) {
+            continue;
+        }
+        ck_assert_int_eq(bswap16_set_impl(impl), 0);
+        for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+            for (size_t off = 0; off < 2; off++) {
+                size_t n = lens[l] - (lens[l] && off);
+                memcpy(want, orig, sizeof(orig));
+                memcpy(got, orig, sizeof(orig));
+                for (size_t i = 0; i < n; i++) {
+                    want[off + i] = ntohs(want[off + i]);
+                }
+                bswap16_buf(got + off, n);
+                ck_assert_msg(!memcmp(got, want, sizeof(got)),
+                              "%s: mismatch, n=%zu, off=%zu",
+                              bswap16_impl_str(impl), n, off);
+            }
+        }
+    }
+    ck_assert_int_eq(bswap16_set_impl(saved), 0);
+}
+END_TEST
+
+/* Packet conversion gives the same bytes whichever byte swap
+ * implementation is in use. */
+START_TEST(test_bsmp_hton_impls)
+{
+    static struct raw_pkt_bsmp want;
+    static struct raw_pkt_bsmp got;
+    const enum bswap16_impl saved = bswap16_get_impl();
+
+    for (size_t i = 0; i < RAW_BSMP_NSAMP; i++) {
+        bsmp1->b_samps[i] = (raw_samp_t)(i * 0x0101 + 3);
+    }
+    ck_assert_int_eq(bswap16_set_impl(BSWAP16_SCALAR), 0);
+    raw_pkt_copy(&want, bsmp1);
+    ck_assert_int_eq(raw_pkt_hton(&want), 0);
+    for (int impl = 0; impl < BSWAP16_NIMPLS; impl++) {
+        if (bswap16_set_impl(impl)) {
+            continue;
+        }
+        raw_pkt_copy(&got, bsmp1);
+        ck_assert_int_eq(raw_pkt_hton(&got), 0);
+        ck_assert_msg(!memcmp(&got, &want, sizeof(got)),
+                      "%s: hton mismatch", bswap16_impl_str(impl));
+        ck_assert_int_eq(raw_pkt_ntoh(&got), 0);
+        ck_assert_msg(!memcmp(&got, bsmp1, sizeof(got)),
+                      "%s: ntoh mismatch", bswap16_impl_str(impl));
+    }
+    ck_assert_int_eq(bswap16_set_impl(saved), 0);
+}
+END_TEST
+
+/* raw_pkt_ntoh_hdr() converts the header but leaves samples in
+ * network byte order, and raw_pkt_hton() undoes it exactly. */
+START_TEST(test_bsmp_ntoh_hdr)
+{
+    static struct raw_pkt_bsmp wire;
+    static struct raw_pkt_bsmp got;
+
+    for (size_t i = 0; i < RAW_BSMP_NSAMP; i++) {
+        bsmp1->b_samps[i] = (raw_samp_t)(i * 0x0101 + 3);
+    }
+    raw_pkt_copy(&wire, bsmp1);
+    ck_assert_int_eq(raw_pkt_hton(&wire), 0);
+    raw_pkt_copy(&got, &wire);
+    ck_assert_int_eq(raw_pkt_ntoh_hdr(&got), 0);
+    ck_assert(got.ph.p_flags & RAW_PFLAG_B_SAMPS_BE);
+    ck_assert_int_eq(got.ph.p_flags & ~RAW_PFLAG_B_SAMPS_BE,
+                     bsmp1->ph.p_flags);
+    ck_assert_int_eq(got.b_id, bsmp1->b_id);
+    ck_assert_int_eq(got.b_sidx, bsmp1->b_sidx);
+    ck_assert_int_eq(got.b_chip_live, bsmp1->b_chip_live);
+    ck_assert_int_eq(raw_exp_cookie(&got), raw_exp_cookie(bsmp1));
+    ck_assert(!memcmp(got.b_samps, wire.b_samps, sizeof(got.b_samps)));
+    ck_assert_int_eq(raw_pkt_hton(&got), 0);
+    ck_assert(!memcmp(&got, &wire, sizeof(got)));
+}
+END_TEST
+
+START_TEST(test_check_wire)
+{
+    static struct raw_pkt_bsmp wire;
+    struct raw_pkt_bsub sub;
+
+    raw_pkt_copy(&wire, bsmp1);
+    ck_assert_int_eq(raw_pkt_hton(&wire), 0);
+    raw_pkt_copy(&sub, bsub1);
+    ck_assert_int_eq(raw_pkt_hton(&sub), 0);
+    ck_assert_int_eq(raw_pkt_check_wire(&wire, sizeof(wire)), RAW_MTYPE_BSMP);
+    ck_assert_int_eq(raw_pkt_check_wire(&sub, sizeof(sub)), RAW_MTYPE_BSUB);
+    ck_assert_int_eq(raw_pkt_check_wire(&wire, sizeof(wire) - 1), -1);
+    ck_assert_int_eq(raw_pkt_check_wire(&sub, sizeof(wire)), -1);
+    ck_assert_int_eq(raw_pkt_check_wire(req1, sizeof(*req1)), -1);
+    ck_assert_int_eq(raw_pkt_check_wire(&wire, 2), -1);
+    wire.ph._p_magic ^= 1;
+    ck_assert_int_eq(raw_pkt_check_wire(&wire, sizeof(wire)), -1);
+}
+END_TEST
+
+/* A nonblocking UDP socket bound to an ephemeral loopback port. */
+static int loopback_udp(struct sockaddr_in *addr)
+{
+    socklen_t len = sizeof(*addr);
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    ck_assert(fd != -1);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ck_assert(bind(fd, (struct sockaddr*)addr, sizeof(*addr)) == 0);
+    ck_assert(getsockname(fd, (struct sockaddr*)addr, &len) == 0);
+    return fd;
+}
+
+static void send_bsmp_to(int fd, struct sockaddr_in *to, uint32_t sidx,
+                         uint8_t magic, size_t len)
+{
+    struct raw_pkt_bsmp pkt;
+    raw_pkt_copy(&pkt, bsmp1);
+    pkt.b_sidx = sidx;
+    ck_assert(raw_pkt_hton(&pkt) == 0);
+    pkt.ph._p_magic = magic;
+    ck_assert(sendto(fd, &pkt, len, 0, (struct sockaddr*)to,
+                     sizeof(*to)) == (ssize_t)len);
+}
+
+/* The kernel filter only lets through well-formed packets of the
+ * right type from the right address. */
+START_TEST(test_data_filter)
+{
+    struct sockaddr_in rx_addr, good_addr, bad_addr;
+    int rx = loopback_udp(&rx_addr);
+    int good = loopback_udp(&good_addr);
+    int bad = loopback_udp(&bad_addr);
+    const size_t bsmp_len = sizeof(struct raw_pkt_bsmp);
+    struct raw_pkt_bsmp got;
+
+    ck_assert(raw_data_filter_attach(rx, (struct sockaddr*)&good_addr,
+                                     RAW_MTYPE_BSMP) == 0);
+    send_bsmp_to(bad, &rx_addr, 1, RAW_PKT_HEADER_MAGIC, bsmp_len);
+    send_bsmp_to(good, &rx_addr, 2, RAW_PKT_HEADER_MAGIC ^ 1, bsmp_len);
+    send_bsmp_to(good, &rx_addr, 3, RAW_PKT_HEADER_MAGIC, bsmp_len - 2);
+    struct raw_pkt_bsub sub;
+    raw_pkt_copy(&sub, bsub1);
+    ck_assert(raw_pkt_hton(&sub) == 0);
+    ck_assert(sendto(good, &sub, sizeof(sub), 0, (struct sockaddr*)&rx_addr,
+                     sizeof(rx_addr)) == (ssize_t)sizeof(sub));
+    send_bsmp_to(good, &rx_addr, 4, RAW_PKT_HEADER_MAGIC, bsmp_len);
+
+    /* Only the last one should have made it. */
+    ck_assert(recv(rx, &got, sizeof(got), 0) == (ssize_t)bsmp_len);
+    ck_assert(raw_pkt_ntoh(&got) == 0);
+    ck_assert_int_eq(got.b_sidx, 4);
+    ck_assert(recv(rx, &got, sizeof(got), 0) == -1 && errno == EAGAIN);
+
+    /* Now drop everything. */
+    ck_assert(raw_data_filter_attach(rx, NULL, 0) == 0);
+    send_bsmp_to(good, &rx_addr, 5, RAW_PKT_HEADER_MAGIC, bsmp_len);
+    ck_assert(recv(rx, &got, sizeof(got), 0) == -1 && errno == EAGAIN);
+
+    close(rx);
+    close(good);
+    close(bad);
+}
+END_TEST
+
 Suite* raw_packet_suite(void)
 {
     Suite *s = suite_create("raw_packet");
@@ -255,6 +442,11 @@ Suite* raw_packet_suite(void)
     tcase_add_test(tc, test_sizes_packing);
     tcase_add_test(tc, test_copy);
     tcase_add_test(tc, test_roundtrips);
+    tcase_add_test(tc, test_bswap_impls);
+    tcase_add_test(tc, test_bsmp_hton_impls);
+    tcase_add_test(tc, test_bsmp_ntoh_hdr);
+    tcase_add_test(tc, test_check_wire);
+    tcase_add_test(tc, test_data_filter);
     suite_add_tcase(s, tc);
     return s;
 }
@@ -0,0 +1,216 @@
+#include "shm_ring.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "raw_packets.h"
+#include "sockutil.h"
+#include "test.h"
+#include "type_attrs.h"
+
+#define NSLOTS 8
+
+struct pkt {
+    uint32_t idx;
+    uint32_t fill[15];
+};
+
+struct shm_ring *wr;
+struct shm_ring *rd;
+
+static void setup_ring(void)
+{
+    wr = shm_ring_create("test-shm-ring", NSLOTS, sizeof(struct pkt));
+    rd = wr ? shm_ring_attach(dup(wr->fd)) : NULL;
+}
+
+static void teardown_ring(void)
+{
+    shm_ring_free(rd);
+    shm_ring_free(wr);
+    rd = wr = NULL;
+}
+
+static void publish(uint8_t mtype, uint32_t idx)
+{
+    struct pkt *p = shm_ring_begin(wr, mtype);
+    p->idx = idx;
+    for (size_t i = 0; i < sizeof(p->fill) / sizeof(p->fill[0]); i++) {
+        p->fill[i] = idx;
+    }
+    shm_ring_commit(wr, sizeof(*p), idx);
+}
+
+START_TEST(test_create_attach)
+{
+    ck_assert(wr != NULL);
+    ck_assert(rd != NULL);
+    ck_assert_int_eq(rd->hdr->sh_nslots, NSLOTS);
+    ck_assert_int_eq(rd->hdr->sh_slot_size % SHM_RING_ALIGN, 0);
+    ck_assert_int_ge(shm_ring_pkt_size(rd), sizeof(struct pkt));
+    ck_assert(shm_ring_create("test-shm-ring", 0, 1) == NULL);
+
+    /* Rounded up to a power of two. */
+    struct shm_ring *r = shm_ring_create("test-shm-ring", 5, 1);
+    ck_assert(r != NULL);
+    ck_assert_int_eq(r->hdr->sh_nslots, 8);
+    shm_ring_free(r);
+
+    /* Not a ring. */
+    int fds[2];
+    ck_assert_int_eq(pipe(fds), 0);
+    ck_assert(shm_ring_attach(fds[0]) == NULL);
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+START_TEST(test_read)
+{
+    struct pkt p;
+    ck_assert_int_eq(shm_ring_read(rd, &p, sizeof(p)), 0);
+    for (uint32_t i = 0; i < 3 * NSLOTS; i++) {
+        publish(RAW_MTYPE_BSMP, i);
+        ck_assert_int_eq(shm_ring_read(rd, &p, sizeof(p)), sizeof(p));
+        ck_assert_int_eq(p.idx, i);
+        ck_assert_int_eq(rd->hdr->sh_sidx, i);
+    }
+    ck_assert_int_eq(shm_ring_read(rd, &p, sizeof(p)), 0);
+    ck_assert_int_eq(rd->nlost, 0);
+
+    /* A new kind of packet starts a new generation. */
+    uint32_t gen = rd->gen;
+    publish(RAW_MTYPE_BSMP, 100);
+    ck_assert_int_eq(shm_ring_read(rd, &p, sizeof(p)), sizeof(p));
+    ck_assert_int_eq(rd->gen, gen);
+    publish(RAW_MTYPE_BSUB, 101);
+    ck_assert_int_eq(shm_ring_read(rd, &p, sizeof(p)), sizeof(p));
+    ck_assert_int_ne(rd->gen, gen);
+    ck_assert_int_eq(rd->hdr->sh_mtype, RAW_MTYPE_BSUB);
+    gen = rd->gen;
+    shm_ring_restart(wr);
+    publish(RAW_MTYPE_BSUB, 102);
+    ck_assert_int_eq(shm_ring_read(rd, &p, sizeof(p)), sizeof(p));
+    ck_assert_int_ne(rd->gen, gen);
+
+    /* Too big for the caller's buffer: skipped. */
+    publish(RAW_MTYPE_BSUB, 103);
+    ck_assert_int_eq(shm_ring_read(rd, &p, sizeof(p) - 1), 0);
+    ck_assert_int_eq(rd->nlost, 1);
+}
+END_TEST
+
+START_TEST(test_overrun)
+{
+    struct pkt p;
+    for (uint32_t i = 0; i < 3 * NSLOTS + 2; i++) {
+        publish(RAW_MTYPE_BSMP, i);
+    }
+    /* We get the last ring's worth, and hear about the rest. */
+    for (uint32_t i = 2 * NSLOTS + 2; i < 3 * NSLOTS + 2; i++) {
+        ck_assert_int_eq(shm_ring_read(rd, &p, sizeof(p)), sizeof(p));
+        ck_assert_int_eq(p.idx, i);
+    }
+    ck_assert_int_eq(shm_ring_read(rd, &p, sizeof(p)), 0);
+    ck_assert_int_eq(rd->nlost, 2 * NSLOTS + 2);
+}
+END_TEST
+
+START_TEST(test_late_reader)
+{
+    /* Readers start at the write index. */
+    publish(RAW_MTYPE_BSMP, 1);
+    struct shm_ring *late = shm_ring_attach(dup(wr->fd));
+    ck_assert(late != NULL);
+    struct pkt p;
+    ck_assert_int_eq(shm_ring_read(late, &p, sizeof(p)), 0);
+    publish(RAW_MTYPE_BSMP, 2);
+    ck_assert_int_eq(shm_ring_read(late, &p, sizeof(p)), sizeof(p));
+    ck_assert_int_eq(p.idx, 2);
+    shm_ring_free(late);
+}
+END_TEST
+
+START_TEST(test_send_fd)
+{
+    int sv[2];
+    ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    ck_assert_int_eq(sockutil_send_fd(sv[0], wr->fd), 0);
+    int fd = sockutil_recv_fd(sv[1]);
+    ck_assert_int_ne(fd, -1);
+    struct shm_ring *r = shm_ring_attach(fd);
+    ck_assert(r != NULL);
+    publish(RAW_MTYPE_BSMP, 7);
+    struct pkt p;
+    ck_assert_int_eq(shm_ring_read(r, &p, sizeof(p)), sizeof(p));
+    ck_assert_int_eq(p.idx, 7);
+    shm_ring_free(r);
+    close(sv[0]);
+    close(sv[1]);
+}
+END_TEST
+
+#define NPUBLISH 2000000
+
+static void* writer_main(__unused void *arg)
+{
+    for (uint32_t i = 0; i < NPUBLISH; i++) {
+        publish(RAW_MTYPE_BSMP, i);
+    }
+    return NULL;
+}
+
+START_TEST(test_two_threads)
+{
+    /* Whatever the reader gets must be whole, and in order. */
+    pthread_t writer;
+    ck_assert_int_eq(pthread_create(&writer, NULL, writer_main, NULL), 0);
+    struct pkt p;
+    uint64_t nread = 0;
+    int64_t last = -1;
+    int bad = 0;
+    while (last < NPUBLISH - 1) {
+        if (!shm_ring_read(rd, &p, sizeof(p))) {
+            continue;
+        }
+        nread++;
+        for (size_t i = 0; i < sizeof(p.fill) / sizeof(p.fill[0]); i++) {
+            bad |= p.fill[i] != p.idx;
+        }
+        bad |= (int64_t)p.idx <= last;
+        last = p.idx;
+    }
+    ck_assert_int_eq(pthread_join(writer, NULL), 0);
+    ck_assert_int_eq(bad, 0);
+    ck_assert_int_eq(nread + rd->nlost, NPUBLISH);
+}
+END_TEST
+
+Suite* shm_ring_suite(void)
+{
+    Suite *s = suite_create("shm_ring");
+    TCase *tc = tcase_create("shm_ring");
+    tcase_add_checked_fixture(tc, setup_ring, teardown_ring);
+    tcase_set_timeout(tc, 60);
+    tcase_add_test(tc, test_create_attach);
+    tcase_add_test(tc, test_read);
+    tcase_add_test(tc, test_overrun);
+    tcase_add_test(tc, test_late_reader);
+    tcase_add_test(tc, test_send_fd);
+    tcase_add_test(tc, test_two_threads);
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+int main(__unused int argc, __unused char *argv[])
+{
+    Suite *s = shm_ring_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    int n_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
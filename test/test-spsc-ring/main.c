@@ -0,0 +1,176 @@
+#include "spsc_ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "test.h"
+#include "type_attrs.h"
+
+#define NSLABS 4
+
+struct slab {
+    uint32_t idx;
+    uint32_t len;
+};
+
+struct spsc_ring *ring;
+
+static void setup_ring(void)
+{
+    ring = spsc_ring_alloc(NSLABS, sizeof(struct slab), 0);
+}
+
+static void teardown_ring(void)
+{
+    spsc_ring_free(ring);
+    ring = NULL;
+}
+
+START_TEST(test_alloc)
+{
+    ck_assert(ring != NULL);
+    size_t size_off = ring->sr_slab_size & (SPSC_RING_CACHE_LINE - 1);
+    uintptr_t addr_off = ((uintptr_t)ring->sr_slabs &
+                          (SPSC_RING_CACHE_LINE - 1));
+    ck_assert_int_eq(size_off, 0);
+    ck_assert_int_eq(addr_off, 0);
+    ck_assert_int_eq(spsc_ring_count(ring), 0);
+    ck_assert(spsc_ring_cons_slab(ring) == NULL);
+    ck_assert(spsc_ring_alloc(0, 1, 0) == NULL);
+}
+END_TEST
+
+START_TEST(test_full_empty)
+{
+    struct slab *first = spsc_ring_prod_slab(ring);
+    ck_assert(first != NULL);
+    /* The head slab doesn't move until it's published. */
+    ck_assert(spsc_ring_prod_slab(ring) == first);
+
+    for (uint32_t i = 0; i < NSLABS; i++) {
+        struct slab *s = spsc_ring_prod_slab(ring);
+        ck_assert(s != NULL);
+        s->idx = i;
+        spsc_ring_produce(ring);
+        ck_assert_int_eq(spsc_ring_count(ring), i + 1);
+    }
+    ck_assert(spsc_ring_prod_slab(ring) == NULL);
+    ck_assert_int_eq(spsc_ring_hwm(ring), NSLABS);
+
+    for (uint32_t i = 0; i < NSLABS; i++) {
+        struct slab *s = spsc_ring_cons_slab(ring);
+        ck_assert(s != NULL);
+        ck_assert_int_eq(s->idx, i);
+        spsc_ring_consume(ring);
+        /* There's room for the producer again. */
+        ck_assert(spsc_ring_prod_slab(ring) != NULL);
+    }
+    ck_assert(spsc_ring_cons_slab(ring) == NULL);
+    ck_assert_int_eq(spsc_ring_count(ring), 0);
+    ck_assert_int_eq(spsc_ring_hwm(ring), NSLABS);
+    spsc_ring_reset_hwm(ring);
+    ck_assert_int_eq(spsc_ring_hwm(ring), 0);
+
+    /* Wrapping around lands back on the first slab. */
+    ck_assert(spsc_ring_prod_slab(ring) == first);
+}
+END_TEST
+
+START_TEST(test_alloc_flags)
+{
+    /* Whatever the system allows, we should get usable memory, and
+     * never flags we didn't ask for. */
+    const int flags = SPSC_RING_HUGEPAGES | SPSC_RING_MLOCK;
+    struct spsc_ring *r = spsc_ring_alloc(NSLABS, 3 * 4096 + 1, flags);
+    ck_assert(r != NULL);
+    ck_assert_int_eq(r->sr_flags & ~flags, 0);
+    ck_assert_int_ge(r->sr_map_len, r->sr_nslabs * r->sr_slab_size);
+    for (size_t i = 0; i < NSLABS; i++) {
+        uint8_t *s = spsc_ring_prod_slab(r);
+        ck_assert(s != NULL);
+        s[0] = 0xaa;
+        s[r->sr_slab_size - 1] = 0x55;
+        spsc_ring_produce(r);
+    }
+    spsc_ring_free(r);
+}
+END_TEST
+
+/*
+ * Push a sequence of indexes from one thread to another through the
+ * ring, and make sure each arrives exactly once, in order. This is
+ * most useful when built with -fsanitize=thread.
+ */
+
+#define STRESS_NSLABS 200000
+#define STRESS_SLAB_LEN 7
+
+static void* stress_consumer(void *arg)
+{
+    uint32_t *bad = arg;
+    uint32_t next = 0;
+    while (next < STRESS_NSLABS) {
+        struct slab *s = spsc_ring_cons_slab(ring);
+        if (!s) {
+            sched_yield();
+            continue;
+        }
+        if (s->idx != next || s->len != next % STRESS_SLAB_LEN) {
+            (*bad)++;
+        }
+        next++;
+        spsc_ring_consume(ring);
+    }
+    return NULL;
+}
+
+START_TEST(test_two_threads)
+{
+    pthread_t consumer;
+    uint32_t bad = 0;
+    ck_assert_int_eq(pthread_create(&consumer, NULL, stress_consumer, &bad),
+                     0);
+    uint32_t next = 0;
+    while (next < STRESS_NSLABS) {
+        struct slab *s = spsc_ring_prod_slab(ring);
+        if (!s) {
+            sched_yield();
+            continue;
+        }
+        s->idx = next;
+        s->len = next % STRESS_SLAB_LEN;
+        next++;
+        spsc_ring_produce(ring);
+    }
+    ck_assert_int_eq(pthread_join(consumer, NULL), 0);
+    ck_assert_int_eq(bad, 0);
+    ck_assert(spsc_ring_cons_slab(ring) == NULL);
+    ck_assert_int_le(spsc_ring_hwm(ring), NSLABS);
+}
+END_TEST
+
+Suite* spsc_ring_suite(void)
+{
+    Suite *s = suite_create("spsc_ring");
+    TCase *tc = tcase_create("spsc_ring");
+    tcase_add_checked_fixture(tc, setup_ring, teardown_ring);
+    tcase_set_timeout(tc, 60);
+    tcase_add_test(tc, test_alloc);
+    tcase_add_test(tc, test_alloc_flags);
+    tcase_add_test(tc, test_full_empty);
+    tcase_add_test(tc, test_two_threads);
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+int main(__unused int argc, __unused char *argv[])
+{
+    Suite *s = spsc_ring_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    int n_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
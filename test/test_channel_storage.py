@@ -5,26 +5,84 @@ from __future__ import print_function
 from contextlib import closing
 import os.path
 import shutil
+import socket
+import struct
 import tempfile
+import threading
+import time
+import unittest
+
+import h5py
+import numpy
 
 import test_helpers
 from daemon_control import *
 
 NSAMPLES = 30000
+NCANNED = 29500                 # ends well clear of a dropped sample
+DAEMON_DATA_PORT = 1370         # where sampstreamer sends to
+FOREIGN_PORT = 5679             # next to where it sends from
+MAX_GAP_REREADS = 100           # as in control-client.c
 
-class TestChannelStorage(test_helpers.DaemonTest):
-
-    def __init__(self, *args, **kwargs):
-        kwargs['start_sampstreamer'] = True
-        super(TestChannelStorage, self).__init__(*args, **kwargs)
+class AbstractTestStorage(test_helpers.DaemonTest):
+    """Parent class for storage test cases."""
 
     def setUp(self):
         self.tmpdir = tempfile.mkdtemp()
-        super(TestChannelStorage, self).setUp()
+        super(AbstractTestStorage, self).setUp()
 
     def tearDown(self):
         shutil.rmtree(self.tmpdir)
-        super(TestChannelStorage, self).tearDown()
+        super(AbstractTestStorage, self).tearDown()
+
+    def ensureStoreOK(self, store, path, nsamples):
+        msg = '\nstore:\n' + str(store)
+        self.assertEqual(store.status, ControlResStore.DONE, msg=msg)
+        self.assertEqual(store.path, path, msg=msg)
+        self.assertEqual(store.nsamples, nsamples, msg=msg)
+
+    def getMissing(self, path):
+        """Get the rows of an HDF5 file's dataset that are missing
+        board sample placeholders, and its gap table, if any."""
+        h5f = h5py.File(path)
+        with closing(h5f) as h5f:
+            dset = h5f[test_helpers.expected_dset_name]
+            flags = dset['ph_flags']
+            rows = list(numpy.flatnonzero(flags &
+                                          test_helpers.PH_MISSINGFLAG))
+            for row in rows:
+                self.assertFalse(dset[row][test_helpers.SAMPLES].any(),
+                                 msg=str(row))
+            gaps_name = test_helpers.expected_dset_name + '_gaps'
+            gaps = h5f[gaps_name][...] if gaps_name in h5f else None
+        return rows, gaps
+
+    def ensureGapsOK(self, store, path):
+        """Check that the board samples a store says it's missing are
+        marked missing in its file, and listed in its gap table."""
+        rows, gaps = self.getMissing(path)
+        msg = '\nstore:\n' + str(store)
+        self.assertGreater(store.gaps, 0, msg=msg)
+        self.assertIsNotNone(gaps)
+        self.assertEqual(len(gaps), store.gaps, msg=msg)
+        self.assertEqual(sum(int(g['len']) for g in gaps), store.missing,
+                         msg=msg)
+        self.assertEqual(len(rows), store.missing, msg=msg)
+        h5f = h5py.File(path)
+        with closing(h5f) as h5f:
+            dset = h5f[test_helpers.expected_dset_name]
+            start_idx = int(dset[0][test_helpers.SAMP_INDEX])
+        gap_rows = []
+        for g in gaps:
+            start = int(g['start']) - start_idx
+            gap_rows.extend(xrange(start, start + int(g['len'])))
+        self.assertEqual(sorted(gap_rows), rows)
+
+class TestChannelStorage(AbstractTestStorage):
+
+    def __init__(self, *args, **kwargs):
+        kwargs['start_sampstreamer'] = True
+        super(TestChannelStorage, self).__init__(*args, **kwargs)
 
     def testSingleStorage(self):
         path = os.path.join(self.tmpdir, "singleStorage.h5")
@@ -66,8 +124,311 @@ class TestChannelStorage(test_helpers.DaemonTest):
         self.ensureStoreOK(store2, path, NSAMPLES)
         self.ensureHDF5OK(path, NSAMPLES)
 
-    def ensureStoreOK(self, store, path, nsamples):
+    def testSmallBuffers(self):
+        path = os.path.join(self.tmpdir, "smallBuffers.h5")
+
+        # Store through a queue of short buffers, then go back to
+        # the defaults, to make sure buffer reconfiguration works.
+        cmds = self.getStoreCmds(path, NSAMPLES)
+        cmds[1].store.nbuffers = 3
+        cmds[1].store.buffer_msec = 7
+        sckt = get_daemon_control_sock()
+        with closing(sckt) as sckt:
+            resp1 = do_control_cmds(cmds, control_socket=sckt)
+            resp2 = do_control_cmds(self.getStoreCmds(path, NSAMPLES),
+                                    control_socket=sckt)
+
+        for resps in (resp1, resp2):
+            self.assertIsNotNone(resps)
+            self.assertEqual(len(resps), 3)
+            self.assertEqual(resps[1].type, ControlResponse.STORE_FINISHED,
+                             msg='\nresponse:\n' + str(resps[1]))
+            self.ensureStoreOK(resps[1].store, path, NSAMPLES)
+        peak = resp1[1].store.peak_buffers
+        self.assertTrue(1 <= peak <= 3, msg='peak_buffers=%d' % peak)
+        self.ensureHDF5OK(path, NSAMPLES)
+
+    def testWireOrder(self):
+        path = os.path.join(self.tmpdir, "wireOrder.h5")
+
+        # Store samples without byte swapping them first; h5py should
+        # still hand back the values sampstreamer sent.
+        cmds = self.getStoreCmds(path, NSAMPLES)
+        cmds[1].store.wire_order = True
+        resps = do_control_cmds(cmds)
+
+        self.assertIsNotNone(resps)
+        self.assertEqual(len(resps), 3)
+        self.assertEqual(resps[1].type, ControlResponse.STORE_FINISHED,
+                         msg='\nresponse:\n' + str(resps[1]))
+        self.ensureStoreOK(resps[1].store, path, NSAMPLES)
+        self.ensureHDF5OK(path, NSAMPLES, wire_order=True)
+        h5f = h5py.File(path)
+        with closing(h5f) as h5f:
+            dset = h5f[test_helpers.expected_dset_name]
+            for i in (0, NSAMPLES // 2, NSAMPLES - 1):
+                bsamp = dset[i]
+                sidx = int(bsamp[test_helpers.SAMP_INDEX])
+                expected = [(sidx + j) & 0xffff for j in xrange(1120)]
+                self.assertEqual(list(bsamp[test_helpers.SAMPLES]),
+                                 expected, msg=str(i))
+
+    def testStoreWhileForwarding(self):
+        path = os.path.join(self.tmpdir, "storeWhileForwarding.h5")
+        port = test_helpers.PROTO2BYTES_DEFAULT_PORT
+
+        # Watch raw board samples go by while they're being stored.
+        fwd = ControlCommand(type=ControlCommand.FORWARD)
+        fwd.forward.dest_udp_addr4 = 0x7f000001
+        fwd.forward.dest_udp_port = port
+        fwd.forward.sample_type = BOARD_SAMPLE_RAW
+        fwd.forward.enable = True
+        unfwd = ControlCommand(type=ControlCommand.FORWARD)
+        unfwd.forward.enable = False
+        acq, store, nacq = self.getStoreCmds(path, NSAMPLES)
+        sckt = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        with closing(sckt) as sckt:
+            sckt.bind(('localhost', port))
+            sckt.settimeout(1.0)
+            resps = do_control_cmds([acq, fwd, store, unfwd, nacq])
+            data = sckt.recv(65536)
+
+        self.assertIsNotNone(resps)
+        self.assertEqual(len(resps), 5)
+        self.assertEqual(resps[2].type, ControlResponse.STORE_FINISHED,
+                         msg='\nresponse:\n' + str(resps[2]))
+        self.ensureStoreOK(resps[2].store, path, NSAMPLES)
+        self.ensureHDF5OK(path, NSAMPLES)
+        self.assertGreater(resps[2].store.forwarded, 0)
+        self.assertEqual(len(data), test_helpers.RAW_BSMP_SIZE)
+
+class TestChannelStorageRxThread(TestChannelStorage):
+    """TestChannelStorage, with samples received on a dedicated thread."""
+
+    def __init__(self, *args, **kwargs):
+        kwargs['daemon_args'] = ['-R']
+        super(TestChannelStorageRxThread, self).__init__(*args, **kwargs)
+
+class TestChannelStorageUnfiltered(TestChannelStorage):
+    """TestChannelStorage, with no kernel packet filter on the data
+    socket, so the daemon's own checks see every packet."""
+
+    def __init__(self, *args, **kwargs):
+        kwargs['daemon_args'] = ['-U']
+        super(TestChannelStorageUnfiltered, self).__init__(*args,
+                                                           **kwargs)
+
+    def testForeignSource(self):
+        path = os.path.join(self.tmpdir, "foreignSource.h5")
+
+        # Board samples from another port, mixed in with sampstreamer's
+        # so they land in the middle of receive batches. They're far
+        # enough ahead that storing one would end the store with
+        # PKTDROP.
+        pkt = (struct.pack('>4B5I', 0x5a, 0, 0x81, 0,
+                           0, 0, 0, 0x40000000, 0) +
+               '\0' * (test_helpers.RAW_BSMP_SIZE - 24))
+        stop = threading.Event()
+        nsent = [0]
+        sckt = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sckt.bind(('localhost', FOREIGN_PORT))
+
+        def send_foreign():
+            while not stop.is_set():
+                sckt.sendto(pkt, ('localhost', DAEMON_DATA_PORT))
+                nsent[0] += 1
+                time.sleep(0.0001)
+
+        sender = threading.Thread(target=send_foreign)
+        with closing(sckt) as sckt:
+            sender.start()
+            try:
+                resps = do_control_cmds(self.getStoreCmds(path, NSAMPLES))
+            finally:
+                stop.set()
+                sender.join()
+
+        self.assertIsNotNone(resps)
+        self.assertEqual(len(resps), 3)
+        self.assertEqual(resps[1].type, ControlResponse.STORE_FINISHED,
+                         msg='\nresponse:\n' + str(resps[1]))
+        self.ensureStoreOK(resps[1].store, path, NSAMPLES)
+        self.ensureHDF5OK(path, NSAMPLES)
+        # They got to the daemon, and it turned them away.
+        self.assertGreater(resps[1].store.foreign, 0,
+                           msg='\nstore:\n' + str(resps[1].store))
+        self.assertLessEqual(resps[1].store.foreign, nsent[0])
+
+class AbstractTestReorderedStorage(AbstractTestStorage):
+    """Parent class for stores from a sampstreamer that sends every
+    REORDER-th board sample REORDER_BY board samples late."""
+
+    REORDER = 100
+    REORDER_BY = 8
+
+    def __init__(self, *args, **kwargs):
+        kwargs['start_sampstreamer'] = True
+        kwargs['sampstreamer_args'] = ['-o', str(self.REORDER),
+                                       '-b', str(self.REORDER_BY)]
+        super(AbstractTestReorderedStorage, self).__init__(*args,
+                                                           **kwargs)
+
+    def setUp(self):
+        if test_helpers.DO_IT_LIVE:
+            raise unittest.SkipTest()
+        super(AbstractTestReorderedStorage, self).setUp()
+
+    def doReorderedStore(self, path):
+        resps = do_control_cmds(self.getStoreCmds(path, NSAMPLES))
+        self.assertIsNotNone(resps)
+        self.assertEqual(len(resps), 3)
+        self.assertEqual(resps[1].type, ControlResponse.STORE_FINISHED,
+                         msg='\nresponse:\n' + str(resps[1]))
+        return resps[1].store
+
+class TestReorderedStorage(AbstractTestReorderedStorage):
+    """Board samples arrive out of order, but well within the daemon's
+    reorder window."""
+
+    def testReordered(self):
+        path = os.path.join(self.tmpdir, "reordered.h5")
+
+        # The daemon puts them back in order without restarting.
+        store = self.doReorderedStore(path)
         msg = '\nstore:\n' + str(store)
-        self.assertEqual(store.status, ControlResStore.DONE, msg=msg)
-        self.assertEqual(store.path, path, msg=msg)
-        self.assertEqual(store.nsamples, nsamples, msg=msg)
+        self.ensureStoreOK(store, path, NSAMPLES)
+        self.assertEqual(store.restarts, 0, msg=msg)
+        self.assertGreater(store.reordered, 0, msg=msg)
+        self.ensureHDF5OK(path, NSAMPLES)
+
+class TestReorderedStorageSmallWindow(AbstractTestReorderedStorage):
+    """Board samples arrive further out of order than the daemon's
+    reorder window allows."""
+
+    def __init__(self, *args, **kwargs):
+        kwargs['daemon_args'] = ['-W', str(self.REORDER_BY // 2)]
+        super(TestReorderedStorageSmallWindow, self).__init__(*args,
+                                                              **kwargs)
+
+    def testReorderedPastWindow(self):
+        path = os.path.join(self.tmpdir, "reorderedPastWindow.h5")
+
+        # The late ones look like drops by the time they turn up.
+        store = self.doReorderedStore(path)
+        self.assertTrue(store.status == ControlResStore.PKTDROP or
+                        store.restarts > 0,
+                        msg='\nstore:\n' + str(store))
+
+class TestDroppedStorage(AbstractTestStorage):
+    """Stores from a sampstreamer that never sends every DROP-th board
+    sample."""
+
+    DROP = 1000
+
+    def __init__(self, *args, **kwargs):
+        kwargs['start_sampstreamer'] = True
+        kwargs['sampstreamer_args'] = ['-d', str(self.DROP)]
+        super(TestDroppedStorage, self).__init__(*args, **kwargs)
+
+    def setUp(self):
+        if test_helpers.DO_IT_LIVE:
+            raise unittest.SkipTest()
+        super(TestDroppedStorage, self).setUp()
+
+    def doDroppedStore(self, path, fill_gaps):
+        cmds = self.getStoreCmds(path, NSAMPLES)
+        cmds[1].store.fill_gaps = fill_gaps
+        resps = do_control_cmds(cmds)
+        self.assertIsNotNone(resps)
+        self.assertEqual(len(resps), 3)
+        self.assertEqual(resps[1].type, ControlResponse.STORE_FINISHED,
+                         msg='\nresponse:\n' + str(resps[1]))
+        return resps[1].store
+
+    def testFillGaps(self):
+        path = os.path.join(self.tmpdir, "fillGaps.h5")
+
+        # The store keeps going past each drop, leaving a placeholder
+        # in its place.
+        store = self.doDroppedStore(path, True)
+        self.ensureStoreOK(store, path, NSAMPLES)
+        self.ensureHDF5OK(path, NSAMPLES)
+        self.ensureGapsOK(store, path)
+        self.assertGreaterEqual(store.missing, NSAMPLES // self.DROP - 1,
+                                msg='\nstore:\n' + str(store))
+
+    def testNoFillGaps(self):
+        path = os.path.join(self.tmpdir, "noFillGaps.h5")
+
+        # Without fill_gaps, the first drop ends the store.
+        store = self.doDroppedStore(path, False)
+        self.assertEqual(store.status, ControlResStore.PKTDROP,
+                         msg='\nstore:\n' + str(store))
+
+class AbstractTestCannedStorage(AbstractTestStorage):
+    """Parent class for stores with start_sample. The dummy data node
+    answers their SATA reads, but leaves out every DROP_EVERY-th board
+    sample the first time it's read, so those have to be read
+    again."""
+
+    DROP_EVERY = None
+
+    def __init__(self, *args, **kwargs):
+        kwargs['dnode_args'] = ['--sata-reads',
+                                '--dport', str(DAEMON_DATA_PORT),
+                                '--drop-every', str(self.DROP_EVERY)]
+        super(AbstractTestCannedStorage, self).__init__(*args, **kwargs)
+
+    def setUp(self):
+        if test_helpers.DO_IT_LIVE:
+            raise unittest.SkipTest()
+        super(AbstractTestCannedStorage, self).setUp()
+
+    def doCannedStore(self, path, nsamples):
+        cmd = ControlCommand(type=ControlCommand.STORE)
+        cmd.store.path = path
+        cmd.store.start_sample = 0
+        cmd.store.nsamples = nsamples
+        cmd.store.backend = STORE_HDF5
+        resps = do_control_cmds([cmd])
+        self.assertIsNotNone(resps)
+        self.assertEqual(len(resps), 1)
+        self.assertEqual(resps[0].type, ControlResponse.STORE_FINISHED,
+                         msg='\nresponse:\n' + str(resps[0]))
+        return resps[0].store
+
+class TestCannedStorageRereads(AbstractTestCannedStorage):
+
+    DROP_EVERY = 1000
+
+    def testRereads(self):
+        path = os.path.join(self.tmpdir, "rereads.h5")
+
+        # Each dropped board sample gets read again, and written over
+        # its placeholder, so nothing's missing in the end.
+        store = self.doCannedStore(path, NCANNED)
+        self.ensureStoreOK(store, path, NCANNED)
+        self.assertGreaterEqual(store.rereads, NCANNED // self.DROP_EVERY,
+                                msg='\nstore:\n' + str(store))
+        self.assertEqual(store.gaps, 0)
+        self.assertEqual(store.missing, 0)
+        self.ensureHDF5OK(path, NCANNED)
+        rows, gaps = self.getMissing(path)
+        self.assertEqual(rows, [])
+        self.assertIsNone(gaps)
+
+class TestCannedStorageGiveUp(AbstractTestCannedStorage):
+
+    DROP_EVERY = 200            # more gaps than MAX_GAP_REREADS
+
+    def testGiveUp(self):
+        path = os.path.join(self.tmpdir, "giveUp.h5")
+
+        # The daemon stops reading gaps again after MAX_GAP_REREADS,
+        # and leaves the rest as placeholders.
+        store = self.doCannedStore(path, NCANNED)
+        msg = '\nstore:\n' + str(store)
+        self.assertEqual(store.status, ControlResStore.PKTDROP, msg=msg)
+        self.assertEqual(store.rereads, MAX_GAP_REREADS, msg=msg)
+        self.ensureHDF5OK(path, NCANNED)
+        self.ensureGapsOK(store, path)
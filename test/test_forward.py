@@ -5,6 +5,7 @@ SAMPLES, E.G."""
 
 import fcntl
 import os
+import struct
 import subprocess
 import time
 
@@ -33,7 +34,9 @@ class ProtoDataMixin(object):
             return True
 
 class RawDataMixin(object):
-    """Mixin for checking streaming packets in raw format."""
+    """Mixin for checking streaming packets in raw format.
+
+    Set raw_size to the size of the packets to expect."""
 
     def raw_start(self):
         self.sckt = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
@@ -45,12 +48,13 @@ class RawDataMixin(object):
 
     def got_stream_data(self):
         try:
-            data, addr = self.sckt.recvfrom(4)
+            data, addr = self.sckt.recvfrom(65536)
         except IOError:
             return False
         else:
             if data[0] != test_helpers.RAW_MAGIC[0]:
                 return False
+            self.assertEqual(len(data), self.raw_size)
             return True
 
 class AbstractTestForward(test_helpers.DaemonTest):
@@ -115,6 +119,8 @@ class TestProtoSubForward(ProtoDataMixin, AbstractTestSubForward):
 
 class TestRawSubForward(RawDataMixin, AbstractTestSubForward):
 
+    raw_size = test_helpers.RAW_BSUB_SIZE
+
     def testRawSubForward(self):
         self.raw_start()
         try:
@@ -135,9 +141,298 @@ class TestProtoSmpForward(ProtoDataMixin, AbstractTestForward):
 
 class TestRawSmpForward(RawDataMixin, AbstractTestForward):
 
+    raw_size = test_helpers.RAW_BSMP_SIZE
+
     def testRawSmpForward(self):
         self.raw_start()
         try:
             self.do_test(BOARD_SAMPLE_RAW)
         finally:
             self.raw_stop()
+
+class TestSubscribers(RawDataMixin, AbstractTestForward):
+    """A subscriber gets raw board samples alongside the client, at the
+    rate it asked for."""
+
+    raw_size = test_helpers.RAW_BSMP_SIZE
+    sub_port = DST_PORT + 1
+    every_nth = 2
+
+    def subscribe(self, subscribe):
+        fwd = ControlCmdForward(dest_udp_addr4=0x7f000001,
+                                dest_udp_port=self.sub_port,
+                                subscribe=subscribe,
+                                sample_type=BOARD_SAMPLE_RAW,
+                                every_nth=self.every_nth)
+        resps = do_control_cmds([ControlCommand(type=ControlCommand.FORWARD,
+                                                forward=fwd)])
+        self.assertIsNotNone(resps)
+        self.assertEqual(resps[0].type, ControlResponse.SUCCESS,
+                         msg='\nsubscribe resp:\n' + str(resps[0]))
+
+    def forward(self, enable):
+        fwd = ControlCmdForward(dest_udp_addr4=0x7f000001,
+                                dest_udp_port=DST_PORT,
+                                enable=enable,
+                                sample_type=BOARD_SAMPLE_RAW,
+                                force_daq_reset=True)
+        resps = do_control_cmds([ControlCommand(type=ControlCommand.FORWARD,
+                                                forward=fwd)])
+        self.assertIsNotNone(resps)
+        self.assertEqual(resps[0].type, ControlResponse.SUCCESS,
+                         msg='\nforward resp:\n' + str(resps[0]))
+
+    def testSubscribers(self):
+        sub = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sub.bind(('localhost', self.sub_port))
+        sub.settimeout(DATA_TIMEOUT_SEC)
+        self.raw_start()
+        try:
+            self.subscribe(True)
+            self.forward(True)
+            for _ in range(10):
+                data = sub.recv(65536)
+                self.assertEqual(len(data), self.raw_size)
+                # b_sidx follows the 4-byte header and 3 other words.
+                sidx = struct.unpack('>I', data[16:20])[0]
+                self.assertEqual(sidx % self.every_nth, 0)
+            self.assertTrue(self.got_stream_data())
+            self.forward(False)
+            self.subscribe(False)
+        finally:
+            self.raw_stop()
+            sub.close()
+
+class TestSharedDecimation(RawDataMixin, AbstractTestForward):
+    """Two subscribers at the same "decimate" share a decimator, and
+    each still gets one board sample per "decimate" of them."""
+
+    raw_size = test_helpers.RAW_BSMP_SIZE
+    sub_ports = (DST_PORT + 1, DST_PORT + 2)
+    decimate = 10
+    noutputs = 50
+
+    def subscribe(self, port, subscribe):
+        fwd = ControlCmdForward(dest_udp_addr4=0x7f000001,
+                                dest_udp_port=port,
+                                subscribe=subscribe,
+                                sample_type=BOARD_SAMPLE_RAW,
+                                decimate=self.decimate)
+        resps = do_control_cmds([ControlCommand(type=ControlCommand.FORWARD,
+                                                forward=fwd)])
+        self.assertIsNotNone(resps)
+        self.assertEqual(resps[0].type, ControlResponse.SUCCESS,
+                         msg='\nsubscribe resp:\n' + str(resps[0]))
+
+    def forward(self, enable):
+        fwd = ControlCmdForward(dest_udp_addr4=0x7f000001,
+                                dest_udp_port=DST_PORT,
+                                enable=enable,
+                                sample_type=BOARD_SAMPLE_RAW,
+                                force_daq_reset=True)
+        resps = do_control_cmds([ControlCommand(type=ControlCommand.FORWARD,
+                                                forward=fwd)])
+        self.assertIsNotNone(resps)
+        self.assertEqual(resps[0].type, ControlResponse.SUCCESS,
+                         msg='\nforward resp:\n' + str(resps[0]))
+
+    def recv_sidxs(self, sckt, n):
+        sidxs = []
+        for _ in range(n):
+            data = sckt.recv(65536)
+            self.assertEqual(len(data), self.raw_size)
+            # b_sidx follows the 4-byte header and 3 other words.
+            sidx = struct.unpack('>I', data[16:20])[0]
+            self.assertEqual(sidx % self.decimate, 0)
+            sidxs.append(sidx)
+        return sidxs
+
+    def testSharedDecimation(self):
+        subs = []
+        self.raw_start()
+        try:
+            for port in self.sub_ports:
+                sub = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+                sub.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF,
+                               4 * self.noutputs * self.raw_size)
+                sub.bind(('localhost', port))
+                sub.settimeout(DATA_TIMEOUT_SEC)
+                subs.append(sub)
+                self.subscribe(port, True)
+            self.forward(True)
+            # The second subscriber may have started a little later,
+            # but from there on, both get the same outputs: every
+            # one the decimator made, not one per batch of packets.
+            first = self.recv_sidxs(subs[0], 2 * self.noutputs)
+            second = self.recv_sidxs(subs[1], self.noutputs)
+            self.assertIn(second[0], first)
+            start = first.index(second[0])
+            self.assertEqual(second, first[start:start + self.noutputs])
+            steps = [b - a for a, b in zip(second, second[1:])]
+            self.assertGreater(steps.count(self.decimate), len(steps) // 2,
+                               msg=str(second))
+            self.forward(False)
+            for port in self.sub_ports:
+                self.subscribe(port, False)
+        finally:
+            self.raw_stop()
+            for sub in subs:
+                sub.close()
+
+class TestProjection(AbstractTestForward):
+    """Forwarding a few channels of each board sample gets a compact
+    BoardSubsample holding just those channels."""
+
+    chans = [(0, 0), (5, 17), (31, 34), (5, 17)]
+
+    def testProjection(self):
+        from data_pb2 import DnodeSample
+        sckt = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sckt.bind(('localhost', DST_PORT))
+        sckt.settimeout(DATA_TIMEOUT_SEC)
+        fwd = ControlCmdForward(dest_udp_addr4=0x7f000001,
+                                dest_udp_port=DST_PORT,
+                                enable=True,
+                                sample_type=BOARD_SAMPLE,
+                                force_daq_reset=True)
+        fwd.chips.extend(c for c, _ in self.chans)
+        fwd.channels.extend(ch for _, ch in self.chans)
+        cmd = ControlCommand(type=ControlCommand.FORWARD, forward=fwd)
+        try:
+            resps = do_control_cmds([cmd])
+            self.assertIsNotNone(resps)
+            self.assertEqual(resps[0].type, ControlResponse.SUCCESS,
+                             msg='\nenable resp:\n' + str(resps[0]))
+            for _ in range(10):
+                dnsample = DnodeSample()
+                dnsample.ParseFromString(sckt.recv(65536))
+                self.assertEqual(dnsample.type, DnodeSample.SUBSAMPLE)
+                bsub = dnsample.subsample
+                self.assertEqual(list(zip(bsub.chips, bsub.channels)),
+                                 self.chans)
+                if test_helpers.DO_IT_LIVE:
+                    continue
+                # sampstreamer sets sample i to the sample index plus i,
+                # and samples are channel-major.
+                for (chip, chan), samp in zip(self.chans, bsub.samples):
+                    self.assertEqual(samp,
+                                     (bsub.samp_idx + chan * 32 + chip) &
+                                     0xFFFF)
+            cmd.forward.enable = False
+            del cmd.forward.chips[:]
+            del cmd.forward.channels[:]
+            resps = do_control_cmds([cmd])
+            self.assertEqual(resps[0].type, ControlResponse.SUCCESS)
+        finally:
+            sckt.close()
+
+class TestDecimation(AbstractTestForward):
+    """A decimated envelope stream gets one BoardSample per "decimate"
+    board samples, with each channel's minimum and maximum over
+    them."""
+
+    decimate = 10
+
+    def testDecimation(self):
+        from data_pb2 import DnodeSample
+        sckt = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sckt.bind(('localhost', DST_PORT))
+        sckt.settimeout(DATA_TIMEOUT_SEC)
+        fwd = ControlCmdForward(dest_udp_addr4=0x7f000001,
+                                dest_udp_port=DST_PORT,
+                                enable=True,
+                                sample_type=BOARD_SAMPLE,
+                                decimate=self.decimate,
+                                envelope=True,
+                                force_daq_reset=True)
+        cmd = ControlCommand(type=ControlCommand.FORWARD, forward=fwd)
+        try:
+            resps = do_control_cmds([cmd])
+            self.assertIsNotNone(resps)
+            self.assertEqual(resps[0].type, ControlResponse.SUCCESS,
+                             msg='\nenable resp:\n' + str(resps[0]))
+            for _ in range(10):
+                dnsample = DnodeSample()
+                dnsample.ParseFromString(sckt.recv(65536))
+                self.assertEqual(dnsample.type, DnodeSample.SAMPLE)
+                bsmp = dnsample.sample
+                self.assertEqual(bsmp.decimation, self.decimate)
+                self.assertEqual(bsmp.samp_idx % self.decimate, 0)
+                if test_helpers.DO_IT_LIVE:
+                    continue
+                # Samples are in host byte order, and sampstreamer sets
+                # sample i to the sample index plus i.
+                fmt = '=%dH' % (len(bsmp.samples) // 2)
+                mins = struct.unpack(fmt, bsmp.samples)
+                maxs = struct.unpack(fmt, bsmp.envelope_max)
+                for i in (0, 1, 500, len(mins) - 1):
+                    vals = [(s + i) & 0xFFFF for s in
+                            range(bsmp.samp_idx,
+                                  bsmp.samp_idx + self.decimate)]
+                    self.assertEqual(mins[i], min(vals))
+                    self.assertEqual(maxs[i], max(vals))
+            cmd.forward.enable = False
+            cmd.forward.ClearField('decimate')
+            cmd.forward.ClearField('envelope')
+            resps = do_control_cmds([cmd])
+            self.assertEqual(resps[0].type, ControlResponse.SUCCESS)
+        finally:
+            sckt.close()
+
+class TestCompact(AbstractTestForward):
+    """The compact BoardSubsample encoding packs the samples as bytes,
+    and only sends the channel map now and then."""
+
+    chans = [(0, 0), (5, 17), (31, 34)]
+
+    def testCompact(self):
+        from data_pb2 import DnodeSample
+        sckt = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sckt.bind(('localhost', DST_PORT))
+        sckt.settimeout(DATA_TIMEOUT_SEC)
+        fwd = ControlCmdForward(dest_udp_addr4=0x7f000001,
+                                dest_udp_port=DST_PORT,
+                                enable=True,
+                                sample_type=BOARD_SAMPLE,
+                                compact=True,
+                                force_daq_reset=True)
+        fwd.chips.extend(c for c, _ in self.chans)
+        fwd.channels.extend(ch for _, ch in self.chans)
+        cmd = ControlCommand(type=ControlCommand.FORWARD, forward=fwd)
+        try:
+            resps = do_control_cmds([cmd])
+            self.assertIsNotNone(resps)
+            self.assertEqual(resps[0].type, ControlResponse.SUCCESS,
+                             msg='\nenable resp:\n' + str(resps[0]))
+            gens = set()
+            nmaps = 0
+            for _ in range(100):
+                dnsample = DnodeSample()
+                dnsample.ParseFromString(sckt.recv(65536))
+                bsub = dnsample.subsample
+                self.assertEqual(len(bsub.samples), 0)
+                self.assertNotEqual(bsub.cfg_gen, 0)
+                gens.add(bsub.cfg_gen)
+                if bsub.chips:
+                    nmaps += 1
+                    self.assertEqual(list(zip(bsub.chips, bsub.channels)),
+                                     self.chans)
+                samps = struct.unpack('<%dH' % len(self.chans),
+                                      bsub.packed_samples)
+                if test_helpers.DO_IT_LIVE:
+                    continue
+                for (chip, chan), samp in zip(self.chans, samps):
+                    self.assertEqual(samp,
+                                     (bsub.samp_idx + chan * 32 + chip) &
+                                     0xFFFF)
+            self.assertEqual(len(gens), 1)
+            # The first one, and at most one per 1024 board samples.
+            self.assertTrue(1 <= nmaps <= 2)
+            cmd.forward.enable = False
+            cmd.forward.ClearField('compact')
+            del cmd.forward.chips[:]
+            del cmd.forward.channels[:]
+            resps = do_control_cmds([cmd])
+            self.assertEqual(resps[0].type, ControlResponse.SUCCESS)
+        finally:
+            sckt.close()
@@ -22,6 +22,8 @@ SAMPSTREAMER_PATH = 'sampstreamer'
 PROTO2BYTES_PATH = 'proto2bytes'
 PROTO2BYTES_DEFAULT_PORT = 7654
 RAW_MAGIC = '\x5a'
+RAW_BSUB_SIZE = 156     # sizeof(struct raw_pkt_bsub)
+RAW_BSMP_SIZE = 2264    # sizeof(struct raw_pkt_bsmp)
 SAMPLE_RATE_HZ = 30000
 
 # For checking HDF5 files
@@ -34,8 +36,14 @@ expected_dtype = numpy.dtype([('ph_flags', '|u1'),
                               ('samp_index', '<u4'),
                               ('chip_live', '<u4'),
                               ('samples', '<u2', (1120,))])
+# Same, for files stored with ControlCmdStore.wire_order set
+expected_wire_dtype = numpy.dtype([('ph_flags', '|u1'),
+                                   ('samp_index', '<u4'),
+                                   ('chip_live', '<u4'),
+                                   ('samples', '>u2', (1120,))])
 
 PH_ERRFLAG = 0x80
+PH_MISSINGFLAG = 0x20   # RAW_PFLAG_B_MISSING
 
 def daemon_sub(*args, **kwargs):
     sub = subprocess.Popen([DAEMON_PATH,
@@ -165,14 +173,16 @@ class DaemonTest(unittest.TestCase):
             self.assertFalse(board_sample[PH_FLAGS] & PH_ERRFLAG,
                              msg=str(i))
 
-    def ensureHDF5OK(self, hdf5_path, nsamples, exp_cookie=None):
+    def ensureHDF5OK(self, hdf5_path, nsamples, exp_cookie=None,
+                     wire_order=False):
         """Open an HDF5 file and do a cursory check of what's inside."""
         h5f = h5py.File(hdf5_path)
         with closing(h5f) as h5f:
             self.assertIn(expected_dset_name, h5f)
             dset = h5f[expected_dset_name]
             # Ensure the datatype matches our expectations
-            self.assertEqual(dset.dtype, expected_dtype)
+            self.assertEqual(dset.dtype, (expected_wire_dtype if wire_order
+                                          else expected_dtype))
             self.assertEqual(len(dset), nsamples)
 
             # If there's an experiment cookie to check, then do so.
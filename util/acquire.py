@@ -14,7 +14,15 @@ from daemon_control import *
 ##
 
 BACKENDS = { 'STORE_HDF5': STORE_HDF5,
-             'STORE_RAW': STORE_RAW }
+             'STORE_RAW': STORE_RAW,
+             'STORE_DIRECT': STORE_DIRECT }
+
+COMPRESSION = { 'none': COMPRESS_NONE,
+                'lz4': COMPRESS_LZ4,
+                'zstd': COMPRESS_ZSTD,
+                'shuffle+lz4': COMPRESS_SHUFFLE_LZ4,
+                'shuffle+zstd': COMPRESS_SHUFFLE_ZSTD,
+                'delta+zstd': COMPRESS_DELTA_ZSTD }
 
 BSI_INTERVAL = 1920
 
@@ -46,6 +54,34 @@ def start(args):
 def stop(args):
     return acquire(False, args)
 
+def hdf5_opts(cmd, args):
+    if args.hdf5_chunk is not None:
+        cmd.store.hdf5_chunk_samples = args.hdf5_chunk
+    if args.hdf5_cache is not None:
+        cmd.store.hdf5_cache_bytes = args.hdf5_cache
+    if args.hdf5_alloc_early:
+        cmd.store.hdf5_alloc_early = True
+    if args.hdf5_meta_block is not None:
+        cmd.store.hdf5_meta_block_size = args.hdf5_meta_block
+    if args.hdf5_latest_format:
+        cmd.store.hdf5_latest_format = True
+    if args.hdf5_direct_chunk:
+        cmd.store.hdf5_direct_chunk = True
+    if args.hdf5_deflate is not None:
+        cmd.store.hdf5_deflate = args.hdf5_deflate
+    if args.hdf5_channel_major:
+        cmd.store.hdf5_channel_major = True
+    if args.hdf5_channel_chunk is not None:
+        cmd.store.hdf5_channel_chunk_samples = args.hdf5_channel_chunk
+    if args.compress is not None:
+        cmd.store.compression = COMPRESSION[args.compress]
+    if args.compress_level is not None:
+        cmd.store.compress_level = args.compress_level
+    if args.compress_threads is not None:
+        cmd.store.compress_threads = args.compress_threads
+    if args.raw_frame is not None:
+        cmd.store.raw_frame_samples = args.raw_frame
+
 def save_stored(args):
     fpath = os.path.abspath(args.file)
     cmd = ControlCommand(type=ControlCommand.STORE)
@@ -54,6 +90,7 @@ def save_stored(args):
     cmd.store.path = fpath
     if args.backend is not None:
         cmd.store.backend = BACKENDS[args.backend]
+    hdf5_opts(cmd, args)
     return [cmd]
 
 def save_stream(args):
@@ -64,6 +101,15 @@ def save_stream(args):
     cmd.store.nsamples = nsamples
     if args.backend is not None:
         cmd.store.backend = BACKENDS[args.backend]
+    if args.nbuffers is not None:
+        cmd.store.nbuffers = args.nbuffers
+    if args.buffer_msec is not None:
+        cmd.store.buffer_msec = args.buffer_msec
+    if args.wire_order:
+        cmd.store.wire_order = True
+    if args.fill_gaps:
+        cmd.store.fill_gaps = True
+    hdf5_opts(cmd, args)
     return [cmd]
 
 def forward(args):
@@ -91,7 +137,25 @@ def forward(args):
         print('Invalid port', args.port, file=sys.stderr)
         sys.exit(1)
     cmd.forward.dest_udp_port = args.port
-    cmd.forward.enable = (args.enable == 'start')
+    if args.channels:
+        for chipchan in args.channels.split(','):
+            chip, chan = chipchan.split(':')
+            cmd.forward.chips.append(int(chip))
+            cmd.forward.channels.append(int(chan))
+    if args.every_nth is not None:
+        cmd.forward.every_nth = args.every_nth
+    if args.decimate is not None:
+        cmd.forward.decimate = args.decimate
+    if args.envelope:
+        cmd.forward.envelope = True
+    if args.compact:
+        cmd.forward.compact = True
+    if args.subscribe:
+        cmd.forward.subscribe = (args.enable == 'start')
+        if args.multicast_ttl is not None:
+            cmd.forward.multicast_ttl = args.multicast_ttl
+    else:
+        cmd.forward.enable = (args.enable == 'start')
     return [cmd]
 
 def subsamples(args):
@@ -140,7 +204,7 @@ start_parser.add_argument(
     help='Board sample index (BSI) at which to start acquiring. Must be a '
          'multiple of %d, default is %d.'%(BSI_INTERVAL, DEFAULT_START_SAMPLE))
 
-BACKEND_CHOICES = ['STORE_HDF5', 'STORE_RAW']
+BACKEND_CHOICES = ['STORE_HDF5', 'STORE_RAW', 'STORE_DIRECT']
 
 def no_arg_parser(cmd, description):
     return argparse.ArgumentParser(prog=cmd, description=description)
@@ -172,6 +236,72 @@ save_stored_parser.add_argument(
     choices=BACKEND_CHOICES,
     help='Storage backend')
 
+def add_hdf5_args(parser):
+    parser.add_argument(
+        '--hdf5-chunk',
+        type=int,
+        default=None,
+        help='Board samples per HDF5 dataset chunk')
+    parser.add_argument(
+        '--hdf5-cache',
+        type=int,
+        default=None,
+        help='HDF5 chunk cache size, in bytes (0 to disable)')
+    parser.add_argument(
+        '--hdf5-alloc-early',
+        action='store_true',
+        help='Allocate the whole HDF5 dataset up front')
+    parser.add_argument(
+        '--hdf5-meta-block',
+        type=int,
+        default=None,
+        help='HDF5 metadata block size, in bytes')
+    parser.add_argument(
+        '--hdf5-latest-format',
+        action='store_true',
+        help='Use the newest HDF5 file format (needs HDF5 1.10 to read)')
+    parser.add_argument(
+        '--hdf5-direct-chunk',
+        action='store_true',
+        help='Write whole HDF5 chunks directly, bypassing the chunk cache')
+    parser.add_argument(
+        '--hdf5-deflate',
+        type=int,
+        choices=range(10),
+        default=None,
+        help='Compress HDF5 chunks at this zlib level')
+    parser.add_argument(
+        '--hdf5-channel-major',
+        action='store_true',
+        help='Store HDF5 samples a channel at a time, for faster reads')
+    parser.add_argument(
+        '--hdf5-channel-chunk',
+        type=int,
+        default=None,
+        help='Board samples per chunk, with --hdf5-channel-major')
+    parser.add_argument(
+        '--compress',
+        choices=sorted(COMPRESSION.keys()),
+        default=None,
+        help='Compress stored samples (delta+zstd is raw-only)')
+    parser.add_argument(
+        '--compress-level',
+        type=int,
+        default=None,
+        help='zstd level, or LZ4 acceleration, with --compress')
+    parser.add_argument(
+        '--compress-threads',
+        type=int,
+        default=None,
+        help='Threads to compress on (0: compress while writing)')
+    parser.add_argument(
+        '--raw-frame',
+        type=int,
+        default=None,
+        help='Board samples per compressed raw file frame')
+
+add_hdf5_args(save_stored_parser)
+
 
 save_stream_parser = argparse.ArgumentParser(
     prog='save_stream',
@@ -185,6 +315,25 @@ save_stream_parser.add_argument(
     default=None,
     choices=BACKEND_CHOICES,
     help='Storage backend')
+save_stream_parser.add_argument(
+    '--nbuffers',
+    type=int,
+    default=None,
+    help='Number of sample buffers to queue in RAM while storing')
+save_stream_parser.add_argument(
+    '--buffer-msec',
+    type=int,
+    default=None,
+    help='Milliseconds of samples per buffer')
+save_stream_parser.add_argument(
+    '--wire-order',
+    action='store_true',
+    help="Store samples big-endian, as they arrive, without swapping")
+save_stream_parser.add_argument(
+    '--fill-gaps',
+    action='store_true',
+    help="Keep going past dropped packets, recording where they were")
+add_hdf5_args(save_stream_parser)
 
 subsamples_parser = argparse.ArgumentParser(
     prog='subsamples',
@@ -224,6 +373,45 @@ forward_parser.add_argument(
     default=DEFAULT_FORWARD_PORT,
     help=('Port to forward packets to, default %s' %
           DEFAULT_FORWARD_PORT))
+forward_parser.add_argument(
+    '-c', '--channels',
+    default=None,
+    help=('With --type sample, only forward these channels, as a '
+          'comma-separated list of chip:channel pairs'))
+forward_parser.add_argument(
+    '-s', '--subscribe',
+    default=False,
+    action='store_true',
+    help=('Add (start) or remove (stop) address:port as an extra '
+          'destination, instead of starting or stopping the stream'))
+forward_parser.add_argument(
+    '-n', '--every-nth',
+    type=int,
+    default=None,
+    help='Only send every Nth sample')
+forward_parser.add_argument(
+    '-d', '--decimate',
+    type=int,
+    default=None,
+    help=('With --type sample or sample_raw, send one low-pass '
+          'filtered sample per DECIMATE'))
+forward_parser.add_argument(
+    '--envelope',
+    default=False,
+    action='store_true',
+    help=('With --decimate and --type sample, send each channel\'s '
+          'minimum and maximum instead of filtering'))
+forward_parser.add_argument(
+    '--compact',
+    default=False,
+    action='store_true',
+    help=('With --type subsample, or --type sample and --channels, '
+          'use the compact subsample encoding'))
+forward_parser.add_argument(
+    '--multicast-ttl',
+    type=int,
+    default=None,
+    help='With --subscribe, TTL for multicast subscribers')
 forward_parser.add_argument(
     'enable',
     choices=['start', 'stop'],
@@ -0,0 +1,183 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmark for board sample byte order conversion.
+ *
+ * For each byte swap implementation the CPU supports, this times
+ * swapping a board sample packet's samples alone, and a full
+ * raw_pkt_ntoh()/raw_pkt_hton() round trip (which is what forwarding
+ * a raw packet costs), and prints nanoseconds per packet.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "bswap16.h"
+#include "raw_packets.h"
+
+#define PROGRAM_NAME "bench-bswap"
+#define DEFAULT_NITERS 200000
+#define DEFAULT_NPKTS 1
+
+static void usage(int exit_status)
+{
+    printf("Usage: %s [OPTIONS]\n\n"
+
+           "Options:\n"
+           "  -h, --help"
+           "\tPrint this message\n"
+           "  -i, --iters"
+           "\tNumber of packets to convert per measurement, default %d\n"
+           "  -p, --packets"
+           "\tCycle through this many packets, default %d (use a\n"
+           "\t\tlarge number to measure with a cold cache)\n"
+           ,
+           PROGRAM_NAME, DEFAULT_NITERS, DEFAULT_NPKTS);
+    exit(exit_status);
+}
+
+struct arguments {
+    size_t niters;
+    size_t npkts;
+};
+
+static void parse_args(struct arguments* args, int argc, char *const argv[])
+{
+    const char shortopts[] = "hi:p:";
+    struct option longopts[] = {
+        /* Keep these sorted with shortopts. */
+        { .name = "help",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'h' },
+        { .name = "iters",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'i' },
+        { .name = "packets",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'p' },
+        {0, 0, 0, 0},
+    };
+    while (1) {
+        int option_idx = 0;
+        int c = getopt_long(argc, argv, shortopts, longopts, &option_idx);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage(EXIT_SUCCESS);
+            break;
+        case 'i': {
+            long niters = strtol(optarg, (char**)0, 10);
+            if (niters <= 0) {
+                fprintf(stderr, "invalid iteration count %ld\n", niters);
+                usage(EXIT_FAILURE);
+            }
+            args->niters = niters;
+            break;
+        }
+        case 'p': {
+            long npkts = strtol(optarg, (char**)0, 10);
+            if (npkts <= 0) {
+                fprintf(stderr, "invalid packet count %ld\n", npkts);
+                usage(EXIT_FAILURE);
+            }
+            args->npkts = npkts;
+            break;
+        }
+        case '?': /* Fall through. */
+        default:
+            usage(EXIT_FAILURE);
+        }
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns ns/packet for just swapping samples. */
+static double time_bswap(struct raw_pkt_bsmp *pkts, struct arguments *args)
+{
+    double start = now_ns();
+    for (size_t i = 0; i < args->niters; i++) {
+        struct raw_pkt_bsmp *bsmp = &pkts[i % args->npkts];
+        bswap16_buf(bsmp->b_samps, RAW_BSMP_NSAMP);
+    }
+    return (now_ns() - start) / args->niters;
+}
+
+/* Returns ns/packet for a raw_pkt_ntoh() and raw_pkt_hton() pair. */
+static double time_roundtrip(struct raw_pkt_bsmp *pkts,
+                             struct arguments *args)
+{
+    double start = now_ns();
+    for (size_t i = 0; i < args->niters; i++) {
+        struct raw_pkt_bsmp *bsmp = &pkts[i % args->npkts];
+        if (raw_pkt_ntoh(bsmp) || raw_pkt_hton(bsmp)) {
+            fprintf(stderr, "packet conversion failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (now_ns() - start) / args->niters;
+}
+
+int main(int argc, char *argv[])
+{
+    struct arguments args = {
+        .niters = DEFAULT_NITERS,
+        .npkts = DEFAULT_NPKTS,
+    };
+    parse_args(&args, argc, argv);
+
+    struct raw_pkt_bsmp *pkts = malloc(args.npkts * sizeof(*pkts));
+    if (!pkts) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < args.npkts; i++) {
+        raw_packet_init(&pkts[i], RAW_MTYPE_BSMP, 0);
+        for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+            pkts[i].b_samps[j] = (raw_samp_t)(i + j);
+        }
+    }
+
+    printf("%zu samples/packet, %zu packets, %zu iterations\n",
+           (size_t)RAW_BSMP_NSAMP, args.npkts, args.niters);
+    printf("%-8s %16s %16s\n", "impl", "swap ns/pkt", "ntoh+hton ns/pkt");
+    for (int impl = 0; impl < BSWAP16_NIMPLS; impl++) {
+        if (bswap16_set_impl(impl)) {
+            printf("%-8s %16s %16s\n", bswap16_impl_str(impl),
+                   "unsupported", "unsupported");
+            continue;
+        }
+        time_bswap(pkts, &args); /* warm up */
+        double swap = time_bswap(pkts, &args);
+        double rt = time_roundtrip(pkts, &args);
+        printf("%-8s %16.1f %16.1f\n", bswap16_impl_str(impl), swap, rt);
+    }
+    free(pkts);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,475 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark for the HDF5 storage backend's tunables.
+ *
+ * This writes board samples to an HDF5 file the way the daemon's
+ * storage worker does, a buffer at a time, and prints the write
+ * throughput, the CPU time it took, and the longest any one buffer
+ * took to write. (A 50 ms
+ * buffer has to be written in 50 ms on average, and the daemon's
+ * queue of them has to cover the worst case.)
+ *
+ * It also compares HDF5's own write path (H5Dwrite()) with direct
+ * chunk writes, compressed and not, and the row layout with the
+ * channel-major one. For the latter, it also prints how long reading
+ * one channel back takes (from the page cache, most likely).
+ *
+ * By default, this tries one configuration, given by the options.
+ * With --sweep, it tries a range of them instead; that's where
+ * hdf5_ch_storage.h's defaults come from.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hdf5.h>
+
+#include "ch_storage.h"
+#include "hdf5_ch_storage.h"
+#include "raw_packets.h"
+
+#define PROGRAM_NAME "bench-hdf5"
+#define DEFAULT_PATH "bench-hdf5.h5"
+#define DEFAULT_NSAMPS (30000 * 20)     /* 20 seconds at 30 kHz */
+#define DEFAULT_BUF_NSAMPS 1500         /* a default 50 ms slab */
+#define READ_CHANNEL 42                 /* which one to read back */
+#define READ_NSAMPS 4096                /* row layout reads at a time */
+
+static void usage(int exit_status)
+{
+    printf("Usage: %s [OPTIONS]\n\n"
+
+           "Options:\n"
+           "  -b, --buffer"
+           "\tBoard samples per write, default %d\n"
+           "  -C, --cache"
+           "\tChunk cache size in bytes, default %d\n"
+           "  -c, --chunk"
+           "\tBoard samples per chunk, default %d\n"
+           "  -d, --direct"
+           "\tUse direct chunk writes, not H5Dwrite()\n"
+           "  -e, --early"
+           "\tAllocate the whole dataset on open\n"
+           "  -h, --help"
+           "\tPrint this message\n"
+           "  -K, --col-chunk"
+           "\tChannel-major chunk length in board samples, default %d\n"
+           "  -k, --channels"
+           "\tUse the channel-major layout\n"
+           "  -l, --legacy"
+           "\tDon't use the latest file format\n"
+           "  -m, --meta-block"
+           "\tMetadata block size in bytes, default %d\n"
+           "  -n, --nsamps"
+           "\tBoard samples to write, default %d\n"
+           "  -o, --output"
+           "\tFile to write, default %s (removed afterwards)\n"
+           "  -p, --prealloc"
+           "\tSize the dataset for all the samples on open\n"
+           "  -s, --sweep"
+           "\tTry a range of settings instead\n"
+           "  -z, --deflate"
+           "\tCompress chunks at this zlib level (1-9)\n"
+           ,
+           PROGRAM_NAME, DEFAULT_BUF_NSAMPS, HDF5_CH_CACHE_BYTES,
+           HDF5_CH_CHUNK_NSAMPS, HDF5_CH_COL_CHUNK_NSAMPS,
+           HDF5_CH_META_BLOCK_SIZE, DEFAULT_NSAMPS, DEFAULT_PATH);
+    exit(exit_status);
+}
+
+struct arguments {
+    const char *path;
+    size_t nsamps;
+    size_t buf_nsamps;
+    int prealloc;
+    int sweep;
+    struct hdf5_ch_opts opts;
+};
+
+static size_t parse_size(const char *what)
+{
+    long val = strtol(optarg, (char**)0, 10);
+    if (val <= 0) {
+        fprintf(stderr, "invalid %s %s\n", what, optarg);
+        usage(EXIT_FAILURE);
+    }
+    return (size_t)val;
+}
+
+static void parse_args(struct arguments* args, int argc, char *const argv[])
+{
+    const char shortopts[] = "b:C:c:dehK:klm:n:o:psz:";
+    struct option longopts[] = {
+        /* Keep these sorted with shortopts. */
+        { .name = "buffer",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'b' },
+        { .name = "cache",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'C' },
+        { .name = "chunk",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'c' },
+        { .name = "direct",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'd' },
+        { .name = "early",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'e' },
+        { .name = "help",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'h' },
+        { .name = "col-chunk",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'K' },
+        { .name = "channels",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'k' },
+        { .name = "legacy",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'l' },
+        { .name = "meta-block",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'm' },
+        { .name = "nsamps",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'n' },
+        { .name = "output",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'o' },
+        { .name = "prealloc",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'p' },
+        { .name = "sweep",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 's' },
+        { .name = "deflate",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'z' },
+        {0, 0, 0, 0},
+    };
+    while (1) {
+        int option_idx = 0;
+        int c = getopt_long(argc, argv, shortopts, longopts, &option_idx);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case 'b':
+            args->buf_nsamps = parse_size("buffer size");
+            break;
+        case 'C':
+            /* Zero is allowed: no cache. */
+            args->opts.cache_bytes = strtoul(optarg, (char**)0, 10);
+            break;
+        case 'c':
+            args->opts.chunk_nsamps = parse_size("chunk size");
+            break;
+        case 'd':
+            args->opts.direct_chunk = 1;
+            break;
+        case 'e':
+            args->opts.alloc_early = 1;
+            break;
+        case 'h':
+            usage(EXIT_SUCCESS);
+            break;
+        case 'K':
+            args->opts.col_chunk_nsamps = parse_size("chunk length");
+            break;
+        case 'k':
+            args->opts.layout = HDF5_CH_LAYOUT_CHANNELS;
+            break;
+        case 'l':
+            args->opts.latest_format = 0;
+            break;
+        case 'm':
+            args->opts.meta_block_size = parse_size("metadata block size");
+            break;
+        case 'n':
+            args->nsamps = parse_size("sample count");
+            break;
+        case 'o':
+            args->path = optarg;
+            break;
+        case 'p':
+            args->prealloc = 1;
+            break;
+        case 's':
+            args->sweep = 1;
+            break;
+        case 'z':
+            args->opts.deflate = (int)parse_size("zlib level");
+            break;
+        case '?': /* Fall through. */
+        default:
+            usage(EXIT_FAILURE);
+        }
+    }
+}
+
+static double clock_ms(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double now_ms(void)
+{
+    return clock_ms(CLOCK_MONOTONIC);
+}
+
+/* Read READ_CHANNEL's samples back from the file at path, the way
+ * an analysis script would, and return how long it took. Exits if
+ * they aren't what bench() wrote. */
+static double bench_read(const char *path, const struct hdf5_ch_opts *opts,
+                         size_t nsamps, size_t buf_nsamps)
+{
+    int err = 0;
+    raw_samp_t *chan = malloc(nsamps * sizeof(*chan));
+    raw_samp_t (*rows)[RAW_BSMP_NSAMP] = malloc(READ_NSAMPS *
+                                                sizeof(*rows));
+    hsize_t arrdim = RAW_BSMP_NSAMP;
+    hid_t arrtype = H5Tarray_create2(H5T_NATIVE_UINT16, 1, &arrdim);
+    hid_t memtype = H5Tcreate(H5T_COMPOUND, sizeof(*rows));
+    H5Tinsert(memtype, "samples", 0, arrtype);
+    double start = now_ms();
+    hid_t file = H5Fopen(path, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (opts->layout == HDF5_CH_LAYOUT_CHANNELS) {
+        /* One hyperslab does it. */
+        hid_t dset = H5Dopen2(file, "wired-dataset/samples", H5P_DEFAULT);
+        hid_t space = H5Dget_space(dset);
+        hsize_t fstart[2] = { READ_CHANNEL, 0 }, count[2] = { 1, nsamps };
+        hsize_t mdim = nsamps;
+        hid_t mspace = H5Screate_simple(1, &mdim, NULL);
+        H5Sselect_hyperslab(space, H5S_SELECT_SET, fstart, NULL, count,
+                            NULL);
+        err |= H5Dread(dset, H5T_NATIVE_UINT16, mspace, space, H5P_DEFAULT,
+                       chan) < 0;
+        H5Sclose(mspace);
+        H5Sclose(space);
+        H5Dclose(dset);
+    } else {
+        /* Every sample comes along for the ride. */
+        hid_t dset = H5Dopen2(file, "wired-dataset", H5P_DEFAULT);
+        hid_t space = H5Dget_space(dset);
+        for (hsize_t off = 0; off < nsamps; off += READ_NSAMPS) {
+            hsize_t n = nsamps - off < READ_NSAMPS ? nsamps - off :
+                READ_NSAMPS;
+            hid_t mspace = H5Screate_simple(1, &n, NULL);
+            H5Sselect_hyperslab(space, H5S_SELECT_SET, &off, NULL, &n, NULL);
+            err |= H5Dread(dset, memtype, mspace, space, H5P_DEFAULT,
+                           rows) < 0;
+            for (hsize_t i = 0; i < n; i++) {
+                chan[off + i] = rows[i][READ_CHANNEL];
+            }
+            H5Sclose(mspace);
+        }
+        H5Sclose(space);
+        H5Dclose(dset);
+    }
+    H5Fclose(file);
+    double ret = now_ms() - start;
+    for (size_t i = 0; i < nsamps; i++) {
+        err |= chan[i] != (raw_samp_t)(i % buf_nsamps + READ_CHANNEL);
+    }
+    if (err) {
+        fprintf(stderr, "can't read back %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    H5Tclose(memtype);
+    H5Tclose(arrtype);
+    free(rows);
+    free(chan);
+    return ret;
+}
+
+static void bench(struct arguments *args, struct raw_pkt_bsmp *buf,
+                  const struct hdf5_ch_opts *opts)
+{
+    struct ch_storage *chns = hdf5_ch_storage_alloc(args->path, NULL);
+    if (!chns || hdf5_ch_storage_set_opts(chns, opts)) {
+        fprintf(stderr, "invalid settings\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ch_storage_open(chns, H5F_ACC_TRUNC)) {
+        fprintf(stderr, "can't open %s\n", args->path);
+        exit(EXIT_FAILURE);
+    }
+    double worst = 0;
+    double start = now_ms();
+    double cpu = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+    for (size_t done = 0; done < args->nsamps; done += args->buf_nsamps) {
+        size_t n = args->nsamps - done;
+        if (n > args->buf_nsamps) {
+            n = args->buf_nsamps;
+        }
+        for (size_t i = 0; i < n; i++) {
+            buf[i].b_sidx = (uint32_t)(done + i);
+        }
+        double t = now_ms();
+        if (ch_storage_write(chns, buf, n)) {
+            fprintf(stderr, "write failed\n");
+            exit(EXIT_FAILURE);
+        }
+        t = now_ms() - t;
+        if (t > worst) {
+            worst = t;
+        }
+    }
+    if (ch_storage_datasync(chns) || ch_storage_close(chns)) {
+        fprintf(stderr, "can't close %s\n", args->path);
+        exit(EXIT_FAILURE);
+    }
+    double total = now_ms() - start;
+    cpu = clock_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    ch_storage_free(chns);
+    double read = bench_read(args->path, opts, args->nsamps,
+                             args->buf_nsamps);
+    unlink(args->path);
+
+    double mb = (double)args->nsamps * sizeof(*buf) / 1e6;
+    char layout[32];
+    if (opts->layout == HDF5_CH_LAYOUT_CHANNELS) {
+        snprintf(layout, sizeof(layout), "ch/%zu", opts->col_chunk_nsamps);
+    } else {
+        strcpy(layout, "rows");
+    }
+    printf("%-8s %8zu %10zu %5s %8zu %6s %8s %6s %4d %9.1f %8.0f %9.1f "
+           "%8.1f\n",
+           layout, opts->chunk_nsamps, opts->cache_bytes,
+           opts->alloc_early ? "early" : "incr", opts->meta_block_size,
+           opts->latest_format ? "latest" : "legacy",
+           opts->expected_nsamps ? "yes" : "no",
+           opts->direct_chunk ? "yes" : "no", opts->deflate,
+           mb / (total / 1e3), cpu, worst, read);
+}
+
+int main(int argc, char *argv[])
+{
+    struct arguments args = {
+        .path = DEFAULT_PATH,
+        .nsamps = DEFAULT_NSAMPS,
+        .buf_nsamps = DEFAULT_BUF_NSAMPS,
+        .prealloc = 0,
+        .sweep = 0,
+    };
+    hdf5_ch_opts_init(&args.opts);
+    parse_args(&args, argc, argv);
+    if (args.prealloc) {
+        args.opts.expected_nsamps = args.nsamps;
+    }
+
+    struct raw_pkt_bsmp *buf = malloc(args.buf_nsamps * sizeof(*buf));
+    if (!buf) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < args.buf_nsamps; i++) {
+        raw_packet_init(&buf[i], RAW_MTYPE_BSMP, 0);
+        for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+            buf[i].b_samps[j] = (raw_samp_t)(i + j);
+        }
+    }
+
+    printf("%zu board samples, %zu per write\n", args.nsamps,
+           args.buf_nsamps);
+    printf("%-8s %8s %10s %5s %8s %6s %8s %6s %4s %9s %8s %9s %8s\n",
+           "layout", "chunk", "cache", "alloc", "meta", "format", "prealloc",
+           "direct", "zlib", "MB/s", "CPU ms", "worst ms", "read ms");
+    if (!args.sweep) {
+        bench(&args, buf, &args.opts);
+        free(buf);
+        return EXIT_SUCCESS;
+    }
+
+    /* One knob at a time, starting from the defaults. Sizes that
+     * matter differently to the two write paths get tried with
+     * both. */
+    static const size_t chunks[] = { 50, 256, 1024, 4096, 15000 };
+    static const size_t caches[] = { 0, 1 << 20, 16 << 20, 64 << 20 };
+    static const size_t metas[] = { 2048, 64 << 10, 1 << 20 };
+    struct hdf5_ch_opts opts;
+    for (int direct = 0; direct < 2; direct++) {
+        for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+            hdf5_ch_opts_init(&opts);
+            opts.direct_chunk = direct;
+            opts.chunk_nsamps = chunks[i];
+            bench(&args, buf, &opts);
+        }
+        for (size_t i = 0; i < sizeof(caches) / sizeof(caches[0]); i++) {
+            hdf5_ch_opts_init(&opts);
+            opts.direct_chunk = direct;
+            opts.cache_bytes = caches[i];
+            bench(&args, buf, &opts);
+        }
+    }
+    for (size_t i = 0; i < sizeof(metas) / sizeof(metas[0]); i++) {
+        hdf5_ch_opts_init(&opts);
+        opts.meta_block_size = metas[i];
+        bench(&args, buf, &opts);
+    }
+    for (int early = 0; early < 2; early++) {
+        for (int prealloc = 0; prealloc < 2; prealloc++) {
+            for (int latest = 0; latest < 2; latest++) {
+                hdf5_ch_opts_init(&opts);
+                opts.alloc_early = early;
+                opts.expected_nsamps = prealloc ? args.nsamps : 0;
+                opts.latest_format = latest;
+                bench(&args, buf, &opts);
+            }
+        }
+    }
+    for (int direct = 0; direct < 2; direct++) {
+        for (int level = 1; level <= 9; level += 4) {
+            hdf5_ch_opts_init(&opts);
+            opts.direct_chunk = direct;
+            opts.deflate = level;
+            bench(&args, buf, &opts);
+        }
+    }
+    static const size_t col_chunks[] = { 4096, 32768, 65536 };
+    for (size_t i = 0; i < sizeof(col_chunks) / sizeof(col_chunks[0]); i++) {
+        hdf5_ch_opts_init(&opts);
+        opts.layout = HDF5_CH_LAYOUT_CHANNELS;
+        opts.col_chunk_nsamps = col_chunks[i];
+        bench(&args, buf, &opts);
+    }
+    free(buf);
+    return EXIT_SUCCESS;
+}
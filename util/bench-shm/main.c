@@ -0,0 +1,331 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark for getting board samples to a local reader.
+ *
+ * This compares the two ways a program on the daemon's host can get
+ * live board samples: the shared memory ring (see shm_ring.h and
+ * the daemon's --shm option), and protobuf forwarding over UDP
+ * loopback, which costs a dnode_pack() and sendmsg() in the daemon,
+ * and a recv() and dnode_sample__unpack() in the reader.
+ *
+ * A writer thread publishes packets as fast as it can; the main
+ * thread reads them as fast as it can. This prints how many the
+ * reader got, how many it lost, and nanoseconds per packet read.
+ */
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dnode_pack.h"
+#include "raw_packets.h"
+#include "shm_ring.h"
+#include "type_attrs.h"
+#include "proto/data.pb-c.h"
+
+#define PROGRAM_NAME "bench-shm"
+#define DEFAULT_NPKTS 1000000
+#define DEFAULT_NSLOTS 8192
+
+static void usage(int exit_status)
+{
+    printf("Usage: %s [OPTIONS]\n\n"
+
+           "Options:\n"
+           "  -h, --help"
+           "\tPrint this message\n"
+           "  -p, --packets"
+           "\tNumber of packets to publish, default %d\n"
+           "  -s, --slots"
+           "\tShared memory ring slots, default %d\n"
+           ,
+           PROGRAM_NAME, DEFAULT_NPKTS, DEFAULT_NSLOTS);
+    exit(exit_status);
+}
+
+struct arguments {
+    size_t npkts;
+    size_t nslots;
+};
+
+static void parse_args(struct arguments* args, int argc, char *const argv[])
+{
+    const char shortopts[] = "hp:s:";
+    struct option longopts[] = {
+        /* Keep these sorted with shortopts. */
+        { .name = "help",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'h' },
+        { .name = "packets",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'p' },
+        { .name = "slots",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 's' },
+        {0, 0, 0, 0},
+    };
+    while (1) {
+        int option_idx = 0;
+        int c = getopt_long(argc, argv, shortopts, longopts, &option_idx);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage(EXIT_SUCCESS);
+            break;
+        case 'p': {
+            long npkts = strtol(optarg, (char**)0, 10);
+            if (npkts <= 0) {
+                fprintf(stderr, "invalid packet count %ld\n", npkts);
+                usage(EXIT_FAILURE);
+            }
+            args->npkts = npkts;
+            break;
+        }
+        case 's': {
+            long nslots = strtol(optarg, (char**)0, 10);
+            if (nslots <= 0) {
+                fprintf(stderr, "invalid slot count %ld\n", nslots);
+                usage(EXIT_FAILURE);
+            }
+            args->nslots = nslots;
+            break;
+        }
+        case '?': /* Fall through. */
+        default:
+            usage(EXIT_FAILURE);
+        }
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+/* What the writer thread publishes, and where. */
+struct writer {
+    struct raw_pkt_bsmp bsmp;
+    size_t npkts;
+    struct shm_ring *ring;      /* shared memory ring, or... */
+    int sockfd;                 /* ...a connected UDP socket */
+    int done;
+};
+
+struct result {
+    uint64_t nread;
+    uint64_t nlost;
+    double ns;                  /* from the first packet to the last */
+};
+
+/*
+ * Shared memory ring
+ */
+
+static void* shm_writer_main(void *arg)
+{
+    struct writer *w = arg;
+    for (size_t i = 0; i < w->npkts; i++) {
+        w->bsmp.b_sidx = (uint32_t)i;
+        void *pkt = shm_ring_begin(w->ring, RAW_MTYPE_BSMP);
+        memcpy(pkt, &w->bsmp, sizeof(w->bsmp));
+        shm_ring_commit(w->ring, sizeof(w->bsmp), (uint32_t)i);
+    }
+    __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static struct result bench_shm(struct writer *w, size_t nslots)
+{
+    struct result res = { .nread = 0, .nlost = 0, .ns = 0 };
+    w->ring = shm_ring_create(PROGRAM_NAME, nslots, sizeof(w->bsmp));
+    if (!w->ring) {
+        die("shm_ring_create");
+    }
+    struct shm_ring *rd = shm_ring_attach(dup(w->ring->fd));
+    if (!rd) {
+        die("shm_ring_attach");
+    }
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, shm_writer_main, w)) {
+        die("pthread_create");
+    }
+    struct raw_pkt_bsmp bsmp;
+    double start = 0;
+    while (1) {
+        int done = __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+        if (shm_ring_read(rd, &bsmp, sizeof(bsmp))) {
+            if (!res.nread++) {
+                start = now_ns();
+            }
+        } else if (done) {
+            break;
+        }
+    }
+    res.ns = now_ns() - start;
+    res.nlost = rd->nlost;
+    pthread_join(writer, NULL);
+    shm_ring_free(rd);
+    shm_ring_free(w->ring);
+    w->ring = NULL;
+    return res;
+}
+
+/*
+ * Protobuf over UDP loopback
+ */
+
+static void* udp_writer_main(void *arg)
+{
+    struct writer *w = arg;
+    static struct dnode_pack pk;
+    DnodeSample dnsample = DNODE_SAMPLE__INIT;
+    BoardSample bsmp = BOARD_SAMPLE__INIT;
+    dnsample.has_type = 1;
+    dnsample.type = DNODE_SAMPLE__TYPE__SAMPLE;
+    dnsample.sample = &bsmp;
+    bsmp.has_is_live = 1;
+    bsmp.is_live = 1;
+    bsmp.has_samp_idx = 1;
+    bsmp.has_samples = 1;
+    bsmp.samples.data = (uint8_t*)w->bsmp.b_samps;
+    bsmp.samples.len = sizeof(w->bsmp.b_samps);
+    for (size_t i = 0; i < w->npkts; i++) {
+        bsmp.samp_idx = (uint32_t)i;
+        if (!dnode_pack(&pk, &dnsample)) {
+            fprintf(stderr, "dnode_pack failed\n");
+            exit(EXIT_FAILURE);
+        }
+        struct msghdr msg = {
+            .msg_iov = pk.iov, .msg_iovlen = pk.niov,
+        };
+        sendmsg(w->sockfd, &msg, 0); /* drops are part of the test */
+    }
+    __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static struct result bench_udp(struct writer *w)
+{
+    struct result res = { .nread = 0, .nlost = 0, .ns = 0 };
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = 0,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+    int rfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (rfd == -1 ||
+        bind(rfd, (struct sockaddr*)&addr, sizeof(addr)) ||
+        getsockname(rfd, (struct sockaddr*)&addr, &addrlen)) {
+        die("reader socket");
+    }
+    w->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (w->sockfd == -1 ||
+        connect(w->sockfd, (struct sockaddr*)&addr, addrlen)) {
+        die("writer socket");
+    }
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, udp_writer_main, w)) {
+        die("pthread_create");
+    }
+    static uint8_t buf[64 * 1024];
+    double start = 0;
+    uint32_t last = 0;
+    while (1) {
+        int done = __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+        ssize_t n = recv(rfd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n <= 0) {
+            if (done) {
+                break;
+            }
+            continue;
+        }
+        DnodeSample *msg = dnode_sample__unpack(NULL, (size_t)n, buf);
+        if (!msg || !msg->sample) {
+            fprintf(stderr, "can't unpack packet\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!res.nread++) {
+            start = now_ns();
+        }
+        last = msg->sample->samp_idx;
+        dnode_sample__free_unpacked(msg, NULL);
+    }
+    res.ns = now_ns() - start;
+    /* Anything missing got dropped somewhere along the way. */
+    res.nlost = res.nread ? (uint64_t)last + 1 - res.nread : w->npkts;
+    pthread_join(writer, NULL);
+    close(w->sockfd);
+    close(rfd);
+    return res;
+}
+
+static void print_result(const char *name, struct result *res)
+{
+    printf("%-8s %12llu %12llu %12.1f\n", name,
+           (unsigned long long)res->nread, (unsigned long long)res->nlost,
+           res->nread ? res->ns / res->nread : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct arguments args = {
+        .npkts = DEFAULT_NPKTS,
+        .nslots = DEFAULT_NSLOTS,
+    };
+    parse_args(&args, argc, argv);
+
+    static struct writer w;
+    raw_packet_init(&w.bsmp, RAW_MTYPE_BSMP, 0);
+    for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+        w.bsmp.b_samps[j] = (raw_samp_t)j;
+    }
+    w.npkts = args.npkts;
+
+    printf("%zu packets of %zu samples\n", args.npkts,
+           (size_t)RAW_BSMP_NSAMP);
+    printf("%-8s %12s %12s %12s\n", "method", "read", "lost",
+           "ns/pkt read");
+    w.done = 0;
+    struct result shm = bench_shm(&w, args.nslots);
+    print_result("shm", &shm);
+    w.done = 0;
+    struct result udp = bench_udp(&w);
+    print_result("udp", &udp);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,307 @@
+/* Copyright (c) 2013 LeafLabs, LLC.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark comparing the storage backends.
+ *
+ * This writes board samples with each backend the way the daemon's
+ * storage worker does, a buffer at a time, and prints the write
+ * throughput, the CPU time it took, and the longest any one buffer
+ * took to write, like bench-hdf5 does. Each run ends by closing the
+ * file and fdatasync()ing it, so what's still in the page cache
+ * counts. (ch_storage_datasync() doesn't do that for HDF5 files; it
+ * only flushes HDF5's own buffers.)
+ *
+ * Run it on the disk you'll be storing to, with enough samples that
+ * the page cache can't hide the disk (the default is about 4 GB).
+ * The direct backend is tried with io_uring and with pwrite(), and
+ * through the page cache, to separate out what each part buys.
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <hdf5.h>
+
+#include "ch_storage.h"
+#include "direct_ch_storage.h"
+#include "hdf5_ch_storage.h"
+#include "raw_ch_storage.h"
+#include "raw_packets.h"
+
+#define PROGRAM_NAME "bench-storage"
+#define DEFAULT_PATH "bench-storage.out"
+#define DEFAULT_NSAMPS (30000 * 60)     /* 1 minute at 30 kHz */
+#define DEFAULT_BUF_NSAMPS 1500         /* a default 50 ms slab */
+
+static void usage(int exit_status)
+{
+    printf("Usage: %s [OPTIONS]\n\n"
+
+           "Options:\n"
+           "  -B, --buf-size"
+           "\tDirect backend bytes per write, default %d\n"
+           "  -b, --buffer"
+           "\tBoard samples per ch_storage_write(), default %d\n"
+           "  -h, --help"
+           "\tPrint this message\n"
+           "  -n, --nsamps"
+           "\tBoard samples to write, default %d\n"
+           "  -o, --output"
+           "\tFile to write, default %s (removed afterwards)\n"
+           "  -p, --prealloc"
+           "\tTell the backends how many samples are coming\n"
+           "  -q, --nbufs"
+           "\tDirect backend buffers, default %d\n"
+           ,
+           PROGRAM_NAME, DIRECT_CH_BUF_SIZE, DEFAULT_BUF_NSAMPS,
+           DEFAULT_NSAMPS, DEFAULT_PATH, DIRECT_CH_NBUFS);
+    exit(exit_status);
+}
+
+struct arguments {
+    const char *path;
+    size_t nsamps;
+    size_t buf_nsamps;
+    int prealloc;
+    struct direct_ch_opts direct_opts;
+};
+
+static size_t parse_size(const char *what)
+{
+    long val = strtol(optarg, (char**)0, 10);
+    if (val <= 0) {
+        fprintf(stderr, "invalid %s %s\n", what, optarg);
+        usage(EXIT_FAILURE);
+    }
+    return (size_t)val;
+}
+
+static void parse_args(struct arguments* args, int argc, char *const argv[])
+{
+    const char shortopts[] = "B:b:hn:o:pq:";
+    struct option longopts[] = {
+        /* Keep these sorted with shortopts. */
+        { .name = "buf-size",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'B' },
+        { .name = "buffer",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'b' },
+        { .name = "help",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'h' },
+        { .name = "nsamps",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'n' },
+        { .name = "output",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'o' },
+        { .name = "prealloc",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'p' },
+        { .name = "nbufs",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'q' },
+        {0, 0, 0, 0},
+    };
+    while (1) {
+        int option_idx = 0;
+        int c = getopt_long(argc, argv, shortopts, longopts, &option_idx);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case 'B':
+            args->direct_opts.buf_size = parse_size("buffer size");
+            break;
+        case 'b':
+            args->buf_nsamps = parse_size("buffer size");
+            break;
+        case 'h':
+            usage(EXIT_SUCCESS);
+            break;
+        case 'n':
+            args->nsamps = parse_size("sample count");
+            break;
+        case 'o':
+            args->path = optarg;
+            break;
+        case 'p':
+            args->prealloc = 1;
+            break;
+        case 'q':
+            args->direct_opts.nbufs = parse_size("buffer count");
+            break;
+        case '?': /* Fall through. */
+        default:
+            usage(EXIT_FAILURE);
+        }
+    }
+}
+
+static double clock_ms(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double now_ms(void)
+{
+    return clock_ms(CLOCK_MONOTONIC);
+}
+
+static void bench(struct arguments *args, struct raw_pkt_bsmp *buf,
+                  const char *name, struct ch_storage *chns,
+                  unsigned flags)
+{
+    if (!chns) {
+        fprintf(stderr, "%s: invalid settings\n", name);
+        exit(EXIT_FAILURE);
+    }
+    if (ch_storage_open(chns, flags) == -1) {
+        fprintf(stderr, "%s: can't open %s\n", name, args->path);
+        exit(EXIT_FAILURE);
+    }
+    double worst = 0;
+    double start = now_ms();
+    double cpu = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+    for (size_t done = 0; done < args->nsamps; done += args->buf_nsamps) {
+        size_t n = args->nsamps - done;
+        if (n > args->buf_nsamps) {
+            n = args->buf_nsamps;
+        }
+        for (size_t i = 0; i < n; i++) {
+            buf[i].b_sidx = (uint32_t)(done + i);
+        }
+        double t = now_ms();
+        if (ch_storage_write(chns, buf, n)) {
+            fprintf(stderr, "%s: write failed\n", name);
+            exit(EXIT_FAILURE);
+        }
+        t = now_ms() - t;
+        if (t > worst) {
+            worst = t;
+        }
+    }
+    if (ch_storage_datasync(chns) || ch_storage_close(chns)) {
+        fprintf(stderr, "%s: can't close %s\n", name, args->path);
+        exit(EXIT_FAILURE);
+    }
+    int fd = open(args->path, O_RDONLY);
+    if (fd == -1 || fdatasync(fd) == -1) {
+        fprintf(stderr, "%s: can't sync %s\n", name, args->path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    double total = now_ms() - start;
+    cpu = clock_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    ch_storage_free(chns);
+    unlink(args->path);
+
+    double mb = (double)args->nsamps * sizeof(*buf) / 1e6;
+    printf("%-16s %9.1f %8.0f %9.1f\n", name, mb / (total / 1e3), cpu,
+           worst);
+}
+
+static struct ch_storage* direct(struct arguments *args, int direct_io,
+                                 int io_uring)
+{
+    struct ch_storage *chns = direct_ch_storage_alloc(args->path, 0644);
+    struct direct_ch_opts opts = args->direct_opts;
+    opts.direct_io = direct_io;
+    opts.io_uring = io_uring;
+    if (chns && direct_ch_storage_set_opts(chns, &opts)) {
+        ch_storage_free(chns);
+        return NULL;
+    }
+    return chns;
+}
+
+int main(int argc, char *argv[])
+{
+    struct arguments args = {
+        .path = DEFAULT_PATH,
+        .nsamps = DEFAULT_NSAMPS,
+        .buf_nsamps = DEFAULT_BUF_NSAMPS,
+        .prealloc = 0,
+    };
+    direct_ch_opts_init(&args.direct_opts);
+    parse_args(&args, argc, argv);
+    if (args.prealloc) {
+        args.direct_opts.expected_nsamps = args.nsamps;
+    }
+
+    struct raw_pkt_bsmp *buf = malloc(args.buf_nsamps * sizeof(*buf));
+    if (!buf) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < args.buf_nsamps; i++) {
+        raw_packet_init(&buf[i], RAW_MTYPE_BSMP, 0);
+        for (size_t j = 0; j < RAW_BSMP_NSAMP; j++) {
+            buf[i].b_samps[j] = (raw_samp_t)(i + j);
+        }
+    }
+
+    printf("%zu board samples, %zu per write\n", args.nsamps,
+           args.buf_nsamps);
+    printf("%-16s %9s %8s %9s\n", "backend", "MB/s", "CPU ms", "worst ms");
+
+    const unsigned raw_flags = O_CREAT | O_RDWR | O_TRUNC;
+    bench(&args, buf, "raw", raw_ch_storage_alloc(args.path, 0644),
+          raw_flags);
+    bench(&args, buf, "direct", direct(&args, 1, 1), raw_flags);
+    bench(&args, buf, "direct/pwrite", direct(&args, 1, 0), raw_flags);
+    bench(&args, buf, "direct/buffered", direct(&args, 0, 1), raw_flags);
+
+    struct hdf5_ch_opts hdf5_opts;
+    hdf5_ch_opts_init(&hdf5_opts);
+    if (args.prealloc) {
+        hdf5_opts.expected_nsamps = args.nsamps;
+    }
+    struct ch_storage *chns = hdf5_ch_storage_alloc(args.path, NULL);
+    if (chns && hdf5_ch_storage_set_opts(chns, &hdf5_opts)) {
+        ch_storage_free(chns);
+        chns = NULL;
+    }
+    bench(&args, buf, "hdf5", chns, H5F_ACC_TRUNC);
+    hdf5_ch_opts_init(&hdf5_opts);
+    hdf5_opts.direct_chunk = 1;
+    hdf5_opts.expected_nsamps = args.prealloc ? args.nsamps : 0;
+    chns = hdf5_ch_storage_alloc(args.path, NULL);
+    if (chns && hdf5_ch_storage_set_opts(chns, &hdf5_opts)) {
+        ch_storage_free(chns);
+        chns = NULL;
+    }
+    bench(&args, buf, "hdf5/direct", chns, H5F_ACC_TRUNC);
+
+    free(buf);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+#!/usr/bin/env python2.7
+"""Find the fastest board sample rate the daemon can store without
+dropping packets.
+
+Expects leafysd and dummy-datanode to already be running and connected
+to each other (not live; sampstreamer stands in for the data node's
+data socket). For each candidate rate, this issues a store command,
+streams board samples at that rate with sampstreamer, and checks the
+store status. The rate doubles until a transfer fails, then bisects.
+
+Each line reports the peak number of sample buffers the transfer
+needed, and how long it took from the first sample arriving until the
+first buffer was stored (i.e. time to first stored sample). It also
+reports how many board samples arrived out of order, and how many
+times the transfer restarted after dropping a packet, per GB stored;
+use --reorder to make sampstreamer shuffle its packets, and compare
+daemons started with different -W reorder windows.
+
+The daemon logs how many syscalls it used per board sample at the end
+of every transfer; build it with
+EXTRA_CFLAGS='-DCONFIG_SAMPLE_RECV_BATCH=<N>' to compare batch sizes.
+"""
+
+from __future__ import print_function
+import argparse
+import os
+import subprocess
+import tempfile
+import threading
+import time
+
+from daemon_control import *
+
+BACKENDS = { 'STORE_HDF5': STORE_HDF5,
+             'STORE_RAW': STORE_RAW,
+             'STORE_DIRECT': STORE_DIRECT }
+
+BSMP_BYTES = 2264               # sizeof(struct raw_pkt_bsmp)
+
+def try_rate(args, rate, path):
+    cmd = ControlCommand(type=ControlCommand.STORE)
+    cmd.store.path = path
+    cmd.store.start_sample = 0
+    cmd.store.nsamples = args.nsamples
+    cmd.store.backend = BACKENDS[args.backend]
+    if args.nbuffers is not None:
+        cmd.store.nbuffers = args.nbuffers
+    if args.buffer_msec is not None:
+        cmd.store.buffer_msec = args.buffer_msec
+    if args.wire_order:
+        cmd.store.wire_order = True
+    result = []
+    def store():
+        result.append(do_control_cmd(cmd))
+    t = threading.Thread(target=store)
+    t.start()
+    # Give the daemon time to set up the transfer before streaming.
+    time.sleep(args.settle)
+    start = time.time()
+    subprocess.check_call([args.sampstreamer, '-i', '0',
+                           '-n', str(args.nsamples), '-r', str(rate),
+                           '-o', str(args.reorder)],
+                          stderr=open(os.devnull, 'w'))
+    elapsed = time.time() - start
+    t.join()
+    rsp = result[0]
+    if rsp is None or rsp.type != ControlResponse.STORE_FINISHED:
+        status = 'no response' if rsp is None else 'error'
+        ok = False
+    else:
+        status = ControlResStore.Status.Name(rsp.store.status)
+        if rsp.store.HasField('peak_buffers'):
+            status += ' (peak buffers: %d' % rsp.store.peak_buffers
+            if rsp.store.HasField('first_write_usec'):
+                status += ', first write after %.1f ms' % (
+                    rsp.store.first_write_usec / 1000.0)
+            status += ')'
+        if rsp.store.HasField('restarts'):
+            gbytes = rsp.store.nsamples * BSMP_BYTES / 1e9
+            status += ' [%d reordered, %d restarts, %.2f restarts/GB]' % (
+                rsp.store.reordered, rsp.store.restarts,
+                rsp.store.restarts / gbytes if gbytes else 0.0)
+        ok = rsp.store.status == ControlResStore.DONE
+    print('%9d/sec (sent at %9.0f/sec): %s' %
+          (rate, args.nsamples / elapsed, status))
+    return ok
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--backend', choices=sorted(BACKENDS.keys()),
+                        default='STORE_RAW',
+                        help='storage backend (default: STORE_RAW)')
+    parser.add_argument('--nsamples', type=int, default=300000,
+                        help='board samples per transfer (default: 300000)')
+    parser.add_argument('--min-rate', type=int, default=30000,
+                        help='first rate to try, in samples/sec '
+                        '(default: 30000)')
+    parser.add_argument('--resolution', type=int, default=5000,
+                        help='stop bisecting at this rate resolution '
+                        '(default: 5000)')
+    parser.add_argument('--nbuffers', type=int, default=None,
+                        help='sample buffers to queue in RAM '
+                        '(default: daemon default)')
+    parser.add_argument('--buffer-msec', type=int, default=None,
+                        help='milliseconds of samples per buffer '
+                        '(default: daemon default)')
+    parser.add_argument('--wire-order', action='store_true',
+                        help='store samples in network byte order')
+    parser.add_argument('--reorder', type=int, default=0,
+                        help='have sampstreamer send every Nth sample '
+                        'after the next one (default: 0, in order)')
+    parser.add_argument('--settle', type=float, default=0.5,
+                        help='seconds to wait after each store command '
+                        '(default: 0.5)')
+    parser.add_argument('--sampstreamer', default='sampstreamer',
+                        help='path to sampstreamer')
+    args = parser.parse_args()
+
+    tmpdir = tempfile.mkdtemp()
+    path = os.path.join(tmpdir, 'bench.out')
+    try:
+        good, bad = 0, args.min_rate
+        while try_rate(args, bad, path):
+            good, bad = bad, bad * 2
+        while bad - good > args.resolution:
+            mid = (good + bad) // 2
+            if try_rate(args, mid, path):
+                good = mid
+            else:
+                bad = mid
+    finally:
+        if os.path.exists(path):
+            os.unlink(path)
+        os.rmdir(tmpdir)
+    if good:
+        print('max sustained rate: %d samples/sec' % good)
+    else:
+        print('dropped packets even at %d samples/sec' % args.min_rate)
+
+if __name__ == '__main__':
+    main()
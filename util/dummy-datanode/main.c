@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "logging.h"
@@ -27,9 +28,21 @@
       .dport = 8881,                            \
       .host = "127.0.0.1",                      \
       .never_reply = 0,                         \
+      .sata_reads = 0,                          \
+      .drop_every = 0,                          \
     }
 
 #define REG_DEFAULT 0xdeadbeef  /* poison value for dummy register init */
+#define DATA_SRC_PORT 5678      /* UDP source port register's value */
+
+/* What SATA reads send; the same as sampstreamer's board samples. */
+#define SATA_COOKIE_H 0xDEADBEEF
+#define SATA_COOKIE_L 0xDEADBEEF
+#define SATA_BOARD_ID 1234
+#define SATA_CHIPS_LIVE 0xFFFFFFFF
+
+/* Values for long-only options that take arguments. */
+#define LONGOPT_DROP_EVERY 256
 
 struct arguments {
     const char *host;  /* Remote hostname to talk to */
@@ -37,6 +50,9 @@ struct arguments {
     uint16_t dport;    /* Remote UDP port listening for data packets */
     int chaos;         /* Chaos mode: randomly fail according to chaos.h */
     int never_reply;   /* Never send any response packets */
+    int sata_reads;    /* Send board samples when asked for SATA reads */
+    unsigned long drop_every; /* With sata_reads, leave out every Nth
+                               * board sample the first time it's read */
 };
 
 static const char* program_name;
@@ -128,6 +144,8 @@ struct daemon_session {
     struct raw_pkt_cmd *req;
     struct raw_pkt_cmd *res;
     reg_map_t regs;
+    uint64_t sata_unread;       /* board samples from this index on
+                                 * haven't been read yet */
 };
 
 /* Convenience routines for struct daemon_session */
@@ -170,6 +188,14 @@ static void parse_args(int argc, char *const argv[])
           .has_arg = no_argument,
           .flag = &args.never_reply,
           .val = 1},
+        { .name = "sata-reads",
+          .has_arg = no_argument,
+          .flag = &args.sata_reads,
+          .val = 1},
+        { .name = "drop-every",
+          .has_arg = required_argument,
+          .flag = 0,
+          .val = LONGOPT_DROP_EVERY},
 
         {0, 0, 0, 0},
     };
@@ -192,6 +218,9 @@ static void parse_args(int argc, char *const argv[])
         case 'h':
             args.host = optarg;
             break;
+        case LONGOPT_DROP_EVERY:
+            args.drop_every = strtoul(optarg, (char**)0, 10);
+            break;
         case 0:
             /* Long option with non-null flag; nothing to do. */
             break;
@@ -290,9 +319,57 @@ static int serve_central_write(struct daemon_session *dsess) /* TODO */
     return serve_reg_write(dsess);
 }
 
-static int serve_sata_write(struct daemon_session *dsess) /* TODO */
+/* Send the board samples the SATA read registers ask for, as if
+ * they'd been on the disk all along. With --drop-every N, every Nth
+ * index is left out the first time it's read, so the daemon has to
+ * ask for it again. */
+static int serve_sata_read(struct daemon_session *dsess)
 {
-    return serve_reg_write(dsess);
+    reg_t *sata_regs = reg_map_get(dsess->regs, RAW_RTYPE_SATA);
+    const uint64_t start = sata_regs[RAW_RADDR_SATA_R_IDX];
+    const uint64_t end = start + sata_regs[RAW_RADDR_SATA_R_LEN];
+    const struct timespec ts = { .tv_sec = 0, .tv_nsec = 1 };
+    struct raw_pkt_bsmp bsmp;
+
+    log_INFO("SATA read of %llu board samples starting at %llu",
+             (unsigned long long)(end - start), (unsigned long long)start);
+    for (uint64_t idx = start; idx < end; idx++) {
+        if (args.drop_every && idx >= dsess->sata_unread &&
+            idx % args.drop_every == args.drop_every - 1) {
+            continue;
+        }
+        raw_packet_init(&bsmp, RAW_MTYPE_BSMP, 0);
+        bsmp.b_cookie_h = SATA_COOKIE_H;
+        bsmp.b_cookie_l = SATA_COOKIE_L;
+        bsmp.b_id = SATA_BOARD_ID;
+        bsmp.b_sidx = (uint32_t)idx;
+        bsmp.b_chip_live = SATA_CHIPS_LIVE;
+        for (size_t i = 0; i < RAW_BSMP_NSAMP; i++) {
+            bsmp.b_samps[i] = (raw_samp_t)(bsmp.b_sidx + i);
+        }
+        if (raw_bsmp_send(dsess->dt_sock, &bsmp, MSG_NOSIGNAL) == -1) {
+            log_WARNING("can't send board sample %llu: %m",
+                        (unsigned long long)idx);
+            break;
+        }
+        nanosleep(&ts, NULL);   /* don't overrun the daemon */
+    }
+    if (end > dsess->sata_unread) {
+        dsess->sata_unread = end;
+    }
+    return 0;
+}
+
+static int serve_sata_write(struct daemon_session *dsess)
+{
+    struct raw_cmd_req *req_cmd = raw_req(dsess->req);
+    int read = (args.sata_reads &&
+                req_cmd->r_addr == RAW_RADDR_SATA_MODE &&
+                req_cmd->r_val == RAW_SATA_MODE_READ);
+    if (serve_reg_write(dsess) == -1) {
+        return -1;
+    }
+    return read ? serve_sata_read(dsess) : 0;
 }
 
 static int serve_daq_write(struct daemon_session *dsess) /* TODO */
@@ -450,7 +527,7 @@ static void init_default_reg_vals(reg_map_t reg_map)
                 if (reg == RAW_RADDR_UDP_SRC_IP4) {
                     mod_regs[reg] = 0x7f000001; /* 127.0.0.1 */
                 } else if (reg == RAW_RADDR_UDP_SRC_IP4_PORT) {
-                    mod_regs[reg] = 5678;
+                    mod_regs[reg] = DATA_SRC_PORT;
                 }
             } else {
                 mod_regs[reg] = REG_DEFAULT;
@@ -459,6 +536,33 @@ static void init_default_reg_vals(reg_map_t reg_map)
     }
 }
 
+/* Get the data socket. For SATA reads, board samples have to come
+ * from where the UDP source registers say, as from a real data
+ * node. */
+static int get_data_sock(struct arguments *args)
+{
+    if (!args->sata_reads) {
+        return sockutil_get_udp_connected_p(args->host, args->dport);
+    }
+    struct sockaddr_in to = {
+        .sin_family = AF_INET,
+        .sin_port = htons(args->dport),
+    };
+    if (inet_pton(AF_INET, args->host, &to.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    int sock = sockutil_get_udp_socket(DATA_SRC_PORT);
+    if (sock == -1) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*)&to, sizeof(to)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
 static int dummy_datanode_start(struct arguments *args)
 {
     int ret = EXIT_FAILURE;
@@ -473,7 +577,7 @@ static int dummy_datanode_start(struct arguments *args)
         log_ERR("can't make cc_sockfd: %m");
         goto nocc;
     }
-    int dt_sock = sockutil_get_udp_connected_p(args->host, args->dport);
+    int dt_sock = get_data_sock(args);
     if (dt_sock == -1) {
         log_ERR("can't make dt_sockfd: %m");
         goto nodt;
@@ -497,6 +601,7 @@ static int dummy_datanode_start(struct arguments *args)
         .req = &req_pkt,
         .res = &res_pkt,
         .regs = reg_map,
+        .sata_unread = 0,
     };
 
     /*
@@ -230,6 +230,7 @@ def save_stream(nsamples, temp_directory, chan, capacitorscale, attempts=4):
     cmd.store.path = os.path.abspath(fpath)
     cmd.store.nsamples = nsamples
     cmd.store.backend = STORE_HDF5
+    cmd.store.hdf5_channel_major = True
     for i in range(attempts):
         reply = do_control_cmd(cmd)
         assert(reply is not None)
@@ -249,6 +250,11 @@ def load_chip_data_from_hdf5(fpath, chips, channel):
     data = dict()
     with h5py.File(fpath, 'r', driver='core') as f:
         d = f['wired-dataset']
+        if isinstance(d, h5py.Group):
+            # Channel-major: each channel's samples are contiguous.
+            for c in chips:
+                data[c] = d['samples'][c*32 + channel, :]
+            return data
         count = d.shape[0]
         for c in chips:
             data[c] = numpy.zeros((count,), dtype='u2')
@@ -30,18 +30,24 @@ for dset in h5f:
 dset = h5f[dset]
 print 'file:', f, 'channels: %d--%d' % (ch_s, ch_end)
 
-assert dset.dtype == numpy.dtype([('ph_flags', '|u1'),
-                                  ('samp_index', '<u4'),
-                                  ('chip_live', '<u4'),
-                                  ('samples', '<u2', (1120,))])
-samp_index = 1
-samples = 3
-
-chdata = []
-idxs = []
-for data in dset:
-    idxs.append(data[samp_index])
-    chdata.append(data[samples][ch_s:ch_end + 1])
+if isinstance(dset, h5py.Group):
+    # Channel-major layout: [channel][time] samples, and the other
+    # fields in datasets of their own.
+    idxs = dset['samp_index'][:]
+    chdata = dset['samples'][ch_s:ch_end + 1, :].T
+else:
+    assert dset.dtype == numpy.dtype([('ph_flags', '|u1'),
+                                      ('samp_index', '<u4'),
+                                      ('chip_live', '<u4'),
+                                      ('samples', '<u2', (1120,))])
+    samp_index = 1
+    samples = 3
+
+    chdata = []
+    idxs = []
+    for data in dset:
+        idxs.append(data[samp_index])
+        chdata.append(data[samples][ch_s:ch_end + 1])
 
 plt.figure(1)
 
@@ -13,12 +13,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <endian.h>
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "raw_packets.h"
@@ -212,9 +214,33 @@ uint32_t handle_sample(DnodeSample *samp, struct arguments *args)
     return samp->sample->samp_idx;
 }
 
+/* Number of samples in a subsample, in either encoding (see
+ * BoardSubsample.packed_samples in data.proto). */
+static size_t subsample_count(const BoardSubsample *bsub)
+{
+    if (bsub->has_packed_samples) {
+        return bsub->packed_samples.len / sizeof(uint16_t);
+    }
+    return bsub->n_samples;
+}
+
+/* The i-th sample in a subsample, in either encoding. */
+static uint32_t subsample_at(const BoardSubsample *bsub, size_t i)
+{
+    if (bsub->has_packed_samples) {
+        uint16_t le;
+        memcpy(&le, bsub->packed_samples.data + i * sizeof(le), sizeof(le));
+        return le16toh(le);
+    }
+    return bsub->samples[i];
+}
+
 /* Returns sample index, for gap checking */
 uint32_t handle_subsample(DnodeSample *samp, struct arguments *args)
 {
+    BoardSubsample *bsub = samp->subsample;
+    size_t nsamps = subsample_count(bsub);
+
     if (args->output == OUT_DAC) {
         uint8_t dac = (uint8_t)samp->subsample->dac_value;
         if (args->enable_string) {
@@ -224,20 +250,25 @@ uint32_t handle_subsample(DnodeSample *samp, struct arguments *args)
         }
     } else if (args->all_sub_channels) {
         if (args->enable_string) {
-            for (size_t i = 0; i < samp->subsample->n_samples; i++) {
-                printf("%u%s", samp->subsample->samples[i],
-                       i < samp->subsample->n_samples - 1 ? "," : "\n");
+            for (size_t i = 0; i < nsamps; i++) {
+                printf("%u%s", subsample_at(bsub, i),
+                       i < nsamps - 1 ? "," : "\n");
             }
+        } else if (bsub->has_packed_samples && BYTE_ORDER == LITTLE_ENDIAN) {
+            /* Already what we want. */
+            __unused ssize_t n = write(STDOUT_FILENO,
+                                       bsub->packed_samples.data,
+                                       nsamps * sizeof(uint16_t));
         } else {
-            uint16_t samp16[samp->subsample->n_samples];
-            for (size_t i = 0; i < samp->subsample->n_samples; i++) {
-                samp16[i] = (uint16_t)(samp->subsample->samples[i] & 0xFFFF);
+            uint16_t samp16[nsamps];
+            for (size_t i = 0; i < nsamps; i++) {
+                samp16[i] = (uint16_t)(subsample_at(bsub, i) & 0xFFFF);
             }
-            size_t s = samp->subsample->n_samples * sizeof(uint16_t);
+            size_t s = nsamps * sizeof(uint16_t);
             __unused ssize_t n = write(STDOUT_FILENO, samp16, s);
         }
-    } else {
-        uint16_t chan = (uint16_t)samp->subsample->samples[args->channel];
+    } else if (args->channel < nsamps) {
+        uint16_t chan = (uint16_t)subsample_at(bsub, args->channel);
         write_chan(chan, args);
     }
     return samp->subsample->samp_idx;
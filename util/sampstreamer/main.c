@@ -38,6 +38,11 @@ static void usage(int exit_status)
     printf("Usage: %s OPTIONS\n\n"
 
            "Options:\n"
+           "  -b, --reorder-by"
+           "\tWith -o, send held back board samples after this many\n"
+           "\t\tothers, default 1\n"
+           "  -d, --drop"
+           "\tSkip every Nth board sample, 0 (default) to send them all\n"
            "  -e, --error-packets\n"
            "\tSet error flag in all packets\n"
            "  -f, --from-port\n"
@@ -50,8 +55,14 @@ static void usage(int exit_status)
            "\tInter-packet nanosecond sleep time (max 1000000), default %d\n"
            "  -n, --nsamps"
            "\tNumber of packets to send, 0 (default) for \"forever\"\n"
+           "  -o, --reorder"
+           "\tSend every Nth board sample late (see -b),\n"
+           "\t\t0 (default) to send them in order\n"
            "  -p, --port"
            "\tSend to daemon at this localhost port, default %d\n"
+           "  -r, --rate"
+           "\tSend this many packets per second (overrides -l), 0 (default)\n"
+           "\t\tfor \"use -l\"\n"
            "  -s, --subs"
            "\tSend board subsamples instead of full board samples\n"
            ,
@@ -68,6 +79,10 @@ static void usage(int exit_status)
        .nsleep_time = NANOSLEEP_TIME,                   \
        .nsamps = SAMPLES_FOREVER,                       \
        .set_err = 0,                                    \
+       .rate = 0,                                       \
+       .reorder = 0,                                    \
+       .reorder_by = 1,                                 \
+       .drop = 0,                                       \
     }
 
 struct arguments {
@@ -78,14 +93,26 @@ struct arguments {
     useconds_t nsleep_time;
     size_t nsamps;
     int set_err;
+    unsigned long rate;         /* packets/sec, or 0 to use nsleep_time */
+    unsigned long reorder;      /* hold back every Nth board sample, */
+    unsigned long reorder_by;   /* until this many more are sent */
+    unsigned long drop;         /* skip every Nth board sample, or 0 */
 };
 
 static void parse_args(struct arguments* args, int argc, char *const argv[])
 {
     int print_usage = 0;
-    const char shortopts[] = "ef:hi:l:n:p:s";
+    const char shortopts[] = "b:d:ef:hi:l:n:o:p:r:s";
     struct option longopts[] = {
         /* Keep these sorted with shortopts. */
+        { .name = "reorder-by",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'b' },
+        { .name = "drop",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'd' },
         { .name = "error-packets",
           .has_arg = no_argument,
           .flag = NULL,
@@ -114,6 +141,14 @@ static void parse_args(struct arguments* args, int argc, char *const argv[])
           .has_arg = required_argument,
           .flag = NULL,
           .val = 'n' },
+        { .name = "reorder",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'o' },
+        { .name = "rate",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'r' },
         { .name = "subs",
           .has_arg = no_argument,
           .flag = NULL,
@@ -132,6 +167,25 @@ static void parse_args(struct arguments* args, int argc, char *const argv[])
             if (print_usage) {
                 usage(EXIT_SUCCESS);
             }
+            break;
+        case 'b': {
+            long reorder_by = strtol(optarg, (char**)0, 10);
+            if (reorder_by < 1) {
+                fprintf(stderr, "invalid reorder distance %ld\n", reorder_by);
+                usage(EXIT_FAILURE);
+            }
+            args->reorder_by = reorder_by;
+            break;
+        }
+        case 'd': {
+            long drop = strtol(optarg, (char**)0, 10);
+            if (drop < 0) {
+                fprintf(stderr, "invalid drop interval %ld\n", drop);
+                usage(EXIT_FAILURE);
+            }
+            args->drop = drop;
+            break;
+        }
         case 'e':
             args->set_err = 1;
             break;
@@ -162,9 +216,27 @@ static void parse_args(struct arguments* args, int argc, char *const argv[])
             args->nsamps = nsamps;
             break;
         }
+        case 'o': {
+            long reorder = strtol(optarg, (char**)0, 10);
+            if (reorder < 0) {
+                fprintf(stderr, "invalid reorder interval %ld\n", reorder);
+                usage(EXIT_FAILURE);
+            }
+            args->reorder = reorder;
+            break;
+        }
         case 'p':
             args->daemon_port = strtol(optarg, (char**)0, 10);
             break;
+        case 'r': {
+            long rate = strtol(optarg, (char**)0, 10);
+            if (rate < 0) {
+                fprintf(stderr, "invalid packet rate %ld\n", rate);
+                usage(EXIT_FAILURE);
+            }
+            args->rate = rate;
+            break;
+        }
         case 's':
             args->subsamples = 1;
             break;
@@ -188,6 +260,29 @@ static inline void send_pkt(void *pkt, size_t size, int sockfd,
     }
 }
 
+/* Wait between packets. If args->rate is set, sleep until packet
+ * number npkts (counting from zero) is due, relative to start, instead
+ * of for a fixed amount of time; this keeps the average rate right
+ * even though nanosleep() overshoots. */
+static void pace(struct arguments *args, const struct timespec *start,
+                 uint64_t npkts, const struct timespec *ts)
+{
+    if (args->rate) {
+        uint64_t ns = npkts * 1000000000ULL / args->rate;
+        struct timespec due = {
+            .tv_sec = start->tv_sec + (time_t)(ns / 1000000000ULL),
+            .tv_nsec = start->tv_nsec + (long)(ns % 1000000000ULL),
+        };
+        if (due.tv_nsec >= 1000000000L) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+    } else if (args->nsleep_time) {
+        nanosleep(ts, NULL);
+    }
+}
+
 void send_subsamples(struct arguments *args,
                      int sockfd,
                      struct sockaddr_in *to)
@@ -199,6 +294,8 @@ void send_subsamples(struct arguments *args,
         .tv_sec = 0,
         .tv_nsec = args->nsleep_time,
     };
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     while (args->nsamps == SAMPLES_FOREVER || idx < args->nsamps) {
         raw_packet_init(&bsub, RAW_MTYPE_BSUB,
                         args->set_err ? RAW_PFLAG_ERR : 0);
@@ -213,9 +310,7 @@ void send_subsamples(struct arguments *args,
             exit(EXIT_FAILURE);
         }
         send_pkt(&bsub, sizeof(bsub), sockfd, to);
-        if (args->nsleep_time) {
-            nanosleep(&ts, NULL);
-        }
+        pace(args, &start, idx - args->start_idx, &ts);
     }
 }
 
@@ -224,11 +319,16 @@ void send_samples(struct arguments *args,
                   struct sockaddr_in *to)
 {
     struct raw_pkt_bsmp bsmp;
+    struct raw_pkt_bsmp held;   /* for args->reorder */
+    int holding = 0;
+    unsigned long nafter = 0;   /* sent since held was held back */
     uint32_t idx = args->start_idx;
     struct timespec ts = {
         .tv_sec = 0,
         .tv_nsec = args->nsleep_time,
     };
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     while (args->nsamps == SAMPLES_FOREVER ||
            idx < args->start_idx + args->nsamps) {
         raw_packet_init(&bsmp, RAW_MTYPE_BSMP,
@@ -238,14 +338,36 @@ void send_samples(struct arguments *args,
         bsmp.b_id = BOARD_ID;
         bsmp.b_sidx = idx++;
         bsmp.b_chip_live = CHIPS_LIVE;
+        /* Give the samples recognizable values, so byte order
+         * mistakes on the receiving end show up. */
+        for (size_t i = 0; i < RAW_BSMP_NSAMP; i++) {
+            bsmp.b_samps[i] = (raw_samp_t)(bsmp.b_sidx + i);
+        }
         if (raw_pkt_hton(&bsmp)) {
             fprintf(stderr, "invalid packet\n");
             exit(EXIT_FAILURE);
         }
-        send_pkt(&bsmp, sizeof(bsmp), sockfd, to);
-        if (args->nsleep_time) {
-            nanosleep(&ts, NULL);
+        int more = (args->nsamps == SAMPLES_FOREVER ||
+                    idx < args->start_idx + args->nsamps);
+        if (args->drop && (idx - args->start_idx) % args->drop == 0) {
+            /* Pretend the network lost this one. */
+        } else if (args->reorder && more && !holding &&
+                   (idx - args->start_idx) % args->reorder == 0) {
+            /* Hold this one back until after the next few. */
+            memcpy(&held, &bsmp, sizeof(held));
+            holding = 1;
+            nafter = 0;
+        } else {
+            send_pkt(&bsmp, sizeof(bsmp), sockfd, to);
+            if (holding && (++nafter == args->reorder_by || !more)) {
+                send_pkt(&held, sizeof(held), sockfd, to);
+                holding = 0;
+            }
         }
+        pace(args, &start, idx - args->start_idx, &ts);
+    }
+    if (holding) {
+        send_pkt(&held, sizeof(held), sockfd, to);
     }
 }
 
@@ -256,8 +378,10 @@ int main(int argc, char *argv[])
     parse_args(&args, argc, argv);
 
     fprintf(stderr,
-            "from_port=%u, daemon port=%u, start index=%u, nsamples=%zu\n",
-            args.from_port, args.daemon_port, args.start_idx, args.nsamps);
+            "from_port=%u, daemon port=%u, start index=%u, nsamples=%zu, "
+            "rate=%lu/sec\n",
+            args.from_port, args.daemon_port, args.start_idx, args.nsamps,
+            args.rate);
 
     int sockfd = sockutil_get_udp_socket(args.from_port);
     if (sockfd == -1) {